@@ -18,6 +18,8 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "block/raw-aio.h"
+#include "trace.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +29,9 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
+    IOHandler *io_poll_begin;
+    IOHandler *io_poll_end;
     int deleted;
     void *opaque;
     bool is_external;
@@ -220,6 +225,12 @@ void aio_set_fd_handler(AioContext *ctx,
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
 
+            if (!node->io_poll) {
+                ctx->poll_disable_cnt--;
+            } else if (ctx->poll_started && node->io_poll_end) {
+                node->io_poll_end(node->opaque);
+            }
+
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
                 node->deleted = 1;
@@ -242,6 +253,9 @@ void aio_set_fd_handler(AioContext *ctx,
 
             g_source_add_poll(&ctx->source, &node->pfd);
             is_new = true;
+
+            /* Polling stays off until the caller adds .io_poll() */
+            ctx->poll_disable_cnt++;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -269,6 +283,65 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd,
+                     AioPollFn *io_poll,
+                     IOHandler *io_poll_begin,
+                     IOHandler *io_poll_end)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    assert(node);
+    if (ctx->poll_started && node->io_poll && node->io_poll_end) {
+        node->io_poll_end(node->opaque);
+    }
+
+    ctx->poll_disable_cnt += !io_poll - !node->io_poll;
+    node->io_poll = io_poll;
+    node->io_poll_begin = io_poll_begin;
+    node->io_poll_end = io_poll_end;
+
+    if (ctx->poll_started && io_poll && io_poll_begin) {
+        io_poll_begin(node->opaque);
+    }
+    aio_notify(ctx);
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll,
+                                 EventNotifierHandler *io_poll_begin,
+                                 EventNotifierHandler *io_poll_end)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll,
+                    (IOHandler *)io_poll_begin, (IOHandler *)io_poll_end);
+}
+
+static void poll_set_started(AioContext *ctx, bool started)
+{
+    AioHandler *node;
+
+    if (started == ctx->poll_started) {
+        return;
+    }
+
+    ctx->poll_started = started;
+
+    ctx->walking_handlers++;
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        IOHandler *fn;
+
+        if (node->deleted || !node->io_poll) {
+            continue;
+        }
+
+        fn = started ? node->io_poll_begin : node->io_poll_end;
+        if (fn) {
+            fn(node->opaque);
+        }
+    }
+    ctx->walking_handlers--;
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -375,6 +448,145 @@ static __thread AioHandler **nodes;
 static __thread unsigned npfd, nalloc;
 static __thread Notifier pollfds_cleanup_notifier;
 
+/* Run each .io_poll() handler once.  *timeout is set to zero if any of
+ * them found something to do, including a pending aio_notify().
+ *
+ * Returns true if progress was made.
+ */
+static bool run_poll_handlers_once(AioContext *ctx, int64_t *timeout)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            *timeout = 0;
+
+            /* aio_notify() does not count as progress */
+            if (node->opaque != &ctx->notifier) {
+                progress = true;
+            }
+        }
+
+        /* Caller handles freeing deleted nodes.  Don't do it here. */
+    }
+
+    return progress;
+}
+
+/* Busy poll the .io_poll() handlers for up to max_ns nanoseconds, or until
+ * one of them finds something to do.  *timeout is reduced by the time spent
+ * polling, so that the overall deadline of aio_poll() is unchanged.
+ *
+ * ctx->notify_me must be non-zero so that aio_notify() can be detected, and
+ * all handlers must support polling.
+ *
+ * Returns true if progress was made.
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns,
+                              int64_t *timeout)
+{
+    bool progress;
+    int64_t start_time, elapsed_time;
+
+    assert(ctx->notify_me);
+    assert(ctx->walking_handlers > 0);
+    assert(ctx->poll_disable_cnt == 0);
+
+    trace_run_poll_handlers_begin(ctx, max_ns, *timeout);
+
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    do {
+        progress = run_poll_handlers_once(ctx, timeout);
+        elapsed_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
+    } while (!progress && *timeout != 0 && elapsed_time < max_ns);
+
+    if (*timeout != -1) {
+        *timeout -= MIN(*timeout, elapsed_time);
+    }
+
+    trace_run_poll_handlers_end(ctx, progress, *timeout);
+    return progress;
+}
+
+/* Busy poll for events if the context allows it, instead of going straight
+ * to poll(2).  Called with the handler list locked.
+ *
+ * Returns true if progress was made; *timeout is set to zero if there is
+ * work that poll(2) should pick up without blocking.
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
+{
+    if (*timeout && ctx->poll_max_ns && ctx->poll_disable_cnt == 0) {
+        /* See qemu_soonest_timeout() uint64_t hack */
+        int64_t max_ns = MIN((uint64_t)*timeout, (uint64_t)ctx->poll_ns);
+
+        if (max_ns) {
+            poll_set_started(ctx, true);
+
+            if (run_poll_handlers(ctx, max_ns, timeout)) {
+                return true;
+            }
+        }
+    }
+
+    if (ctx->poll_started) {
+        poll_set_started(ctx, false);
+
+        /* .io_poll_end() may have re-enabled notifications; check once
+         * more for work that arrived while they were off.
+         */
+        return run_poll_handlers_once(ctx, timeout);
+    }
+    return false;
+}
+
+/* Adapt the polling time to how long aio_poll() blocked, block_ns.  If an
+ * event arrived within the current window polling is paying off; if it
+ * arrived a bit later the window is too small; if it took longer than
+ * poll_max_ns, polling is just burning CPU.
+ */
+static void adjust_poll_time(AioContext *ctx, int64_t block_ns)
+{
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, poll less */
+        int64_t old = ctx->poll_ns;
+
+        if (ctx->poll_shrink) {
+            ctx->poll_ns /= ctx->poll_shrink;
+        } else {
+            ctx->poll_ns = 0;
+        }
+
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns &&
+               block_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        int64_t old = ctx->poll_ns;
+        int64_t grow = ctx->poll_grow;
+
+        if (grow == 0) {
+            grow = 2;
+        }
+
+        if (ctx->poll_ns) {
+            ctx->poll_ns *= grow;
+        } else {
+            ctx->poll_ns = 4000; /* start polling at 4 microseconds */
+        }
+
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 static void pollfds_cleanup(Notifier *n, void *unused)
 {
     g_assert(npfd == 0);
@@ -408,13 +620,26 @@ static void add_pollfd(AioHandler *node)
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
-    int i, ret;
+    int i, ret = 0;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Completions already posted to the io_uring ring can be reaped
+     * without a trip through poll(); with SQPOLL the ring fd is often
+     * not even signalled because the kernel thread is still busy.
+     */
+    if (ctx->linux_io_uring &&
+        luring_poll_completions(ctx->linux_io_uring)) {
+        progress = true;
+        blocking = false;
+    }
+#endif
+
     /* aio_notify can avoid the expensive event_notifier_set if
      * everything (file descriptors, bottom halves, timers) will
      * be re-evaluated before the next blocking poll().  This is
@@ -430,37 +655,51 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        if (!node->deleted && node->pfd.events
-            && !aio_epoll_enabled(ctx)
-            && aio_node_check(ctx, node->is_external)) {
-            add_pollfd(node);
-        }
+    if (ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     }
 
     timeout = blocking ? aio_compute_timeout(ctx) : 0;
 
-    /* wait until next event */
-    if (timeout) {
-        aio_context_release(ctx);
-    }
-    if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
-        AioHandler epoll_handler;
+    if (try_poll_mode(ctx, &timeout)) {
+        progress = true;
+    } else {
+        /* fill pollfds */
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            if (!node->deleted && node->pfd.events
+                && !aio_epoll_enabled(ctx)
+                && aio_node_check(ctx, node->is_external)) {
+                add_pollfd(node);
+            }
+        }
 
-        epoll_handler.pfd.fd = ctx->epollfd;
-        epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
-        npfd = 0;
-        add_pollfd(&epoll_handler);
-        ret = aio_epoll(ctx, pollfds, npfd, timeout);
-    } else  {
-        ret = qemu_poll_ns(pollfds, npfd, timeout);
+        /* wait until next event */
+        if (timeout) {
+            aio_context_release(ctx);
+        }
+        if (aio_epoll_check_poll(ctx, pollfds, npfd, timeout)) {
+            AioHandler epoll_handler;
+
+            epoll_handler.pfd.fd = ctx->epollfd;
+            epoll_handler.pfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+            npfd = 0;
+            add_pollfd(&epoll_handler);
+            ret = aio_epoll(ctx, pollfds, npfd, timeout);
+        } else  {
+            ret = qemu_poll_ns(pollfds, npfd, timeout);
+        }
+        if (timeout) {
+            aio_context_acquire(ctx);
+        }
     }
+
     if (blocking) {
         atomic_sub(&ctx->notify_me, 2);
     }
-    if (timeout) {
-        aio_context_acquire(ctx);
+
+    /* Adjust polling time */
+    if (ctx->poll_max_ns && blocking) {
+        adjust_poll_time(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
     }
 
     aio_notify_accept(ctx);
@@ -485,6 +724,20 @@ bool aio_poll(AioContext *ctx, bool blocking)
     return progress;
 }
 
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink, Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * value is used once.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+    ctx->poll_grow = grow;
+    ctx->poll_shrink = shrink;
+
+    aio_notify(ctx);
+}
+
 void aio_context_setup(AioContext *ctx)
 {
 #ifdef CONFIG_EPOLL_CREATE1
@@ -0,0 +1,233 @@
+/*
+ * Atomic helpers
+ *
+ * Generate the helpers used by TCG for the guest atomic operations that
+ * are not expanded inline by the backend.  In system emulation they are
+ * also the slow path of the inline expansion.
+ *
+ * Included from cputlb.c and user-exec.c.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if DATA_SIZE == 8
+# define SUFFIX     q
+# define LSUFFIX    q
+# define DATA_TYPE  uint64_t
+# define ABI_TYPE   uint64_t
+# define BSWAP      bswap64
+#elif DATA_SIZE == 4
+# define SUFFIX     l
+# define LSUFFIX    ul
+# define DATA_TYPE  uint32_t
+# define ABI_TYPE   uint32_t
+# define BSWAP      bswap32
+#elif DATA_SIZE == 2
+# define SUFFIX     w
+# define LSUFFIX    uw
+# define DATA_TYPE  uint16_t
+# define ABI_TYPE   uint32_t
+# define BSWAP      bswap16
+#elif DATA_SIZE == 1
+# define SUFFIX     b
+# define LSUFFIX    ub
+# define DATA_TYPE  uint8_t
+# define ABI_TYPE   uint32_t
+# define BSWAP
+#else
+# error unsupported data size
+#endif
+
+#define ATOMIC_NAME(X)      HELPER(glue(glue(atomic_, X), SUFFIX))
+#define ATOMIC_HOST_NAME(X) glue(glue(atomic_, X), glue(_host_, SUFFIX))
+
+/* Operations on host memory holding guest data.  MOP only tells whether
+   the guest value is in the opposite byte order from the host's, in which
+   case everything but cmpxchg and xchg needs a compare-and-swap loop.  */
+
+static inline DATA_TYPE ATOMIC_HOST_NAME(cmpxchg)(DATA_TYPE *haddr,
+                                                  DATA_TYPE cmpv,
+                                                  DATA_TYPE newv,
+                                                  TCGMemOp mop)
+{
+    if (mop & MO_BSWAP) {
+        return BSWAP(atomic_cmpxchg__nocheck(haddr, BSWAP(cmpv),
+                                             BSWAP(newv)));
+    }
+    return atomic_cmpxchg__nocheck(haddr, cmpv, newv);
+}
+
+static inline DATA_TYPE ATOMIC_HOST_NAME(xchg)(DATA_TYPE *haddr,
+                                               DATA_TYPE val, TCGMemOp mop)
+{
+    if (mop & MO_BSWAP) {
+        return BSWAP(atomic_xchg__nocheck(haddr, BSWAP(val)));
+    }
+    return atomic_xchg__nocheck(haddr, val);
+}
+
+#define GEN_ATOMIC_HOST(X, OP)                                          \
+static inline DATA_TYPE ATOMIC_HOST_NAME(X)(DATA_TYPE *haddr,           \
+                                            DATA_TYPE val,              \
+                                            TCGMemOp mop)               \
+{                                                                       \
+    DATA_TYPE old, cmp, newv;                                           \
+                                                                        \
+    if (!(mop & MO_BSWAP)) {                                            \
+        return glue(atomic_, X)(haddr, val);                            \
+    }                                                                   \
+    old = atomic_read__nocheck(haddr);                                  \
+    do {                                                                \
+        cmp = old;                                                      \
+        newv = BSWAP(cmp) OP val;                                       \
+        old = atomic_cmpxchg__nocheck(haddr, cmp, BSWAP(newv));         \
+    } while (old != cmp);                                               \
+    return BSWAP(old);                                                  \
+}
+
+GEN_ATOMIC_HOST(fetch_add, +)
+GEN_ATOMIC_HOST(fetch_and, &)
+GEN_ATOMIC_HOST(fetch_or, |)
+GEN_ATOMIC_HOST(fetch_xor, ^)
+
+#undef GEN_ATOMIC_HOST
+
+#ifdef CONFIG_SOFTMMU
+#define ATOMIC_MMU_NAME(X) \
+    glue(glue(glue(helper_atomic_, X), SUFFIX), _mmu)
+
+/* atomic_mmu_lookup returns NULL for accesses that do not go straight to
+   RAM.  Those are done with a load followed by a store, which is not
+   atomic with respect to other vCPUs but is as good as any device
+   access gets.  */
+
+static inline DATA_TYPE glue(atomic_ld_, SUFFIX)(CPUArchState *env,
+                                                 target_ulong addr,
+                                                 TCGMemOpIdx oi,
+                                                 uintptr_t retaddr)
+{
+#if DATA_SIZE == 1
+    return helper_ret_ldub_mmu(env, addr, oi, retaddr);
+#else
+    if ((get_memop(oi) & MO_BSWAP) == MO_LE) {
+        return glue(glue(helper_le_ld, LSUFFIX), _mmu)(env, addr, oi, retaddr);
+    } else {
+        return glue(glue(helper_be_ld, LSUFFIX), _mmu)(env, addr, oi, retaddr);
+    }
+#endif
+}
+
+static inline void glue(atomic_st_, SUFFIX)(CPUArchState *env,
+                                            target_ulong addr, DATA_TYPE val,
+                                            TCGMemOpIdx oi, uintptr_t retaddr)
+{
+#if DATA_SIZE == 1
+    helper_ret_stb_mmu(env, addr, val, oi, retaddr);
+#else
+    if ((get_memop(oi) & MO_BSWAP) == MO_LE) {
+        glue(glue(helper_le_st, SUFFIX), _mmu)(env, addr, val, oi, retaddr);
+    } else {
+        glue(glue(helper_be_st, SUFFIX), _mmu)(env, addr, val, oi, retaddr);
+    }
+#endif
+}
+
+ABI_TYPE ATOMIC_MMU_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                                  ABI_TYPE cmpv, ABI_TYPE newv,
+                                  TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    DATA_TYPE *haddr = atomic_mmu_lookup(env, addr, oi, retaddr);
+    DATA_TYPE old;
+
+    if (likely(haddr)) {
+        return ATOMIC_HOST_NAME(cmpxchg)(haddr, cmpv, newv, get_memop(oi));
+    }
+    old = glue(atomic_ld_, SUFFIX)(env, addr, oi, retaddr);
+    if (old == (DATA_TYPE)cmpv) {
+        glue(atomic_st_, SUFFIX)(env, addr, newv, oi, retaddr);
+    }
+    return old;
+}
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv, uint32_t oi)
+{
+    return ATOMIC_MMU_NAME(cmpxchg)(env, addr, cmpv, newv, oi, GETRA());
+}
+
+#define GEN_ATOMIC_HELPER(X, OP)                                        \
+ABI_TYPE ATOMIC_MMU_NAME(X)(CPUArchState *env, target_ulong addr,       \
+                            ABI_TYPE val, TCGMemOpIdx oi,               \
+                            uintptr_t retaddr)                          \
+{                                                                       \
+    DATA_TYPE *haddr = atomic_mmu_lookup(env, addr, oi, retaddr);       \
+    DATA_TYPE old;                                                      \
+                                                                        \
+    if (likely(haddr)) {                                                \
+        return ATOMIC_HOST_NAME(X)(haddr, val, get_memop(oi));          \
+    }                                                                   \
+    old = glue(atomic_ld_, SUFFIX)(env, addr, oi, retaddr);             \
+    glue(atomic_st_, SUFFIX)(env, addr, OP(old, val), oi, retaddr);     \
+    return old;                                                         \
+}                                                                       \
+                                                                        \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, uint32_t oi)                      \
+{                                                                       \
+    return ATOMIC_MMU_NAME(X)(env, addr, val, oi, GETRA());             \
+}
+
+#else /* !CONFIG_SOFTMMU */
+
+ABI_TYPE ATOMIC_NAME(cmpxchg)(CPUArchState *env, target_ulong addr,
+                              ABI_TYPE cmpv, ABI_TYPE newv, uint32_t oi)
+{
+    return ATOMIC_HOST_NAME(cmpxchg)(g2h(addr), cmpv, newv, get_memop(oi));
+}
+
+#define GEN_ATOMIC_HELPER(X, OP)                                        \
+ABI_TYPE ATOMIC_NAME(X)(CPUArchState *env, target_ulong addr,           \
+                        ABI_TYPE val, uint32_t oi)                      \
+{                                                                       \
+    return ATOMIC_HOST_NAME(X)(g2h(addr), val, get_memop(oi));          \
+}
+#endif /* CONFIG_SOFTMMU */
+
+#define ATOMIC_OP_XCHG(OLD, VAL)       (VAL)
+#define ATOMIC_OP_FETCH_ADD(OLD, VAL)  ((OLD) + (VAL))
+#define ATOMIC_OP_FETCH_AND(OLD, VAL)  ((OLD) & (VAL))
+#define ATOMIC_OP_FETCH_OR(OLD, VAL)   ((OLD) | (VAL))
+#define ATOMIC_OP_FETCH_XOR(OLD, VAL)  ((OLD) ^ (VAL))
+
+GEN_ATOMIC_HELPER(xchg, ATOMIC_OP_XCHG)
+GEN_ATOMIC_HELPER(fetch_add, ATOMIC_OP_FETCH_ADD)
+GEN_ATOMIC_HELPER(fetch_and, ATOMIC_OP_FETCH_AND)
+GEN_ATOMIC_HELPER(fetch_or, ATOMIC_OP_FETCH_OR)
+GEN_ATOMIC_HELPER(fetch_xor, ATOMIC_OP_FETCH_XOR)
+
+#undef GEN_ATOMIC_HELPER
+#undef ATOMIC_OP_XCHG
+#undef ATOMIC_OP_FETCH_ADD
+#undef ATOMIC_OP_FETCH_AND
+#undef ATOMIC_OP_FETCH_OR
+#undef ATOMIC_OP_FETCH_XOR
+#undef ATOMIC_MMU_NAME
+#undef ATOMIC_HOST_NAME
+#undef ATOMIC_NAME
+#undef BSWAP
+#undef ABI_TYPE
+#undef DATA_TYPE
+#undef LSUFFIX
+#undef SUFFIX
+#undef DATA_SIZE
@@ -238,6 +238,8 @@ BlockDriverState *bdrv_new(void)
     bs->aio_context = qemu_get_aio_context();
 
     qemu_co_queue_init(&bs->flush_queue);
+    qemu_mutex_init(&bs->reqs_lock);
+    qemu_event_init(&bs->remote_done, false);
 
     QTAILQ_INSERT_TAIL(&all_bdrv_states, bs, bs_list);
 
@@ -2305,6 +2307,9 @@ static void bdrv_delete(BlockDriverState *bs)
     }
     QTAILQ_REMOVE(&all_bdrv_states, bs, bs_list);
 
+    assert(!bs->queue_contexts);
+    qemu_event_destroy(&bs->remote_done);
+    qemu_mutex_destroy(&bs->reqs_lock);
     g_free(bs);
 }
 
@@ -2887,6 +2892,15 @@ ImageInfoSpecific *bdrv_get_specific_info(BlockDriverState *bs)
     return NULL;
 }
 
+BlockStatsSpecific *bdrv_get_specific_stats(const BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+    if (drv && drv->bdrv_get_specific_stats) {
+        return drv->bdrv_get_specific_stats(bs);
+    }
+    return NULL;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkdebugEvent event)
 {
     if (!bs || !bs->drv || !bs->drv->bdrv_debug_event) {
@@ -3567,6 +3581,8 @@ void bdrv_attach_aio_context(BlockDriverState *bs,
 
 void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
 {
+    assert(!bs->queue_contexts);
+
     bdrv_drain(bs); /* ensure there are no in-flight requests */
 
     bdrv_detach_aio_context(bs);
@@ -3579,6 +3595,90 @@ void bdrv_set_aio_context(BlockDriverState *bs, AioContext *new_context)
     aio_context_release(new_context);
 }
 
+AioContext *bdrv_get_request_aio_context(BlockDriverState *bs)
+{
+    AioContext *ctx;
+
+    if (!bs->queue_contexts) {
+        return bs->aio_context;
+    }
+
+    ctx = qemu_get_current_aio_context();
+    return g_slist_find(bs->queue_contexts, ctx) ? ctx : bs->aio_context;
+}
+
+int bdrv_add_queue_context(BlockDriverState *bs, AioContext *ctx,
+                           Error **errp)
+{
+    BdrvChild *child, *failed;
+    int ret;
+
+    if (!bs->drv) {
+        error_setg(errp, "Node '%s' has no medium", bdrv_get_node_name(bs));
+        return -ENOMEDIUM;
+    }
+    if (!bs->drv->bdrv_supports_multiqueue) {
+        error_setg(errp, "Driver '%s' does not support multiqueue",
+                   bs->drv->format_name);
+        return -ENOTSUP;
+    }
+    if (bs->copy_on_read) {
+        error_setg(errp, "Copy-on-read is not supported in multiqueue mode");
+        return -ENOTSUP;
+    }
+    if (!QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        error_setg(errp, "Dirty bitmaps are not supported in multiqueue mode");
+        return -ENOTSUP;
+    }
+    if (!QLIST_EMPTY(&bs->before_write_notifiers.notifiers)) {
+        error_setg(errp, "Node '%s' is in use by a block job or has a write "
+                   "threshold, which is not supported in multiqueue mode",
+                   bdrv_get_device_or_node_name(bs));
+        return -ENOTSUP;
+    }
+
+    if (bs->drv->bdrv_add_queue_context) {
+        bs->drv->bdrv_add_queue_context(bs, ctx);
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        ret = bdrv_add_queue_context(child->bs, ctx, errp);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    bs->queue_contexts = g_slist_prepend(bs->queue_contexts, ctx);
+    return 0;
+
+fail:
+    failed = child;
+    QLIST_FOREACH(child, &bs->children, next) {
+        if (child == failed) {
+            break;
+        }
+        bdrv_del_queue_context(child->bs, ctx);
+    }
+    if (bs->drv->bdrv_del_queue_context) {
+        bs->drv->bdrv_del_queue_context(bs, ctx);
+    }
+    return ret;
+}
+
+void bdrv_del_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+    BdrvChild *child;
+
+    assert(g_slist_find(bs->queue_contexts, ctx));
+    bs->queue_contexts = g_slist_remove(bs->queue_contexts, ctx);
+
+    if (bs->drv && bs->drv->bdrv_del_queue_context) {
+        bs->drv->bdrv_del_queue_context(bs, ctx);
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        bdrv_del_queue_context(child->bs, ctx);
+    }
+}
+
 void bdrv_add_aio_context_notifier(BlockDriverState *bs,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
@@ -27,28 +27,117 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
-void block_acct_init(BlockAcctStats *stats, bool account_invalid,
-                     bool account_failed)
-{
-    stats->account_invalid = account_invalid;
-    stats->account_failed = account_failed;
+/* Identifies the current thread as the owner of a shard */
+static __thread char shard_owner;
 
+void block_acct_init(BlockAcctStats *stats)
+{
+    qemu_mutex_init(&stats->lock);
     if (qtest_enabled()) {
         clock_type = QEMU_CLOCK_VIRTUAL;
     }
 }
 
+void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
+                      bool account_failed)
+{
+    stats->account_invalid = account_invalid;
+    stats->account_failed = account_failed;
+}
+
 void block_acct_cleanup(BlockAcctStats *stats)
 {
     BlockAcctTimedStats *s, *next;
+    BlockAcctShard *shard, *next_shard;
+
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    for (shard = stats->shards; shard; shard = next_shard) {
+        next_shard = shard->next;
+        g_free(shard);
+    }
+    qemu_mutex_destroy(&stats->lock);
+}
+
+/* Return the counters of the current thread, creating them on first use.
+ * Shards are never removed before block_acct_cleanup(), so the list can
+ * be walked without locks.
+ */
+static BlockAcctCounters *block_acct_counters(BlockAcctStats *stats)
+{
+    BlockAcctShard *shard, *head;
+
+    for (shard = atomic_rcu_read(&stats->shards); shard;
+         shard = shard->next) {
+        if (shard->owner == &shard_owner) {
+            return &shard->counters;
+        }
+    }
+
+    shard = g_new0(BlockAcctShard, 1);
+    shard->owner = &shard_owner;
+    do {
+        head = atomic_read(&stats->shards);
+        shard->next = head;
+    } while (atomic_cmpxchg(&stats->shards, head, shard) != head);
+
+    return &shard->counters;
+}
+
+/* Counters are 64 bits wide even on 32-bit hosts.  Only the owner of a
+ * shard writes it, but queries read it from other threads, so stores and
+ * foreign loads must not tear.
+ */
+static inline void block_acct_add(uint64_t *counter, uint64_t n)
+{
+    atomic_set__nocheck(counter, *counter + n);
+}
+
+static inline uint64_t block_acct_read(uint64_t *counter)
+{
+    return atomic_read__nocheck(counter);
+}
+
+static unsigned block_acct_histogram_bin(int64_t latency_ns)
+{
+    unsigned bin;
+
+    if (latency_ns <= 1) {
+        return 0;
+    }
+    bin = 63 - clz64(latency_ns);
+    return MIN(bin, BLOCK_ACCT_HISTOGRAM_BINS - 1);
+}
+
+static void block_acct_account_latency(BlockAcctStats *stats,
+                                       BlockAcctCounters *c,
+                                       enum BlockAcctType type,
+                                       int64_t time_ns, int64_t latency_ns)
+{
+    BlockAcctTimedStats *s;
+    unsigned bin = block_acct_histogram_bin(latency_ns);
+
+    block_acct_add(&c->total_time_ns[type], latency_ns);
+    block_acct_add(&c->latency_histogram[type][bin], 1);
+    atomic_set__nocheck(&c->last_access_time_ns, time_ns);
+
+    /* Intervals are only added while the device is being set up */
+    if (QSLIST_EMPTY(&stats->intervals)) {
+        return;
+    }
+
+    qemu_mutex_lock(&stats->lock);
+    QSLIST_FOREACH(s, &stats->intervals, entries) {
+        timed_average_account(&s->latency[type], latency_ns);
+    }
+    qemu_mutex_unlock(&stats->lock);
 }
 
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
@@ -58,12 +147,14 @@ void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length)
 
     s = g_new0(BlockAcctTimedStats, 1);
     s->interval_length = interval_length;
-    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
-
     for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
         timed_average_init(&s->latency[i], clock_type,
                            (uint64_t) interval_length * NANOSECONDS_PER_SECOND);
     }
+
+    qemu_mutex_lock(&stats->lock);
+    QSLIST_INSERT_HEAD(&stats->intervals, s, entries);
+    qemu_mutex_unlock(&stats->lock);
 }
 
 BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
@@ -88,7 +179,7 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
 
 void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
-    BlockAcctTimedStats *s;
+    BlockAcctCounters *c = block_acct_counters(stats);
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
 
@@ -98,24 +189,20 @@ void block_acct_done(BlockAcctStats *stats, BlockAcctCookie *cookie)
 
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
-    stats->nr_bytes[cookie->type] += cookie->bytes;
-    stats->nr_ops[cookie->type]++;
-    stats->total_time_ns[cookie->type] += latency_ns;
-    stats->last_access_time_ns = time_ns;
-
-    QSLIST_FOREACH(s, &stats->intervals, entries) {
-        timed_average_account(&s->latency[cookie->type], latency_ns);
-    }
+    block_acct_add(&c->nr_bytes[cookie->type], cookie->bytes);
+    block_acct_add(&c->nr_ops[cookie->type], 1);
+    block_acct_account_latency(stats, c, cookie->type, time_ns, latency_ns);
 }
 
 void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
 {
+    BlockAcctCounters *c = block_acct_counters(stats);
+
     assert(cookie->type < BLOCK_MAX_IOTYPE);
 
-    stats->failed_ops[cookie->type]++;
+    block_acct_add(&c->failed_ops[cookie->type], 1);
 
     if (stats->account_failed) {
-        BlockAcctTimedStats *s;
         int64_t time_ns = qemu_clock_get_ns(clock_type);
         int64_t latency_ns = time_ns - cookie->start_time_ns;
 
@@ -123,17 +210,15 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie)
             latency_ns = qtest_latency_ns;
         }
 
-        stats->total_time_ns[cookie->type] += latency_ns;
-        stats->last_access_time_ns = time_ns;
-
-        QSLIST_FOREACH(s, &stats->intervals, entries) {
-            timed_average_account(&s->latency[cookie->type], latency_ns);
-        }
+        block_acct_account_latency(stats, c, cookie->type, time_ns,
+                                   latency_ns);
     }
 }
 
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
 {
+    BlockAcctCounters *c = block_acct_counters(stats);
+
     assert(type < BLOCK_MAX_IOTYPE);
 
     /* block_acct_done() and block_acct_failed() update
@@ -141,23 +226,100 @@ void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type)
      * invalid requests are accounted during their submission,
      * therefore there's no actual I/O involved. */
 
-    stats->invalid_ops[type]++;
+    block_acct_add(&c->invalid_ops[type], 1);
 
     if (stats->account_invalid) {
-        stats->last_access_time_ns = qemu_clock_get_ns(clock_type);
+        atomic_set__nocheck(&c->last_access_time_ns,
+                            qemu_clock_get_ns(clock_type));
     }
 }
 
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                       int num_requests)
 {
+    BlockAcctCounters *c = block_acct_counters(stats);
+
     assert(type < BLOCK_MAX_IOTYPE);
-    stats->merged[type] += num_requests;
+
+    block_acct_add(&c->merged[type], num_requests);
+}
+
+/* Add up the counters of all threads.  The latency histograms are
+ * relative to the last block_acct_reset_latency_histograms().
+ *
+ * The result is not an atomic snapshot: requests that complete in other
+ * threads meanwhile may or may not be included.
+ */
+void block_acct_get_counters(BlockAcctStats *stats, BlockAcctCounters *c)
+{
+    BlockAcctShard *shard;
+    unsigned i, j;
+
+    memset(c, 0, sizeof(*c));
+    for (shard = atomic_rcu_read(&stats->shards); shard;
+         shard = shard->next) {
+        BlockAcctCounters *sc = &shard->counters;
+
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            c->nr_bytes[i] += block_acct_read(&sc->nr_bytes[i]);
+            c->nr_ops[i] += block_acct_read(&sc->nr_ops[i]);
+            c->invalid_ops[i] += block_acct_read(&sc->invalid_ops[i]);
+            c->failed_ops[i] += block_acct_read(&sc->failed_ops[i]);
+            c->total_time_ns[i] += block_acct_read(&sc->total_time_ns[i]);
+            c->merged[i] += block_acct_read(&sc->merged[i]);
+            for (j = 0; j < BLOCK_ACCT_HISTOGRAM_BINS; j++) {
+                c->latency_histogram[i][j] +=
+                    block_acct_read(&sc->latency_histogram[i][j]);
+            }
+        }
+        c->last_access_time_ns =
+            MAX(c->last_access_time_ns,
+                atomic_read__nocheck(&sc->last_access_time_ns));
+    }
+
+    qemu_mutex_lock(&stats->lock);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        for (j = 0; j < BLOCK_ACCT_HISTOGRAM_BINS; j++) {
+            c->latency_histogram[i][j] -= stats->histogram_base[i][j];
+        }
+    }
+    qemu_mutex_unlock(&stats->lock);
+}
+
+/* The shards can only be written by their owner, so a reset records the
+ * current values and later queries subtract them.
+ */
+void block_acct_reset_latency_histograms(BlockAcctStats *stats)
+{
+    BlockAcctShard *shard;
+    unsigned i, j;
+
+    qemu_mutex_lock(&stats->lock);
+    memset(stats->histogram_base, 0, sizeof(stats->histogram_base));
+    for (shard = atomic_rcu_read(&stats->shards); shard;
+         shard = shard->next) {
+        for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+            for (j = 0; j < BLOCK_ACCT_HISTOGRAM_BINS; j++) {
+                stats->histogram_base[i][j] +=
+                    block_acct_read(&shard->counters.latency_histogram[i][j]);
+            }
+        }
+    }
+    qemu_mutex_unlock(&stats->lock);
 }
 
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats)
 {
-    return qemu_clock_get_ns(clock_type) - stats->last_access_time_ns;
+    BlockAcctShard *shard;
+    int64_t last_access_time_ns = 0;
+
+    for (shard = atomic_rcu_read(&stats->shards); shard;
+         shard = shard->next) {
+        last_access_time_ns =
+            MAX(last_access_time_ns,
+                atomic_read__nocheck(&shard->counters.last_access_time_ns));
+    }
+    return qemu_clock_get_ns(clock_type) - last_access_time_ns;
 }
 
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
@@ -61,6 +61,10 @@ struct BlockBackend {
     bool allow_write_beyond_eof;
 
     NotifierList remove_bs_notifiers, insert_bs_notifiers;
+
+    /* Additional AioContexts submitting requests in multiqueue mode */
+    GSList *queue_contexts;
+    Error *mq_blocker;
 };
 
 typedef struct BlockBackendAIOCB {
@@ -127,6 +131,7 @@ BlockBackend *blk_new(void)
     blk = g_new0(BlockBackend, 1);
     blk->refcnt = 1;
     blk_set_enable_write_cache(blk, true);
+    block_acct_init(&blk->stats);
 
     qemu_co_queue_init(&blk->public.throttled_reqs[0]);
     qemu_co_queue_init(&blk->public.throttled_reqs[1]);
@@ -173,6 +178,7 @@ static void blk_delete(BlockBackend *blk)
     assert(!blk->refcnt);
     assert(!blk->name);
     assert(!blk->dev);
+    assert(!blk->queue_contexts);
     if (blk->root) {
         blk_remove_bs(blk);
     }
@@ -894,7 +900,7 @@ BlockAIOCB *blk_abort_aio_request(BlockBackend *blk,
     acb->blk = blk;
     acb->ret = ret;
 
-    bh = aio_bh_new(blk_get_aio_context(blk), error_callback_bh, acb);
+    bh = aio_bh_new(blk_get_request_aio_context(blk), error_callback_bh, acb);
     acb->bh = bh;
     qemu_bh_schedule(bh);
 
@@ -920,8 +926,27 @@ static void blk_aio_complete(BlkAioEmAIOCB *acb)
         qemu_bh_delete(acb->bh);
     }
     if (acb->has_returned) {
+        BlockDriverState *bs = acb->common.bs;
+
         acb->common.cb(acb->common.opaque, acb->rwco.ret);
         qemu_aio_unref(acb);
+        if (bs) {
+            bdrv_dec_in_flight(bs);
+        }
+    }
+}
+
+/* AioContext in which requests that the current thread submits to @blk
+ * complete; it differs from blk_get_aio_context() in multiqueue mode.
+ */
+static AioContext *blk_get_request_aio_context(BlockBackend *blk)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    if (bs) {
+        return bdrv_get_request_aio_context(bs);
+    } else {
+        return qemu_get_aio_context();
     }
 }
 
@@ -939,6 +964,9 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
     Coroutine *co;
 
     acb = blk_aio_get(&blk_aio_em_aiocb_info, blk, cb, opaque);
+    if (acb->common.bs) {
+        bdrv_inc_in_flight(acb->common.bs);
+    }
     acb->rwco = (BlkRwCo) {
         .blk    = blk,
         .offset = offset,
@@ -955,7 +983,8 @@ static BlockAIOCB *blk_aio_prwv(BlockBackend *blk, int64_t offset, int bytes,
 
     acb->has_returned = true;
     if (acb->rwco.ret != NOT_DONE) {
-        acb->bh = aio_bh_new(blk_get_aio_context(blk), blk_aio_complete_bh, acb);
+        acb->bh = aio_bh_new(blk_get_request_aio_context(blk),
+                             blk_aio_complete_bh, acb);
         qemu_bh_schedule(acb->bh);
     }
 
@@ -1412,6 +1441,63 @@ void blk_set_aio_context(BlockBackend *blk, AioContext *new_context)
     }
 }
 
+/*
+ * Allow requests to be submitted to @blk from @ctx in addition to its
+ * home AioContext.  The BlockDriverState tree must support multiqueue
+ * operation (see bdrv_add_queue_context()); I/O throttling does not.
+ */
+int blk_add_queue_context(BlockBackend *blk, AioContext *ctx, Error **errp)
+{
+    BlockDriverState *bs = blk_bs(blk);
+    int ret;
+
+    if (!bs) {
+        error_setg(errp, "Device has no medium");
+        return -ENOMEDIUM;
+    }
+    if (blk->public.throttle_state) {
+        error_setg(errp, "I/O throttling is not supported in multiqueue mode");
+        return -ENOTSUP;
+    }
+    assert(ctx != blk_get_aio_context(blk));
+    assert(!g_slist_find(blk->queue_contexts, ctx));
+
+    bdrv_drain(bs);
+    ret = bdrv_add_queue_context(bs, ctx, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (!blk->queue_contexts) {
+        error_setg(&blk->mq_blocker, "node is used by a multiqueue device");
+        bdrv_op_block_all(bs, blk->mq_blocker);
+    }
+    blk->queue_contexts = g_slist_prepend(blk->queue_contexts, ctx);
+    return 0;
+}
+
+void blk_del_queue_context(BlockBackend *blk, AioContext *ctx)
+{
+    BlockDriverState *bs = blk_bs(blk);
+
+    assert(g_slist_find(blk->queue_contexts, ctx));
+    blk->queue_contexts = g_slist_remove(blk->queue_contexts, ctx);
+
+    bdrv_drain(bs);
+    bdrv_del_queue_context(bs, ctx);
+
+    if (!blk->queue_contexts) {
+        bdrv_op_unblock_all(bs, blk->mq_blocker);
+        error_free(blk->mq_blocker);
+        blk->mq_blocker = NULL;
+    }
+}
+
+bool blk_is_multiqueue(BlockBackend *blk)
+{
+    return blk->queue_contexts != NULL;
+}
+
 void blk_add_aio_context_notifier(BlockBackend *blk,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque)
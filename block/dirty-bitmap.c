@@ -76,6 +76,10 @@ BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
 
     assert((granularity & (granularity - 1)) == 0);
 
+    if (bs->queue_contexts) {
+        error_setg(errp, "Dirty bitmaps are not supported in multiqueue mode");
+        return NULL;
+    }
     if (name && bdrv_find_dirty_bitmap(bs, name)) {
         error_setg(errp, "Bitmap already exists: %s", name);
         return NULL;
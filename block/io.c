@@ -143,7 +143,8 @@ bool bdrv_requests_pending(BlockDriverState *bs)
 {
     BdrvChild *child;
 
-    if (!QLIST_EMPTY(&bs->tracked_requests)) {
+    if (!QLIST_EMPTY(&bs->tracked_requests) || atomic_read(&bs->in_flight) ||
+        atomic_read(&bs->remote_in_flight)) {
         return true;
     }
 
@@ -156,6 +157,71 @@ bool bdrv_requests_pending(BlockDriverState *bs)
     return false;
 }
 
+/* Check if requests are in flight that complete in the node's own
+ * AioContext, and therefore wake it up
+ */
+static bool bdrv_local_requests_pending(BlockDriverState *bs)
+{
+    BdrvTrackedRequest *req;
+    BdrvChild *child;
+    bool pending = atomic_read(&bs->in_flight);
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    QLIST_FOREACH(req, &bs->tracked_requests, list) {
+        if (req->ctx == bs->aio_context) {
+            pending = true;
+            break;
+        }
+    }
+    qemu_mutex_unlock(&bs->reqs_lock);
+
+    QLIST_FOREACH(child, &bs->children, next) {
+        pending = pending || bdrv_local_requests_pending(child->bs);
+    }
+    return pending;
+}
+
+/* Return a node below @bs with requests in flight in a queue context */
+static BlockDriverState *bdrv_remote_requests_pending(BlockDriverState *bs)
+{
+    BlockDriverState *found;
+    BdrvChild *child;
+
+    if (atomic_read(&bs->remote_in_flight)) {
+        return bs;
+    }
+    QLIST_FOREACH(child, &bs->children, next) {
+        found = bdrv_remote_requests_pending(child->bs);
+        if (found) {
+            return found;
+        }
+    }
+    return NULL;
+}
+
+/* Wait for requests on @bs to make progress.  Requests that complete in
+ * the threads of queue contexts do not wake up the node's AioContext, so
+ * once only those are left, sleep until they are done instead of polling.
+ */
+static void bdrv_drain_wait(BlockDriverState *bs)
+{
+    BlockDriverState *remote;
+
+    if (!bs->queue_contexts || bdrv_local_requests_pending(bs)) {
+        aio_poll(bdrv_get_aio_context(bs), true);
+        return;
+    }
+
+    remote = bdrv_remote_requests_pending(bs);
+    if (remote) {
+        /* Reset before checking again, or a completion in between is lost */
+        qemu_event_reset(&remote->remote_done);
+        if (atomic_read(&remote->remote_in_flight)) {
+            qemu_event_wait(&remote->remote_done);
+        }
+    }
+}
+
 static void bdrv_drain_recurse(BlockDriverState *bs)
 {
     BdrvChild *child;
@@ -182,7 +248,11 @@ static void bdrv_drain_poll(BlockDriverState *bs)
     while (busy) {
         /* Keep iterating */
         busy = bdrv_requests_pending(bs);
-        busy |= aio_poll(bdrv_get_aio_context(bs), busy);
+        if (busy) {
+            bdrv_drain_wait(bs);
+        } else {
+            busy = aio_poll(bdrv_get_aio_context(bs), false);
+        }
     }
 }
 
@@ -223,7 +293,12 @@ static void coroutine_fn bdrv_co_yield_to_drain(BlockDriverState *bs)
 void bdrv_drained_begin(BlockDriverState *bs)
 {
     if (!bs->quiesce_counter++) {
+        GSList *l;
+
         aio_disable_external(bdrv_get_aio_context(bs));
+        for (l = bs->queue_contexts; l; l = l->next) {
+            aio_disable_external(l->data);
+        }
         bdrv_parent_drained_begin(bs);
     }
 
@@ -239,12 +314,17 @@ void bdrv_drained_begin(BlockDriverState *bs)
 
 void bdrv_drained_end(BlockDriverState *bs)
 {
+    GSList *l;
+
     assert(bs->quiesce_counter > 0);
     if (--bs->quiesce_counter > 0) {
         return;
     }
 
     bdrv_parent_drained_end(bs);
+    for (l = bs->queue_contexts; l; l = l->next) {
+        aio_enable_external(l->data);
+    }
     aio_enable_external(bdrv_get_aio_context(bs));
 }
 
@@ -326,7 +406,7 @@ void bdrv_drain_all(void)
                 if (aio_context == bdrv_get_aio_context(bs)) {
                     if (bdrv_requests_pending(bs)) {
                         busy = true;
-                        aio_poll(aio_context, busy);
+                        bdrv_drain_wait(bs);
                     }
                 }
             }
@@ -355,6 +435,63 @@ void bdrv_drain_all(void)
     }
 }
 
+static void bdrv_dec_remote_in_flight(BlockDriverState *bs)
+{
+    if (atomic_fetch_dec(&bs->remote_in_flight) == 1) {
+        qemu_event_set(&bs->remote_done);
+    }
+}
+
+void bdrv_inc_in_flight(BlockDriverState *bs)
+{
+    if (bdrv_get_request_aio_context(bs) != bs->aio_context) {
+        atomic_inc(&bs->remote_in_flight);
+    } else {
+        atomic_inc(&bs->in_flight);
+    }
+}
+
+void bdrv_dec_in_flight(BlockDriverState *bs)
+{
+    /* Called in the thread that submitted the request */
+    if (bdrv_get_request_aio_context(bs) != bs->aio_context) {
+        bdrv_dec_remote_in_flight(bs);
+    } else {
+        atomic_dec(&bs->in_flight);
+    }
+}
+
+/* A coroutine waiting for a tracked request that completes in a different
+ * AioContext.
+ */
+typedef struct BdrvRemoteWaiter {
+    Coroutine *co;
+    AioContext *ctx;
+    QSLIST_ENTRY(BdrvRemoteWaiter) next;
+} BdrvRemoteWaiter;
+
+static IntervalTreeRoot *tracked_request_tree(BdrvTrackedRequest *req)
+{
+    return req->serialising ? &req->bs->serialising_requests
+                            : &req->bs->nonserialising_requests;
+}
+
+static void tracked_request_tree_insert(BdrvTrackedRequest *req)
+{
+    if (req->overlap_bytes) {
+        req->overlap_node.start = req->overlap_offset;
+        req->overlap_node.last = req->overlap_offset + req->overlap_bytes - 1;
+        interval_tree_insert(&req->overlap_node, tracked_request_tree(req));
+    }
+}
+
+static void tracked_request_tree_remove(BdrvTrackedRequest *req)
+{
+    if (req->overlap_bytes) {
+        interval_tree_remove(&req->overlap_node, tracked_request_tree(req));
+    }
+}
+
 /**
  * Remove an active request from the tracked requests list
  *
@@ -362,12 +499,30 @@ void bdrv_drain_all(void)
  */
 static void tracked_request_end(BdrvTrackedRequest *req)
 {
+    BlockDriverState *bs = req->bs;
+    BdrvRemoteWaiter *w, *next;
+
+    qemu_mutex_lock(&bs->reqs_lock);
+    tracked_request_tree_remove(req);
     if (req->serialising) {
-        req->bs->serialising_in_flight--;
+        bs->serialising_in_flight--;
     }
 
     QLIST_REMOVE(req, list);
+    w = QSLIST_FIRST(&req->remote_waiters);
+    QSLIST_INIT(&req->remote_waiters);
+    qemu_mutex_unlock(&bs->reqs_lock);
+
     qemu_co_queue_restart_all(&req->wait_queue);
+    for (; w; w = next) {
+        /* w lives on the stack of the waiter, which can run right away */
+        next = QSLIST_NEXT(w, next);
+        aio_co_schedule(w->ctx, w->co);
+    }
+
+    if (req->ctx != bs->aio_context) {
+        bdrv_dec_remote_in_flight(bs);
+    }
 }
 
 /**
@@ -385,14 +540,21 @@ static void tracked_request_begin(BdrvTrackedRequest *req,
         .bytes          = bytes,
         .type           = type,
         .co             = qemu_coroutine_self(),
+        .ctx            = bdrv_get_request_aio_context(bs),
         .serialising    = false,
         .overlap_offset = offset,
         .overlap_bytes  = bytes,
     };
 
     qemu_co_queue_init(&req->wait_queue);
+    if (req->ctx != bs->aio_context) {
+        atomic_inc(&bs->remote_in_flight);
+    }
 
+    qemu_mutex_lock(&bs->reqs_lock);
     QLIST_INSERT_HEAD(&bs->tracked_requests, req, list);
+    tracked_request_tree_insert(req);
+    qemu_mutex_unlock(&bs->reqs_lock);
 }
 
 static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
@@ -401,6 +563,11 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
     unsigned int overlap_bytes = ROUND_UP(req->offset + req->bytes, align)
                                - overlap_offset;
 
+    qemu_mutex_lock(&req->bs->reqs_lock);
+
+    /* The key changes, and possibly the tree too */
+    tracked_request_tree_remove(req);
+
     if (!req->serialising) {
         req->bs->serialising_in_flight++;
         req->serialising = true;
@@ -408,6 +575,10 @@ static void mark_request_serialising(BdrvTrackedRequest *req, uint64_t align)
 
     req->overlap_offset = MIN(req->overlap_offset, overlap_offset);
     req->overlap_bytes = MAX(req->overlap_bytes, overlap_bytes);
+
+    tracked_request_tree_insert(req);
+
+    qemu_mutex_unlock(&req->bs->reqs_lock);
 }
 
 /**
@@ -464,61 +635,81 @@ static int bdrv_get_cluster_size(BlockDriverState *bs)
     }
 }
 
-static bool tracked_request_overlaps(BdrvTrackedRequest *req,
-                                     int64_t offset, unsigned int bytes)
+/* Return a request in @tree that overlaps @self and that @self must wait
+ * for, or NULL if there is none.  Called with bs->reqs_lock held.
+ */
+static BdrvTrackedRequest *find_overlapping_request(BdrvTrackedRequest *self,
+                                                   IntervalTreeRoot *tree)
 {
-    /*        aaaa   bbbb */
-    if (offset >= req->overlap_offset + req->overlap_bytes) {
-        return false;
-    }
-    /* bbbb   aaaa        */
-    if (req->overlap_offset >= offset + bytes) {
-        return false;
+    uint64_t start = self->overlap_offset;
+    uint64_t last = self->overlap_offset + self->overlap_bytes - 1;
+    IntervalTreeNode *node;
+
+    for (node = interval_tree_iter_first(tree, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        BdrvTrackedRequest *req =
+            container_of(node, BdrvTrackedRequest, overlap_node);
+
+        if (req == self) {
+            continue;
+        }
+
+        /* Hitting this means there was a reentrant request, for
+         * example, a block driver issuing nested requests.  This must
+         * never happen since it means deadlock.
+         */
+        assert(qemu_coroutine_self() != req->co);
+
+        /* If the request is already (indirectly) waiting for us, or
+         * will wait for us as soon as it wakes up, then just go on
+         * (instead of producing a deadlock in the former case). */
+        if (!req->waiting_for) {
+            return req;
+        }
     }
-    return true;
+    return NULL;
 }
 
 static bool coroutine_fn wait_serialising_requests(BdrvTrackedRequest *self)
 {
     BlockDriverState *bs = self->bs;
     BdrvTrackedRequest *req;
-    bool retry;
     bool waited = false;
 
-    if (!bs->serialising_in_flight) {
+    if (!atomic_read(&bs->serialising_in_flight) || !self->overlap_bytes) {
         return false;
     }
 
-    do {
-        retry = false;
-        QLIST_FOREACH(req, &bs->tracked_requests, list) {
-            if (req == self || (!req->serialising && !self->serialising)) {
-                continue;
-            }
-            if (tracked_request_overlaps(req, self->overlap_offset,
-                                         self->overlap_bytes))
-            {
-                /* Hitting this means there was a reentrant request, for
-                 * example, a block driver issuing nested requests.  This must
-                 * never happen since it means deadlock.
-                 */
-                assert(qemu_coroutine_self() != req->co);
-
-                /* If the request is already (indirectly) waiting for us, or
-                 * will wait for us as soon as it wakes up, then just go on
-                 * (instead of producing a deadlock in the former case). */
-                if (!req->waiting_for) {
-                    self->waiting_for = req;
-                    qemu_co_queue_wait(&req->wait_queue);
-                    self->waiting_for = NULL;
-                    retry = true;
-                    waited = true;
-                    break;
-                }
-            }
+    qemu_mutex_lock(&bs->reqs_lock);
+
+    /* Serialising requests conflict with everything that overlaps them,
+     * other requests only with serialising ones.
+     */
+    while ((req = find_overlapping_request(self, &bs->serialising_requests)) ||
+           (self->serialising &&
+            (req = find_overlapping_request(self,
+                                            &bs->nonserialising_requests)))) {
+        self->waiting_for = req;
+        if (req->ctx == self->ctx) {
+            /* req cannot complete before we yield, it runs in our thread */
+            qemu_mutex_unlock(&bs->reqs_lock);
+            qemu_co_queue_wait(&req->wait_queue);
+        } else {
+            BdrvRemoteWaiter w = {
+                .co = qemu_coroutine_self(),
+                .ctx = self->ctx,
+            };
+
+            QSLIST_INSERT_HEAD(&req->remote_waiters, &w, next);
+            qemu_mutex_unlock(&bs->reqs_lock);
+            qemu_coroutine_yield();
         }
-    } while (retry);
+        qemu_mutex_lock(&bs->reqs_lock);
+        self->waiting_for = NULL;
+        waited = true;
+    }
 
+    qemu_mutex_unlock(&bs->reqs_lock);
     return waited;
 }
 
@@ -1346,9 +1537,10 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
 
-    ++bs->write_gen;
+    atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, start_sector, end_sector - start_sector);
 
+    qemu_mutex_lock(&bs->reqs_lock);
     if (bs->wr_highest_offset < offset + bytes) {
         bs->wr_highest_offset = offset + bytes;
     }
@@ -1357,6 +1549,7 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
         bs->total_sectors = MAX(bs->total_sectors, end_sector);
         ret = 0;
     }
+    qemu_mutex_unlock(&bs->reqs_lock);
 
     return ret;
 }
@@ -2098,8 +2291,11 @@ static const AIOCBInfo bdrv_em_co_aiocb_info = {
 static void bdrv_co_complete(BlockAIOCBCoroutine *acb)
 {
     if (!acb->need_bh) {
+        BlockDriverState *bs = acb->common.bs;
+
         acb->common.cb(acb->common.opaque, acb->req.error);
         qemu_aio_unref(acb);
+        bdrv_dec_in_flight(bs);
     }
 }
 
@@ -2118,7 +2314,8 @@ static void bdrv_co_maybe_schedule_bh(BlockAIOCBCoroutine *acb)
     if (acb->req.error != -EINPROGRESS) {
         BlockDriverState *bs = acb->common.bs;
 
-        acb->bh = aio_bh_new(bdrv_get_aio_context(bs), bdrv_co_em_bh, acb);
+        acb->bh = aio_bh_new(bdrv_get_request_aio_context(bs),
+                             bdrv_co_em_bh, acb);
         qemu_bh_schedule(acb->bh);
     }
 }
@@ -2151,6 +2348,7 @@ static BlockAIOCB *bdrv_co_aio_prw_vector(BdrvChild *child,
     BlockAIOCBCoroutine *acb;
 
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, child->bs, cb, opaque);
+    bdrv_inc_in_flight(child->bs);
     acb->child = child;
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
@@ -2184,6 +2382,7 @@ BlockAIOCB *bdrv_aio_flush(BlockDriverState *bs,
     BlockAIOCBCoroutine *acb;
 
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
+    bdrv_inc_in_flight(bs);
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
 
@@ -2212,6 +2411,7 @@ BlockAIOCB *bdrv_aio_pdiscard(BlockDriverState *bs, int64_t offset, int count,
     trace_bdrv_aio_pdiscard(bs, offset, count, opaque);
 
     acb = qemu_aio_get(&bdrv_em_co_aiocb_info, bs, cb, opaque);
+    bdrv_inc_in_flight(bs);
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
     acb->req.offset = offset;
@@ -2280,14 +2480,19 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
 
     tracked_request_begin(&req, bs, 0, 0, BDRV_TRACKED_FLUSH);
 
-    int current_gen = bs->write_gen;
+    int current_gen = atomic_read(&bs->write_gen);
 
-    /* Wait until any previous flushes are completed */
-    while (bs->active_flush_req != NULL) {
-        qemu_co_queue_wait(&bs->flush_queue);
-    }
+    /* Wait until any previous flushes are completed.  In multiqueue mode
+     * flushes from different queues go to the driver in parallel instead,
+     * flush_queue cannot wake up coroutines in other threads.
+     */
+    if (!bs->queue_contexts) {
+        while (bs->active_flush_req != NULL) {
+            qemu_co_queue_wait(&bs->flush_queue);
+        }
 
-    bs->active_flush_req = &req;
+        bs->active_flush_req = &req;
+    }
 
     /* Write back all layers by calling one driver function */
     if (bs->drv->bdrv_co_flush) {
@@ -2310,7 +2515,7 @@ int coroutine_fn bdrv_co_flush(BlockDriverState *bs)
     }
 
     /* Check if we really need to flush anything */
-    if (bs->flushed_gen == current_gen) {
+    if (atomic_read(&bs->flushed_gen) == current_gen) {
         goto flush_parent;
     }
 
@@ -2356,10 +2561,12 @@ flush_parent:
     ret = bs->file ? bdrv_co_flush(bs->file->bs) : 0;
 out:
     /* Notify any pending flushes that we have completed */
-    bs->flushed_gen = current_gen;
-    bs->active_flush_req = NULL;
-    /* Return value is ignored - it's ok if wait queue is empty */
-    qemu_co_queue_next(&bs->flush_queue);
+    atomic_set(&bs->flushed_gen, current_gen);
+    if (bs->active_flush_req == &req) {
+        bs->active_flush_req = NULL;
+        /* Return value is ignored - it's ok if wait queue is empty */
+        qemu_co_queue_next(&bs->flush_queue);
+    }
 
     tracked_request_end(&req);
     return ret;
@@ -2486,7 +2693,7 @@ int coroutine_fn bdrv_co_pdiscard(BlockDriverState *bs, int64_t offset,
     }
     ret = 0;
 out:
-    ++bs->write_gen;
+    atomic_inc(&bs->write_gen);
     bdrv_set_dirty(bs, req.offset >> BDRV_SECTOR_BITS,
                    req.bytes >> BDRV_SECTOR_BITS);
     tracked_request_end(&req);
@@ -2598,6 +2805,7 @@ BlockAIOCB *bdrv_aio_ioctl(BlockDriverState *bs,
                                             bs, cb, opaque);
     Coroutine *co;
 
+    bdrv_inc_in_flight(bs);
     acb->need_bh = true;
     acb->req.error = -EINPROGRESS;
     acb->req.req = req;
@@ -2677,7 +2885,12 @@ void bdrv_io_plug(BlockDriverState *bs)
         bdrv_io_plug(child->bs);
     }
 
-    if (bs->io_plugged++ == 0 && bs->io_plug_disabled == 0) {
+    if (bs->queue_contexts) {
+        /* Each queue has its own plug count in the driver */
+        if (bs->drv && bs->drv->bdrv_io_plug) {
+            bs->drv->bdrv_io_plug(bs);
+        }
+    } else if (bs->io_plugged++ == 0 && bs->io_plug_disabled == 0) {
         BlockDriver *drv = bs->drv;
         if (drv && drv->bdrv_io_plug) {
             drv->bdrv_io_plug(bs);
@@ -2689,11 +2902,17 @@ void bdrv_io_unplug(BlockDriverState *bs)
 {
     BdrvChild *child;
 
-    assert(bs->io_plugged);
-    if (--bs->io_plugged == 0 && bs->io_plug_disabled == 0) {
-        BlockDriver *drv = bs->drv;
-        if (drv && drv->bdrv_io_unplug) {
-            drv->bdrv_io_unplug(bs);
+    if (bs->queue_contexts) {
+        if (bs->drv && bs->drv->bdrv_io_unplug) {
+            bs->drv->bdrv_io_unplug(bs);
+        }
+    } else {
+        assert(bs->io_plugged);
+        if (--bs->io_plugged == 0 && bs->io_plug_disabled == 0) {
+            BlockDriver *drv = bs->drv;
+            if (drv && drv->bdrv_io_unplug) {
+                drv->bdrv_io_unplug(bs);
+            }
         }
     }
 
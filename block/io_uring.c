@@ -0,0 +1,459 @@
+/*
+ * Linux io_uring support.
+ *
+ * Based on the Linux native AIO support in linux-aio.c.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include <liburing.h>
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "block/block.h"
+#include "block/raw-aio.h"
+#include "qemu/coroutine.h"
+#include "qapi/error.h"
+
+/*
+ * Submission queue size, per AioContext.  The completion queue is twice
+ * as large.  Requests beyond this are kept in the submit queue below
+ * until earlier ones complete, rather than failing with EAGAIN.
+ */
+#define MAX_ENTRIES 1024
+
+/* Number of slots in the table of registered files.  */
+#define MAX_FILES 64
+
+/* How long the SQPOLL kernel thread spins before going to sleep, in ms.  */
+#define SQ_THREAD_IDLE_MS 1000
+
+typedef struct LuringAIOCB {
+    Coroutine *co;
+    struct io_uring_sqe sqeq;
+    ssize_t ret;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(LuringAIOCB) next;
+
+    /*
+     * Buffered reads may return short even before EOF.  The rest of the
+     * request is then resubmitted, starting total_read bytes into qiov.
+     */
+    int total_read;
+    QEMUIOVector resubmit_qiov;
+} LuringAIOCB;
+
+typedef struct LuringQueue {
+    int plugged;
+    unsigned int in_queue;
+    unsigned int in_flight;
+    bool blocked;
+    QSIMPLEQ_HEAD(, LuringAIOCB) submit_queue;
+} LuringQueue;
+
+struct LuringState {
+    AioContext *aio_context;
+
+    struct io_uring ring;
+
+    /* io queue for submit at batch */
+    LuringQueue io_q;
+
+    /* I/O completion processing for nested event loops */
+    QEMUBH *completion_bh;
+
+    /* Host fd in each slot of the registered file table, -1 if free.
+     * files_registered is false if the kernel lacks sparse file sets.  */
+    int files[MAX_FILES];
+    bool files_registered;
+};
+
+static void ioq_submit(LuringState *s);
+
+/**
+ * luring_resubmit:
+ *
+ * Resubmit a request by appending it to submit_queue.  The caller must
+ * ensure that ioq_submit() is called later so that submit_queue requests
+ * are started.
+ */
+static void luring_resubmit(LuringState *s, LuringAIOCB *luringcb)
+{
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+}
+
+/**
+ * luring_resubmit_short_read:
+ *
+ * Short reads are rare but may occur.  The remaining read request needs to
+ * be resubmitted.
+ */
+static void luring_resubmit_short_read(LuringState *s, LuringAIOCB *luringcb,
+                                       int nread)
+{
+    QEMUIOVector *resubmit_qiov;
+    size_t remaining;
+
+    /* Update read position */
+    luringcb->total_read += nread;
+    remaining = luringcb->qiov->size - luringcb->total_read;
+
+    /* Shorten qiov */
+    resubmit_qiov = &luringcb->resubmit_qiov;
+    if (resubmit_qiov->iov == NULL) {
+        qemu_iovec_init(resubmit_qiov, luringcb->qiov->niov);
+    } else {
+        qemu_iovec_reset(resubmit_qiov);
+    }
+    qemu_iovec_concat(resubmit_qiov, luringcb->qiov, luringcb->total_read,
+                      remaining);
+
+    /* Update sqe */
+    luringcb->sqeq.off += nread;
+    luringcb->sqeq.addr = (__u64)(uintptr_t)luringcb->resubmit_qiov.iov;
+    luringcb->sqeq.len = luringcb->resubmit_qiov.niov;
+
+    luring_resubmit(s, luringcb);
+}
+
+/**
+ * luring_process_completions:
+ *
+ * Fetches completed I/O requests, consumes cqes and invokes their callbacks.
+ * The function is somewhat tricky because it supports nested event loops,
+ * for example when a request callback invokes aio_poll().  The completion
+ * BH is scheduled while cqes are being processed, so that a nested event
+ * loop sees the remaining ones; polling the ring fd would not, since it
+ * only wakes up when new completions are added.
+ */
+static void luring_process_completions(LuringState *s)
+{
+    struct io_uring_cqe *cqe;
+
+    qemu_bh_schedule(s->completion_bh);
+
+    while (io_uring_peek_cqe(&s->ring, &cqe) == 0) {
+        LuringAIOCB *luringcb;
+        int ret;
+
+        if (!cqe) {
+            break;
+        }
+
+        luringcb = io_uring_cqe_get_data(cqe);
+        ret = cqe->res;
+        io_uring_cqe_seen(&s->ring, cqe);
+
+        /* Change counters one-by-one because we can be nested. */
+        s->io_q.in_flight--;
+
+        /* total_read is non-zero only for resubmitted read requests */
+        if (ret == -EINTR || ret == -EAGAIN) {
+            luring_resubmit(s, luringcb);
+            continue;
+        } else if (ret >= 0 && luringcb->is_read &&
+                   luringcb->total_read + ret < luringcb->qiov->size) {
+            if (ret > 0) {
+                luring_resubmit_short_read(s, luringcb, ret);
+                continue;
+            }
+            /* Short reads mean EOF, pad with zeros. */
+            qemu_iovec_memset(luringcb->qiov, luringcb->total_read, 0,
+                              luringcb->qiov->size - luringcb->total_read);
+            ret = 0;
+        } else if (ret >= 0) {
+            if (luringcb->is_read || ret == luringcb->qiov->size) {
+                ret = 0;
+            } else {
+                ret = -ENOSPC;
+            }
+        }
+
+        if (luringcb->resubmit_qiov.iov) {
+            qemu_iovec_destroy(&luringcb->resubmit_qiov);
+        }
+        luringcb->ret = ret;
+        qemu_coroutine_enter(luringcb->co);
+    }
+
+    qemu_bh_cancel(s->completion_bh);
+}
+
+static void luring_process_completions_and_submit(LuringState *s)
+{
+    aio_context_acquire(s->aio_context);
+    luring_process_completions(s);
+
+    if (!s->io_q.plugged && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+    aio_context_release(s->aio_context);
+}
+
+static void qemu_luring_completion_bh(void *opaque)
+{
+    LuringState *s = opaque;
+    luring_process_completions_and_submit(s);
+}
+
+static void qemu_luring_completion_cb(void *opaque)
+{
+    LuringState *s = opaque;
+    luring_process_completions_and_submit(s);
+}
+
+static bool qemu_luring_poll_cb(void *opaque)
+{
+    return luring_poll_completions(opaque);
+}
+
+bool luring_poll_completions(LuringState *s)
+{
+    if (!io_uring_cq_ready(&s->ring)) {
+        return false;
+    }
+    luring_process_completions_and_submit(s);
+    return true;
+}
+
+static void ioq_init(LuringQueue *io_q)
+{
+    QSIMPLEQ_INIT(&io_q->submit_queue);
+    io_q->plugged = 0;
+    io_q->in_queue = 0;
+    io_q->in_flight = 0;
+    io_q->blocked = false;
+}
+
+static void ioq_submit(LuringState *s)
+{
+    int ret = 0;
+    LuringAIOCB *luringcb, *luringcb_next;
+
+    while (s->io_q.in_queue > 0) {
+        /*
+         * Try to fetch sqes from the ring for requests waiting in
+         * the overflow queue
+         */
+        QSIMPLEQ_FOREACH_SAFE(luringcb, &s->io_q.submit_queue, next,
+                              luringcb_next) {
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&s->ring);
+            if (!sqe) {
+                break;
+            }
+            /* Prep sqe for submission */
+            *sqe = luringcb->sqeq;
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.submit_queue, next);
+        }
+        ret = io_uring_submit(&s->ring);
+        /* Prevent infinite loop if submission is refused */
+        if (ret <= 0) {
+            if (ret == -EAGAIN || ret == -EINTR) {
+                continue;
+            }
+            break;
+        }
+        s->io_q.in_flight += ret;
+        s->io_q.in_queue  -= ret;
+    }
+    s->io_q.blocked = (s->io_q.in_queue > 0);
+
+    if (s->io_q.in_flight) {
+        /*
+         * We can try to complete something just right away if there are
+         * still requests in-flight.
+         */
+        luring_process_completions(s);
+    }
+}
+
+void luring_io_plug(BlockDriverState *bs, LuringState *s)
+{
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, LuringState *s)
+{
+    assert(s->io_q.plugged);
+    if (--s->io_q.plugged == 0 &&
+        !s->io_q.blocked && s->io_q.in_queue > 0) {
+        ioq_submit(s);
+    }
+}
+
+/* Return the registered file slot for FD, registering it if needed, or -1
+   if FD must be passed to the kernel as is.  */
+static int luring_fixed_file(LuringState *s, int fd)
+{
+    int i, free_slot = -1;
+
+    if (!s->files_registered) {
+        return -1;
+    }
+    for (i = 0; i < MAX_FILES; i++) {
+        if (s->files[i] == fd) {
+            return i;
+        }
+        if (s->files[i] == -1 && free_slot == -1) {
+            free_slot = i;
+        }
+    }
+    if (free_slot == -1 ||
+        io_uring_register_files_update(&s->ring, free_slot, &fd, 1) != 1) {
+        return -1;
+    }
+    s->files[free_slot] = fd;
+    return free_slot;
+}
+
+void luring_unregister_fd(LuringState *s, int fd)
+{
+    int i, none = -1;
+
+    /* Requests already in flight keep their own reference to the file.  */
+    for (i = 0; i < MAX_FILES; i++) {
+        if (s->files[i] == fd) {
+            io_uring_register_files_update(&s->ring, i, &none, 1);
+            s->files[i] = -1;
+        }
+    }
+}
+
+/**
+ * luring_do_submit:
+ * @fd: file descriptor for I/O
+ * @luringcb: AIO control block
+ * @s: AIO state
+ * @offset: offset for request
+ * @type: type of request
+ *
+ * Fetches sqes from ring, adds to pending queue and preps them
+ *
+ */
+static int luring_do_submit(int fd, LuringAIOCB *luringcb, LuringState *s,
+                            uint64_t offset, int type)
+{
+    struct io_uring_sqe *sqes = &luringcb->sqeq;
+    int slot = luring_fixed_file(s, fd);
+
+    if (slot >= 0) {
+        fd = slot;
+    }
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        io_uring_prep_writev(sqes, fd, luringcb->qiov->iov,
+                             luringcb->qiov->niov, offset);
+        break;
+    case QEMU_AIO_READ:
+        io_uring_prep_readv(sqes, fd, luringcb->qiov->iov,
+                            luringcb->qiov->niov, offset);
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        abort();
+    }
+    if (slot >= 0) {
+        io_uring_sqe_set_flags(sqes, IOSQE_FIXED_FILE);
+    }
+    io_uring_sqe_set_data(sqes, luringcb);
+
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.submit_queue, luringcb, next);
+    s->io_q.in_queue++;
+    if (!s->io_q.blocked &&
+        (!s->io_q.plugged ||
+         s->io_q.in_flight + s->io_q.in_queue >= MAX_ENTRIES)) {
+        ioq_submit(s);
+    }
+    return 0;
+}
+
+int coroutine_fn luring_co_submit(BlockDriverState *bs, LuringState *s, int fd,
+                                  uint64_t offset, QEMUIOVector *qiov, int type)
+{
+    int ret;
+    LuringAIOCB luringcb = {
+        .co         = qemu_coroutine_self(),
+        .ret        = -EINPROGRESS,
+        .qiov       = qiov,
+        .is_read    = (type == QEMU_AIO_READ),
+    };
+
+    ret = luring_do_submit(fd, &luringcb, s, offset, type);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (luringcb.ret == -EINPROGRESS) {
+        qemu_coroutine_yield();
+    }
+    return luringcb.ret;
+}
+
+void luring_detach_aio_context(LuringState *s, AioContext *old_context)
+{
+    aio_set_fd_handler(old_context, s->ring.ring_fd, false,
+                       NULL, NULL, NULL);
+    qemu_bh_delete(s->completion_bh);
+    s->aio_context = NULL;
+}
+
+void luring_attach_aio_context(LuringState *s, AioContext *new_context)
+{
+    s->aio_context = new_context;
+    s->completion_bh = aio_bh_new(new_context, qemu_luring_completion_bh, s);
+    aio_set_fd_handler(s->aio_context, s->ring.ring_fd, false,
+                       qemu_luring_completion_cb, NULL, s);
+    aio_set_fd_poll(s->aio_context, s->ring.ring_fd, qemu_luring_poll_cb,
+                    NULL, NULL);
+}
+
+LuringState *luring_init(bool sqpoll, Error **errp)
+{
+    int rc, i;
+    LuringState *s = g_new0(LuringState, 1);
+    struct io_uring_params params = { 0 };
+
+    if (sqpoll) {
+        params.flags |= IORING_SETUP_SQPOLL;
+        params.sq_thread_idle = SQ_THREAD_IDLE_MS;
+    }
+
+    rc = io_uring_queue_init_params(MAX_ENTRIES, &s->ring, &params);
+    if (rc < 0) {
+        error_setg_errno(errp, -rc, "failed to init linux io_uring ring");
+        g_free(s);
+        return NULL;
+    }
+
+    /* Start with an empty, sparse table; files are added on first use.  */
+    for (i = 0; i < MAX_FILES; i++) {
+        s->files[i] = -1;
+    }
+    rc = io_uring_register_files(&s->ring, s->files, MAX_FILES);
+    s->files_registered = rc == 0;
+    if (sqpoll && !s->files_registered) {
+        /* Older kernels only accept registered files in SQPOLL mode.  */
+        error_setg_errno(errp, -rc, "io_uring SQPOLL mode needs registered "
+                         "files, which this kernel does not support");
+        io_uring_queue_exit(&s->ring);
+        g_free(s);
+        return NULL;
+    }
+
+    ioq_init(&s->io_q);
+    return s;
+}
+
+void luring_cleanup(LuringState *s)
+{
+    if (s->files_registered) {
+        io_uring_unregister_files(&s->ring);
+    }
+    io_uring_queue_exit(&s->ring);
+    g_free(s);
+}
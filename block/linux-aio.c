@@ -164,6 +164,43 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* The completion ring that the kernel maps into our address space; the
+ * io_context_t returned by io_setup points to it.
+ */
+struct aio_ring {
+    unsigned id;    /* kernel internal index number */
+    unsigned nr;    /* number of io_events */
+    unsigned head;
+    unsigned tail;
+
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length; /* size of aio_ring */
+
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Check for completions without entering the kernel */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LinuxAioState *s = container_of(e, LinuxAioState, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC ||
+        ring->head == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    /* Pairs with the kernel's barrier before it publishes tail */
+    smp_rmb();
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -342,6 +379,8 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context)
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
                            qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb,
+                                NULL, NULL);
 }
 
 LinuxAioState *laio_init(void)
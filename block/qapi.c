@@ -361,40 +361,75 @@ static BlockStats *bdrv_query_stats(BlockBackend *blk,
                                     const BlockDriverState *bs,
                                     bool query_backing);
 
+static BlockLatencyHistogramInfo *
+bdrv_query_latency_histogram(uint64_t *bins)
+{
+    BlockLatencyHistogramInfo *info = g_new0(BlockLatencyHistogramInfo, 1);
+    int i;
+
+    /* Trailing empty bins are left out */
+    for (i = BLOCK_ACCT_HISTOGRAM_BINS - 1; i >= 0; i--) {
+        if (bins[i]) {
+            break;
+        }
+    }
+    for (; i >= 0; i--) {
+        uint64List *entry = g_new0(uint64List, 1);
+        entry->value = bins[i];
+        entry->next = info->bins;
+        info->bins = entry;
+    }
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockAcctCounters c;
+
+    block_acct_get_counters(stats, &c);
 
-    ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
-    ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
-    ds->rd_operations = stats->nr_ops[BLOCK_ACCT_READ];
-    ds->wr_operations = stats->nr_ops[BLOCK_ACCT_WRITE];
+    ds->rd_bytes = c.nr_bytes[BLOCK_ACCT_READ];
+    ds->wr_bytes = c.nr_bytes[BLOCK_ACCT_WRITE];
+    ds->rd_operations = c.nr_ops[BLOCK_ACCT_READ];
+    ds->wr_operations = c.nr_ops[BLOCK_ACCT_WRITE];
 
-    ds->failed_rd_operations = stats->failed_ops[BLOCK_ACCT_READ];
-    ds->failed_wr_operations = stats->failed_ops[BLOCK_ACCT_WRITE];
-    ds->failed_flush_operations = stats->failed_ops[BLOCK_ACCT_FLUSH];
+    ds->failed_rd_operations = c.failed_ops[BLOCK_ACCT_READ];
+    ds->failed_wr_operations = c.failed_ops[BLOCK_ACCT_WRITE];
+    ds->failed_flush_operations = c.failed_ops[BLOCK_ACCT_FLUSH];
 
-    ds->invalid_rd_operations = stats->invalid_ops[BLOCK_ACCT_READ];
-    ds->invalid_wr_operations = stats->invalid_ops[BLOCK_ACCT_WRITE];
+    ds->invalid_rd_operations = c.invalid_ops[BLOCK_ACCT_READ];
+    ds->invalid_wr_operations = c.invalid_ops[BLOCK_ACCT_WRITE];
     ds->invalid_flush_operations =
-        stats->invalid_ops[BLOCK_ACCT_FLUSH];
+        c.invalid_ops[BLOCK_ACCT_FLUSH];
 
-    ds->rd_merged = stats->merged[BLOCK_ACCT_READ];
-    ds->wr_merged = stats->merged[BLOCK_ACCT_WRITE];
-    ds->flush_operations = stats->nr_ops[BLOCK_ACCT_FLUSH];
-    ds->wr_total_time_ns = stats->total_time_ns[BLOCK_ACCT_WRITE];
-    ds->rd_total_time_ns = stats->total_time_ns[BLOCK_ACCT_READ];
-    ds->flush_total_time_ns = stats->total_time_ns[BLOCK_ACCT_FLUSH];
+    ds->rd_merged = c.merged[BLOCK_ACCT_READ];
+    ds->wr_merged = c.merged[BLOCK_ACCT_WRITE];
+    ds->flush_operations = c.nr_ops[BLOCK_ACCT_FLUSH];
+    ds->wr_total_time_ns = c.total_time_ns[BLOCK_ACCT_WRITE];
+    ds->rd_total_time_ns = c.total_time_ns[BLOCK_ACCT_READ];
+    ds->flush_total_time_ns = c.total_time_ns[BLOCK_ACCT_FLUSH];
 
-    ds->has_idle_time_ns = stats->last_access_time_ns > 0;
+    ds->has_idle_time_ns = c.last_access_time_ns > 0;
     if (ds->has_idle_time_ns) {
         ds->idle_time_ns = block_acct_idle_time_ns(stats);
     }
 
+    ds->has_rd_latency_histogram = true;
+    ds->rd_latency_histogram =
+        bdrv_query_latency_histogram(c.latency_histogram[BLOCK_ACCT_READ]);
+    ds->has_wr_latency_histogram = true;
+    ds->wr_latency_histogram =
+        bdrv_query_latency_histogram(c.latency_histogram[BLOCK_ACCT_WRITE]);
+    ds->has_flush_latency_histogram = true;
+    ds->flush_latency_histogram =
+        bdrv_query_latency_histogram(c.latency_histogram[BLOCK_ACCT_FLUSH]);
+
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    qemu_mutex_lock(&stats->lock);
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -426,6 +461,8 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
         dev_stats->avg_wr_queue_depth =
             block_acct_queue_depth(ts, BLOCK_ACCT_WRITE);
     }
+
+    qemu_mutex_unlock(&stats->lock);
 }
 
 static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
@@ -438,6 +475,9 @@ static void bdrv_query_bds_stats(BlockStats *s, const BlockDriverState *bs,
 
     s->stats->wr_highest_offset = bs->wr_highest_offset;
 
+    s->driver_specific = bdrv_get_specific_stats(bs);
+    s->has_driver_specific = s->driver_specific != NULL;
+
     if (bs->file) {
         s->has_parent = true;
         s->parent = bdrv_query_stats(NULL, bs->file->bs, query_backing);
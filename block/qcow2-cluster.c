@@ -23,7 +23,6 @@
  */
 
 #include "qemu/osdep.h"
-#include <zlib.h>
 
 #include "qapi/error.h"
 #include "qemu-common.h"
@@ -144,20 +143,25 @@ int qcow2_grow_l1_table(BlockDriverState *bs, uint64_t min_size,
 /*
  * l2_load
  *
- * Loads a L2 table into memory. If the table is in the cache, the cache
- * is used; otherwise the L2 table is loaded from the image file.
+ * @bs: The BlockDriverState
+ * @offset: A guest offset, used to calculate what slice of the L2
+ *          table to load.
+ * @l2_offset: Offset to the L2 table in the image file.
+ * @l2_slice: Location to store the pointer to the L2 slice.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * Loads the L2 slice that contains the entry for @offset into memory. If
+ * the slice is in the cache, the cache is used; otherwise it is loaded
+ * from the image file.
  */
-
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, uint64_t offset,
+                   uint64_t l2_offset, uint64_t **l2_slice)
 {
     BDRVQcow2State *s = bs->opaque;
+    int start_of_slice = l2_entry_size(s) *
+        (offset_to_l2_index(s, offset) - offset_to_l2_slice_index(s, offset));
 
-    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                           (void **)l2_table);
+    return qcow2_cache_get(bs, s->l2_table_cache, l2_offset + start_of_slice,
+                           (void **)l2_slice);
 }
 
 /*
@@ -204,13 +208,16 @@ int qcow2_write_l1_entry(BlockDriverState *bs, int l1_index)
  * table) copy the contents of the old L2 table into the newly allocated one.
  * Otherwise the new table is initialized with zeros.
  *
+ * The table is written slice by slice through the L2 cache; the caller
+ * loads the slice it needs afterwards.
  */
 
-static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
+static int l2_allocate(BlockDriverState *bs, int l1_index)
 {
     BDRVQcow2State *s = bs->opaque;
     uint64_t old_l2_offset;
-    uint64_t *l2_table = NULL;
+    uint64_t *l2_slice = NULL;
+    unsigned slice, slice_size2, n_slices;
     int64_t l2_offset;
     int ret;
 
@@ -220,7 +227,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->cluster_size);
     if (l2_offset < 0) {
         ret = l2_offset;
         goto fail;
@@ -231,41 +238,48 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* allocate a new entry in the l2 cache */
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     trace_qcow2_l2_allocate_get_empty(bs, l1_index);
-    ret = qcow2_cache_get_empty(bs, s->l2_table_cache, l2_offset, (void**) table);
-    if (ret < 0) {
-        goto fail;
-    }
+    for (slice = 0; slice < n_slices; slice++) {
+        /* allocate a new entry in the l2 cache */
+        ret = qcow2_cache_get_empty(bs, s->l2_table_cache,
+                                    l2_offset + slice * slice_size2,
+                                    (void **) &l2_slice);
+        if (ret < 0) {
+            goto fail;
+        }
 
-    l2_table = *table;
+        if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
+            /* if there was no old l2 table, clear the new slice */
+            memset(l2_slice, 0, slice_size2);
+        } else {
+            uint64_t *old_slice;
+            uint64_t old_l2_slice_offset =
+                (old_l2_offset & L1E_OFFSET_MASK) + slice * slice_size2;
+
+            /* if there was an old l2 table, read a slice from the disk */
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
+            ret = qcow2_cache_get(bs, s->l2_table_cache, old_l2_slice_offset,
+                                  (void **) &old_slice);
+            if (ret < 0) {
+                goto fail;
+            }
 
-    if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
-        /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
-    } else {
-        uint64_t* old_table;
+            memcpy(l2_slice, old_slice, slice_size2);
 
-        /* if there was an old l2 table, read it from the disk */
-        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = qcow2_cache_get(bs, s->l2_table_cache,
-            old_l2_offset & L1E_OFFSET_MASK,
-            (void**) &old_table);
-        if (ret < 0) {
-            goto fail;
+            qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_slice);
         }
 
-        memcpy(l2_table, old_table, s->cluster_size);
+        /* write the l2 slice to the file */
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
 
-        qcow2_cache_put(bs, s->l2_table_cache, (void **) &old_table);
+        trace_qcow2_l2_allocate_write_l2(bs, l1_index);
+        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_slice);
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
 
-    /* write the l2 table to the file */
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_WRITE);
-
-    trace_qcow2_l2_allocate_write_l2(bs, l1_index);
-    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret < 0) {
         goto fail;
@@ -279,18 +293,17 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    *table = l2_table;
     trace_qcow2_l2_allocate_done(bs, l1_index, 0);
     return 0;
 
 fail:
     trace_qcow2_l2_allocate_done(bs, l1_index, ret);
-    if (l2_table != NULL) {
-        qcow2_cache_put(bs, s->l2_table_cache, (void**) table);
+    if (l2_slice != NULL) {
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_slice);
     }
     s->l1_table[l1_index] = old_l2_offset;
     if (l2_offset > 0) {
-        qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+        qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                             QCOW2_DISCARD_ALWAYS);
     }
     return ret;
@@ -303,12 +316,12 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(int nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcow2State *s, int nb_clusters,
+        uint64_t *l2_slice, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK | QCOW_OFLAG_COMPRESSED;
-    uint64_t first_entry = be64_to_cpu(l2_table[0]);
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
     uint64_t offset = first_entry & mask;
 
     if (!offset)
@@ -317,8 +330,8 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
     assert(qcow2_get_cluster_type(first_entry) == QCOW2_CLUSTER_NORMAL);
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i) & mask;
+        if (offset + ((uint64_t) i << s->cluster_bits) != l2_entry) {
             break;
         }
     }
@@ -326,14 +339,16 @@ static int count_contiguous_clusters(int nb_clusters, int cluster_size,
 	return i;
 }
 
-static int count_contiguous_clusters_by_type(int nb_clusters,
-                                             uint64_t *l2_table,
+static int count_contiguous_clusters_by_type(BDRVQcow2State *s,
+                                             int nb_clusters,
+                                             uint64_t *l2_slice, int l2_index,
                                              int wanted_type)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        int type = qcow2_get_cluster_type(l2_entry);
 
         if (type != wanted_type) {
             break;
@@ -343,6 +358,47 @@ static int count_contiguous_clusters_by_type(int nb_clusters,
     return i;
 }
 
+/*
+ * Checks how many subclusters, starting at subcluster @sc_index of the cluster
+ * at @l2_index, have the same type as the first one and, if they are
+ * allocated, are contiguous in the image file.  At most @nb_clusters clusters
+ * are looked at.  The first subcluster must have a valid type that is not
+ * QCOW2_CLUSTER_COMPRESSED.
+ */
+static int count_contiguous_subclusters(BDRVQcow2State *s, int nb_clusters,
+                                        unsigned sc_index, uint64_t *l2_slice,
+                                        int l2_index)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index);
+    uint64_t expected_offset = l2_entry & L2E_OFFSET_MASK;
+    int type = qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index);
+    int count = 0;
+    int i, j;
+
+    assert(type >= 0 && type != QCOW2_CLUSTER_COMPRESSED);
+
+    for (i = 0; i < nb_clusters; i++) {
+        l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+
+        if (type == QCOW2_CLUSTER_NORMAL &&
+            (l2_entry & L2E_OFFSET_MASK) !=
+            expected_offset + ((uint64_t) i << s->cluster_bits)) {
+            break;
+        }
+
+        for (j = (i == 0 ? sc_index : 0); j < s->subclusters_per_cluster; j++) {
+            if (qcow2_get_subcluster_type(l2_entry, l2_bitmap, j) != type) {
+                return count;
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -524,23 +580,67 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         return -EIO;
     }
 
-    /* load the l2 table in memory */
+    /* load the l2 slice in memory */
 
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    l2_index = offset_to_l2_slice_index(s, offset);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     nb_clusters = size_to_clusters(s, bytes_needed);
     /* bytes_needed <= *bytes + offset_in_cluster, both of which are unsigned
      * integers; the minimum cluster size is 512, so this assertion is always
      * true */
     assert(nb_clusters <= INT_MAX);
+    /* only the entries in the loaded slice can be looked at */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
+
+    if (has_subclusters(s)) {
+        unsigned sc_index = offset_to_sc_index(s, offset);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+        ret = qcow2_get_subcluster_type(*cluster_offset, l2_bitmap, sc_index);
+        if (ret < 0) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Invalid subcluster "
+                                    "bitmap %#" PRIx64 " (L2 offset: %#"
+                                    PRIx64 ", L2 index: %#x)", l2_bitmap,
+                                    l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+
+        if (ret == QCOW2_CLUSTER_COMPRESSED) {
+            *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+            bytes_available = s->cluster_size;
+        } else {
+            c = count_contiguous_subclusters(s, nb_clusters, sc_index,
+                                             l2_table, l2_index);
+            bytes_available = (uint64_t) (sc_index + c) << s->subcluster_bits;
+            if (ret == QCOW2_CLUSTER_NORMAL) {
+                *cluster_offset &= L2E_OFFSET_MASK;
+            } else {
+                *cluster_offset = 0;
+            }
+        }
+
+        if (ret == QCOW2_CLUSTER_NORMAL &&
+            offset_into_cluster(s, *cluster_offset)) {
+            qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
+                                    PRIx64 " unaligned (L2 offset: %#" PRIx64
+                                    ", L2 index: %#x)", *cluster_offset,
+                                    l2_offset, l2_index);
+            ret = -EIO;
+            goto fail;
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+        goto out;
+    }
 
     ret = qcow2_get_cluster_type(*cluster_offset);
     switch (ret) {
@@ -557,20 +657,21 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
             ret = -EIO;
             goto fail;
         }
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
-                                              QCOW2_CLUSTER_ZERO);
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index, QCOW2_CLUSTER_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_clusters_by_type(nb_clusters, &l2_table[l2_index],
+        c = count_contiguous_clusters_by_type(s, nb_clusters, l2_table,
+                                              l2_index,
                                               QCOW2_CLUSTER_UNALLOCATED);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], QCOW_OFLAG_ZERO);
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         if (offset_into_cluster(s, *cluster_offset)) {
             qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset %#"
@@ -611,10 +712,10 @@ fail:
  * get_cluster_table
  *
  * for a given disk offset, load (and allocate if needed)
- * the l2 table.
+ * the l2 table slice that contains its entry.
  *
- * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * the l2 slice and the cluster index in the slice are given to
+ * the caller.
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -649,29 +750,33 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
     /* seek the l2 table of the given l2 offset */
 
-    if (s->l1_table[l1_index] & QCOW_OFLAG_COPIED) {
-        /* load the l2 table in memory */
-        ret = l2_load(bs, l2_offset, &l2_table);
-        if (ret < 0) {
-            return ret;
-        }
-    } else {
+    if (!(s->l1_table[l1_index] & QCOW_OFLAG_COPIED)) {
         /* First allocate a new L2 table (and do COW if needed) */
-        ret = l2_allocate(bs, l1_index, &l2_table);
+        ret = l2_allocate(bs, l1_index);
         if (ret < 0) {
             return ret;
         }
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t),
+            qcow2_free_clusters(bs, l2_offset, s->cluster_size,
                                 QCOW2_DISCARD_OTHER);
         }
+
+        /* Get the offset of the newly-allocated l2 table */
+        l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+        assert(offset_into_cluster(s, l2_offset) == 0);
+    }
+
+    /* load the l2 slice in memory */
+    ret = l2_load(bs, offset, l2_offset, &l2_table);
+    if (ret < 0) {
+        return ret;
     }
 
     /* find the cluster offset for the given disk offset */
 
-    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_index = offset_to_l2_slice_index(s, offset);
 
     *new_l2_table = l2_table;
     *new_l2_index = l2_index;
@@ -690,6 +795,10 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
  * Return the cluster offset if successful,
  * Return 0, otherwise.
  *
+ * The caller must hold s->lock.  Compressed clusters are packed one after
+ * another by qcow2_alloc_bytes(), so concurrent writers only have to
+ * serialise this allocation and the L2 update; writing the data to the
+ * allocated range may then happen in parallel.
  */
 
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -709,7 +818,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -733,7 +842,11 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        /* compressed clusters are not divided into subclusters */
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
     return cluster_offset;
@@ -808,21 +921,45 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     }
     qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
 
-    assert(l2_index + m->nb_clusters <= s->l2_size);
+    assert(l2_index + m->nb_clusters <= s->l2_slice_size);
     for (i = 0; i < m->nb_clusters; i++) {
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t new_entry = (cluster_offset + (i << s->cluster_bits)) |
+                             QCOW_OFLAG_COPIED;
+
         /* if two concurrent writes happen to the same unallocated cluster
          * each write allocates separate cluster and writes data concurrently.
          * The first one to complete updates l2 table with pointer to its
          * cluster the second one has to do RMW (which is done above by
          * perform_cow()), update l2 table with its cluster pointer and free
-         * old cluster. This is what this loop does */
-        if (l2_table[l2_index + i] != 0) {
-            old_cluster[j++] = l2_table[l2_index + i];
+         * old cluster. This is what this loop does.  With subclusters, the
+         * allocation may also reuse the cluster that is already there. */
+        if (old_entry != 0 && old_entry != new_entry) {
+            old_cluster[j++] = old_entry;
         }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
-     }
+        set_l2_entry(s, l2_table, l2_index + i, new_entry);
+
+        if (has_subclusters(s)) {
+            uint64_t old_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+            uint64_t start = MAX(m->cow_start.offset, cluster_start);
+            uint64_t end = MIN(m->cow_end.offset + m->cow_end.nb_bytes,
+                               cluster_start + s->cluster_size);
+            uint64_t alloc_mask = QCOW_OFLAG_SUB_ALLOC_RANGE(
+                (start - cluster_start) >> s->subcluster_bits,
+                DIV_ROUND_UP(end - cluster_start, s->subcluster_size));
+
+            /* The subclusters covered by the write and its COW are allocated
+             * now.  The others keep their state, except that allocated ones
+             * of a replaced cluster have already been copied by the COW. */
+            if (old_entry != new_entry) {
+                old_bitmap &= QCOW_L2_BITMAP_ALL_ZEROES;
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          (old_bitmap & ~(alloc_mask << 32)) | alloc_mask);
+        }
+    }
 
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
@@ -835,7 +972,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1,
+            qcow2_free_any_clusters(bs, old_cluster[i], 1,
                                     QCOW2_DISCARD_NEVER);
         }
     }
@@ -857,7 +994,7 @@ static int count_cow_clusters(BDRVQcow2State *s, int nb_clusters,
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
         switch(cluster_type) {
@@ -908,12 +1045,21 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t old_start = l2meta_cow_start(old_alloc);
         uint64_t old_end = l2meta_cow_end(old_alloc);
 
+        if (has_subclusters(s)) {
+            /* The subcluster bitmap of an L2 entry is updated as a whole, so
+             * allocations in the same cluster must not run concurrently */
+            start = start_of_cluster(s, start);
+            end = align_offset(end, s->cluster_size);
+            old_start = start_of_cluster(s, old_start);
+            old_end = align_offset(old_end, s->cluster_size);
+        }
+
         if (end <= old_start || start >= old_end) {
             /* No intersection */
         } else {
-            if (start < old_start) {
+            if (guest_offset < old_start) {
                 /* Stop at the start of a running allocation */
-                bytes = old_start - start;
+                bytes = old_start - guest_offset;
             } else {
                 bytes = 0;
             }
@@ -945,6 +1091,47 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
     return 0;
 }
 
+/*
+ * Returns the number of clusters, starting at @l2_index, that can be written
+ * to in place in an image with subclusters: they must be contiguous in the
+ * image file, have QCOW_OFLAG_COPIED set, and all of their subclusters that
+ * the area [@offset_in_cluster, @offset_in_cluster + @bytes) (relative to
+ * the first cluster) touches must be allocated.
+ */
+static int count_writable_clusters(BDRVQcow2State *s, int nb_clusters,
+                                   uint64_t *l2_slice, int l2_index,
+                                   uint64_t offset_in_cluster, uint64_t bytes)
+{
+    uint64_t first_entry = get_l2_entry(s, l2_slice, l2_index);
+    uint64_t end = offset_in_cluster + bytes;
+    int i;
+
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_slice, l2_index + i);
+        uint64_t l2_bitmap = get_l2_bitmap(s, l2_slice, l2_index + i);
+        uint64_t cluster_start = (uint64_t) i << s->cluster_bits;
+        uint64_t start_in = MAX(offset_in_cluster, cluster_start);
+        uint64_t end_in = MIN(end, cluster_start + s->cluster_size);
+        uint64_t mask;
+
+        if ((l2_entry & QCOW_OFLAG_COMPRESSED) ||
+            !(l2_entry & QCOW_OFLAG_COPIED) ||
+            (l2_entry & L2E_OFFSET_MASK) !=
+            (first_entry & L2E_OFFSET_MASK) + cluster_start) {
+            break;
+        }
+
+        mask = QCOW_OFLAG_SUB_ALLOC_RANGE(
+            (start_in - cluster_start) >> s->subcluster_bits,
+            DIV_ROUND_UP(end_in - cluster_start, s->subcluster_size));
+        if ((l2_bitmap & mask) != mask) {
+            break;
+        }
+    }
+
+    return i;
+}
+
 /*
  * Checks how many already allocated clusters that don't require a copy on
  * write there are at the given guest_offset (up to *bytes). If
@@ -985,14 +1172,14 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
                                 == offset_into_cluster(s, *host_offset));
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1001,7 +1188,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -1026,13 +1213,26 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
             goto out;
         }
 
-        /* We keep all QCOW_OFLAG_COPIED clusters */
-        keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index],
-                                      QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            /* Clusters with unallocated subclusters in the written area are
+             * left to handle_alloc(), which does the COW for them */
+            keep_clusters =
+                count_writable_clusters(s, nb_clusters, l2_table, l2_index,
+                                        offset_into_cluster(s, guest_offset),
+                                        *bytes);
+        } else {
+            /* We keep all QCOW_OFLAG_COPIED clusters */
+            keep_clusters =
+                count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                          QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+        }
         assert(keep_clusters <= nb_clusters);
 
+        if (keep_clusters == 0) {
+            ret = 0;
+            goto out;
+        }
+
         *bytes = MIN(*bytes,
                  keep_clusters * s->cluster_size
                  - offset_into_cluster(s, guest_offset));
@@ -1056,6 +1256,70 @@ out:
     return ret;
 }
 
+/*
+ * Hands out up to *nb_clusters clusters from the run reserved for allocating
+ * writes, and reserves a new run of s->alloc_batch_clusters clusters if the
+ * old one is used up. Reserving a whole run at once means that its refcounts
+ * are updated in one go instead of once per write request.
+ *
+ * If host_offset is non-zero, the clusters must start there, which only works
+ * if it is the start of the unused part of the run.
+ *
+ * Returns the offset of the first cluster and updates *nb_clusters, or returns
+ * 0 if the reservation cannot be used for this allocation, or -errno.
+ */
+static int64_t take_reserved_clusters(BlockDriverState *bs,
+                                      uint64_t host_offset,
+                                      uint64_t *nb_clusters)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int64_t offset;
+
+    if (s->reserved_clusters == 0) {
+        /* Allocations that are at least as large as a batch gain nothing */
+        if (host_offset != 0 || s->alloc_batch_clusters <= *nb_clusters) {
+            return 0;
+        }
+
+        offset = qcow2_alloc_clusters(bs, (uint64_t) s->alloc_batch_clusters
+                                          << s->cluster_bits);
+        if (offset < 0) {
+            return offset;
+        }
+        s->reserved_offset = offset;
+        s->reserved_clusters = s->alloc_batch_clusters;
+    } else if (host_offset != 0 && host_offset != s->reserved_offset) {
+        return 0;
+    }
+
+    offset = s->reserved_offset;
+    *nb_clusters = MIN(*nb_clusters, s->reserved_clusters);
+    s->reserved_offset += *nb_clusters << s->cluster_bits;
+    s->reserved_clusters -= *nb_clusters;
+
+    return offset;
+}
+
+/*
+ * Frees the clusters that have been reserved for allocating writes, but not
+ * used yet. Must be called before the image is closed or its refcounts are
+ * checked, otherwise these clusters are leaked.
+ */
+void qcow2_release_reserved_clusters(BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    if (s->reserved_clusters == 0) {
+        return;
+    }
+
+    qcow2_free_clusters(bs, s->reserved_offset,
+                        s->reserved_clusters << s->cluster_bits,
+                        QCOW2_DISCARD_NEVER);
+    s->reserved_offset = 0;
+    s->reserved_clusters = 0;
+}
+
 /*
  * Allocates new clusters for the given guest_offset.
  *
@@ -1079,12 +1343,21 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
                                    uint64_t *host_offset, uint64_t *nb_clusters)
 {
     BDRVQcow2State *s = bs->opaque;
+    int64_t reserved;
 
     trace_qcow2_do_alloc_clusters_offset(qemu_coroutine_self(), guest_offset,
                                          *host_offset, *nb_clusters);
 
     /* Allocate new clusters */
     trace_qcow2_cluster_alloc_phys(qemu_coroutine_self());
+    reserved = take_reserved_clusters(bs, *host_offset, nb_clusters);
+    if (reserved < 0) {
+        return reserved;
+    } else if (reserved > 0) {
+        *host_offset = reserved;
+        return 0;
+    }
+
     if (*host_offset == 0) {
         int64_t cluster_offset =
             qcow2_alloc_clusters(bs, *nb_clusters * s->cluster_size);
@@ -1103,11 +1376,76 @@ static int do_alloc_cluster_offset(BlockDriverState *bs, uint64_t guest_offset,
     }
 }
 
+/* Whether an L2 entry of an image with subclusters refers to host data */
+static bool l2_entry_has_host_cluster(uint64_t l2_entry)
+{
+    return (l2_entry & QCOW_OFLAG_COMPRESSED) || (l2_entry & L2E_OFFSET_MASK);
+}
+
+/*
+ * Calculates the COW regions of an allocation of @nb_clusters clusters at
+ * @guest_offset in an image with subclusters.  @nb_bytes is the number of
+ * bytes from the start of the first cluster to the end of the write request.
+ *
+ * Only the partially written subclusters at either end need to be copied,
+ * and not even those if they are allocated already in a cluster that is
+ * reused.  If a new cluster replaces one that has host data, that data is
+ * copied as a whole; the default regions set by the caller already do that.
+ *
+ * Returns 0 on success, -errno otherwise.
+ */
+static int calculate_subcluster_cow(BlockDriverState *bs,
+                                    uint64_t guest_offset, int nb_clusters,
+                                    int nb_bytes, bool reuse,
+                                    int *cow_start_bytes, int *cow_end_bytes)
+{
+    BDRVQcow2State *s = bs->opaque;
+    uint64_t *l2_table;
+    uint64_t first_entry, first_bitmap, last_entry, last_bitmap;
+    int l2_index, ret;
+
+    ret = get_cluster_table(bs, guest_offset, &l2_table, &l2_index);
+    if (ret < 0) {
+        return ret;
+    }
+
+    first_entry = get_l2_entry(s, l2_table, l2_index);
+    first_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    last_entry = get_l2_entry(s, l2_table, l2_index + nb_clusters - 1);
+    last_bitmap = get_l2_bitmap(s, l2_table, l2_index + nb_clusters - 1);
+
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    if (reuse || !l2_entry_has_host_cluster(first_entry)) {
+        int sc_index = offset_to_sc_index(s, guest_offset);
+
+        *cow_start_bytes = offset_into_subcluster(s, guest_offset);
+        if (reuse && (first_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index))) {
+            *cow_start_bytes = 0;
+        }
+    }
+
+    if (reuse || !l2_entry_has_host_cluster(last_entry)) {
+        int sc_index = offset_to_sc_index(s, nb_bytes - 1);
+
+        *cow_end_bytes = offset_into_subcluster(s, -nb_bytes);
+        if (reuse && (last_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index))) {
+            *cow_end_bytes = 0;
+        }
+    }
+
+    return 0;
+}
+
 /*
  * Allocates new clusters for an area that either is yet unallocated or needs a
  * copy on write. If *host_offset is non-zero, clusters are only allocated if
  * the new allocation can match the specified host offset.
  *
+ * In images with subclusters, a cluster that is only partially allocated is
+ * not replaced if no other L2 entry references it; its missing subclusters
+ * are filled in place instead.
+ *
  * Note that guest_offset may not be cluster aligned. In this case, the
  * returned *host_offset points to exact byte referenced by guest_offset and
  * therefore isn't cluster aligned as well.
@@ -1131,6 +1469,7 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t *l2_table;
     uint64_t entry;
     uint64_t nb_clusters;
+    bool reuse = false;
     int ret;
 
     uint64_t alloc_cluster_offset;
@@ -1140,14 +1479,14 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     assert(*bytes > 0);
 
     /*
-     * Calculate the number of clusters to look for. We stop at L2 table
+     * Calculate the number of clusters to look for. We stop at L2 slice
      * boundaries to keep things simple.
      */
     nb_clusters =
         size_to_clusters(s, offset_into_cluster(s, guest_offset) + *bytes);
 
-    l2_index = offset_to_l2_index(s, guest_offset);
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    l2_index = offset_to_l2_slice_index(s, guest_offset);
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     /* Find L2 entry for the first involved cluster */
@@ -1156,10 +1495,17 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (has_subclusters(s) && !(entry & QCOW_OFLAG_COMPRESSED) &&
+        (entry & QCOW_OFLAG_COPIED) && (entry & L2E_OFFSET_MASK))
+    {
+        /* Some of the subclusters we write to are not allocated yet, but the
+         * cluster itself is and belongs to us alone: fill them in place */
+        nb_clusters = 1;
+        reuse = true;
+    } else if (entry & QCOW_OFLAG_COMPRESSED) {
+        /* For the moment, overwrite compressed clusters one by one */
         nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
@@ -1172,12 +1518,22 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
     qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
 
-    /* Allocate, if necessary at a given offset in the image file */
-    alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
+    if (reuse) {
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+        if (*host_offset != 0 &&
+            start_of_cluster(s, *host_offset) != alloc_cluster_offset)
+        {
+            *bytes = 0;
+            return 0;
+        }
+    } else {
+        /* Allocate, if necessary at a given offset in the image file */
+        alloc_cluster_offset = start_of_cluster(s, *host_offset);
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* Can't extend contiguous allocation */
@@ -1214,8 +1570,19 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t requested_bytes = *bytes + offset_into_cluster(s, guest_offset);
     int avail_bytes = MIN(INT_MAX, nb_clusters << s->cluster_bits);
     int nb_bytes = MIN(requested_bytes, avail_bytes);
+    int cow_start_bytes = offset_into_cluster(s, guest_offset);
+    int cow_end_bytes = avail_bytes - nb_bytes;
     QCowL2Meta *old_m = *m;
 
+    if (has_subclusters(s)) {
+        ret = calculate_subcluster_cow(bs, guest_offset, nb_clusters, nb_bytes,
+                                       reuse, &cow_start_bytes,
+                                       &cow_end_bytes);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1226,12 +1593,13 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .nb_clusters    = nb_clusters,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_bytes   = offset_into_cluster(s, guest_offset),
+            .offset     = offset_into_cluster(s, guest_offset)
+                          - cow_start_bytes,
+            .nb_bytes   = cow_start_bytes,
         },
         .cow_end = {
             .offset     = nb_bytes,
-            .nb_bytes   = avail_bytes - nb_bytes,
+            .nb_bytes   = cow_end_bytes,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1376,33 +1744,6 @@ again:
     return 0;
 }
 
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
 int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -1420,8 +1761,8 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
         if (ret < 0) {
             return ret;
         }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
+        if (qcow2_decompress(bs, s->cluster_cache, s->cluster_size,
+                             s->cluster_data + sector_offset, csize) < 0) {
             return -EIO;
         }
         s->cluster_cache_offset = coffset;
@@ -1431,7 +1772,7 @@ int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
 
 /*
  * This discards as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of discarded
+ * all clusters in the same L2 slice) and returns the number of discarded
  * clusters.
  */
 static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1449,14 +1790,34 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_l2_entry;
 
-        old_l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        old_l2_entry = get_l2_entry(s, l2_table, l2_index + i);
+
+        if (has_subclusters(s)) {
+            uint64_t old_l2_bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+            uint64_t new_l2_bitmap = full_discard ? 0
+                                                  : QCOW_L2_BITMAP_ALL_ZEROES;
+
+            /* Same as below: nothing to do if the cluster already reads as
+             * requested */
+            if (old_l2_entry == 0 &&
+                (old_l2_bitmap == new_l2_bitmap ||
+                 (old_l2_bitmap == 0 && !bs->backing))) {
+                continue;
+            }
+
+            qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
+            set_l2_bitmap(s, l2_table, l2_index + i, new_l2_bitmap);
+            qcow2_free_any_clusters(bs, old_l2_entry, 1, type);
+            continue;
+        }
 
         /*
          * If full_discard is false, make sure that a discarded area reads back
@@ -1495,9 +1856,9 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
         if (!full_discard && s->qcow_version >= 3) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
         } else {
-            l2_table[l2_index + i] = cpu_to_be64(0);
+            set_l2_entry(s, l2_table, l2_index + i, 0);
         }
 
         /* Then decrease the refcount */
@@ -1552,7 +1913,7 @@ fail:
 
 /*
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
- * all clusters in the same L2 table) and returns the number of zeroed
+ * all clusters in the same L2 slice) and returns the number of zeroed
  * clusters.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
@@ -1569,22 +1930,32 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
         return ret;
     }
 
-    /* Limit nb_clusters to one L2 table */
-    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+    /* Limit nb_clusters to one L2 slice */
+    nb_clusters = MIN(nb_clusters, s->l2_slice_size - l2_index);
     assert(nb_clusters <= INT_MAX);
 
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (has_subclusters(s)) {
+            /* An allocated host cluster is kept for later writes */
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1,
+                                        QCOW2_DISCARD_REQUEST);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1, QCOW2_DISCARD_REQUEST);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1644,13 +2015,17 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
     BDRVQcow2State *s = bs->opaque;
     bool is_active_l1 = (l1_table == s->l1_table);
     uint64_t *l2_table = NULL;
+    unsigned slice, slice_size2, n_slices;
     int ret;
     int i, j;
 
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
+
     if (!is_active_l1) {
         /* inactive L2 tables require a buffer to be stored in when loading
          * them from disk */
-        l2_table = qemu_try_blockalign(bs->file->bs, s->cluster_size);
+        l2_table = qemu_try_blockalign(bs->file->bs, slice_size2);
         if (l2_table == NULL) {
             return -ENOMEM;
         }
@@ -1658,7 +2033,6 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
 
     for (i = 0; i < l1_size; i++) {
         uint64_t l2_offset = l1_table[i] & L1E_OFFSET_MASK;
-        bool l2_dirty = false;
         uint64_t l2_refcount;
 
         if (!l2_offset) {
@@ -1678,123 +2052,133 @@ static int expand_zero_clusters_in_l1(BlockDriverState *bs, uint64_t *l1_table,
             goto fail;
         }
 
-        if (is_active_l1) {
-            /* get active L2 tables from cache */
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                    (void **)&l2_table);
-        } else {
-            /* load inactive L2 tables from disk */
-            ret = bdrv_read(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                            (void *)l2_table, s->cluster_sectors);
-        }
-        if (ret < 0) {
-            goto fail;
-        }
-
         ret = qcow2_get_refcount(bs, l2_offset >> s->cluster_bits,
                                  &l2_refcount);
         if (ret < 0) {
             goto fail;
         }
 
-        for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
-            int64_t offset = l2_entry & L2E_OFFSET_MASK;
-            int cluster_type = qcow2_get_cluster_type(l2_entry);
-            bool preallocated = offset != 0;
+        for (slice = 0; slice < n_slices; slice++) {
+            uint64_t slice_offset = l2_offset + slice * slice_size2;
+            bool l2_dirty = false;
 
-            if (cluster_type != QCOW2_CLUSTER_ZERO) {
-                continue;
+            if (is_active_l1) {
+                /* get active L2 tables from cache */
+                ret = qcow2_cache_get(bs, s->l2_table_cache, slice_offset,
+                        (void **)&l2_table);
+            } else {
+                /* load inactive L2 tables from disk */
+                ret = bdrv_read(bs->file, slice_offset / BDRV_SECTOR_SIZE,
+                                (void *)l2_table,
+                                slice_size2 / BDRV_SECTOR_SIZE);
+            }
+            if (ret < 0) {
+                goto fail;
             }
 
-            if (!preallocated) {
-                if (!bs->backing) {
-                    /* not backed; therefore we can simply deallocate the
-                     * cluster */
-                    l2_table[j] = 0;
-                    l2_dirty = true;
+            for (j = 0; j < s->l2_slice_size; j++) {
+                uint64_t l2_entry = get_l2_entry(s, l2_table, j);
+                int64_t offset = l2_entry & L2E_OFFSET_MASK;
+                int cluster_type = qcow2_get_cluster_type(l2_entry);
+                bool preallocated = offset != 0;
+
+                if (cluster_type != QCOW2_CLUSTER_ZERO) {
                     continue;
                 }
 
-                offset = qcow2_alloc_clusters(bs, s->cluster_size);
-                if (offset < 0) {
-                    ret = offset;
-                    goto fail;
-                }
+                if (!preallocated) {
+                    if (!bs->backing) {
+                        /* not backed; therefore we can simply deallocate the
+                         * cluster */
+                        set_l2_entry(s, l2_table, j, 0);
+                        l2_dirty = true;
+                        continue;
+                    }
 
-                if (l2_refcount > 1) {
-                    /* For shared L2 tables, set the refcount accordingly (it is
-                     * already 1 and needs to be l2_refcount) */
-                    ret = qcow2_update_cluster_refcount(bs,
-                            offset >> s->cluster_bits,
-                            refcount_diff(1, l2_refcount), false,
-                            QCOW2_DISCARD_OTHER);
-                    if (ret < 0) {
-                        qcow2_free_clusters(bs, offset, s->cluster_size,
-                                            QCOW2_DISCARD_OTHER);
+                    offset = qcow2_alloc_clusters(bs, s->cluster_size);
+                    if (offset < 0) {
+                        ret = offset;
                         goto fail;
                     }
+
+                    if (l2_refcount > 1) {
+                        /* For shared L2 tables, set the refcount accordingly
+                         * (it is already 1 and needs to be l2_refcount) */
+                        ret = qcow2_update_cluster_refcount(bs,
+                                offset >> s->cluster_bits,
+                                refcount_diff(1, l2_refcount), false,
+                                QCOW2_DISCARD_OTHER);
+                        if (ret < 0) {
+                            qcow2_free_clusters(bs, offset, s->cluster_size,
+                                                QCOW2_DISCARD_OTHER);
+                            goto fail;
+                        }
+                    }
                 }
-            }
 
-            if (offset_into_cluster(s, offset)) {
-                qcow2_signal_corruption(bs, true, -1, -1, "Data cluster offset "
-                                        "%#" PRIx64 " unaligned (L2 offset: %#"
-                                        PRIx64 ", L2 index: %#x)", offset,
-                                        l2_offset, j);
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                if (offset_into_cluster(s, offset)) {
+                    qcow2_signal_corruption(bs, true, -1, -1, "Data cluster "
+                                            "offset %#" PRIx64 " unaligned "
+                                            "(L2 offset: %#" PRIx64 ", L2 "
+                                            "index: %#x)", offset, l2_offset,
+                                            slice * s->l2_slice_size + j);
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    ret = -EIO;
+                    goto fail;
                 }
-                ret = -EIO;
-                goto fail;
-            }
 
-            ret = qcow2_pre_write_overlap_check(bs, 0, offset, s->cluster_size);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = qcow2_pre_write_overlap_check(bs, 0, offset,
+                                                    s->cluster_size);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            ret = bdrv_pwrite_zeroes(bs->file, offset, s->cluster_size, 0);
-            if (ret < 0) {
-                if (!preallocated) {
-                    qcow2_free_clusters(bs, offset, s->cluster_size,
-                                        QCOW2_DISCARD_ALWAYS);
+                ret = bdrv_pwrite_zeroes(bs->file, offset, s->cluster_size, 0);
+                if (ret < 0) {
+                    if (!preallocated) {
+                        qcow2_free_clusters(bs, offset, s->cluster_size,
+                                            QCOW2_DISCARD_ALWAYS);
+                    }
+                    goto fail;
                 }
-                goto fail;
-            }
 
-            if (l2_refcount == 1) {
-                l2_table[j] = cpu_to_be64(offset | QCOW_OFLAG_COPIED);
-            } else {
-                l2_table[j] = cpu_to_be64(offset);
+                if (l2_refcount == 1) {
+                    set_l2_entry(s, l2_table, j, offset | QCOW_OFLAG_COPIED);
+                } else {
+                    set_l2_entry(s, l2_table, j, offset);
+                }
+                l2_dirty = true;
             }
-            l2_dirty = true;
-        }
 
-        if (is_active_l1) {
-            if (l2_dirty) {
-                qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache, l2_table);
-                qcow2_cache_depends_on_flush(s->l2_table_cache);
-            }
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
-        } else {
-            if (l2_dirty) {
-                ret = qcow2_pre_write_overlap_check(bs,
-                        QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2, l2_offset,
-                        s->cluster_size);
-                if (ret < 0) {
-                    goto fail;
+            if (is_active_l1) {
+                if (l2_dirty) {
+                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                 l2_table);
+                    qcow2_cache_depends_on_flush(s->l2_table_cache);
                 }
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            } else {
+                if (l2_dirty) {
+                    ret = qcow2_pre_write_overlap_check(bs,
+                            QCOW2_OL_INACTIVE_L2 | QCOW2_OL_ACTIVE_L2,
+                            slice_offset, slice_size2);
+                    if (ret < 0) {
+                        goto fail;
+                    }
 
-                ret = bdrv_write(bs->file, l2_offset / BDRV_SECTOR_SIZE,
-                                 (void *)l2_table, s->cluster_sectors);
-                if (ret < 0) {
-                    goto fail;
+                    ret = bdrv_write(bs->file, slice_offset / BDRV_SECTOR_SIZE,
+                                     (void *)l2_table,
+                                     slice_size2 / BDRV_SECTOR_SIZE);
+                    if (ret < 0) {
+                        goto fail;
+                    }
                 }
             }
         }
@@ -1834,6 +2218,10 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
     int ret;
     int i, j;
 
+    /* Zero clusters are part of the subcluster bitmap in images with extended
+     * L2 entries, which cannot be downgraded anyway */
+    assert(!has_subclusters(s));
+
     if (status_cb) {
         l1_entries = s->l1_size;
         for (i = 0; i < s->nb_snapshots; i++) {
@@ -1046,6 +1046,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     uint64_t *l1_table, *l2_table, l2_offset, offset, l1_size2, refcount;
     bool l1_allocated = false;
     int64_t old_offset, old_l2_offset;
+    unsigned slice, slice_size2, n_slices;
     int i, j, l1_modified = 0, nb_csectors;
     int ret;
 
@@ -1054,6 +1055,8 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
     l2_table = NULL;
     l1_table = NULL;
     l1_size2 = l1_size * sizeof(uint64_t);
+    slice_size2 = s->l2_slice_size * l2_entry_size(s);
+    n_slices = s->cluster_size / slice_size2;
 
     s->cache_discards = true;
 
@@ -1095,20 +1098,22 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                 goto fail;
             }
 
-            ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset,
-                (void**) &l2_table);
-            if (ret < 0) {
-                goto fail;
-            }
+            for (slice = 0; slice < n_slices; slice++) {
+                ret = qcow2_cache_get(bs, s->l2_table_cache,
+                                      l2_offset + slice * slice_size2,
+                                      (void **) &l2_table);
+                if (ret < 0) {
+                    goto fail;
+                }
 
-            for(j = 0; j < s->l2_size; j++) {
-                uint64_t cluster_index;
+                for (j = 0; j < s->l2_slice_size; j++) {
+                    uint64_t cluster_index;
 
-                offset = be64_to_cpu(l2_table[j]);
-                old_offset = offset;
-                offset &= ~QCOW_OFLAG_COPIED;
+                    offset = get_l2_entry(s, l2_table, j);
+                    old_offset = offset;
+                    offset &= ~QCOW_OFLAG_COPIED;
 
-                switch (qcow2_get_cluster_type(offset)) {
+                    switch (qcow2_get_cluster_type(offset)) {
                     case QCOW2_CLUSTER_COMPRESSED:
                         nb_csectors = ((offset >> s->csize_shift) &
                                        s->csize_mask) + 1;
@@ -1133,12 +1138,15 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                                                     "unaligned (L2 offset: %#"
                                                     PRIx64 ", L2 index: %#x)",
                                                     offset & L2E_OFFSET_MASK,
-                                                    l2_offset, j);
+                                                    l2_offset,
+                                                    slice * s->l2_slice_size +
+                                                    j);
                             ret = -EIO;
                             goto fail;
                         }
 
-                        cluster_index = (offset & L2E_OFFSET_MASK) >> s->cluster_bits;
+                        cluster_index = (offset & L2E_OFFSET_MASK) >>
+                                        s->cluster_bits;
                         if (!cluster_index) {
                             /* unallocated */
                             refcount = 0;
@@ -1165,23 +1173,24 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
 
                     default:
                         abort();
-                }
+                    }
 
-                if (refcount == 1) {
-                    offset |= QCOW_OFLAG_COPIED;
-                }
-                if (offset != old_offset) {
-                    if (addend > 0) {
-                        qcow2_cache_set_dependency(bs, s->l2_table_cache,
-                            s->refcount_block_cache);
+                    if (refcount == 1) {
+                        offset |= QCOW_OFLAG_COPIED;
+                    }
+                    if (offset != old_offset) {
+                        if (addend > 0) {
+                            qcow2_cache_set_dependency(bs, s->l2_table_cache,
+                                s->refcount_block_cache);
+                        }
+                        set_l2_entry(s, l2_table, j, offset);
+                        qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
+                                                     l2_table);
                     }
-                    l2_table[j] = cpu_to_be64(offset);
-                    qcow2_cache_entry_mark_dirty(bs, s->l2_table_cache,
-                                                 l2_table);
                 }
-            }
 
-            qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+                qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+            }
 
             if (addend != 0) {
                 ret = qcow2_update_cluster_refcount(bs, l2_offset >>
@@ -1372,15 +1381,14 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
                               int flags)
 {
     BDRVQcow2State *s = bs->opaque;
-    uint64_t *l2_table, l2_entry;
+    uint64_t *l2_table, l2_entry, l2_bitmap;
     uint64_t next_contiguous_offset = 0;
-    int i, l2_size, nb_csectors, ret;
+    int i, nb_csectors, ret;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
-    l2_table = g_malloc(l2_size);
+    l2_table = g_malloc(s->cluster_size);
 
-    ret = bdrv_pread(bs->file, l2_offset, l2_table, l2_size);
+    ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
     if (ret < 0) {
         fprintf(stderr, "ERROR: I/O error in check_refcounts_l2\n");
         res->check_errors++;
@@ -1389,7 +1397,31 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+        l2_bitmap = get_l2_bitmap(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+                if (l2_bitmap) {
+                    fprintf(stderr, "ERROR: L2 entry %#" PRIx64 ": compressed "
+                            "cluster has a non-empty subcluster bitmap\n",
+                            l2_offset + i * l2_entry_size(s));
+                    res->corruptions++;
+                }
+            } else if ((l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) &
+                       (l2_bitmap >> 32)) {
+                fprintf(stderr, "ERROR: L2 entry %#" PRIx64 ": subclusters "
+                        "are both allocated and zero\n",
+                        l2_offset + i * l2_entry_size(s));
+                res->corruptions++;
+            } else if ((l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC) &&
+                       !(l2_entry & L2E_OFFSET_MASK)) {
+                fprintf(stderr, "ERROR: L2 entry %#" PRIx64 ": allocated "
+                        "subclusters without a host cluster\n",
+                        l2_offset + i * l2_entry_size(s));
+                res->corruptions++;
+            }
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1610,8 +1642,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
             }
         }
 
-        ret = bdrv_pread(bs->file, l2_offset, l2_table,
-                         s->l2_size * sizeof(uint64_t));
+        ret = bdrv_pread(bs->file, l2_offset, l2_table, s->cluster_size);
         if (ret < 0) {
             fprintf(stderr, "ERROR: Could not read L2 table: %s\n",
                     strerror(-ret));
@@ -1620,7 +1651,7 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
         }
 
         for (j = 0; j < s->l2_size; j++) {
-            uint64_t l2_entry = be64_to_cpu(l2_table[j]);
+            uint64_t l2_entry = get_l2_entry(s, l2_table, j);
             uint64_t data_offset = l2_entry & L2E_OFFSET_MASK;
             int cluster_type = qcow2_get_cluster_type(l2_entry);
 
@@ -1640,9 +1671,9 @@ static int check_oflag_copied(BlockDriverState *bs, BdrvCheckResult *res,
                                                     "ERROR",
                             l2_entry, refcount);
                     if (fix & BDRV_FIX_ERRORS) {
-                        l2_table[j] = cpu_to_be64(refcount == 1
-                                    ? l2_entry |  QCOW_OFLAG_COPIED
-                                    : l2_entry & ~QCOW_OFLAG_COPIED);
+                        set_l2_entry(s, l2_table, j, refcount == 1
+                                     ? l2_entry |  QCOW_OFLAG_COPIED
+                                     : l2_entry & ~QCOW_OFLAG_COPIED);
                         l2_dirty = true;
                         res->corruptions_fixed++;
                     } else {
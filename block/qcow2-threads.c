@@ -0,0 +1,237 @@
+/*
+ * Threaded data processing for qcow2: compression and decompression of
+ * clusters
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/thread-pool.h"
+#include "block/qcow2.h"
+#include "qemu/bswap.h"
+
+/* The point of zstd is speed; its lowest level still compresses about as
+ * well as zlib does */
+#define QCOW2_ZSTD_LEVEL 1
+
+typedef ssize_t Qcow2CompressFunc(void *dest, size_t dest_size,
+                                  const void *src, size_t src_size);
+
+typedef struct Qcow2CompressData {
+    void *dest;
+    size_t dest_size;
+    const void *src;
+    size_t src_size;
+    ssize_t ret;
+
+    Qcow2CompressFunc *func;
+} Qcow2CompressData;
+
+/*
+ * Each compression function returns the compressed size, -ENOMEM if the
+ * data does not fit into @dest_size bytes, or -EIO on other errors.
+ */
+
+/* best compression, small window, no zlib header */
+static ssize_t qcow2_zlib_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    z_stream strm;
+    ssize_t ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                       -12, 9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    strm.avail_in = src_size;
+    strm.next_in = (void *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        ret = dest_size - strm.avail_out;
+    } else {
+        ret = (ret == Z_OK ? -ENOMEM : -EIO);
+    }
+
+    deflateEnd(&strm);
+    return ret;
+}
+
+static int qcow2_zlib_decompress(void *dest, size_t dest_size,
+                                 const void *src, size_t src_size)
+{
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    strm.avail_in = src_size;
+    strm.next_in = (void *)src;
+    strm.avail_out = dest_size;
+    strm.next_out = dest;
+
+    ret = inflateInit2(&strm, -12);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+
+    /* The input is padded to a sector boundary, so there may be trailing
+     * garbage after the end of the stream; Z_BUF_ERROR with a full output
+     * buffer is success as well. */
+    ret = inflate(&strm, Z_FINISH);
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) || strm.avail_out != 0) {
+        ret = -EIO;
+    } else {
+        ret = 0;
+    }
+
+    inflateEnd(&strm);
+    return ret;
+}
+
+#ifdef CONFIG_ZSTD
+/*
+ * Compressed clusters are padded to a sector boundary on disk, and zstd
+ * cannot tell the end of its frame from the padding.  The compressed size
+ * is therefore stored in front of the frame, as a 32-bit big-endian value.
+ */
+static ssize_t qcow2_zstd_compress(void *dest, size_t dest_size,
+                                   const void *src, size_t src_size)
+{
+    size_t ret;
+
+    if (dest_size < sizeof(uint32_t)) {
+        return -ENOMEM;
+    }
+
+    ret = ZSTD_compress((uint8_t *)dest + sizeof(uint32_t),
+                        dest_size - sizeof(uint32_t), src, src_size,
+                        QCOW2_ZSTD_LEVEL);
+    if (ZSTD_isError(ret)) {
+        /* Most likely the output did not fit; store the cluster uncompressed */
+        return -ENOMEM;
+    }
+
+    stl_be_p(dest, ret);
+    return ret + sizeof(uint32_t);
+}
+
+static int qcow2_zstd_decompress(void *dest, size_t dest_size,
+                                 const void *src, size_t src_size)
+{
+    size_t zstd_size, ret;
+
+    if (src_size < sizeof(uint32_t)) {
+        return -EIO;
+    }
+
+    zstd_size = ldl_be_p(src);
+    if (zstd_size > src_size - sizeof(uint32_t)) {
+        return -EIO;
+    }
+
+    ret = ZSTD_decompress(dest, dest_size,
+                          (const uint8_t *)src + sizeof(uint32_t), zstd_size);
+    if (ZSTD_isError(ret) || ret != dest_size) {
+        return -EIO;
+    }
+
+    return 0;
+}
+#endif
+
+static int qcow2_compress_pool_func(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+
+    data->ret = data->func(data->dest, data->dest_size,
+                           data->src, data->src_size);
+    return 0;
+}
+
+/*
+ * qcow2_co_compress:
+ *
+ * Compress @src_size bytes from @src into @dest with the compression type of
+ * the image.  The work is done in the thread pool of the image's AioContext,
+ * so that up to QCOW2_MAX_THREADS clusters of one image can be compressed in
+ * parallel while the calling coroutine yields.
+ *
+ * Returns the compressed size on success, -ENOMEM if the data does not
+ * compress into @dest_size bytes and -EIO on other errors.
+ */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    Qcow2CompressData data = {
+        .dest       = dest,
+        .dest_size  = dest_size,
+        .src        = src,
+        .src_size   = src_size,
+    };
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        data.func = qcow2_zlib_compress;
+        break;
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        data.func = qcow2_zstd_compress;
+        break;
+#endif
+    default:
+        abort();
+    }
+
+    while (s->nb_compress_threads >= QCOW2_MAX_THREADS) {
+        qemu_co_queue_wait(&s->compress_wait_queue);
+    }
+
+    s->nb_compress_threads++;
+    thread_pool_submit_co(pool, qcow2_compress_pool_func, &data);
+    s->nb_compress_threads--;
+
+    qemu_co_queue_next(&s->compress_wait_queue);
+
+    return data.ret;
+}
+
+/*
+ * qcow2_decompress:
+ *
+ * Decompress @src_size bytes from @src into exactly @dest_size bytes at
+ * @dest.  @src may contain padding after the compressed data.
+ *
+ * Returns 0 on success and -EIO on error.
+ */
+int qcow2_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size)
+{
+    BDRVQcow2State *s = bs->opaque;
+
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+        return qcow2_zlib_decompress(dest, dest_size, src, src_size);
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+        return qcow2_zstd_decompress(dest, dest_size, src, src_size);
+#endif
+    default:
+        abort();
+    }
+}
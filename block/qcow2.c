@@ -25,7 +25,6 @@
 #include "block/block_int.h"
 #include "sysemu/block-backend.h"
 #include "qemu/module.h"
-#include <zlib.h>
 #include "block/qcow2.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
@@ -63,6 +62,12 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_COMPRESSION_TYPE 0xc03183a3
+
+typedef struct {
+    uint8_t compression_type;
+    uint8_t reserved[7];
+} QEMU_PACKED Qcow2CompressionTypeExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -148,6 +153,26 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
 #endif
             break;
 
+        case QCOW2_EXT_MAGIC_COMPRESSION_TYPE:
+        {
+            Qcow2CompressionTypeExt compression_ext;
+
+            if (ext.len != sizeof(compression_ext)) {
+                error_setg(errp, "ERROR: ext_compression_type: len=%" PRIu32
+                           " invalid (!=%zu)", ext.len,
+                           sizeof(compression_ext));
+                return 2;
+            }
+            ret = bdrv_pread(bs->file, offset, &compression_ext, ext.len);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "ERROR: ext_compression_type: "
+                                 "Could not read compression type");
+                return 3;
+            }
+            s->compression_type = compression_ext.compression_type;
+            break;
+        }
+
         case QCOW2_EXT_MAGIC_FEATURE_TABLE:
             if (p_feature_table != NULL) {
                 void* feature_table = g_malloc0(ext.len + 2 * sizeof(Qcow2Feature));
@@ -188,6 +213,35 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
     return 0;
 }
 
+/*
+ * Images whose compressed clusters do not use zlib must carry the compression
+ * type incompatible feature bit, so that implementations that know only zlib
+ * refuse to open them.
+ */
+static int validate_compression_type(BDRVQcow2State *s, Error **errp)
+{
+    switch (s->compression_type) {
+    case QCOW2_COMPRESSION_TYPE_ZLIB:
+#ifdef CONFIG_ZSTD
+    case QCOW2_COMPRESSION_TYPE_ZSTD:
+#endif
+        break;
+    default:
+        error_setg(errp, "qcow2: unsupported compression type %u",
+                   s->compression_type);
+        return -ENOTSUP;
+    }
+
+    if ((s->compression_type == QCOW2_COMPRESSION_TYPE_ZLIB) !=
+        !(s->incompatible_features & QCOW2_INCOMPAT_COMPRESSION)) {
+        error_setg(errp, "qcow2: compression type feature bit does not match "
+                   "the compression type header extension");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
 static void cleanup_unknown_header_ext(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -451,6 +505,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_SIZE,
             .help = "Maximum L2 table cache size",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Size of each entry in the L2 cache",
+        },
         {
             .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
             .type = QEMU_OPT_SIZE,
@@ -461,6 +520,11 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_NUMBER,
             .help = "Clean unused cache entries after this time (in seconds)",
         },
+        {
+            .name = QCOW2_OPT_ALLOC_BATCH_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Reserve this much space at once for allocating writes",
+        },
         { /* end of list */ }
     },
 };
@@ -581,10 +645,12 @@ static void read_cache_sizes(BlockDriverState *bs, QemuOpts *opts,
 typedef struct Qcow2ReopenState {
     Qcow2Cache *l2_table_cache;
     Qcow2Cache *refcount_block_cache;
+    int l2_slice_size; /* Number of entries in a slice of the L2 table */
     bool use_lazy_refcounts;
     int overlap_check;
     bool discard_passthrough[QCOW2_DISCARD_MAX];
     uint64_t cache_clean_interval;
+    int alloc_batch_clusters;
 } Qcow2ReopenState;
 
 static int qcow2_update_options_prepare(BlockDriverState *bs,
@@ -596,7 +662,8 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
     QemuOpts *opts = NULL;
     const char *opt_overlap_check, *opt_overlap_check_template;
     int overlap_check_template = 0;
-    uint64_t l2_cache_size, refcount_cache_size;
+    uint64_t l2_cache_size, l2_cache_entry_size, refcount_cache_size;
+    uint64_t alloc_batch_size;
     int i;
     Error *local_err = NULL;
     int ret;
@@ -618,7 +685,20 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
-    l2_cache_size /= s->cluster_size;
+    l2_cache_entry_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_ENTRY_SIZE,
+                                            MIN(s->cluster_size,
+                                                DEFAULT_L2_CACHE_ENTRY_SIZE));
+    if (l2_cache_entry_size < (1 << MIN_CLUSTER_BITS) ||
+        l2_cache_entry_size > s->cluster_size ||
+        !is_power_of_2(l2_cache_entry_size)) {
+        error_setg(errp, "L2 cache entry size must be a power of two between "
+                   "%d and the cluster size", 1 << MIN_CLUSTER_BITS);
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->l2_slice_size = l2_cache_entry_size / l2_entry_size(s);
+
+    l2_cache_size /= l2_cache_entry_size;
     if (l2_cache_size < MIN_L2_CACHE_SIZE) {
         l2_cache_size = MIN_L2_CACHE_SIZE;
     }
@@ -656,8 +736,10 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         }
     }
 
-    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
-    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
+    r->l2_table_cache = qcow2_cache_create(bs, l2_cache_size,
+                                           l2_cache_entry_size);
+    r->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size,
+                                                 s->cluster_size);
     if (r->l2_table_cache == NULL || r->refcount_block_cache == NULL) {
         error_setg(errp, "Could not allocate metadata caches");
         ret = -ENOMEM;
@@ -674,6 +756,17 @@ static int qcow2_update_options_prepare(BlockDriverState *bs,
         goto fail;
     }
 
+    /* Allocation batch size, rounded down to whole clusters */
+    alloc_batch_size = qemu_opt_get_size(opts, QCOW2_OPT_ALLOC_BATCH_SIZE,
+                                         (uint64_t) s->alloc_batch_clusters
+                                         << s->cluster_bits);
+    if (alloc_batch_size >> s->cluster_bits > INT_MAX) {
+        error_setg(errp, "Allocation batch size too big");
+        ret = -EINVAL;
+        goto fail;
+    }
+    r->alloc_batch_clusters = alloc_batch_size >> s->cluster_bits;
+
     /* lazy-refcounts; flush if going from enabled to disabled */
     r->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
@@ -764,6 +857,7 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
     }
     s->l2_table_cache = r->l2_table_cache;
     s->refcount_block_cache = r->refcount_block_cache;
+    s->l2_slice_size = r->l2_slice_size;
 
     s->overlap_check = r->overlap_check;
     s->use_lazy_refcounts = r->use_lazy_refcounts;
@@ -772,6 +866,8 @@ static void qcow2_update_options_commit(BlockDriverState *bs,
         s->discard_passthrough[i] = r->discard_passthrough[i];
     }
 
+    s->alloc_batch_clusters = r->alloc_batch_clusters;
+
     if (s->cache_clean_interval != r->cache_clean_interval) {
         cache_clean_timer_del(bs);
         s->cache_clean_interval = r->cache_clean_interval;
@@ -983,7 +1079,21 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         bs->encrypted = true;
     }
 
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+    s->subclusters_per_cluster = 1;
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+            error_setg(errp, "Unsupported cluster size for extended L2 "
+                       "entries: 2^%d", s->cluster_bits);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ctz32(s->subcluster_size);
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - ctz32(l2_entry_size(s));
     s->l2_size = 1 << s->l2_bits;
     /* 2^(s->refcount_order - 3) is the refcount width in bytes */
     s->refcount_block_bits = s->cluster_bits - (s->refcount_order - 3);
@@ -1106,6 +1216,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
     QTAILQ_INIT(&s->discards);
 
     /* read qcow2 extensions */
+    s->compression_type = QCOW2_COMPRESSION_TYPE_ZLIB;
     if (qcow2_read_extensions(bs, header.header_length, ext_end, NULL,
         &local_err)) {
         error_propagate(errp, local_err);
@@ -1113,6 +1224,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
         goto fail;
     }
 
+    ret = validate_compression_type(s, errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* read the backing file name */
     if (header.backing_file_offset != 0) {
         len = header.backing_file_size;
@@ -1154,6 +1270,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_wait_queue);
+    QSIMPLEQ_INIT(&s->l2_updates);
+    qemu_co_queue_init(&s->l2_updates_done);
 
     /* Repair image if dirty */
     if (!(flags & (BDRV_O_CHECK | BDRV_O_INACTIVE)) && !bs->read_only &&
@@ -1258,6 +1377,8 @@ static int qcow2_reopen_prepare(BDRVReopenState *state,
 
     /* We need to write out any unwritten data if we reopen read-only. */
     if ((state->flags & BDRV_O_RDWR) == 0) {
+        qcow2_release_reserved_clusters(state->bs);
+
         ret = bdrv_flush(state->bs);
         if (ret < 0) {
             goto fail;
@@ -1551,6 +1672,86 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2L2Update {
+    QCowL2Meta *l2meta;
+    int ret;
+    bool done;
+    QSIMPLEQ_ENTRY(Qcow2L2Update) next;
+} Qcow2L2Update;
+
+/*
+ * Links the clusters allocated for a write request (the QCowL2Meta chain
+ * *l2meta) into the L2 tables after the data has been written, and takes
+ * them off the list of in-flight allocations.
+ *
+ * Requests whose data writes complete while another request is updating the
+ * L2 tables do not take s->lock one after the other; they queue up and the
+ * request that already holds the lock links all of them in the same pass.
+ * Their L2 and refcount updates then go to disk with the same cache
+ * writeback.
+ *
+ * Must be called without s->lock held and returns with s->lock held. On
+ * error, *l2meta is left pointing to the allocations that were not linked.
+ */
+static int coroutine_fn qcow2_co_link_l2(BlockDriverState *bs,
+                                         QCowL2Meta **l2meta)
+{
+    BDRVQcow2State *s = bs->opaque;
+    Qcow2L2Update update = { .l2meta = *l2meta };
+    Qcow2L2Update *u;
+
+    if (*l2meta == NULL) {
+        qemu_co_mutex_lock(&s->lock);
+        return 0;
+    }
+
+    QSIMPLEQ_INSERT_TAIL(&s->l2_updates, &update, next);
+
+    if (s->l2_updates_busy) {
+        /* Another request links our clusters along with its own */
+        while (!update.done) {
+            qemu_co_queue_wait(&s->l2_updates_done);
+        }
+        qemu_co_mutex_lock(&s->lock);
+        *l2meta = update.l2meta;
+        return update.ret;
+    }
+
+    s->l2_updates_busy = true;
+    qemu_co_mutex_lock(&s->lock);
+
+    while ((u = QSIMPLEQ_FIRST(&s->l2_updates)) != NULL) {
+        QSIMPLEQ_REMOVE_HEAD(&s->l2_updates, next);
+
+        while (u->l2meta != NULL) {
+            QCowL2Meta *next;
+
+            u->ret = qcow2_alloc_cluster_link_l2(bs, u->l2meta);
+            if (u->ret < 0) {
+                break;
+            }
+
+            /* Take the request off the list of running requests */
+            if (u->l2meta->nb_clusters != 0) {
+                QLIST_REMOVE(u->l2meta, next_in_flight);
+            }
+
+            qemu_co_queue_restart_all(&u->l2meta->dependent_requests);
+
+            next = u->l2meta->next;
+            g_free(u->l2meta);
+            u->l2meta = next;
+        }
+        u->done = true;
+    }
+
+    s->l2_updates_busy = false;
+    qemu_co_queue_restart_all(&s->l2_updates_done);
+
+    *l2meta = update.l2meta;
+    return update.ret;
+}
+
 static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
                                          uint64_t bytes, QEMUIOVector *qiov,
                                          int flags)
@@ -1640,29 +1841,14 @@ static coroutine_fn int qcow2_co_pwritev(BlockDriverState *bs, uint64_t offset,
         ret = bdrv_co_pwritev(bs->file,
                               cluster_offset + offset_in_cluster,
                               cur_bytes, &hd_qiov, 0);
-        qemu_co_mutex_lock(&s->lock);
         if (ret < 0) {
+            qemu_co_mutex_lock(&s->lock);
             goto fail;
         }
 
-        while (l2meta != NULL) {
-            QCowL2Meta *next;
-
-            ret = qcow2_alloc_cluster_link_l2(bs, l2meta);
-            if (ret < 0) {
-                goto fail;
-            }
-
-            /* Take the request off the list of running requests */
-            if (l2meta->nb_clusters != 0) {
-                QLIST_REMOVE(l2meta, next_in_flight);
-            }
-
-            qemu_co_queue_restart_all(&l2meta->dependent_requests);
-
-            next = l2meta->next;
-            g_free(l2meta);
-            l2meta = next;
+        ret = qcow2_co_link_l2(bs, &l2meta);
+        if (ret < 0) {
+            goto fail;
         }
 
         bytes -= cur_bytes;
@@ -1700,6 +1886,8 @@ static int qcow2_inactivate(BlockDriverState *bs)
     BDRVQcow2State *s = bs->opaque;
     int ret, result = 0;
 
+    qcow2_release_reserved_clusters(bs);
+
     ret = qcow2_cache_flush(bs, s->l2_table_cache);
     if (ret) {
         result = ret;
@@ -1910,6 +2098,23 @@ int qcow2_update_header(BlockDriverState *bs)
         buflen -= ret;
     }
 
+    /* Compression type header extension */
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        Qcow2CompressionTypeExt compression_ext = {
+            .compression_type = s->compression_type,
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_COMPRESSION_TYPE,
+                             &compression_ext, sizeof(compression_ext),
+                             buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Feature table */
     if (s->qcow_version >= 3) {
         Qcow2Feature features[] = {
@@ -1923,6 +2128,16 @@ int qcow2_update_header(BlockDriverState *bs)
                 .bit  = QCOW2_INCOMPAT_CORRUPT_BITNR,
                 .name = "corrupt bit",
             },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_COMPRESSION_BITNR,
+                .name = "compression type",
+            },
+            {
+                .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+                .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+                .name = "extended L2 entries",
+            },
             {
                 .type = QCOW2_FEAT_TYPE_COMPATIBLE,
                 .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
@@ -2073,7 +2288,8 @@ static int qcow2_create2(const char *filename, int64_t total_size,
                          const char *backing_file, const char *backing_format,
                          int flags, size_t cluster_size, PreallocMode prealloc,
                          QemuOpts *opts, int version, int refcount_order,
-                         Error **errp)
+                         Qcow2CompressionType compression_type,
+                         bool extended_l2, Error **errp)
 {
     int cluster_bits;
     QDict *options;
@@ -2088,6 +2304,12 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         return -EINVAL;
     }
 
+    if (extended_l2 && cluster_bits < MIN_EXTL2_CLUSTER_BITS) {
+        error_setg(errp, "Extended L2 entries are only supported with cluster "
+                   "sizes of at least %dk", 1 << (MIN_EXTL2_CLUSTER_BITS - 10));
+        return -EINVAL;
+    }
+
     /*
      * Open the image file and write a minimal qcow2 header.
      *
@@ -2115,6 +2337,7 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         int64_t meta_size = 0;
         uint64_t nreftablee, nrefblocke, nl1e, nl2e;
         int64_t aligned_total_size = align_offset(total_size, cluster_size);
+        size_t l2e_size = extended_l2 ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
         int refblock_bits, refblock_size;
         /* refcount entry size in bytes */
         double rces = (1 << refcount_order) / 8.;
@@ -2128,11 +2351,11 @@ static int qcow2_create2(const char *filename, int64_t total_size,
 
         /* total size of L2 tables */
         nl2e = aligned_total_size / cluster_size;
-        nl2e = align_offset(nl2e, cluster_size / sizeof(uint64_t));
-        meta_size += nl2e * sizeof(uint64_t);
+        nl2e = align_offset(nl2e, cluster_size / l2e_size);
+        meta_size += nl2e * l2e_size;
 
         /* total size of L1 tables */
-        nl1e = nl2e * sizeof(uint64_t) / cluster_size;
+        nl1e = nl2e * l2e_size / cluster_size;
         nl1e = align_offset(nl1e, cluster_size / sizeof(uint64_t));
         meta_size += nl1e * sizeof(uint64_t);
 
@@ -2211,6 +2434,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (extended_l2) {
+        header->incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = blk_pwrite(blk, 0, header, cluster_size, 0);
     g_free(header);
     if (ret < 0) {
@@ -2258,6 +2485,12 @@ static int qcow2_create2(const char *filename, int64_t total_size,
         abort();
     }
 
+    if (compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        BDRVQcow2State *s = blk_bs(blk)->opaque;
+        s->compression_type = compression_type;
+        s->incompatible_features |= QCOW2_INCOMPAT_COMPRESSION;
+    }
+
     /* Create a full header (including things like feature table) */
     ret = qcow2_update_header(blk_bs(blk));
     if (ret < 0) {
@@ -2328,6 +2561,8 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
     int version = 3;
     uint64_t refcount_bits = 16;
     int refcount_order;
+    Qcow2CompressionType compression_type;
+    bool extended_l2;
     Error *local_err = NULL;
     int ret;
 
@@ -2401,9 +2636,46 @@ static int qcow2_create(const char *filename, QemuOpts *opts, Error **errp)
 
     refcount_order = ctz32(refcount_bits);
 
+    g_free(buf);
+    buf = qemu_opt_get_del(opts, BLOCK_OPT_COMPRESSION_TYPE);
+    compression_type = qapi_enum_parse(Qcow2CompressionType_lookup, buf,
+                                       QCOW2_COMPRESSION_TYPE__MAX,
+                                       QCOW2_COMPRESSION_TYPE_ZLIB,
+                                       &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto finish;
+    }
+
+#ifndef CONFIG_ZSTD
+    if (compression_type == QCOW2_COMPRESSION_TYPE_ZSTD) {
+        error_setg(errp, "This build does not support zstd compression");
+        ret = -ENOTSUP;
+        goto finish;
+    }
+#endif
+
+    if (version < 3 && compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_setg(errp, "Compression types other than zlib require "
+                   "compatibility level 1.1 or above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
+    extended_l2 = qemu_opt_get_bool_del(opts, BLOCK_OPT_EXTL2, false);
+    if (version < 3 && extended_l2) {
+        error_setg(errp, "Extended L2 entries are only supported with "
+                   "compatibility level 1.1 and above (use compat=1.1 or "
+                   "greater)");
+        ret = -EINVAL;
+        goto finish;
+    }
+
     ret = qcow2_create2(filename, size, backing_file, backing_fmt, flags,
                         cluster_size, prealloc, opts, version, refcount_order,
-                        &local_err);
+                        compression_type, extended_l2, &local_err);
     error_propagate(errp, local_err);
 
 finish:
@@ -2533,61 +2805,20 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
-typedef struct Qcow2WriteCo {
-    BlockDriverState *bs;
-    int64_t sector_num;
-    const uint8_t *buf;
-    int nb_sectors;
-    int ret;
-} Qcow2WriteCo;
-
-static void qcow2_write_co_entry(void *opaque)
-{
-    Qcow2WriteCo *co = opaque;
-    QEMUIOVector qiov;
-    uint64_t offset = co->sector_num * BDRV_SECTOR_SIZE;
-    uint64_t bytes = co->nb_sectors * BDRV_SECTOR_SIZE;
-
-    struct iovec iov = (struct iovec) {
-        .iov_base   = (uint8_t*) co->buf,
-        .iov_len    = bytes,
-    };
-    qemu_iovec_init_external(&qiov, &iov, 1);
-
-    co->ret = qcow2_co_pwritev(co->bs, offset, bytes, &qiov, 0);
-}
-
-/* Wrapper for non-coroutine contexts */
-static int qcow2_write(BlockDriverState *bs, int64_t sector_num,
-                       const uint8_t *buf, int nb_sectors)
-{
-    Coroutine *co;
-    AioContext *aio_context = bdrv_get_aio_context(bs);
-    Qcow2WriteCo data = {
-        .bs         = bs,
-        .sector_num = sector_num,
-        .buf        = buf,
-        .nb_sectors = nb_sectors,
-        .ret        = -EINPROGRESS,
-    };
-    co = qemu_coroutine_create(qcow2_write_co_entry, &data);
-    qemu_coroutine_enter(co);
-    while (data.ret == -EINPROGRESS) {
-        aio_poll(aio_context, true);
-    }
-    return data.ret;
-}
-
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_co_write_compressed(BlockDriverState *bs,
+                                                  int64_t sector_num,
+                                                  const uint8_t *buf,
+                                                  int nb_sectors)
 {
     BDRVQcow2State *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    ssize_t out_len;
     uint8_t *out_buf;
     uint64_t cluster_offset;
+    int ret;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -2605,65 +2836,61 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
             uint8_t *pad_buf = qemu_blockalign(bs, s->cluster_size);
             memset(pad_buf, 0, s->cluster_size);
             memcpy(pad_buf, buf, nb_sectors * BDRV_SECTOR_SIZE);
-            ret = qcow2_write_compressed(bs, sector_num,
-                                         pad_buf, s->cluster_sectors);
+            ret = qcow2_co_write_compressed(bs, sector_num,
+                                            pad_buf, s->cluster_sectors);
             qemu_vfree(pad_buf);
         }
         return ret;
     }
 
+    /* Compression runs in the thread pool; other requests, including
+     * further compressed writes, make progress in the meantime. */
     out_buf = g_malloc(s->cluster_size);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
+    out_len = qcow2_co_compress(bs, out_buf, s->cluster_size - 1,
+                                buf, s->cluster_size);
+    if (out_len == -ENOMEM) {
+        /* could not compress: write normal cluster */
+        iov = (struct iovec) {
+            .iov_base   = (uint8_t *) buf,
+            .iov_len    = s->cluster_size,
+        };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+        ret = qcow2_co_pwritev(bs, sector_num << BDRV_SECTOR_BITS,
+                               s->cluster_size, &qiov, 0);
+        goto fail;
+    } else if (out_len < 0) {
         ret = -EINVAL;
         goto fail;
     }
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
-
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
+    /* Only the allocation is serialised.  Whichever write gets here first
+     * gets the next free bytes, so host offsets follow completion order. */
+    qemu_co_mutex_lock(&s->lock);
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, out_len);
+    if (!cluster_offset) {
+        qemu_co_mutex_unlock(&s->lock);
+        ret = -EIO;
         goto fail;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
+    cluster_offset &= s->cluster_offset_mask;
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = qcow2_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset) {
-            ret = -EIO;
-            goto fail;
-        }
-        cluster_offset &= s->cluster_offset_mask;
+    ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
+    qemu_co_mutex_unlock(&s->lock);
+    if (ret < 0) {
+        goto fail;
+    }
 
-        ret = qcow2_pre_write_overlap_check(bs, 0, cluster_offset, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    iov = (struct iovec) {
+        .iov_base   = out_buf,
+        .iov_len    = out_len,
+    };
+    qemu_iovec_init_external(&qiov, &iov, 1);
 
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
-        if (ret < 0) {
-            goto fail;
-        }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_co_pwritev(bs->file, cluster_offset, out_len, &qiov, 0);
+    if (ret < 0) {
+        goto fail;
     }
 
     ret = 0;
@@ -2672,6 +2899,49 @@ fail:
     return ret;
 }
 
+typedef struct Qcow2WriteCompressedCo {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    const uint8_t *buf;
+    int nb_sectors;
+    int ret;
+} Qcow2WriteCompressedCo;
+
+static void qcow2_write_compressed_entry(void *opaque)
+{
+    Qcow2WriteCompressedCo *co = opaque;
+
+    co->ret = qcow2_co_write_compressed(co->bs, co->sector_num, co->buf,
+                                        co->nb_sectors);
+}
+
+/* Callers that run in a coroutine, like qemu-img convert, can have several
+ * compressed writes in flight; everybody else waits for completion here. */
+static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
+                                  const uint8_t *buf, int nb_sectors)
+{
+    Coroutine *co;
+    AioContext *aio_context = bdrv_get_aio_context(bs);
+    Qcow2WriteCompressedCo data = {
+        .bs         = bs,
+        .sector_num = sector_num,
+        .buf        = buf,
+        .nb_sectors = nb_sectors,
+        .ret        = -EINPROGRESS,
+    };
+
+    if (qemu_in_coroutine()) {
+        return qcow2_co_write_compressed(bs, sector_num, buf, nb_sectors);
+    }
+
+    co = qemu_coroutine_create(qcow2_write_compressed_entry, &data);
+    qemu_coroutine_enter(co);
+    while (data.ret == -EINPROGRESS) {
+        aio_poll(aio_context, true);
+    }
+    return data.ret;
+}
+
 static int make_completely_empty(BlockDriverState *bs)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -2781,6 +3051,8 @@ static int make_completely_empty(BlockDriverState *bs)
     s->refcount_table[0] = 2 * s->cluster_size;
 
     s->free_cluster_index = 0;
+    s->reserved_offset = 0;
+    s->reserved_clusters = 0;
     assert(3 + l1_clusters <= s->refcount_block_size);
     offset = qcow2_alloc_clusters(bs, 3 * s->cluster_size + l1_size2);
     if (offset < 0) {
@@ -2919,6 +3191,14 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
             .has_corrupt        = true,
             .refcount_bits      = s->refcount_bits,
         };
+        if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+            spec_info->u.qcow2.data->has_compression_type = true;
+            spec_info->u.qcow2.data->compression_type = s->compression_type;
+        }
+        if (has_subclusters(s)) {
+            spec_info->u.qcow2.data->has_extended_l2 = true;
+            spec_info->u.qcow2.data->extended_l2 = true;
+        }
     } else {
         /* if this assertion fails, this probably means a new version was
          * added without having it covered here */
@@ -2928,6 +3208,26 @@ static ImageInfoSpecific *qcow2_get_specific_info(BlockDriverState *bs)
     return spec_info;
 }
 
+static BlockStatsSpecific *qcow2_get_specific_stats(const BlockDriverState *bs)
+{
+    BDRVQcow2State *s = bs->opaque;
+    BlockStatsSpecific *stats = g_new(BlockStatsSpecific, 1);
+
+    *stats = (BlockStatsSpecific){
+        .type = BLOCK_STATS_SPECIFIC_KIND_QCOW2,
+        .u.qcow2.data = g_new(BlockStatsSpecificQcow2, 1),
+    };
+    *stats->u.qcow2.data = (BlockStatsSpecificQcow2){
+        .l2_cache       = g_new0(Qcow2CacheStats, 1),
+        .refcount_cache = g_new0(Qcow2CacheStats, 1),
+    };
+    qcow2_cache_get_stats(s->l2_table_cache, stats->u.qcow2.data->l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache,
+                          stats->u.qcow2.data->refcount_cache);
+
+    return stats;
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -2993,6 +3293,17 @@ static int qcow2_downgrade(BlockDriverState *bs, int target_version,
         return -ENOTSUP;
     }
 
+    if (has_subclusters(s)) {
+        error_report("compat=0.10 does not support extended L2 entries");
+        return -ENOTSUP;
+    }
+
+    if (s->compression_type != QCOW2_COMPRESSION_TYPE_ZLIB) {
+        error_report("compat=0.10 does not support compression type %s",
+                     Qcow2CompressionType_lookup[s->compression_type]);
+        return -ENOTSUP;
+    }
+
     /* clear incompatible features */
     if (s->incompatible_features & QCOW2_INCOMPAT_DIRTY) {
         ret = qcow2_mark_clean(bs);
@@ -3175,6 +3486,15 @@ static int qcow2_amend_options(BlockDriverState *bs, QemuOpts *opts,
                              "not exceed 64 bits");
                 return -EINVAL;
             }
+        } else if (!strcmp(desc->name, BLOCK_OPT_COMPRESSION_TYPE)) {
+            error_report("Changing the compression type is not supported");
+            return -ENOTSUP;
+        } else if (!strcmp(desc->name, BLOCK_OPT_EXTL2)) {
+            if (qemu_opt_get_bool(opts, BLOCK_OPT_EXTL2, has_subclusters(s)) !=
+                has_subclusters(s)) {
+                error_report("Changing the L2 entry format is not supported");
+                return -ENOTSUP;
+            }
         } else {
             /* if this point is reached, this probably means a new option was
              * added without having it covered here */
@@ -3386,6 +3706,17 @@ static QemuOptsList qcow2_create_opts = {
             .help = "Width of a reference count entry in bits",
             .def_value_str = "16"
         },
+        {
+            .name = BLOCK_OPT_COMPRESSION_TYPE,
+            .type = QEMU_OPT_STRING,
+            .help = "Compression method used for compressed clusters "
+                    "(allowed values: zlib, zstd)"
+        },
+        {
+            .name = BLOCK_OPT_EXTL2,
+            .type = QEMU_OPT_BOOL,
+            .help = "Extended L2 entries with 32 subclusters per cluster"
+        },
         { /* end of list */ }
     }
 };
@@ -3422,6 +3753,7 @@ BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_load_tmp = qcow2_snapshot_load_tmp,
     .bdrv_get_info          = qcow2_get_info,
     .bdrv_get_specific_info = qcow2_get_specific_info,
+    .bdrv_get_specific_stats = qcow2_get_specific_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
@@ -59,11 +59,35 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1ULL << 0)
 
+/* With extended L2 entries, every cluster is divided into this many
+ * subclusters.  The second half of the entry is a bitmap with one
+ * "allocated" bit (bits 0-31) and one "reads as zero" bit (bits 32-63) for
+ * each of them. */
+#define QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER 32
+#define QCOW_OFLAG_SUB_ALLOC(X)   (1ULL << (X))
+#define QCOW_OFLAG_SUB_ZERO(X)    (QCOW_OFLAG_SUB_ALLOC(X) << 32)
+/* Subclusters X to Y-1 */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC(Y) - QCOW_OFLAG_SUB_ALLOC(X))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(X, Y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(X, Y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC \
+    QCOW_OFLAG_SUB_ALLOC_RANGE(0, QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)
+#define QCOW_L2_BITMAP_ALL_ZEROES \
+    QCOW_OFLAG_SUB_ZERO_RANGE(0, QCOW_EXTL2_SUBCLUSTERS_PER_CLUSTER)
+
+/* Size of a standard and an extended L2 entry in bytes */
+#define L2E_SIZE_NORMAL   (sizeof(uint64_t))
+#define L2E_SIZE_EXTENDED (sizeof(uint64_t) * 2)
+
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Subclusters must not be smaller than a sector */
+#define MIN_EXTL2_CLUSTER_BITS 14
+
 /* Must be at least 2 to cover COW */
-#define MIN_L2_CACHE_SIZE 2 /* clusters */
+#define MIN_L2_CACHE_SIZE 2 /* entries */
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define MIN_REFCOUNT_CACHE_SIZE 4 /* clusters */
@@ -76,8 +100,15 @@
  * clusters */
 #define DEFAULT_L2_REFCOUNT_SIZE_RATIO 4
 
+/* L2 cache entries hold slices of at most this size, so that a cache miss
+ * with large clusters does not read (and keep) a whole L2 table */
+#define DEFAULT_L2_CACHE_ENTRY_SIZE 65536 /* bytes */
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
+/* Maximum number of clusters that are compressed in parallel */
+#define QCOW2_MAX_THREADS 4
+
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy-refcounts"
 #define QCOW2_OPT_DISCARD_REQUEST "pass-discard-request"
@@ -95,8 +126,10 @@
 #define QCOW2_OPT_OVERLAP_INACTIVE_L2 "overlap-check.inactive-l2"
 #define QCOW2_OPT_CACHE_SIZE "cache-size"
 #define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_L2_CACHE_ENTRY_SIZE "l2-cache-entry-size"
 #define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 #define QCOW2_OPT_CACHE_CLEAN_INTERVAL "cache-clean-interval"
+#define QCOW2_OPT_ALLOC_BATCH_SIZE "alloc-batch-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -178,13 +211,19 @@ enum {
 
 /* Incompatible feature bits */
 enum {
-    QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
-    QCOW2_INCOMPAT_CORRUPT_BITNR = 1,
-    QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
-    QCOW2_INCOMPAT_CORRUPT       = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
-
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
-                                 | QCOW2_INCOMPAT_CORRUPT,
+    QCOW2_INCOMPAT_DIRTY_BITNR       = 0,
+    QCOW2_INCOMPAT_CORRUPT_BITNR     = 1,
+    QCOW2_INCOMPAT_COMPRESSION_BITNR = 3,
+    QCOW2_INCOMPAT_EXTL2_BITNR       = 4,
+    QCOW2_INCOMPAT_DIRTY             = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_CORRUPT           = 1 << QCOW2_INCOMPAT_CORRUPT_BITNR,
+    QCOW2_INCOMPAT_COMPRESSION       = 1 << QCOW2_INCOMPAT_COMPRESSION_BITNR,
+    QCOW2_INCOMPAT_EXTL2             = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
+
+    QCOW2_INCOMPAT_MASK              = QCOW2_INCOMPAT_DIRTY
+                                     | QCOW2_INCOMPAT_CORRUPT
+                                     | QCOW2_INCOMPAT_COMPRESSION
+                                     | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -226,8 +265,12 @@ typedef struct BDRVQcow2State {
     int cluster_bits;
     int cluster_size;
     int cluster_sectors;
+    int subcluster_bits;
+    int subcluster_size;
+    int subclusters_per_cluster;    /* 1 without extended L2 entries */
     int l2_bits;
     int l2_size;
+    int l2_slice_size;  /* number of L2 entries in an L2 cache entry */
     int l1_size;
     int l1_vm_state_index;
     int refcount_block_bits;
@@ -254,8 +297,27 @@ typedef struct BDRVQcow2State {
     uint64_t free_cluster_index;
     uint64_t free_byte_offset;
 
+    /* Data clusters are allocated alloc_batch_clusters at a time; the part of
+     * the run that has not been handed out to a write request yet starts at
+     * reserved_offset */
+    int alloc_batch_clusters;
+    uint64_t reserved_offset;
+    uint64_t reserved_clusters;
+
     CoMutex lock;
 
+    /* Write requests waiting for their allocations to be linked into the L2
+     * tables, and whether a request is already doing so */
+    QSIMPLEQ_HEAD(, Qcow2L2Update) l2_updates;
+    bool l2_updates_busy;
+    CoQueue l2_updates_done;
+
+    Qcow2CompressionType compression_type;
+    /* Compression jobs running in the thread pool, and the coroutines that
+     * wait because QCOW2_MAX_THREADS of them are already running */
+    int nb_compress_threads;
+    CoQueue compress_wait_queue;
+
     QCryptoCipher *cipher; /* current cipher, NULL if no key yet */
     uint32_t crypt_method_header;
     uint64_t snapshots_offset;
@@ -407,6 +469,16 @@ static inline int64_t offset_into_cluster(BDRVQcow2State *s, int64_t offset)
     return offset & (s->cluster_size - 1);
 }
 
+static inline int64_t offset_into_subcluster(BDRVQcow2State *s, int64_t offset)
+{
+    return offset & (s->subcluster_size - 1);
+}
+
+static inline int offset_to_sc_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->subcluster_bits) & (s->subclusters_per_cluster - 1);
+}
+
 static inline uint64_t size_to_clusters(BDRVQcow2State *s, uint64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
@@ -423,6 +495,11 @@ static inline int offset_to_l2_index(BDRVQcow2State *s, int64_t offset)
     return (offset >> s->cluster_bits) & (s->l2_size - 1);
 }
 
+static inline int offset_to_l2_slice_index(BDRVQcow2State *s, int64_t offset)
+{
+    return (offset >> s->cluster_bits) & (s->l2_slice_size - 1);
+}
+
 static inline int64_t align_offset(int64_t offset, int n)
 {
     offset = (offset + n - 1) & ~(n - 1);
@@ -452,6 +529,75 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type (QCOW2_CLUSTER_*) of subcluster @sc_index of a cluster
+ * with an extended L2 entry, or -EIO if the allocation bitmap is invalid.
+ * Compressed clusters have no subclusters and an empty bitmap.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap,
+                                            unsigned sc_index)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return l2_bitmap ? -EIO : QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index)) {
+        if ((l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) ||
+            !(l2_entry & L2E_OFFSET_MASK)) {
+            return -EIO;
+        }
+        return QCOW2_CLUSTER_NORMAL;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
+static inline bool has_subclusters(BDRVQcow2State *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+static inline size_t l2_entry_size(BDRVQcow2State *s)
+{
+    return has_subclusters(s) ? L2E_SIZE_EXTENDED : L2E_SIZE_NORMAL;
+}
+
+/* Accessors for the L2 entry at index @idx of an L2 slice (in host byte
+ * order); the bitmap of images without subclusters is always 0 */
+static inline uint64_t get_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                    int idx)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    return be64_to_cpu(l2_slice[idx]);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                     int idx)
+{
+    if (has_subclusters(s)) {
+        idx *= l2_entry_size(s) / sizeof(uint64_t);
+        return be64_to_cpu(l2_slice[idx + 1]);
+    } else {
+        return 0;
+    }
+}
+
+static inline void set_l2_entry(BDRVQcow2State *s, uint64_t *l2_slice,
+                                int idx, uint64_t entry)
+{
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx] = cpu_to_be64(entry);
+}
+
+static inline void set_l2_bitmap(BDRVQcow2State *s, uint64_t *l2_slice,
+                                 int idx, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    idx *= l2_entry_size(s) / sizeof(uint64_t);
+    l2_slice[idx + 1] = cpu_to_be64(bitmap);
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcow2State *s)
 {
@@ -546,6 +692,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
                                          int compressed_size);
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
+void qcow2_release_reserved_clusters(BlockDriverState *bs);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors, enum qcow2_discard_type type, bool full_discard);
 int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
@@ -554,6 +701,13 @@ int qcow2_expand_zero_clusters(BlockDriverState *bs,
                                BlockDriverAmendStatusCB *status_cb,
                                void *cb_opaque);
 
+/* qcow2-threads.c functions */
+ssize_t coroutine_fn qcow2_co_compress(BlockDriverState *bs,
+                                       void *dest, size_t dest_size,
+                                       const void *src, size_t src_size);
+int qcow2_decompress(BlockDriverState *bs, void *dest, size_t dest_size,
+                     const void *src, size_t src_size);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
@@ -571,7 +725,8 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               int table_size);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
 void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
@@ -590,5 +745,6 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, Qcow2CacheStats *stats);
 
 #endif
@@ -145,6 +145,7 @@ typedef struct BDRVRawState {
     bool discard_zeroes:1;
     bool has_fallocate;
     bool needs_alignment;
+    bool use_linux_io_uring;
 } BDRVRawState;
 
 typedef struct BDRVRawReopenState {
@@ -459,6 +460,23 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif /* !defined(CONFIG_LINUX_AIO) */
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        if (!aio_setup_linux_io_uring(bdrv_get_aio_context(bs), errp)) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->use_linux_io_uring = true;
+    }
+#else
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        error_setg(errp, "aio=io_uring was specified, but is not supported "
+                         "in this build.");
+        ret = -EINVAL;
+        goto fail;
+    }
+#endif /* !defined(CONFIG_LINUX_IO_URING) */
+
     s->has_discard = true;
     s->has_write_zeroes = true;
     bs->supported_zero_flags = BDRV_REQ_MAY_UNMAP;
@@ -617,6 +635,13 @@ static void raw_reopen_commit(BDRVReopenState *state)
 
     s->open_flags = raw_s->open_flags;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio =
+            aio_get_linux_io_uring(bdrv_get_aio_context(state->bs));
+        luring_unregister_fd(aio, s->fd);
+    }
+#endif
     qemu_close(s->fd);
     s->fd = raw_s->fd;
 
@@ -1209,7 +1234,7 @@ static int paio_submit_co(BlockDriverState *bs, int fd,
     }
 
     trace_paio_submit_co(offset, count, type);
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(bdrv_get_request_aio_context(bs));
     return thread_pool_submit_co(pool, aio_worker, acb);
 }
 
@@ -1234,7 +1259,7 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
     }
 
     trace_paio_submit(acb, opaque, offset, count, type);
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(bdrv_get_request_aio_context(bs));
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 
@@ -1257,13 +1282,24 @@ static int coroutine_fn raw_co_prw(BlockDriverState *bs, uint64_t offset,
             type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_AIO
         } else if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-            LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+            LinuxAioState *aio =
+                aio_get_linux_aio(bdrv_get_request_aio_context(bs));
             assert(qiov->size == bytes);
             return laio_co_submit(bs, aio, s->fd, offset, qiov, type);
 #endif
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* Unlike Linux AIO, io_uring is asynchronous for buffered I/O too */
+    if (s->use_linux_io_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        LuringState *aio =
+            aio_get_linux_io_uring(bdrv_get_request_aio_context(bs));
+        assert(qiov->size == bytes);
+        return luring_co_submit(bs, aio, s->fd, offset, qiov, type);
+    }
+#endif
+
     return paio_submit_co(bs, s->fd, offset, qiov, bytes, type);
 }
 
@@ -1284,22 +1320,98 @@ static int coroutine_fn raw_co_pwritev(BlockDriverState *bs, uint64_t offset,
 
 static void raw_aio_plug(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+#endif
+
 #ifdef CONFIG_LINUX_AIO
     if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio =
+            aio_get_linux_aio(bdrv_get_request_aio_context(bs));
         laio_io_plug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio =
+            aio_get_linux_io_uring(bdrv_get_request_aio_context(bs));
+        luring_io_plug(bs, aio);
+    }
+#endif
 }
 
 static void raw_aio_unplug(BlockDriverState *bs)
 {
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+#endif
+
 #ifdef CONFIG_LINUX_AIO
     if (bs->open_flags & BDRV_O_NATIVE_AIO) {
-        LinuxAioState *aio = aio_get_linux_aio(bdrv_get_aio_context(bs));
+        LinuxAioState *aio =
+            aio_get_linux_aio(bdrv_get_request_aio_context(bs));
         laio_io_unplug(bs, aio);
     }
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_linux_io_uring) {
+        LuringState *aio =
+            aio_get_linux_io_uring(bdrv_get_request_aio_context(bs));
+        luring_io_unplug(bs, aio);
+    }
+#endif
+}
+
+static void raw_detach_aio_context(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        LuringState *aio = aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+        luring_unregister_fd(aio, s->fd);
+    }
+#endif
+}
+
+static void raw_attach_aio_context(BlockDriverState *bs,
+                                   AioContext *new_context)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring(new_context, &local_err)) {
+            error_reportf_err(local_err, "Unable to use io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        }
+    }
+#endif
+}
+
+static void raw_add_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring) {
+        Error *local_err = NULL;
+        if (!aio_setup_linux_io_uring(ctx, &local_err)) {
+            error_reportf_err(local_err, "Unable to use io_uring, "
+                                         "falling back to thread pool: ");
+            s->use_linux_io_uring = false;
+        }
+    }
+#endif
+}
+
+static void raw_del_queue_context(BlockDriverState *bs, AioContext *ctx)
+{
+#ifdef CONFIG_LINUX_IO_URING
+    BDRVRawState *s = bs->opaque;
+    if (s->use_linux_io_uring && s->fd >= 0) {
+        luring_unregister_fd(aio_get_linux_io_uring(ctx), s->fd);
+    }
+#endif
 }
 
 static BlockAIOCB *raw_aio_flush(BlockDriverState *bs,
@@ -1318,6 +1430,13 @@ static void raw_close(BlockDriverState *bs)
     BDRVRawState *s = bs->opaque;
 
     if (s->fd >= 0) {
+#ifdef CONFIG_LINUX_IO_URING
+        if (s->use_linux_io_uring) {
+            LuringState *aio =
+                aio_get_linux_io_uring(bdrv_get_aio_context(bs));
+            luring_unregister_fd(aio, s->fd);
+        }
+#endif
         qemu_close(s->fd);
         s->fd = -1;
     }
@@ -1868,6 +1987,11 @@ BlockDriver bdrv_file = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_supports_multiqueue = true,
+    .bdrv_add_queue_context = raw_add_queue_context,
+    .bdrv_del_queue_context = raw_del_queue_context,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -2188,7 +2312,7 @@ static BlockAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
-    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    pool = aio_get_thread_pool(bdrv_get_request_aio_context(bs));
     return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
 }
 #endif /* linux */
@@ -2311,6 +2435,11 @@ static BlockDriver bdrv_host_device = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_supports_multiqueue = true,
+    .bdrv_add_queue_context = raw_add_queue_context,
+    .bdrv_del_queue_context = raw_del_queue_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -2432,6 +2561,11 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_supports_multiqueue = true,
+    .bdrv_add_queue_context = raw_add_queue_context,
+    .bdrv_del_queue_context = raw_del_queue_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -2562,6 +2696,11 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_refresh_limits = raw_refresh_limits,
     .bdrv_io_plug = raw_aio_plug,
     .bdrv_io_unplug = raw_aio_unplug,
+    .bdrv_detach_aio_context = raw_detach_aio_context,
+    .bdrv_attach_aio_context = raw_attach_aio_context,
+    .bdrv_supports_multiqueue = true,
+    .bdrv_add_queue_context = raw_add_queue_context,
+    .bdrv_del_queue_context = raw_del_queue_context,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength      = raw_getlength,
@@ -117,6 +117,12 @@ void qmp_block_set_write_threshold(const char *node_name,
         return;
     }
 
+    if (bs->queue_contexts && threshold_bytes) {
+        error_setg(errp, "Write thresholds are not supported in multiqueue "
+                   "mode");
+        return;
+    }
+
     aio_context = bdrv_get_aio_context(bs);
     aio_context_acquire(aio_context);
 
@@ -27,6 +27,7 @@
 #include "qemu/timer.h"
 #include "exec/address-spaces.h"
 #include "qemu/rcu.h"
+#include "qemu/main-loop.h"
 #include "exec/tb-hash.h"
 #include "exec/log.h"
 #if defined(TARGET_I386) && !defined(CONFIG_USER_ONLY)
@@ -178,10 +179,12 @@ static inline tcg_target_ulong cpu_tb_exec(CPUState *cpu, TranslationBlock *itb)
     tb_exit = ret & TB_EXIT_MASK;
     trace_exec_tb_exit(last_tb, tb_exit);
 
-    if (tb_exit > TB_EXIT_IDX1) {
+    if (tb_exit > TB_EXIT_IDX1 && !(last_tb->lazy_flags & TB_LAZY_ENTRY)) {
         /* We didn't start executing this TB (eg because the instruction
          * counter hit zero); we must restore the guest PC to the address
-         * of the start of the TB.
+         * of the start of the TB.  A TB_LAZY_ENTRY block only checks for
+         * exit requests after its first instruction and has already
+         * stored the guest PC.
          */
         CPUClass *cc = CPU_GET_CLASS(cpu);
         qemu_log_mask_and_addr(CPU_LOG_EXEC, last_tb->pc,
@@ -219,6 +222,7 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     old_tb_flushed = cpu->tb_flushed;
     cpu->tb_flushed = false;
     tb = tb_gen_code(cpu, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
@@ -226,11 +230,61 @@ static void cpu_exec_nocache(CPUState *cpu, int max_cycles,
                          | (ignore_icount ? CF_IGNORE_ICOUNT : 0));
     tb->orig_tb = cpu->tb_flushed ? NULL : orig_tb;
     cpu->tb_flushed |= old_tb_flushed;
+    tb_unlock();
+
     /* execute the generated code */
     trace_exec_tb_nocache(tb, tb->pc);
     cpu_tb_exec(cpu, tb);
+
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
+}
+
+/* Execute the current guest instruction alone, in a TB that is thrown
+ * away afterwards.  Called for EXCP_ATOMIC with the other vCPUs stopped
+ * and parallel_cpus clear.  An exception raised by the instruction is
+ * left in cpu->exception_index for the next cpu_exec().
+ */
+void cpu_exec_step(CPUState *cpu)
+{
+    CPUClass *cc = CPU_GET_CLASS(cpu);
+    CPUArchState *env = (CPUArchState *)cpu->env_ptr;
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    uint32_t flags;
+
+    current_cpu = cpu;
+    rcu_read_lock();
+    cc->cpu_exec_enter(cpu);
+
+    if (sigsetjmp(cpu->jmp_env, 0) == 0) {
+        cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+        tb_lock();
+        tb = tb_gen_code(cpu, pc, cs_base, flags, 1 | CF_NOCACHE);
+        tb->orig_tb = NULL;
+        tb_unlock();
+
+        trace_exec_tb_nocache(tb, pc);
+        cpu_tb_exec(cpu, tb);
+
+        tb_lock();
+        tb_phys_invalidate(tb, -1);
+        tb_free(tb);
+        tb_unlock();
+    } else {
+        /* The instruction faulted; cpu_restore_state has already
+         * invalidated the one-shot TB.
+         */
+        cpu = current_cpu;
+        cc = CPU_GET_CLASS(cpu);
+        cpu->can_do_io = 1;
+        tb_lock_reset();
+    }
+
+    cc->cpu_exec_exit(cpu);
+    rcu_read_unlock();
 }
 #endif
 
@@ -250,7 +304,8 @@ static bool tb_cmp(const void *p, const void *d)
     if (tb->pc == desc->pc &&
         tb->page_addr[0] == desc->phys_page1 &&
         tb->cs_base == desc->cs_base &&
-        tb->flags == desc->flags) {
+        tb->flags == desc->flags &&
+        !atomic_read(&tb->invalid)) {
         /* check next page if needed */
         if (tb->page_addr[1] == -1) {
             return true;
@@ -287,6 +342,15 @@ static TranslationBlock *tb_find_physical(CPUState *cpu,
     return qht_lookup(&tcg_ctx.tb_ctx.htable, tb_cmp, &desc, h);
 }
 
+static inline void tb_jmp_cache_set(CPUState *cpu, target_ulong pc,
+                                    TranslationBlock *tb)
+{
+    TBJmpCacheEntry *e = &cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+
+    e->gen = cpu->tb_jmp_cache_gen;
+    atomic_set(&e->tb, tb);
+}
+
 static TranslationBlock *tb_find_slow(CPUState *cpu,
                                       target_ulong pc,
                                       target_ulong cs_base,
@@ -295,38 +359,79 @@ static TranslationBlock *tb_find_slow(CPUState *cpu,
     TranslationBlock *tb;
 
     tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        goto found;
+    if (!tb) {
+        /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
+         * taken outside tb_lock.  The lookup above was done without
+         * any lock, so check again now that we hold them: another
+         * vCPU may have translated the block in the meantime.
+         */
+        mmap_lock();
+        tb_lock();
+        tb = tb_find_physical(cpu, pc, cs_base, flags);
+        if (!tb) {
+            /* if no translated code available, then translate it now */
+            tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
+        }
+        tb_unlock();
+        mmap_unlock();
+    } else {
+        tb_region_touch(tb);
     }
 
-#ifdef CONFIG_USER_ONLY
-    /* mmap_lock is needed by tb_gen_code, and mmap_lock must be
-     * taken outside tb_lock.  Since we're momentarily dropping
-     * tb_lock, there's a chance that our desired tb has been
-     * translated.
-     */
-    tb_unlock();
+    /* we add the TB in the virtual pc hash table */
+    tb_jmp_cache_set(cpu, pc, tb);
+    return tb;
+}
+
+#ifdef TARGET_SUPPORTS_SUPERBLOCKS
+/* Number of times a TB is entered from the execution loop before it is
+   translated again as a superblock.  */
+#define TB_HOT_THRESHOLD 64
+
+/* Count the executions of TB and, once it is hot, replace it with a
+ * superblock that also covers the blocks it jumps to.  Until then no
+ * other TB is chained to it, so that all of its executions come through
+ * here.
+ */
+static TranslationBlock *tb_profile(CPUState *cpu, TranslationBlock *tb,
+                                    TranslationBlock **last_tb)
+{
+    target_ulong pc, cs_base;
+    uint32_t flags, count;
+
+    if (tb->cflags & ~CF_USE_ICOUNT) {
+        return tb;
+    }
+    if (atomic_read(&tb->exec_count) >= TB_HOT_THRESHOLD) {
+        /* Being replaced by another vCPU.  */
+        return tb;
+    }
+    count = atomic_fetch_inc(&tb->exec_count) + 1;
+    if (count != TB_HOT_THRESHOLD) {
+        if (count < TB_HOT_THRESHOLD) {
+            *last_tb = NULL;
+        }
+        return tb;
+    }
+
+    pc = tb->pc;
+    cs_base = tb->cs_base;
+    flags = tb->flags;
     mmap_lock();
     tb_lock();
-    tb = tb_find_physical(cpu, pc, cs_base, flags);
-    if (tb) {
-        mmap_unlock();
-        goto found;
+    if (tb->invalid) {
+        /* Not worth replacing any more; run it this once.  */
+        *last_tb = NULL;
+    } else {
+        tb_phys_invalidate(tb, -1);
+        tb = tb_gen_code(cpu, pc, cs_base, flags, CF_SUPERBLOCK);
+        tb_jmp_cache_set(cpu, pc, tb);
     }
-#endif
-
-    /* if no translated code available, then translate it now */
-    tb = tb_gen_code(cpu, pc, cs_base, flags, 0);
-
-#ifdef CONFIG_USER_ONLY
+    tb_unlock();
     mmap_unlock();
-#endif
-
-found:
-    /* we add the TB in the virtual pc hash table */
-    cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
     return tb;
 }
+#endif
 
 static inline TranslationBlock *tb_find_fast(CPUState *cpu,
                                              TranslationBlock **last_tb,
@@ -334,6 +439,7 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
 {
     CPUArchState *env = (CPUArchState *)cpu->env_ptr;
     TranslationBlock *tb;
+    TBJmpCacheEntry *e;
     target_ulong cs_base, pc;
     uint32_t flags;
 
@@ -341,12 +447,16 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
        always be the same before a given translated block
        is executed. */
     cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
-    tb_lock();
-    tb = cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
-    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+    e = &cpu->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    tb = atomic_rcu_read(&e->tb);
+    if (unlikely(!tb || e->gen != cpu->tb_jmp_cache_gen ||
+                 tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
         tb = tb_find_slow(cpu, pc, cs_base, flags);
     }
+#ifdef TARGET_SUPPORTS_SUPERBLOCKS
+    tb = tb_profile(cpu, tb, last_tb);
+#endif
     if (cpu->tb_flushed) {
         /* Ensure that no TB jump will be modified as the
          * translation buffer has been flushed.
@@ -363,14 +473,39 @@ static inline TranslationBlock *tb_find_fast(CPUState *cpu,
         *last_tb = NULL;
     }
 #endif
+    /* A lazy exit does not save the flags on its chained path; it may
+       only be linked to a TB that recomputes them first.  */
+    if (*last_tb && ((*last_tb)->lazy_flags & (TB_LAZY_JMP0 << tb_exit)) &&
+        !(tb->lazy_flags & TB_LAZY_ENTRY)) {
+        *last_tb = NULL;
+    }
     /* See if we can patch the calling TB. */
     if (*last_tb && !qemu_loglevel_mask(CPU_LOG_TB_NOCHAIN)) {
-        tb_add_jump(*last_tb, tb_exit, tb);
+        tb_lock();
+        /* Either TB may have been invalidated by another vCPU since
+           we looked it up; never link to or from a dead TB.  */
+        if (!atomic_read(&tb->invalid) && !atomic_read(&(*last_tb)->invalid)) {
+            tb_add_jump(*last_tb, tb_exit, tb);
+        }
+        tb_unlock();
     }
-    tb_unlock();
     return tb;
 }
 
+/* Multi-threaded TCG runs translated code without the BQL.  Take it
+ * around code that touches device or global state, unless the caller
+ * (single-threaded TCG, or a nested path) already holds it.  Returns
+ * true if the lock was taken and must be released by the caller.
+ */
+static inline bool cpu_exec_lock_iothread(void)
+{
+    if (qemu_mutex_iothread_locked()) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
 static inline bool cpu_handle_halt(CPUState *cpu)
 {
     if (cpu->halted) {
@@ -378,8 +513,13 @@ static inline bool cpu_handle_halt(CPUState *cpu)
         if ((cpu->interrupt_request & CPU_INTERRUPT_POLL)
             && replay_interrupt()) {
             X86CPU *x86_cpu = X86_CPU(cpu);
+            bool release_lock = cpu_exec_lock_iothread();
+
             apic_poll_irq(x86_cpu->apic_state);
             cpu_reset_interrupt(cpu, CPU_INTERRUPT_POLL);
+            if (release_lock) {
+                qemu_mutex_unlock_iothread();
+            }
         }
 #endif
         if (!cpu_has_work(cpu)) {
@@ -433,8 +573,13 @@ static inline bool cpu_handle_exception(CPUState *cpu, int *ret)
 #else
             if (replay_exception()) {
                 CPUClass *cc = CPU_GET_CLASS(cpu);
+                bool release_lock = cpu_exec_lock_iothread();
+
                 cc->do_interrupt(cpu);
                 cpu->exception_index = -1;
+                if (release_lock) {
+                    qemu_mutex_unlock_iothread();
+                }
             } else if (!replay_has_interrupt()) {
                 /* give a chance to iothread in replay mode */
                 *ret = EXCP_INTERRUPT;
@@ -460,9 +605,13 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
                                         TranslationBlock **last_tb)
 {
     CPUClass *cc = CPU_GET_CLASS(cpu);
-    int interrupt_request = cpu->interrupt_request;
 
-    if (unlikely(interrupt_request)) {
+    if (unlikely(atomic_read(&cpu->interrupt_request))) {
+        /* Should a path below leave via cpu_loop_exit, the lock is
+           dropped by cpu_exec when it catches the longjmp.  */
+        bool release_lock = cpu_exec_lock_iothread();
+        int interrupt_request = cpu->interrupt_request;
+
         if (unlikely(cpu->singlestep_enabled & SSTEP_NOIRQ)) {
             /* Mask out external interrupts for this step. */
             interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -517,6 +666,9 @@ static inline void cpu_handle_interrupt(CPUState *cpu,
                the program flow was changed */
             *last_tb = NULL;
         }
+        if (release_lock) {
+            qemu_mutex_unlock_iothread();
+        }
     }
     if (unlikely(cpu->exit_request || replay_has_interrupt())) {
         cpu->exit_request = 0;
@@ -651,6 +803,11 @@ int cpu_exec(CPUState *cpu)
 #endif /* buggy compiler */
             cpu->can_do_io = 1;
             tb_lock_reset();
+            if (qemu_tcg_mttcg_enabled() && qemu_mutex_iothread_locked()) {
+                /* taken by an MMIO access or interrupt delivery that
+                   ended in cpu_loop_exit */
+                qemu_mutex_unlock_iothread();
+            }
         }
     } /* for(;;) */
 
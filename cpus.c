@@ -36,6 +36,7 @@
 #include "sysemu/kvm.h"
 #include "qmp-commands.h"
 #include "exec/exec-all.h"
+#include "tcg.h"
 
 #include "qemu/thread.h"
 #include "sysemu/cpus.h"
@@ -46,6 +47,7 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "tb-cache.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -687,6 +689,61 @@ void configure_icount(QemuOpts *opts, Error **errp)
                    NANOSECONDS_PER_SECOND / 10);
 }
 
+/* Multi-threaded TCG is only used by default for guests that have been
+ * audited for concurrent execution (TARGET_SUPPORTS_MTTCG).  Everybody
+ * else keeps the single round-robin thread unless it is forced on.
+ */
+static bool default_mttcg_enabled(void)
+{
+    if (use_icount || TCG_OVERSIZED_GUEST) {
+        return false;
+    }
+#ifdef TARGET_SUPPORTS_MTTCG
+    return true;
+#else
+    return false;
+#endif
+}
+
+void qemu_tcg_configure(QemuOpts *opts, Error **errp)
+{
+    const char *t = qemu_opt_get(opts, "thread");
+    const char *cache = qemu_opt_get(opts, "tb-cache");
+
+    if (cache) {
+        Error *local_err = NULL;
+
+        tb_cache_init(cache, &local_err);
+        if (local_err) {
+            error_propagate(errp, local_err);
+            return;
+        }
+    }
+
+    if (!t) {
+        mttcg_enabled = default_mttcg_enabled();
+        return;
+    }
+
+    if (strcmp(t, "multi") == 0) {
+        if (TCG_OVERSIZED_GUEST) {
+            error_setg(errp, "No MTTCG when guest word size > hosts");
+        } else if (use_icount) {
+            error_setg(errp, "No MTTCG when icount is enabled");
+        } else {
+#ifndef TARGET_SUPPORTS_MTTCG
+            error_report("warning: Guest not yet converted to MTTCG - "
+                         "you may get unexpected results");
+#endif
+            mttcg_enabled = true;
+        }
+    } else if (strcmp(t, "single") == 0) {
+        mttcg_enabled = false;
+    } else {
+        error_setg(errp, "Invalid 'thread' setting %s", t);
+    }
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -899,18 +956,41 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+/* exclusive work items (multi-threaded TCG), protected by the BQL */
+static QemuCond qemu_exclusive_cond;
+static QemuCond qemu_exclusive_resume;
+static int pending_cpus;
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
     qemu_cond_init(&qemu_cpu_cond);
     qemu_cond_init(&qemu_pause_cond);
     qemu_cond_init(&qemu_work_cond);
+    qemu_cond_init(&qemu_exclusive_cond);
+    qemu_cond_init(&qemu_exclusive_resume);
     qemu_cond_init(&qemu_io_proceeded_cond);
     qemu_mutex_init(&qemu_global_mutex);
 
     qemu_thread_get_self(&io_thread);
 }
 
+static void queue_work_on_cpu(CPUState *cpu, struct qemu_work_item *wi)
+{
+    qemu_mutex_lock(&cpu->work_mutex);
+    if (cpu->queued_work_first == NULL) {
+        cpu->queued_work_first = wi;
+    } else {
+        cpu->queued_work_last->next = wi;
+    }
+    cpu->queued_work_last = wi;
+    wi->next = NULL;
+    wi->done = false;
+    qemu_mutex_unlock(&cpu->work_mutex);
+
+    qemu_cpu_kick(cpu);
+}
+
 void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
 {
     struct qemu_work_item wi;
@@ -923,19 +1003,9 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi.func = func;
     wi.data = data;
     wi.free = false;
+    wi.exclusive = false;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = &wi;
-    } else {
-        cpu->queued_work_last->next = &wi;
-    }
-    cpu->queued_work_last = &wi;
-    wi.next = NULL;
-    wi.done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
-
-    qemu_cpu_kick(cpu);
+    queue_work_on_cpu(cpu, &wi);
     while (!atomic_mb_read(&wi.done)) {
         CPUState *self_cpu = current_cpu;
 
@@ -958,18 +1028,83 @@ void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     wi->data = data;
     wi->free = true;
 
-    qemu_mutex_lock(&cpu->work_mutex);
-    if (cpu->queued_work_first == NULL) {
-        cpu->queued_work_first = wi;
-    } else {
-        cpu->queued_work_last->next = wi;
+    queue_work_on_cpu(cpu, wi);
+}
+
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data)
+{
+    struct qemu_work_item *wi;
+
+    /* Never run inline: the caller may well be executing translated code. */
+    wi = g_malloc0(sizeof(struct qemu_work_item));
+    wi->func = func;
+    wi->data = data;
+    wi->free = true;
+    wi->exclusive = true;
+
+    queue_work_on_cpu(cpu, wi);
+}
+
+/* To run exclusive work items we force all vCPUs out of translated code.
+ * This is the softmmu counterpart of the user-mode exclusive section in
+ * linux-user/main.c; here all the bookkeeping is protected by the BQL,
+ * which vCPU threads hold whenever they are outside cpu_exec.
+ */
+
+/* Wait for pending exclusive operations to complete.  */
+static inline void exclusive_idle(void)
+{
+    while (pending_cpus) {
+        qemu_cond_wait(&qemu_exclusive_resume, &qemu_global_mutex);
     }
-    cpu->queued_work_last = wi;
-    wi->next = NULL;
-    wi->done = false;
-    qemu_mutex_unlock(&cpu->work_mutex);
+}
 
-    qemu_cpu_kick(cpu);
+/* Start an exclusive operation.
+   Must only be called from outside cpu_exec.  */
+static void start_exclusive(void)
+{
+    CPUState *other_cpu;
+
+    exclusive_idle();
+
+    pending_cpus = 1;
+    /* Make all other cpus stop executing.  */
+    CPU_FOREACH(other_cpu) {
+        if (other_cpu->running) {
+            pending_cpus++;
+            cpu_exit(other_cpu);
+        }
+    }
+    while (pending_cpus > 1) {
+        qemu_cond_wait(&qemu_exclusive_cond, &qemu_global_mutex);
+    }
+}
+
+/* Finish an exclusive operation.  */
+static void end_exclusive(void)
+{
+    pending_cpus = 0;
+    qemu_cond_broadcast(&qemu_exclusive_resume);
+}
+
+/* Wait for exclusive ops to finish, and begin cpu execution.  */
+static void cpu_exec_start(CPUState *cpu)
+{
+    exclusive_idle();
+    cpu->running = true;
+}
+
+/* Mark cpu as not executing, and release pending exclusive ops.  */
+static void cpu_exec_end(CPUState *cpu)
+{
+    cpu->running = false;
+    if (pending_cpus > 1) {
+        pending_cpus--;
+        if (pending_cpus == 1) {
+            qemu_cond_signal(&qemu_exclusive_cond);
+        }
+    }
 }
 
 static void qemu_kvm_destroy_vcpu(CPUState *cpu)
@@ -1000,7 +1135,13 @@ static void flush_queued_work(CPUState *cpu)
             cpu->queued_work_last = NULL;
         }
         qemu_mutex_unlock(&cpu->work_mutex);
-        wi->func(wi->data);
+        if (wi->exclusive) {
+            start_exclusive();
+            wi->func(wi->data);
+            end_exclusive();
+        } else {
+            wi->func(wi->data);
+        }
         qemu_mutex_lock(&cpu->work_mutex);
         if (wi->free) {
             g_free(wi);
@@ -1038,6 +1179,15 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
     }
 }
 
+static void qemu_mttcg_wait_io_event(CPUState *cpu)
+{
+    while (cpu_thread_is_idle(cpu)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
@@ -1135,9 +1285,15 @@ static void *qemu_dummy_cpu_thread_fn(void *arg)
 #endif
 }
 
+static int tcg_cpu_exec(CPUState *cpu);
 static void tcg_exec_all(void);
 
-static void *qemu_tcg_cpu_thread_fn(void *arg)
+/* Single-threaded TCG
+ *
+ * In the single-threaded case one thread round-robins between all
+ * vCPUs in tcg_exec_all, holding the BQL while translated code runs.
+ */
+static void *qemu_tcg_rr_cpu_thread_fn(void *arg)
 {
     CPUState *cpu = arg;
     CPUState *remove_cpu = NULL;
@@ -1195,6 +1351,64 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+/* Multi-threaded TCG
+ *
+ * In the multi-threaded case each vCPU has its own thread and runs
+ * translated code without holding the BQL; the TLS variable current_cpu
+ * identifies the vCPU deep in the call chain.
+ */
+/* Exclusive work item: run the instruction that exited with EXCP_ATOMIC
+ * while no other vCPU is in translated code.
+ */
+static void tcg_exec_step_atomic(void *data)
+{
+    CPUState *cpu = data;
+
+    parallel_cpus = false;
+    cpu_exec_step(cpu);
+    parallel_cpus = true;
+}
+
+static void *qemu_tcg_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    int r;
+
+    rcu_register_thread();
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+
+    cpu->thread_id = qemu_get_thread_id();
+    cpu->created = true;
+    cpu->can_do_io = 1;
+    current_cpu = cpu;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    /* process any pending work */
+    atomic_mb_set(&cpu->exit_request, 1);
+
+    do {
+        if (cpu_can_run(cpu)) {
+            r = tcg_cpu_exec(cpu);
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(cpu);
+            } else if (r == EXCP_ATOMIC) {
+                /* Runs from qemu_mttcg_wait_io_event below */
+                async_safe_run_on_cpu(cpu, tcg_exec_step_atomic, cpu);
+            }
+        }
+        atomic_mb_set(&cpu->exit_request, 0);
+        qemu_mttcg_wait_io_event(cpu);
+    } while (!cpu->unplug || cpu_can_run(cpu));
+
+    qemu_tcg_destroy_vcpu(cpu);
+    cpu->created = false;
+    qemu_cond_signal(&qemu_cpu_cond);
+    qemu_mutex_unlock_iothread();
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -1231,7 +1445,11 @@ void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
     if (tcg_enabled()) {
-        qemu_cpu_kick_no_halt();
+        if (qemu_tcg_mttcg_enabled()) {
+            cpu_exit(cpu);
+        } else {
+            qemu_cpu_kick_no_halt();
+        }
     } else {
         qemu_cpu_kick_thread(cpu);
     }
@@ -1264,9 +1482,10 @@ void qemu_mutex_lock_iothread(void)
 {
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
-     * TCG code execution.
+     * TCG code execution.  Multi-threaded TCG never runs translated code
+     * with the BQL held.
      */
-    if (!tcg_enabled() || qemu_in_vcpu_thread() ||
+    if (!tcg_enabled() || qemu_tcg_mttcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
         qemu_mutex_lock(&qemu_global_mutex);
         atomic_dec(&iothread_requesting_mutex);
@@ -1312,7 +1531,7 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (!kvm_enabled() && !qemu_tcg_mttcg_enabled()) {
             CPU_FOREACH(cpu) {
                 cpu->stop = false;
                 cpu->stopped = true;
@@ -1370,15 +1589,18 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
     static QemuCond *tcg_halt_cond;
     static QemuThread *tcg_cpu_thread;
 
-    /* share a single thread for all cpus with TCG */
-    if (!tcg_cpu_thread) {
+    /* with MTTCG every cpu gets its own thread, otherwise
+       share a single thread for all cpus with TCG */
+    if (qemu_tcg_mttcg_enabled() || !tcg_cpu_thread) {
+        parallel_cpus = qemu_tcg_mttcg_enabled();
         cpu->thread = g_malloc0(sizeof(QemuThread));
         cpu->halt_cond = g_malloc0(sizeof(QemuCond));
         qemu_cond_init(cpu->halt_cond);
-        tcg_halt_cond = cpu->halt_cond;
         snprintf(thread_name, VCPU_THREAD_NAME_SIZE, "CPU %d/TCG",
                  cpu->cpu_index);
-        qemu_thread_create(cpu->thread, thread_name, qemu_tcg_cpu_thread_fn,
+        qemu_thread_create(cpu->thread, thread_name,
+                           qemu_tcg_mttcg_enabled() ?
+                           qemu_tcg_cpu_thread_fn : qemu_tcg_rr_cpu_thread_fn,
                            cpu, QEMU_THREAD_JOINABLE);
 #ifdef _WIN32
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
@@ -1386,7 +1608,10 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
         while (!cpu->created) {
             qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
         }
-        tcg_cpu_thread = cpu->thread;
+        if (!qemu_tcg_mttcg_enabled()) {
+            tcg_halt_cond = cpu->halt_cond;
+            tcg_cpu_thread = cpu->thread;
+        }
     } else {
         cpu->thread = tcg_cpu_thread;
         cpu->halt_cond = tcg_halt_cond;
@@ -1538,7 +1763,18 @@ static int tcg_cpu_exec(CPUState *cpu)
         cpu->icount_decr.u16.low = decr;
         cpu->icount_extra = count;
     }
-    ret = cpu_exec(cpu);
+    if (qemu_tcg_mttcg_enabled()) {
+        /* Translated code runs without the BQL; paths that touch device
+         * or global state (MMIO, interrupt delivery) take it themselves.
+         */
+        cpu_exec_start(cpu);
+        qemu_mutex_unlock_iothread();
+        ret = cpu_exec(cpu);
+        qemu_mutex_lock_iothread();
+        cpu_exec_end(cpu);
+    } else {
+        ret = cpu_exec(cpu);
+    }
 #ifdef CONFIG_PROFILER
     tcg_time += profile_getclock() - ti;
 #endif
@@ -23,6 +23,7 @@
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
 #include "exec/cpu_ldst.h"
+#include "exec/helper-proto.h"
 
 #include "exec/cputlb.h"
 
@@ -31,7 +32,10 @@
 #include "exec/exec-all.h"
 #include "tcg/tcg.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "exec/log.h"
+#include "translate-all.h"
 
 /* DEBUG defines, enable DEBUG_TLB_LOG to log to the CPU_LOG_MMU target */
 /* #define DEBUG_TLB */
@@ -60,6 +64,271 @@
 
 /* statistics */
 int tlb_flush_count;
+int tlb_flush_page_count;
+int tlb_flush_async_count;
+int tlb_flush_elided_count;
+
+/* In multi-threaded TCG a vCPU's TLB may only be modified by the thread
+ * that runs it.  Flush requests coming from any other thread are recorded
+ * in the target's CPUTLBFlushPending and handed to the owning vCPU as a
+ * single asynchronous work item, performed before it executes any further
+ * guest code.  Requests arriving while one is already queued are merged
+ * into it: page flushes covered by a pending full flush are dropped, and
+ * once more than TLB_FLUSH_PENDING_PAGES distinct pages are pending they
+ * are coalesced into a flush of the MMU indexes involved.
+ */
+#define ALL_MMUIDX_BITS ((1 << NB_MMU_MODES) - 1)
+
+QEMU_BUILD_BUG_ON(NB_MMU_MODES > 16);
+
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return qemu_tcg_mttcg_enabled() && cpu->created && !qemu_cpu_is_self(cpu);
+}
+
+static uint16_t make_mmu_index_bitmap(va_list args)
+{
+    uint16_t bitmap = 0;
+
+    for (;;) {
+        int mmu_idx = va_arg(args, int);
+
+        if (mmu_idx < 0) {
+            break;
+        }
+        bitmap |= 1 << mmu_idx;
+    }
+
+    return bitmap;
+}
+
+static void tlb_flush_async_work(void *data);
+
+/* Must be called with pending->lock held.  */
+static void tlb_flush_pending_add(CPUTLBFlushPending *pending,
+                                  target_ulong addr, uint16_t idxmap)
+{
+    unsigned i, j;
+
+    if (addr == (target_ulong)-1) {
+        pending->full_idxmap |= idxmap;
+        goto trim;
+    }
+
+    idxmap &= ~pending->full_idxmap;
+    if (!idxmap) {
+        return;
+    }
+
+    for (i = 0; i < pending->nr_pages; i++) {
+        if (pending->pages[i].addr == addr) {
+            pending->pages[i].idxmap |= idxmap;
+            return;
+        }
+    }
+
+    if (pending->nr_pages < TLB_FLUSH_PENDING_PAGES) {
+        pending->pages[pending->nr_pages].addr = addr;
+        pending->pages[pending->nr_pages].idxmap = idxmap;
+        pending->nr_pages++;
+        return;
+    }
+
+    /* Too many pages: flush every MMU index they touch instead.  */
+    pending->full_idxmap |= idxmap;
+    for (i = 0; i < pending->nr_pages; i++) {
+        pending->full_idxmap |= pending->pages[i].idxmap;
+    }
+
+trim:
+    /* Drop the page flushes now covered by full_idxmap.  */
+    for (i = j = 0; i < pending->nr_pages; i++) {
+        uint16_t left = pending->pages[i].idxmap & ~pending->full_idxmap;
+
+        if (left) {
+            pending->pages[j].addr = pending->pages[i].addr;
+            pending->pages[j].idxmap = left;
+            j++;
+        }
+    }
+    pending->nr_pages = j;
+}
+
+static void tlb_flush_queue_work(CPUState *cpu, target_ulong addr,
+                                 uint16_t idxmap)
+{
+    CPUTLBFlushPending *pending = &cpu->tlb_flush_pending;
+    bool schedule;
+
+    qemu_spin_lock(&pending->lock);
+    tlb_flush_pending_add(pending, addr, idxmap);
+    schedule = !pending->queued;
+    pending->queued = true;
+    qemu_spin_unlock(&pending->lock);
+
+    if (schedule) {
+        async_run_on_cpu(cpu, tlb_flush_async_work, cpu);
+    } else {
+        atomic_inc(&tlb_flush_elided_count);
+    }
+}
+
+static inline bool tlb_entry_is_empty(const CPUTLBEntry *te)
+{
+    return te->addr_read == -1 && te->addr_write == -1 && te->addr_code == -1;
+}
+
+/* Point the fast path at the (possibly new) table of MMU index @mmu_idx
+ * and invalidate all of its entries.  Must be called with tlb->lock held.
+ */
+static void tlb_mmu_reset_locked(CPUArchState *env, CPUTLBDesc *desc,
+                                 int mmu_idx)
+{
+    memset(desc->table, -1, desc->n_entries * sizeof(CPUTLBEntry));
+    memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+    desc->n_used_entries = 0;
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+    env->tlb_mask[mmu_idx] = (desc->n_entries - 1) << CPU_TLB_ENTRY_BITS;
+    env->tlb_table[mmu_idx] = desc->table;
+    env->iotlb[mmu_idx] = desc->iotlb;
+#endif
+}
+
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* Length of the window over which TLB usage is sampled for resizing.  */
+#define TLB_RESIZE_WINDOW_NS (100 * 1000 * 1000)
+
+static void tlb_mmu_alloc_locked(CPUTLBDesc *desc, size_t n_entries)
+{
+    g_free(desc->table);
+    g_free(desc->iotlb);
+
+    /* Under memory pressure fall back to smaller tables, down to
+     * the minimum size which is allocated with g_new like any
+     * other non-optional data structure.
+     */
+    for (;;) {
+        desc->n_entries = n_entries;
+        if (n_entries <= (1 << CPU_TLB_DYN_MIN_BITS)) {
+            desc->table = g_new(CPUTLBEntry, n_entries);
+            desc->iotlb = g_new(CPUIOTLBEntry, n_entries);
+            return;
+        }
+        desc->table = g_try_new(CPUTLBEntry, n_entries);
+        desc->iotlb = g_try_new(CPUIOTLBEntry, n_entries);
+        if (desc->table && desc->iotlb) {
+            return;
+        }
+        g_free(desc->table);
+        g_free(desc->iotlb);
+        n_entries >>= 1;
+    }
+}
+
+/* Resize the TLB of an MMU index, just before it is flushed, according
+ * to the highest number of entries in use seen during the current window:
+ *
+ * - if more than 70% of the entries were used, the guest's working set
+ *   does not fit and most fills evict a live translation: double the size;
+ *
+ * - if less than 30% of the entries were used for a whole window, the
+ *   flushes keep discarding the table before it fills up, and a smaller
+ *   table makes each of them cheaper: shrink to the smallest size that
+ *   would have kept usage under 70%.
+ *
+ * Must be called with tlb->lock held.
+ */
+static void tlb_mmu_resize_locked(CPUTLBDesc *desc, int64_t now)
+{
+    size_t old_size = desc->n_entries;
+    size_t new_size = old_size;
+    size_t rate;
+    bool window_expired = now > desc->window_begin_ns + TLB_RESIZE_WINDOW_NS;
+
+    if (desc->n_used_entries > desc->window_max_entries) {
+        desc->window_max_entries = desc->n_used_entries;
+    }
+    rate = desc->window_max_entries * 100 / old_size;
+
+    if (rate > 70) {
+        new_size = MIN(old_size << 1, 1 << CPU_TLB_DYN_MAX_BITS);
+    } else if (rate < 30 && window_expired) {
+        size_t ceil = 1 << CPU_TLB_DYN_MIN_BITS;
+
+        if (desc->window_max_entries > ceil) {
+            ceil = pow2ceil(desc->window_max_entries);
+            if (desc->window_max_entries * 100 / ceil > 70) {
+                ceil <<= 1;
+            }
+        }
+        new_size = ceil;
+    }
+
+    if (new_size == old_size) {
+        if (window_expired) {
+            desc->window_begin_ns = now;
+            desc->window_max_entries = desc->n_used_entries;
+        }
+        return;
+    }
+
+    tlb_debug("resize %zu -> %zu\n", old_size, new_size);
+    tlb_mmu_alloc_locked(desc, new_size);
+    desc->window_begin_ns = now;
+    desc->window_max_entries = 0;
+    desc->n_resize++;
+}
+#endif
+
+/* Must be called with tlb->lock held.  */
+static void tlb_flush_one_mmuidx_locked(CPUArchState *env, CPUTLB *tlb,
+                                        int mmu_idx)
+{
+    CPUTLBDesc *desc = &tlb->d[mmu_idx];
+
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+    tlb_mmu_resize_locked(desc, get_clock_realtime());
+#endif
+    tlb_mmu_reset_locked(env, desc, mmu_idx);
+    desc->n_flush++;
+}
+
+void tlb_init(CPUState *cpu)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLB *tlb = g_new0(CPUTLB, 1);
+    int mmu_idx;
+
+    qemu_spin_init(&tlb->lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        CPUTLBDesc *desc = &tlb->d[mmu_idx];
+
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+        tlb_mmu_alloc_locked(desc, 1 << CPU_TLB_DYN_DEFAULT_BITS);
+        desc->window_begin_ns = get_clock_realtime();
+#else
+        desc->n_entries = CPU_TLB_SIZE;
+        desc->table = env->tlb_table[mmu_idx];
+        desc->iotlb = env->iotlb[mmu_idx];
+#endif
+        tlb_mmu_reset_locked(env, desc, mmu_idx);
+    }
+    cpu->tlb = tlb;
+}
+
+void tlb_destroy(CPUState *cpu)
+{
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+    int mmu_idx;
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        g_free(cpu->tlb->d[mmu_idx].table);
+        g_free(cpu->tlb->d[mmu_idx].iotlb);
+    }
+#endif
+    g_free(cpu->tlb);
+    cpu->tlb = NULL;
+}
 
 /* NOTE:
  * If flush_global is true (the usual case), flush all tlb entries.
@@ -73,53 +342,75 @@ int tlb_flush_count;
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
-void tlb_flush(CPUState *cpu, int flush_global)
+static void tlb_flush_nocheck(CPUState *cpu, int flush_global)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("(%d)\n", flush_global);
 
-    memset(env->tlb_table, -1, sizeof(env->tlb_table));
-    memset(env->tlb_v_table, -1, sizeof(env->tlb_v_table));
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    qemu_spin_lock(&cpu->tlb->lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        tlb_flush_one_mmuidx_locked(env, cpu->tlb, mmu_idx);
+    }
+    qemu_spin_unlock(&cpu->tlb->lock);
+    cpu_tb_jmp_cache_clear(cpu);
 
     env->vtlb_index = 0;
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
-    tlb_flush_count++;
+    atomic_inc(&tlb_flush_count);
 }
 
-static inline void v_tlb_flush_by_mmuidx(CPUState *cpu, va_list argp)
+void tlb_flush(CPUState *cpu, int flush_global)
+{
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_queue_work(cpu, -1, ALL_MMUIDX_BITS);
+    } else {
+        tlb_flush_nocheck(cpu, flush_global);
+    }
+}
+
+static void tlb_flush_by_mmuidx_nocheck(CPUState *cpu, uint16_t idxmap)
 {
     CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("start\n");
 
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
-
-        if (mmu_idx < 0) {
-            break;
+    qemu_spin_lock(&cpu->tlb->lock);
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
         }
 
         tlb_debug("%d\n", mmu_idx);
 
-        memset(env->tlb_table[mmu_idx], -1, sizeof(env->tlb_table[0]));
-        memset(env->tlb_v_table[mmu_idx], -1, sizeof(env->tlb_v_table[0]));
+        tlb_flush_one_mmuidx_locked(env, cpu->tlb, mmu_idx);
     }
+    qemu_spin_unlock(&cpu->tlb->lock);
 
-    memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+    cpu_tb_jmp_cache_clear(cpu);
 }
 
 void tlb_flush_by_mmuidx(CPUState *cpu, ...)
 {
     va_list argp;
+    uint16_t idxmap;
+
     va_start(argp, cpu);
-    v_tlb_flush_by_mmuidx(cpu, argp);
+    idxmap = make_mmu_index_bitmap(argp);
     va_end(argp);
+
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_queue_work(cpu, -1, idxmap);
+    } else {
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
+    }
 }
 
-static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
+/* Return true if the entry was flushed.  */
+static inline bool tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
@@ -128,16 +419,36 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
         addr == (tlb_entry->addr_code &
                  (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
         memset(tlb_entry, -1, sizeof(*tlb_entry));
+        return true;
+    }
+    return false;
+}
+
+static inline void tlb_flush_page_mmuidx(CPUState *cpu, int mmu_idx,
+                                         target_ulong addr)
+{
+    CPUArchState *env = cpu->env_ptr;
+    CPUTLBDesc *desc = &cpu->tlb->d[mmu_idx];
+    int k;
+
+    if (tlb_flush_entry(tlb_entry(env, mmu_idx, addr), addr) &&
+        desc->n_used_entries) {
+        desc->n_used_entries--;
+    }
+
+    /* check whether there are vltb entries that need to be flushed */
+    for (k = 0; k < CPU_VTLB_SIZE; k++) {
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
     }
 }
 
-void tlb_flush_page(CPUState *cpu, target_ulong addr)
+static void tlb_flush_page_nocheck(CPUState *cpu, target_ulong addr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     tlb_debug("page :" TARGET_FMT_lx "\n", addr);
+    atomic_inc(&tlb_flush_page_count);
 
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
@@ -145,36 +456,35 @@ void tlb_flush_page(CPUState *cpu, target_ulong addr)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        tlb_flush(cpu, 1);
+        tlb_flush_nocheck(cpu, 1);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-    }
-
-    /* check whether there are entries that need to be flushed in the vtlb */
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        int k;
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+        tlb_flush_page_mmuidx(cpu, mmu_idx, addr);
     }
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
-void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+void tlb_flush_page(CPUState *cpu, target_ulong addr)
 {
-    CPUArchState *env = cpu->env_ptr;
-    int i, k;
-    va_list argp;
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_queue_work(cpu, addr & TARGET_PAGE_MASK, ALL_MMUIDX_BITS);
+    } else {
+        tlb_flush_page_nocheck(cpu, addr);
+    }
+}
 
-    va_start(argp, addr);
+static void tlb_flush_page_by_mmuidx_nocheck(CPUState *cpu, target_ulong addr,
+                                             uint16_t idxmap)
+{
+    CPUArchState *env = cpu->env_ptr;
+    int mmu_idx;
 
     tlb_debug("addr "TARGET_FMT_lx"\n", addr);
+    atomic_inc(&tlb_flush_page_count);
 
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
@@ -182,35 +492,81 @@ void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
                   TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
                   env->tlb_flush_addr, env->tlb_flush_mask);
 
-        v_tlb_flush_by_mmuidx(cpu, argp);
-        va_end(argp);
+        tlb_flush_by_mmuidx_nocheck(cpu, idxmap);
         return;
     }
 
     addr &= TARGET_PAGE_MASK;
-    i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-
-    for (;;) {
-        int mmu_idx = va_arg(argp, int);
 
-        if (mmu_idx < 0) {
-            break;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        if (!(idxmap & (1 << mmu_idx))) {
+            continue;
         }
 
         tlb_debug("idx %d\n", mmu_idx);
 
-        tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
-
-        /* check whether there are vltb entries that need to be flushed */
-        for (k = 0; k < CPU_VTLB_SIZE; k++) {
-            tlb_flush_entry(&env->tlb_v_table[mmu_idx][k], addr);
-        }
+        tlb_flush_page_mmuidx(cpu, mmu_idx, addr);
     }
-    va_end(argp);
 
     tb_flush_jmp_cache(cpu, addr);
 }
 
+void tlb_flush_page_by_mmuidx(CPUState *cpu, target_ulong addr, ...)
+{
+    va_list argp;
+    uint16_t idxmap;
+
+    va_start(argp, addr);
+    idxmap = make_mmu_index_bitmap(argp);
+    va_end(argp);
+
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush_queue_work(cpu, addr & TARGET_PAGE_MASK, idxmap);
+    } else {
+        tlb_flush_page_by_mmuidx_nocheck(cpu, addr, idxmap);
+    }
+}
+
+static void tlb_flush_async_work(void *data)
+{
+    CPUState *cpu = data;
+    CPUTLBFlushPending *pending = &cpu->tlb_flush_pending;
+    CPUTLBFlushPending work;
+    unsigned i;
+
+    /* Take a snapshot so that new requests can be queued while this one
+     * is being performed.
+     */
+    qemu_spin_lock(&pending->lock);
+    work.full_idxmap = pending->full_idxmap;
+    work.nr_pages = pending->nr_pages;
+    memcpy(work.pages, pending->pages,
+           pending->nr_pages * sizeof(pending->pages[0]));
+    pending->full_idxmap = 0;
+    pending->nr_pages = 0;
+    pending->queued = false;
+    qemu_spin_unlock(&pending->lock);
+
+    atomic_inc(&tlb_flush_async_count);
+
+    if (work.full_idxmap == ALL_MMUIDX_BITS) {
+        tlb_flush_nocheck(cpu, 1);
+    } else if (work.full_idxmap) {
+        tlb_flush_by_mmuidx_nocheck(cpu, work.full_idxmap);
+    }
+
+    for (i = 0; i < work.nr_pages; i++) {
+        target_ulong addr = work.pages[i].addr;
+        uint16_t idxmap = work.pages[i].idxmap;
+
+        if (idxmap == ALL_MMUIDX_BITS) {
+            tlb_flush_page_nocheck(cpu, addr);
+        } else {
+            tlb_flush_page_by_mmuidx_nocheck(cpu, addr, idxmap);
+        }
+    }
+}
+
 /* update the TLBs so that writes to code in the virtual page 'addr'
    can be detected */
 void tlb_protect_code(ram_addr_t ram_addr)
@@ -239,7 +595,14 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+            /* May race with the owning vCPU refilling the entry when
+               TCG is multi-threaded; oversized guests never are.  */
+#if TCG_OVERSIZED_GUEST
             tlb_entry->addr_write |= TLB_NOTDIRTY;
+#else
+            atomic_set(&tlb_entry->addr_write,
+                       tlb_entry->addr_write | TLB_NOTDIRTY);
+#endif
         }
     }
 }
@@ -256,6 +619,10 @@ static inline ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+/* Unlike the other tlb_* functions, this may be called from any thread;
+ * hold the TLB lock so that the owning vCPU cannot resize the tables
+ * under our feet.
+ */
 void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
 {
     CPUArchState *env;
@@ -263,12 +630,13 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
     int mmu_idx;
 
     env = cpu->env_ptr;
+    qemu_spin_lock(&cpu->tlb->lock);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        unsigned int i;
+        CPUTLBDesc *desc = &cpu->tlb->d[mmu_idx];
+        size_t i;
 
-        for (i = 0; i < CPU_TLB_SIZE; i++) {
-            tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
-                                  start1, length);
+        for (i = 0; i < desc->n_entries; i++) {
+            tlb_reset_dirty_range(&desc->table[i], start1, length);
         }
 
         for (i = 0; i < CPU_VTLB_SIZE; i++) {
@@ -276,6 +644,7 @@ void tlb_reset_dirty(CPUState *cpu, ram_addr_t start1, ram_addr_t length)
                                   start1, length);
         }
     }
+    qemu_spin_unlock(&cpu->tlb->lock);
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -290,13 +659,11 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
 void tlb_set_dirty(CPUState *cpu, target_ulong vaddr)
 {
     CPUArchState *env = cpu->env_ptr;
-    int i;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
-    i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
-        tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+        tlb_set_dirty1(tlb_entry(env, mmu_idx, vaddr), vaddr);
     }
 
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
@@ -379,10 +746,13 @@ void tlb_set_page_with_attrs(CPUState *cpu, target_ulong vaddr,
     iotlb = memory_region_section_get_iotlb(cpu, section, vaddr, paddr, xlat,
                                             prot, &address);
 
-    index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index = tlb_index(env, mmu_idx, vaddr);
     te = &env->tlb_table[mmu_idx][index];
 
     /* do not discard the translation in te, evict it into a victim tlb */
+    if (tlb_entry_is_empty(te)) {
+        cpu->tlb->d[mmu_idx].n_used_entries++;
+    }
     env->tlb_v_table[mmu_idx][vidx] = *te;
     env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
 
@@ -475,11 +845,12 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
     CPUState *cpu = ENV_GET_CPU(env1);
     CPUIOTLBEntry *iotlbentry;
 
-    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     mmu_idx = cpu_mmu_index(env1, true);
+    page_index = tlb_index(env1, mmu_idx, addr);
     if (unlikely(env1->tlb_table[mmu_idx][page_index].addr_code !=
                  (addr & TARGET_PAGE_MASK))) {
         cpu_ldub_code(env1, addr);
+        page_index = tlb_index(env1, mmu_idx, addr);
     }
     iotlbentry = &env1->iotlb[mmu_idx][page_index];
     pd = iotlbentry->addr & ~TARGET_PAGE_MASK;
@@ -503,7 +874,9 @@ tb_page_addr_t get_page_addr_code(CPUArchState *env1, target_ulong addr)
 static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
                            size_t elt_ofs, target_ulong page)
 {
+    CPUTLBDesc *desc = &ENV_GET_CPU(env)->tlb->d[mmu_idx];
     size_t vidx;
+
     for (vidx = 0; vidx < CPU_VTLB_SIZE; ++vidx) {
         CPUTLBEntry *vtlb = &env->tlb_v_table[mmu_idx][vidx];
         target_ulong cmp = *(target_ulong *)((uintptr_t)vtlb + elt_ofs);
@@ -516,9 +889,11 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 
             tmptlb = *tlb; *tlb = *vtlb; *vtlb = tmptlb;
             tmpio = *io; *io = *vio; *vio = tmpio;
+            desc->n_victim_hit++;
             return true;
         }
     }
+    desc->n_miss++;
     return false;
 }
 
@@ -527,6 +902,72 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
   victim_tlb_hit(env, mmu_idx, index, offsetof(CPUTLBEntry, TY), \
                  (ADDR) & TARGET_PAGE_MASK)
 
+/* Probe the TLB for an atomic read-modify-write of SIZE bytes at ADDR,
+ * raising any fault the store would raise; RETADDR is the GETRA() of
+ * the helper.  Return the host address of the data if it lives in RAM,
+ * or NULL if the access has to go through the I/O path (MMIO, or not
+ * naturally aligned).  Pages that are not
+ * dirty are handled here the way notdirty_mem_write does it, since
+ * the atomic operation bypasses the notdirty callback.
+ */
+void *tlb_vaddr_to_host_atomic(CPUArchState *env, target_ulong addr,
+                                int size, int mmu_idx, uintptr_t retaddr)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+    size_t index = tlb_index(env, mmu_idx, addr);
+    target_ulong tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    ram_addr_t ram_addr;
+    void *haddr;
+
+    retaddr -= GETPC_ADJ;
+
+    if ((addr & TARGET_PAGE_MASK)
+        != (tlb_addr & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+        if (!VICTIM_TLB_HIT(addr_write, addr)) {
+            tlb_fill(cpu, addr, MMU_DATA_STORE, mmu_idx, retaddr);
+            index = tlb_index(env, mmu_idx, addr);
+        }
+        tlb_addr = env->tlb_table[mmu_idx][index].addr_write;
+    }
+
+    if (unlikely((tlb_addr & TLB_MMIO) || (addr & (size - 1)))) {
+        return NULL;
+    }
+
+    haddr = (void *)((uintptr_t)addr + env->tlb_table[mmu_idx][index].addend);
+    if (unlikely(tlb_addr & TLB_NOTDIRTY)) {
+        ram_addr = qemu_ram_addr_from_host_nofail(haddr);
+        if (!cpu_physical_memory_get_dirty_flag(ram_addr, DIRTY_MEMORY_CODE)) {
+            cpu->mem_io_pc = retaddr;
+            cpu->mem_io_vaddr = addr;
+            tb_lock();
+            tb_invalidate_phys_page_fast(ram_addr, size);
+            tb_unlock();
+        }
+        cpu_physical_memory_set_dirty_range(ram_addr, size,
+                                            DIRTY_CLIENTS_NOCODE);
+        if (!cpu_physical_memory_is_clean(ram_addr)) {
+            tlb_set_dirty(cpu, addr);
+        }
+    }
+    return haddr;
+}
+
+static void *atomic_mmu_lookup(CPUArchState *env, target_ulong addr,
+                               TCGMemOpIdx oi, uintptr_t retaddr)
+{
+    size_t mmu_idx = get_mmuidx(oi);
+    TCGMemOp mop = get_memop(oi);
+    int a_bits = get_alignment_bits(mop);
+
+    if (a_bits > 0 && (addr & ((1 << a_bits) - 1)) != 0) {
+        cpu_unaligned_access(ENV_GET_CPU(env), addr, MMU_DATA_STORE, mmu_idx,
+                             retaddr - GETPC_ADJ);
+    }
+    return tlb_vaddr_to_host_atomic(env, addr, 1 << (mop & MO_SIZE), mmu_idx,
+                                    retaddr);
+}
+
 #define MMUSUFFIX _mmu
 
 #define SHIFT 0
@@ -540,6 +981,18 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 
 #define SHIFT 3
 #include "softmmu_template.h"
+
+#define DATA_SIZE 1
+#include "atomic_template.h"
+
+#define DATA_SIZE 2
+#include "atomic_template.h"
+
+#define DATA_SIZE 4
+#include "atomic_template.h"
+
+#define DATA_SIZE 8
+#include "atomic_template.h"
 #undef MMUSUFFIX
 
 #define MMUSUFFIX _cmmu
@@ -560,3 +1013,29 @@ static bool victim_tlb_hit(CPUArchState *env, size_t mmu_idx, size_t index,
 
 #define SHIFT 3
 #include "softmmu_template.h"
+
+void tlb_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *cpu;
+    int mmu_idx;
+
+    cpu_fprintf(f, "\nTLB statistics (entries, used, misses, victim hits, "
+                "flushes, resizes):\n");
+    CPU_FOREACH(cpu) {
+        if (!cpu->tlb) {
+            continue;
+        }
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            CPUTLBDesc *desc = &cpu->tlb->d[mmu_idx];
+
+            cpu_fprintf(f, "CPU %d mmu_idx %d    %zu %zu %zu %zu %zu %zu\n",
+                        cpu->cpu_index, mmu_idx,
+                        atomic_read(&desc->n_entries),
+                        atomic_read(&desc->n_used_entries),
+                        atomic_read(&desc->n_miss),
+                        atomic_read(&desc->n_victim_hit),
+                        atomic_read(&desc->n_flush),
+                        atomic_read(&desc->n_resize));
+        }
+    }
+}
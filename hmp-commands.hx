@@ -961,6 +961,23 @@ STEXI
 @item migrate_set_cache_size @var{value}
 @findex migrate_set_cache_size
 Set cache size to @var{value} (in bytes) for xbzrle migrations.
+ETEXI
+
+    {
+        .name       = "calc_dirty_rate",
+        .args_type  = "calc-time:i",
+        .params     = "calc-time",
+        .help       = "measure the guest's dirty page rate over calc-time "
+                      "seconds without migrating; see 'info dirty_rate'",
+        .mhandler.cmd = hmp_calc_dirty_rate,
+    },
+
+STEXI
+@item calc_dirty_rate @var{calc-time}
+@findex calc_dirty_rate
+Measure the rate at which the guest dirties its RAM over @var{calc-time}
+seconds, without starting a migration.  Use @code{info dirty_rate} to show
+the result.
 ETEXI
 
     {
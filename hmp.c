@@ -239,6 +239,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
@@ -304,6 +306,12 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, " %s: '%s'",
             MigrationParameter_lookup[MIGRATION_PARAMETER_TLS_HOSTNAME],
             params->tls_hostname ? : "");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_CHANNELS],
+            params->x_multifd_channels);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT],
+            params->x_multifd_page_count);
         monitor_printf(mon, "\n");
     }
 
@@ -316,6 +324,40 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+    DirtyRateBlockInfoList *block;
+    DirtyRateNodeInfoList *node;
+
+    monitor_printf(mon, "status: %s\n",
+                   DirtyRateStatus_lookup[info->status]);
+    if (info->has_calc_time) {
+        monitor_printf(mon, "calc time: %" PRId64 " seconds\n",
+                       info->calc_time);
+    }
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "dirty pages: %" PRIu64 " (%" PRIu64
+                       " bytes each)\n", info->dirty_pages, info->page_size);
+        monitor_printf(mon, "dirty rate: %0.2f MB/s\n", info->dirty_rate);
+    }
+    for (block = info->blocks; block; block = block->next) {
+        monitor_printf(mon, "block %s: size %" PRIu64 " kbytes, dirty pages %"
+                       PRIu64 ", dirty rate %0.2f MB/s\n",
+                       block->value->id, block->value->size >> 10,
+                       block->value->dirty_pages, block->value->dirty_rate);
+    }
+    for (node = info->nodes; node; node = node->next) {
+        monitor_printf(mon, "node %" PRId64 ": size %" PRIu64
+                       " kbytes, dirty pages %" PRIu64
+                       ", dirty rate %0.2f MB/s\n",
+                       node->value->node, node->value->size >> 10,
+                       node->value->dirty_pages, node->value->dirty_rate);
+    }
+
+    qapi_free_DirtyRateInfo(info);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -1211,6 +1253,15 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t calc_time = qdict_get_int(qdict, "calc-time");
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(calc_time, &err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
     int64_t value = qdict_get_int(qdict, "value");
@@ -1260,6 +1311,8 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
     bool has_cpu_throttle_increment = false;
     bool has_tls_creds = false;
     bool has_tls_hostname = false;
+    bool has_x_multifd_channels = false;
+    bool has_x_multifd_page_count = false;
     bool use_int_value = false;
     int i;
 
@@ -1291,6 +1344,14 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
             case MIGRATION_PARAMETER_TLS_HOSTNAME:
                 has_tls_hostname = true;
                 break;
+            case MIGRATION_PARAMETER_X_MULTIFD_CHANNELS:
+                has_x_multifd_channels = true;
+                use_int_value = true;
+                break;
+            case MIGRATION_PARAMETER_X_MULTIFD_PAGE_COUNT:
+                has_x_multifd_page_count = true;
+                use_int_value = true;
+                break;
             }
 
             if (use_int_value) {
@@ -1308,6 +1369,8 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
                                        has_cpu_throttle_increment, valueint,
                                        has_tls_creds, valuestr,
                                        has_tls_hostname, valuestr,
+                                       has_x_multifd_channels, valueint,
+                                       has_x_multifd_page_count, valueint,
                                        &err);
             break;
         }
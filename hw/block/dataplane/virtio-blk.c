@@ -26,43 +26,60 @@
 #include "hw/virtio/virtio-bus.h"
 #include "qom/object_interfaces.h"
 
+typedef struct VirtIOBlockDataPlaneThread {
+    VirtIOBlockDataPlane *s;
+    IOThread *iothread;
+    AioContext *ctx;
+    QEMUBH *bh;                     /* bh for guest notification */
+    unsigned long *batch_notify_vqs;
+} VirtIOBlockDataPlaneThread;
+
 struct VirtIOBlockDataPlane {
     bool starting;
     bool stopping;
 
     VirtIOBlkConf *conf;
     VirtIODevice *vdev;
-    QEMUBH *bh;                     /* bh for guest notification */
-    unsigned long *batch_notify_vqs;
 
-    /* Note that these EventNotifiers are assigned by value.  This is
-     * fine as long as you do not call event_notifier_cleanup on them
-     * (because you don't own the file descriptor or handle; you just
-     * use it).
+    /* Virtqueue i is served by threads[i % nthreads_active].  The first
+     * thread's AioContext is the home AioContext of the BlockBackend; the
+     * others submit requests to it in multiqueue mode.
      */
-    IOThread *iothread;
+    VirtIOBlockDataPlaneThread *threads;
+    unsigned nthreads;
+    unsigned nthreads_active;
     AioContext *ctx;
 };
 
+static VirtIOBlockDataPlaneThread *
+virtio_blk_data_plane_vq_thread(VirtIOBlockDataPlane *s, unsigned index)
+{
+    return &s->threads[index % s->nthreads_active];
+}
+
 /* Raise an interrupt to signal guest, if necessary */
 void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
 {
-    set_bit(virtio_get_queue_index(vq), s->batch_notify_vqs);
-    qemu_bh_schedule(s->bh);
+    VirtIOBlockDataPlaneThread *t =
+        virtio_blk_data_plane_vq_thread(s, virtio_get_queue_index(vq));
+
+    set_bit(virtio_get_queue_index(vq), t->batch_notify_vqs);
+    qemu_bh_schedule(t->bh);
 }
 
 static void notify_guest_bh(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockDataPlaneThread *t = opaque;
+    VirtIOBlockDataPlane *s = t->s;
     unsigned nvqs = s->conf->num_queues;
     unsigned long bitmap[BITS_TO_LONGS(nvqs)];
     unsigned j;
 
-    memcpy(bitmap, s->batch_notify_vqs, sizeof(bitmap));
-    memset(s->batch_notify_vqs, 0, sizeof(bitmap));
+    memcpy(bitmap, t->batch_notify_vqs, sizeof(bitmap));
+    memset(t->batch_notify_vqs, 0, sizeof(bitmap));
 
     for (j = 0; j < nvqs; j += BITS_PER_LONG) {
-        unsigned long bits = bitmap[j];
+        unsigned long bits = bitmap[j / BITS_PER_LONG];
 
         while (bits != 0) {
             unsigned i = j + ctzl(bits);
@@ -77,6 +94,40 @@ static void notify_guest_bh(void *opaque)
     }
 }
 
+/* Look up the colon-separated list of IOThread ids in @ids */
+static IOThread **virtio_blk_data_plane_parse_iothreads(const char *ids,
+                                                        unsigned *n,
+                                                        Error **errp)
+{
+    gchar **names = g_strsplit(ids, ":", 0);
+    IOThread **iothreads;
+    unsigned i;
+
+    *n = g_strv_length(names);
+    if (*n == 0) {
+        error_setg(errp, "iothreads property must not be empty");
+        g_strfreev(names);
+        return NULL;
+    }
+
+    iothreads = g_new0(IOThread *, *n);
+    for (i = 0; i < *n; i++) {
+        Object *obj = object_resolve_path_component(object_get_objects_root(),
+                                                    names[i]);
+
+        iothreads[i] = (IOThread *)object_dynamic_cast(obj, TYPE_IOTHREAD);
+        if (!iothreads[i]) {
+            error_setg(errp, "'%s' is not an iothread", names[i]);
+            g_free(iothreads);
+            iothreads = NULL;
+            break;
+        }
+    }
+
+    g_strfreev(names);
+    return iothreads;
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
                                   VirtIOBlockDataPlane **dataplane,
@@ -86,9 +137,27 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
 
+    IOThread **iothreads;
+    unsigned i, n;
+
     *dataplane = NULL;
 
-    if (!conf->iothread) {
+    if (conf->iothreads) {
+        if (conf->iothread) {
+            error_setg(errp, "iothread and iothreads properties are "
+                       "mutually exclusive");
+            return;
+        }
+        iothreads = virtio_blk_data_plane_parse_iothreads(conf->iothreads,
+                                                          &n, errp);
+        if (!iothreads) {
+            return;
+        }
+    } else if (conf->iothread) {
+        iothreads = g_new(IOThread *, 1);
+        iothreads[0] = conf->iothread;
+        n = 1;
+    } else {
         return;
     }
 
@@ -97,6 +166,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
         error_setg(errp,
                    "device is incompatible with dataplane "
                    "(transport does not support notifiers)");
+        g_free(iothreads);
         return;
     }
 
@@ -105,6 +175,7 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
      */
     if (blk_op_is_blocked(conf->conf.blk, BLOCK_OP_TYPE_DATAPLANE, errp)) {
         error_prepend(errp, "cannot start dataplane thread: ");
+        g_free(iothreads);
         return;
     }
 
@@ -112,11 +183,22 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
     s->vdev = vdev;
     s->conf = conf;
 
-    s->iothread = conf->iothread;
-    object_ref(OBJECT(s->iothread));
-    s->ctx = iothread_get_aio_context(s->iothread);
-    s->bh = aio_bh_new(s->ctx, notify_guest_bh, s);
-    s->batch_notify_vqs = bitmap_new(conf->num_queues);
+    /* More threads than queues would sit idle */
+    s->nthreads = MIN(n, conf->num_queues);
+    s->nthreads_active = 1;
+    s->threads = g_new0(VirtIOBlockDataPlaneThread, s->nthreads);
+    for (i = 0; i < s->nthreads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        t->s = s;
+        t->iothread = iothreads[i];
+        object_ref(OBJECT(t->iothread));
+        t->ctx = iothread_get_aio_context(t->iothread);
+        t->bh = aio_bh_new(t->ctx, notify_guest_bh, t);
+        t->batch_notify_vqs = bitmap_new(conf->num_queues);
+    }
+    s->ctx = s->threads[0].ctx;
+    g_free(iothreads);
 
     *dataplane = s;
 }
@@ -124,14 +206,21 @@ void virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *conf,
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
 {
+    unsigned i;
+
     if (!s) {
         return;
     }
 
     virtio_blk_data_plane_stop(s);
-    g_free(s->batch_notify_vqs);
-    qemu_bh_delete(s->bh);
-    object_unref(OBJECT(s->iothread));
+    for (i = 0; i < s->nthreads; i++) {
+        VirtIOBlockDataPlaneThread *t = &s->threads[i];
+
+        g_free(t->batch_notify_vqs);
+        qemu_bh_delete(t->bh);
+        object_unref(OBJECT(t->iothread));
+    }
+    g_free(s->threads);
     g_free(s);
 }
 
@@ -146,6 +235,58 @@ static void virtio_blk_data_plane_handle_output(VirtIODevice *vdev,
     virtio_blk_handle_vq(s, vq);
 }
 
+/* Let the other iothreads submit requests to the BlockBackend directly.
+ * If that is not possible, all virtqueues are served by the first one.
+ *
+ * Context: QEMU global mutex held
+ */
+static void virtio_blk_data_plane_add_queues(VirtIOBlockDataPlane *s)
+{
+    BlockBackend *blk = s->conf->conf.blk;
+    Error *local_err = NULL;
+    char *home;
+    unsigned i;
+
+    s->nthreads_active = 1;
+    if (s->nthreads == 1) {
+        return;
+    }
+    home = iothread_get_id(s->threads[0].iothread);
+
+    /* A stopped request is retried from the home AioContext, which must
+     * not touch virtqueues owned by other threads.
+     */
+    for (i = 0; i < 2; i++) {
+        BlockdevOnError on_error = blk_get_on_error(blk, i == 0);
+
+        if (on_error == BLOCKDEV_ON_ERROR_STOP ||
+            on_error == BLOCKDEV_ON_ERROR_ENOSPC) {
+            error_report("virtio-blk: werror/rerror=stop is not supported "
+                         "with multiple iothreads, using only '%s'", home);
+            g_free(home);
+            return;
+        }
+    }
+
+    aio_context_acquire(s->ctx);
+    for (i = 1; i < s->nthreads; i++) {
+        if (blk_add_queue_context(blk, s->threads[i].ctx, &local_err) < 0) {
+            error_reportf_err(local_err, "virtio-blk: cannot use multiple "
+                              "iothreads, using only '%s': ", home);
+            while (--i > 0) {
+                blk_del_queue_context(blk, s->threads[i].ctx);
+            }
+            aio_context_release(s->ctx);
+            g_free(home);
+            return;
+        }
+    }
+    aio_context_release(s->ctx);
+
+    s->nthreads_active = s->nthreads;
+    g_free(home);
+}
+
 /* Context: QEMU global mutex held */
 void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
@@ -187,6 +328,7 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     trace_virtio_blk_data_plane_start(s);
 
     blk_set_aio_context(s->conf->conf.blk, s->ctx);
+    virtio_blk_data_plane_add_queues(s);
 
     /* Kick right away to begin processing requests already in vring */
     for (i = 0; i < nvqs; i++) {
@@ -196,14 +338,15 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
     }
 
     /* Get this show started by hooking up our callbacks */
-    aio_context_acquire(s->ctx);
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_vq_thread(s, i)->ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx,
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx,
                 virtio_blk_data_plane_handle_output);
+        aio_context_release(ctx);
     }
-    aio_context_release(s->ctx);
     return;
 
   fail_guest_notifiers:
@@ -234,16 +377,23 @@ void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    aio_context_acquire(s->ctx);
-
     /* Stop notifications for new requests from guest */
     for (i = 0; i < nvqs; i++) {
         VirtQueue *vq = virtio_get_queue(s->vdev, i);
+        AioContext *ctx = virtio_blk_data_plane_vq_thread(s, i)->ctx;
 
-        virtio_queue_aio_set_host_notifier_handler(vq, s->ctx, NULL);
+        aio_context_acquire(ctx);
+        virtio_queue_aio_set_host_notifier_handler(vq, ctx, NULL);
+        aio_context_release(ctx);
     }
 
+    aio_context_acquire(s->ctx);
+
     /* Drain and switch bs back to the QEMU main loop */
+    for (i = 1; i < s->nthreads_active; i++) {
+        blk_del_queue_context(s->conf->conf.blk, s->threads[i].ctx);
+    }
+    s->nthreads_active = 1;
     blk_set_aio_context(s->conf->conf.blk, qemu_get_aio_context());
 
     aio_context_release(s->ctx);
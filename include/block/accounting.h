@@ -26,6 +26,7 @@
 #define BLOCK_ACCOUNTING_H
 
 #include "qemu/timed-average.h"
+#include "qemu/thread.h"
 
 typedef struct BlockAcctTimedStats BlockAcctTimedStats;
 
@@ -42,15 +43,48 @@ struct BlockAcctTimedStats {
     QSLIST_ENTRY(BlockAcctTimedStats) entries;
 };
 
-typedef struct BlockAcctStats {
+/* Latency histograms have one bin per power of two nanoseconds: bin i
+ * counts the requests with 2^i <= latency < 2^(i+1) ns.  Bin 0 also
+ * counts requests that took less than a nanosecond, and the last bin
+ * has no upper bound.
+ */
+#define BLOCK_ACCT_HISTOGRAM_BINS 40
+
+typedef struct BlockAcctCounters {
     uint64_t nr_bytes[BLOCK_MAX_IOTYPE];
     uint64_t nr_ops[BLOCK_MAX_IOTYPE];
     uint64_t invalid_ops[BLOCK_MAX_IOTYPE];
     uint64_t failed_ops[BLOCK_MAX_IOTYPE];
     uint64_t total_time_ns[BLOCK_MAX_IOTYPE];
     uint64_t merged[BLOCK_MAX_IOTYPE];
+    uint64_t latency_histogram[BLOCK_MAX_IOTYPE][BLOCK_ACCT_HISTOGRAM_BINS];
     int64_t last_access_time_ns;
+} BlockAcctCounters;
+
+/* Counters private to one thread.  Only the owning thread writes them, so
+ * requests can be accounted without locks or atomic read-modify-write
+ * operations even when several threads complete requests for the same
+ * BlockBackend (multiqueue mode); readers add up all the shards.
+ */
+typedef struct BlockAcctShard BlockAcctShard;
+struct BlockAcctShard {
+    BlockAcctCounters counters;
+    const void *owner;
+    BlockAcctShard *next;
+};
+
+typedef struct BlockAcctStats {
+    BlockAcctShard *shards;
+
+    /* Protects the timed statistics in @intervals and
+     * @histogram_base.
+     */
+    QemuMutex lock;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+
+    /* Value of the latency histograms at the last reset */
+    uint64_t histogram_base[BLOCK_MAX_IOTYPE][BLOCK_ACCT_HISTOGRAM_BINS];
+
     bool account_invalid;
     bool account_failed;
 } BlockAcctStats;
@@ -61,8 +95,9 @@ typedef struct BlockAcctCookie {
     enum BlockAcctType type;
 } BlockAcctCookie;
 
-void block_acct_init(BlockAcctStats *stats, bool account_invalid,
-                     bool account_failed);
+void block_acct_init(BlockAcctStats *stats);
+void block_acct_setup(BlockAcctStats *stats, bool account_invalid,
+                      bool account_failed);
 void block_acct_cleanup(BlockAcctStats *stats);
 void block_acct_add_interval(BlockAcctStats *stats, unsigned interval_length);
 BlockAcctTimedStats *block_acct_interval_next(BlockAcctStats *stats,
@@ -74,6 +109,8 @@ void block_acct_failed(BlockAcctStats *stats, BlockAcctCookie *cookie);
 void block_acct_invalid(BlockAcctStats *stats, enum BlockAcctType type);
 void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
                            int num_requests);
+void block_acct_get_counters(BlockAcctStats *stats, BlockAcctCounters *c);
+void block_acct_reset_latency_histograms(BlockAcctStats *stats);
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
@@ -46,9 +46,12 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct ThreadPool;
 struct LinuxAioState;
+struct LuringState;
+struct Coroutine;
 
 struct AioContext {
     GSource source;
@@ -119,6 +122,13 @@ struct AioContext {
     /* Scheduling this BH forces the event loop it iterate */
     QEMUBH *notify_dummy_bh;
 
+    /* Coroutines woken up from other threads with aio_co_schedule(), and
+     * the BH that enters them.  The list is accessed with atomic
+     * primitives.
+     */
+    QSLIST_HEAD(, Coroutine) scheduled_coroutines;
+    QEMUBH *co_schedule_bh;
+
     /* Thread pool for performing work and receiving completion callbacks */
     struct ThreadPool *thread_pool;
 
@@ -129,11 +139,39 @@ struct AioContext {
     struct LinuxAioState *linux_aio;
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    /* State for Linux io_uring, created on first use.  Uses
+     * aio_context_acquire/release for locking.  io_uring_sqpoll asks for
+     * a kernel submission thread and must be set before the ring exists.
+     */
+    struct LuringState *linux_io_uring;
+    bool io_uring_sqpoll;
+#endif
+
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
 
     int external_disable_cnt;
 
+    /* Number of AioHandlers without .io_poll().  Busy polling is only
+     * possible while this is zero, otherwise it would starve them.
+     */
+    int poll_disable_cnt;
+
+    /* Adaptive busy polling, see aio_context_set_poll_params().  poll_ns
+     * is the current polling window; it grows while polling finds events
+     * before the window expires and shrinks when it keeps expiring.
+     */
+    int64_t poll_ns;        /* current polling time in nanoseconds */
+    int64_t poll_max_ns;    /* maximum polling time in nanoseconds */
+    int64_t poll_grow;      /* polling time growth factor */
+    int64_t poll_shrink;    /* polling time shrink factor */
+
+    /* Are we in polling mode or monitoring file descriptors?  Handlers'
+     * .io_poll_begin() has been called if and only if this is true.
+     */
+    bool poll_started;
+
     /* epoll(7) state used when built with CONFIG_EPOLL */
     int epollfd;
     bool epoll_enabled;
@@ -337,6 +375,30 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Add busy polling callbacks to the handler of @fd, which must have been
+ * registered with aio_set_fd_handler.  @io_poll checks for work without
+ * making system calls and, if there is any, processes it and returns true.
+ * @io_poll_begin and @io_poll_end (both optional) are invoked when the
+ * event loop switches to and from polling; they can be used to suppress
+ * notifications that are redundant while polling.  After @io_poll_end,
+ * @io_poll is called once more so that racing work is not missed.
+ *
+ * The callbacks are dropped together with the fd handler.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd,
+                     AioPollFn *io_poll,
+                     IOHandler *io_poll_begin,
+                     IOHandler *io_poll_end);
+
+/* Same as aio_set_fd_poll, for an event notifier registered with
+ * aio_set_event_notifier.  The callbacks receive @notifier as argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll,
+                                 EventNotifierHandler *io_poll_begin,
+                                 EventNotifierHandler *io_poll_end);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -348,6 +410,39 @@ struct ThreadPool *aio_get_thread_pool(AioContext *ctx);
 /* Return the LinuxAioState bound to this AioContext */
 struct LinuxAioState *aio_get_linux_aio(AioContext *ctx);
 
+/* Create the io_uring ring of this AioContext if it does not exist yet.
+ * Return the LuringState, or NULL with @errp set on failure.
+ */
+struct LuringState *aio_setup_linux_io_uring(AioContext *ctx, Error **errp);
+
+/* Return the LuringState bound to this AioContext, or NULL if
+ * aio_setup_linux_io_uring has not succeeded yet.
+ */
+struct LuringState *aio_get_linux_io_uring(AioContext *ctx);
+
+/**
+ * aio_co_schedule:
+ * @ctx: the aio context
+ * @co: the coroutine
+ *
+ * Start a coroutine on a remote AioContext.  The coroutine must be
+ * suspended (e.g. in qemu_coroutine_yield()) and must have been running
+ * in @ctx, or not have run at all.  It is entered from a bottom half of
+ * @ctx, with @ctx acquired.
+ *
+ * This is the way to wake up a coroutine from a thread other than the one
+ * that runs @ctx.
+ */
+void aio_co_schedule(AioContext *ctx, struct Coroutine *co);
+
+/**
+ * qemu_get_current_aio_context:
+ *
+ * Return the AioContext whose event loop runs in the current thread: the
+ * one of an IOThread, or the main loop's.
+ */
+AioContext *qemu_get_current_aio_context(void);
+
 /**
  * aio_timer_new:
  * @ctx: the aio context
@@ -454,4 +549,19 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds (0 disables polling)
+ * @grow: polling time growth factor (0 selects the default)
+ * @shrink: polling time shrink factor (0 resets to no polling)
+ *
+ * Poll mode can be used instead of blocking in poll(2) when all handlers
+ * of @ctx support it.  The polling time adapts between 0 and @max_ns to
+ * how quickly events arrive.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 int64_t grow, int64_t shrink,
+                                 Error **errp);
+
 #endif
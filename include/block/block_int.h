@@ -32,6 +32,7 @@
 #include "qemu/timer.h"
 #include "qapi-types.h"
 #include "qemu/hbitmap.h"
+#include "qemu/interval-tree.h"
 #include "block/snapshot.h"
 #include "qemu/main-loop.h"
 #include "qemu/throttle.h"
@@ -56,6 +57,8 @@
 #define BLOCK_OPT_NOCOW             "nocow"
 #define BLOCK_OPT_OBJECT_SIZE       "object_size"
 #define BLOCK_OPT_REFCOUNT_BITS     "refcount_bits"
+#define BLOCK_OPT_COMPRESSION_TYPE  "compression_type"
+#define BLOCK_OPT_EXTL2             "extended_l2"
 
 #define BLOCK_PROBE_BUF_SIZE        512
 
@@ -77,9 +80,21 @@ typedef struct BdrvTrackedRequest {
     int64_t overlap_offset;
     unsigned int overlap_bytes;
 
+    /* [overlap_offset, overlap_offset + overlap_bytes - 1] in
+     * bs->serialising_requests or bs->nonserialising_requests; not in
+     * either tree if overlap_bytes is zero.
+     */
+    IntervalTreeNode overlap_node;
+
     QLIST_ENTRY(BdrvTrackedRequest) list;
     Coroutine *co; /* owner, used for deadlock detection */
-    CoQueue wait_queue; /* coroutines blocked on this request */
+    AioContext *ctx; /* AioContext that runs the owner */
+    CoQueue wait_queue; /* coroutines in ctx blocked on this request */
+
+    /* Coroutines in other AioContexts blocked on this request (only in
+     * multiqueue mode); they are woken up with aio_co_schedule().
+     */
+    QSLIST_HEAD(, BdrvRemoteWaiter) remote_waiters;
 
     struct BdrvTrackedRequest *waiting_for;
 } BdrvTrackedRequest;
@@ -223,6 +238,7 @@ struct BlockDriver {
                                   Error **errp);
     int (*bdrv_get_info)(BlockDriverState *bs, BlockDriverInfo *bdi);
     ImageInfoSpecific *(*bdrv_get_specific_info)(BlockDriverState *bs);
+    BlockStatsSpecific *(*bdrv_get_specific_stats)(const BlockDriverState *bs);
 
     int coroutine_fn (*bdrv_save_vmstate)(BlockDriverState *bs,
                                           QEMUIOVector *qiov,
@@ -290,6 +306,20 @@ struct BlockDriver {
     void (*bdrv_attach_aio_context)(BlockDriverState *bs,
                                     AioContext *new_context);
 
+    /* Set to true if requests may be submitted from several AioContexts at
+     * once (multiqueue mode).  Such a request must complete in the
+     * AioContext returned by bdrv_get_request_aio_context(), and the
+     * driver must not keep per-request state outside of it.
+     */
+    bool bdrv_supports_multiqueue;
+
+    /* Prepare for requests submitted from @ctx in multiqueue mode, or undo
+     * it.  Called with no in-flight requests, with parents before child
+     * nodes.
+     */
+    void (*bdrv_add_queue_context)(BlockDriverState *bs, AioContext *ctx);
+    void (*bdrv_del_queue_context)(BlockDriverState *bs, AioContext *ctx);
+
     /* io queue for linux-aio */
     void (*bdrv_io_plug)(BlockDriverState *bs);
     void (*bdrv_io_unplug)(BlockDriverState *bs);
@@ -444,13 +474,19 @@ struct BlockDriverState {
 
     CoQueue flush_queue;            /* Serializing flush queue */
     BdrvTrackedRequest *active_flush_req; /* Flush request in flight */
-    unsigned int write_gen;         /* Current data generation */
-    unsigned int flushed_gen;       /* Flushed write generation */
+    unsigned int write_gen;         /* Current data generation (atomic) */
+    unsigned int flushed_gen;       /* Flushed write generation (atomic) */
 
     BlockDriver *drv; /* NULL means no media */
     void *opaque;
 
     AioContext *aio_context; /* event loop used for fd handlers, timers, etc */
+
+    /* Multiqueue mode: AioContexts other than aio_context whose threads
+     * submit requests to this node concurrently, see
+     * bdrv_add_queue_context().  Only changed while the node is drained.
+     */
+    GSList *queue_contexts;
     /* long-running tasks intended to always use the same AioContext as this
      * BDS may register themselves in this list to be notified of changes
      * regarding this BDS's context */
@@ -474,9 +510,35 @@ struct BlockDriverState {
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
+    /* In-flight requests by overlap range, so that serialising requests
+     * can find conflicts without walking tracked_requests.  Requests that
+     * need not wait for each other are in nonserialising_requests.
+     */
+    IntervalTreeRoot serialising_requests;
+    IntervalTreeRoot nonserialising_requests;
+
     /* Offset after the highest byte written to */
     uint64_t wr_highest_offset;
 
+    /* Protects tracked_requests, serialising_in_flight, the two request
+     * trees, the waiters of tracked requests and wr_highest_offset, which
+     * are accessed from several threads in multiqueue mode.
+     */
+    QemuMutex reqs_lock;
+
+    /* Number of BlockBackend AIO requests in flight, including the
+     * completion callback.  Accessed with atomic primitives.
+     */
+    unsigned int in_flight;
+
+    /* In multiqueue mode, the number of tracked requests and BlockBackend
+     * AIO requests (which are then not in in_flight) that complete in a
+     * queue context rather than in aio_context.  Accessed with atomic
+     * primitives; remote_done is set whenever it drops to zero.
+     */
+    unsigned int remote_in_flight;
+    QemuEvent remote_done;
+
     /* I/O Limits */
     BlockLimits bl;
 
@@ -613,6 +675,40 @@ void bdrv_detach_aio_context(BlockDriverState *bs);
 void bdrv_attach_aio_context(BlockDriverState *bs,
                              AioContext *new_context);
 
+/**
+ * bdrv_add_queue_context:
+ *
+ * Enter multiqueue mode, or add another AioContext to it: allow requests to
+ * @bs and its children to be submitted from the thread of @ctx, concurrently
+ * with the AioContext of @bs and the other queue contexts.  Requests
+ * submitted from @ctx complete in @ctx.
+ *
+ * All drivers in the subtree must set .bdrv_supports_multiqueue, and features
+ * that are not thread-safe (copy-on-read, dirty bitmaps, before write
+ * notifiers) must not be in use.  The caller must have drained @bs.
+ */
+int bdrv_add_queue_context(BlockDriverState *bs, AioContext *ctx,
+                           Error **errp);
+
+/**
+ * bdrv_del_queue_context:
+ *
+ * Undo bdrv_add_queue_context().  The caller must have drained @bs.
+ */
+void bdrv_del_queue_context(BlockDriverState *bs, AioContext *ctx);
+
+/**
+ * bdrv_get_request_aio_context:
+ *
+ * Return the AioContext in which a request to @bs that is submitted by the
+ * current thread completes: the current thread's one if it is a queue
+ * context of @bs, otherwise the AioContext of @bs.
+ */
+AioContext *bdrv_get_request_aio_context(BlockDriverState *bs);
+
+void bdrv_inc_in_flight(BlockDriverState *bs);
+void bdrv_dec_in_flight(BlockDriverState *bs);
+
 /**
  * bdrv_add_aio_context_notifier:
  *
@@ -28,6 +28,7 @@
 #include "tcg-target.h"
 #ifndef CONFIG_USER_ONLY
 #include "exec/hwaddr.h"
+#include "qemu/thread.h"
 #endif
 #include "exec/memattrs.h"
 
@@ -96,6 +97,24 @@ typedef uint64_t target_ulong;
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
 
+/* TCG backends that define TCG_TARGET_IMPLEMENTS_DYN_TLB load the TLB
+ * mask and table pointer from env instead of computing a displacement
+ * into a fixed-size array, which lets each MMU index of the TLB be
+ * resized at run time between CPU_TLB_DYN_MIN_BITS and CPU_TLB_DYN_MAX_BITS.
+ */
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+
+# if HOST_LONG_BITS == 32
+/* Make sure we do not require a double-word shift for the TLB load */
+#  define CPU_TLB_DYN_MAX_BITS (32 - TARGET_PAGE_BITS)
+# else
+/* With 4 KiB pages, 2^22 entries cover 16 GiB of guest address space.  */
+#  define CPU_TLB_DYN_MAX_BITS MIN(22, TARGET_LONG_BITS - TARGET_PAGE_BITS)
+# endif
+#endif
+
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
        bit TARGET_PAGE_BITS-1..4  : Nonzero for accesses that should not
@@ -129,11 +148,50 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* Per-MMU-index bookkeeping of the TLB, kept outside of CPUArchState
+ * so that it survives the memset() that most targets perform on reset.
+ */
+typedef struct CPUTLBDesc {
+    CPUTLBEntry *table;
+    CPUIOTLBEntry *iotlb;
+    size_t n_entries;           /* always a power of two */
+    size_t n_used_entries;      /* valid entries in table */
+    /* Resizing window; see tlb_mmu_resize_locked() */
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    /* Statistics */
+    size_t n_miss;              /* not found in either TLB */
+    size_t n_victim_hit;        /* found in the victim TLB */
+    size_t n_flush;             /* full flushes of this MMU index */
+    size_t n_resize;
+} CPUTLBDesc;
+
+typedef struct CPUTLB {
+    /* Protects the table and iotlb pointers of @d, which are replaced
+     * on resize, against tlb_reset_dirty() called from other threads.
+     */
+    QemuSpin lock;
+    CPUTLBDesc d[NB_MMU_MODES];
+} CPUTLB;
+
+#ifdef TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* tlb_mask, tlb_table and iotlb mirror CPUState's CPUTLB for the benefit
+ * of generated code; they are reloaded on every full flush.
+ */
+#define CPU_COMMON_TLB_TABLES                                           \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
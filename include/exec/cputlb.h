@@ -26,6 +26,10 @@ void tlb_unprotect_code(ram_addr_t ram_addr);
 void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
                            uintptr_t length);
 extern int tlb_flush_count;
+extern int tlb_flush_page_count;
+extern int tlb_flush_async_count;
+extern int tlb_flush_elided_count;
+void tlb_dump_info(FILE *f, fprintf_function cpu_fprintf);
 
 #endif
 #endif
@@ -71,6 +71,14 @@ static inline void cpu_list_lock(void)
 void cpu_exec_init(CPUState *cpu, Error **errp);
 void QEMU_NORETURN cpu_loop_exit(CPUState *cpu);
 void QEMU_NORETURN cpu_loop_exit_restore(CPUState *cpu, uintptr_t pc);
+void QEMU_NORETURN cpu_loop_exit_atomic(CPUState *cpu, uintptr_t pc);
+
+/* True while vCPUs may run translated code concurrently (multi-threaded
+ * TCG), except during cpu_exec_step() when the other vCPUs are stopped.
+ * Helpers that cannot be made atomic on the host exit with EXCP_ATOMIC
+ * when it is set.
+ */
+extern bool parallel_cpus;
 
 #if !defined(CONFIG_USER_ONLY)
 void cpu_reloading_memory_map(void);
@@ -94,6 +102,18 @@ void cpu_reloading_memory_map(void);
  */
 void cpu_address_space_init(CPUState *cpu, AddressSpace *as, int asidx);
 /* cputlb.c */
+/**
+ * tlb_init:
+ * @cpu: CPU whose TLB should be initialized
+ *
+ * Allocate the TLB of the specified CPU; called by cpu_exec_init().
+ */
+void tlb_init(CPUState *cpu);
+/**
+ * tlb_destroy:
+ * @cpu: CPU whose TLB should be freed
+ */
+void tlb_destroy(CPUState *cpu);
 /**
  * tlb_flush_page:
  * @cpu: CPU whose TLB should be flushed
@@ -224,6 +244,14 @@ struct TranslationBlock {
 #define CF_NOCACHE     0x10000 /* To be freed after execution */
 #define CF_USE_ICOUNT  0x20000
 #define CF_IGNORE_ICOUNT 0x40000 /* Do not generate icount code */
+#define CF_SUPERBLOCK  0x80000 /* Follow direct jumps past the first block */
+
+    uint32_t exec_count; /* executions counted until the TB becomes hot */
+    uint8_t lazy_flags;
+#define TB_LAZY_JMP0   0x01 /* slot 0 leaves lazily synced globals unsaved */
+#define TB_LAZY_JMP1   0x02
+#define TB_LAZY_ENTRY  0x04 /* first insn overwrites the lazy globals */
+    bool invalid;   /* set by tb_phys_invalidate; never chain to this TB */
 
     void *tc_ptr;    /* pointer to the translated code */
     uint8_t *tc_search;  /* pointer to search data */
@@ -265,6 +293,7 @@ struct TranslationBlock {
 };
 
 void tb_free(TranslationBlock *tb);
+void tb_region_touch(TranslationBlock *tb);
 void tb_flush(CPUState *cpu);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
 
@@ -375,6 +404,9 @@ struct MemoryRegion *iotlb_to_region(CPUState *cpu,
 
 void tlb_fill(CPUState *cpu, target_ulong addr, MMUAccessType access_type,
               int mmu_idx, uintptr_t retaddr);
+void *tlb_vaddr_to_host_atomic(CPUArchState *env, target_ulong addr,
+                                int size, int mmu_idx, uintptr_t retaddr);
+void cpu_exec_step(CPUState *cpu);
 
 #endif
 
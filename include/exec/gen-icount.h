@@ -9,16 +9,32 @@ static int icount_start_insn_idx;
 static TCGLabel *icount_label;
 static TCGLabel *exitreq_label;
 
-static inline void gen_tb_start(TranslationBlock *tb)
+/* Branch to exitreq_label if the CPU was asked to stop executing TBs.
+ * TBs flagged with TB_LAZY_ENTRY may be entered with part of the guest
+ * state still unsaved; the front end emits this check itself once the
+ * first instruction has recomputed that state, and binds exitreq_label
+ * to a path that stores it and the next PC before exiting with
+ * TB_EXIT_REQUESTED.
+ */
+static inline void gen_tb_exit_check(void)
 {
-    TCGv_i32 count, flag, imm;
+    TCGv_i32 flag;
 
-    exitreq_label = gen_new_label();
     flag = tcg_temp_new_i32();
     tcg_gen_ld_i32(flag, cpu_env,
                    offsetof(CPUState, tcg_exit_req) - ENV_OFFSET);
     tcg_gen_brcondi_i32(TCG_COND_NE, flag, 0, exitreq_label);
     tcg_temp_free_i32(flag);
+}
+
+static inline void gen_tb_start(TranslationBlock *tb)
+{
+    TCGv_i32 count, imm;
+
+    exitreq_label = gen_new_label();
+    if (!(tb->lazy_flags & TB_LAZY_ENTRY)) {
+        gen_tb_exit_check();
+    }
 
     if (!(tb->cflags & CF_USE_ICOUNT)) {
         return;
@@ -47,8 +63,10 @@ static inline void gen_tb_start(TranslationBlock *tb)
 
 static void gen_tb_end(TranslationBlock *tb, int num_insns)
 {
-    gen_set_label(exitreq_label);
-    tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    if (!(tb->lazy_flags & TB_LAZY_ENTRY)) {
+        gen_set_label(exitreq_label);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    }
 
     if (tb->cflags & CF_USE_ICOUNT) {
         /* Update the num_insn immediate parameter now that we know
@@ -26,8 +26,26 @@
 #define CODE_GEN_HTABLE_BITS     15
 #define CODE_GEN_HTABLE_SIZE     (1 << CODE_GEN_HTABLE_BITS)
 
+/* Maximum number of regions the code buffer is split into.  */
+#define TB_MAX_REGIONS           8
+
 typedef struct TranslationBlock TranslationBlock;
 typedef struct TBContext TBContext;
+typedef struct TBRegion TBRegion;
+
+/* A slice of the code buffer, together with the slice of the tbs array
+ * describing the code in it.  Regions are filled one at a time; when
+ * the current one is full, the least recently used one is evicted and
+ * becomes the current region.
+ */
+struct TBRegion {
+    void *start;
+    void *end;              /* end of the generated code */
+    void *highwater;
+    TranslationBlock *tbs;
+    int nb_tbs;
+    unsigned int last_use;  /* tb_ctx.region_clock when last used */
+};
 
 struct TBContext {
 
@@ -37,8 +55,16 @@ struct TBContext {
     /* any access to the tbs or the page table must use this lock */
     QemuMutex tb_lock;
 
+    TBRegion regions[TB_MAX_REGIONS];
+    int nb_regions;
+    int cur_region;
+    int region_max_tbs;
+    size_t region_size;
+    unsigned int region_clock;
+
     /* statistics */
     int tb_flush_count;
+    int tb_evict_count;
     int tb_phys_invalidate_count;
 };
 
@@ -34,6 +34,7 @@ struct VirtIOBlkConf
 {
     BlockConf conf;
     IOThread *iothread;
+    char *iothreads;            /* colon-separated ids, for multiqueue */
     char *serial;
     uint32_t scsi;
     uint32_t config_wce;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -45,8 +45,21 @@ void cache_fini(PageCache *cache);
  * @addr: page addr
  * @current_age: current bitmap generation
  */
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age);
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age);
+
+/**
+ * cache_lookup: Get the data cached for an addr and mark it as used
+ *
+ * Like cache_is_cached followed by get_cached_data, but looks up the
+ * page only once.
+ *
+ * Returns pointer to the data cached or NULL if not cached
+ *
+ * @cache pointer to the PageCache struct
+ * @addr: page addr
+ * @current_age: current bitmap generation
+ */
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr, uint64_t current_age);
 
 /**
  * get_cached_data: Get the data cached for an addr
@@ -60,7 +73,10 @@ uint8_t *get_cached_data(const PageCache *cache, uint64_t addr);
 
 /**
  * cache_insert: insert the page into the cache. the page cache
- * will dup the data on insert. the previous value will be overwritten
+ * will dup the data on insert. the previous value will be overwritten.
+ * If the page is not cached yet and there is no free slot for it, the
+ * least recently used page that can hold it is evicted, unless that page
+ * is still fresh.
  *
  * Returns -1 when the page isn't inserted into cache
  *
@@ -194,6 +194,22 @@
     _old;                                                               \
     })
 
+/* Variants of the above without the size check, for guest data that may
+ * be wider than a host pointer.  The caller must know that the host can
+ * access it atomically.
+ */
+#define atomic_read__nocheck(ptr)   __atomic_load_n(ptr, __ATOMIC_RELAXED)
+#define atomic_set__nocheck(ptr, i) __atomic_store_n(ptr, i, __ATOMIC_RELAXED)
+#define atomic_xchg__nocheck(ptr, i)                                    \
+    __atomic_exchange_n(ptr, (i), __ATOMIC_SEQ_CST)
+#define atomic_cmpxchg__nocheck(ptr, old, new)                          \
+    ({                                                                  \
+    typeof_strip_qual(*ptr) _old = (old);                               \
+    __atomic_compare_exchange_n(ptr, &_old, (new), false,               \
+                                __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);    \
+    _old;                                                               \
+    })
+
 /* Provide shorter names for GCC atomic builtins, return old value */
 #define atomic_fetch_inc(ptr)  __atomic_fetch_add(ptr, 1, __ATOMIC_SEQ_CST)
 #define atomic_fetch_dec(ptr)  __atomic_fetch_sub(ptr, 1, __ATOMIC_SEQ_CST)
@@ -201,6 +217,7 @@
 #define atomic_fetch_sub(ptr, n) __atomic_fetch_sub(ptr, n, __ATOMIC_SEQ_CST)
 #define atomic_fetch_and(ptr, n) __atomic_fetch_and(ptr, n, __ATOMIC_SEQ_CST)
 #define atomic_fetch_or(ptr, n)  __atomic_fetch_or(ptr, n, __ATOMIC_SEQ_CST)
+#define atomic_fetch_xor(ptr, n) __atomic_fetch_xor(ptr, n, __ATOMIC_SEQ_CST)
 
 /* And even shorter names that return void.  */
 #define atomic_inc(ptr)    ((void) __atomic_fetch_add(ptr, 1, __ATOMIC_SEQ_CST))
@@ -395,8 +412,14 @@
 #define atomic_fetch_sub       __sync_fetch_and_sub
 #define atomic_fetch_and       __sync_fetch_and_and
 #define atomic_fetch_or        __sync_fetch_and_or
+#define atomic_fetch_xor       __sync_fetch_and_xor
 #define atomic_cmpxchg         __sync_val_compare_and_swap
 
+#define atomic_read__nocheck   atomic_read
+#define atomic_set__nocheck    atomic_set
+#define atomic_xchg__nocheck   atomic_xchg
+#define atomic_cmpxchg__nocheck atomic_cmpxchg
+
 /* And even shorter names that return void.  */
 #define atomic_inc(ptr)        ((void) __sync_fetch_and_add(ptr, 1))
 #define atomic_dec(ptr)        ((void) __sync_fetch_and_add(ptr, -1))
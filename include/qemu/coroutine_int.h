@@ -43,6 +43,9 @@ struct Coroutine {
     /* Coroutines that should be woken up when we yield or terminate */
     QSIMPLEQ_HEAD(, Coroutine) co_queue_wakeup;
     QSIMPLEQ_ENTRY(Coroutine) co_queue_next;
+
+    /* Link in AioContext.scheduled_coroutines, see aio_co_schedule() */
+    QSLIST_ENTRY(Coroutine) co_scheduled_next;
 };
 
 Coroutine *qemu_coroutine_new(void);
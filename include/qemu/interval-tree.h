@@ -0,0 +1,84 @@
+/*
+ * Interval trees
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * An interval tree stores closed intervals [start, last] and finds all the
+ * intervals that overlap a given one in O(log n + k) time, where k is the
+ * number of matches.  It is a self-balancing (AVL) binary search tree
+ * ordered by start, where every node also records the largest @last of its
+ * subtree.
+ *
+ * Nodes are meant to be embedded in a larger structure and retrieved with
+ * container_of.  The tree does no memory allocation and no locking.
+ */
+
+#ifndef QEMU_INTERVAL_TREE_H
+#define QEMU_INTERVAL_TREE_H
+
+typedef struct IntervalTreeNode {
+    struct IntervalTreeNode *left;
+    struct IntervalTreeNode *right;
+    struct IntervalTreeNode *parent;
+    int height;
+
+    uint64_t start;         /* Start of interval */
+    uint64_t last;          /* Last location _in_ interval */
+    uint64_t subtree_last;  /* Largest @last in this subtree */
+} IntervalTreeNode;
+
+typedef struct IntervalTreeRoot {
+    IntervalTreeNode *root;
+} IntervalTreeRoot;
+
+static inline bool interval_tree_empty(IntervalTreeRoot *root)
+{
+    return root->root == NULL;
+}
+
+/**
+ * interval_tree_insert:
+ * @node: node to add; @node->start and @node->last must be filled in
+ * @root: the tree
+ *
+ * Add @node to @root.  Intervals with the same start are allowed.
+ */
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_remove:
+ * @node: node to remove, which must be in @root
+ * @root: the tree
+ *
+ * The interval of a node must not change while it is in a tree; remove it
+ * first and insert it again afterwards.
+ */
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root);
+
+/**
+ * interval_tree_iter_first:
+ * @root: the tree
+ * @start: start of the interval
+ * @last: last location in the interval
+ *
+ * Return the node with the lowest start among those that overlap
+ * [@start, @last], or NULL if there is none.
+ */
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last);
+
+/**
+ * interval_tree_iter_next:
+ * @node: the node returned by the previous call
+ * @start: start of the interval
+ * @last: last location in the interval
+ *
+ * Return the next node overlapping [@start, @last] in the order of start,
+ * or NULL if there is none.  The tree must not have been modified since
+ * @node was returned.
+ */
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last);
+
+#endif
@@ -231,6 +231,34 @@ struct kvm_run;
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
 
+/* An entry of the jump cache is only valid while @gen matches the
+ * tb_jmp_cache_gen of its vCPU, so the whole cache can be invalidated
+ * by bumping the generation instead of clearing it.
+ */
+typedef struct TBJmpCacheEntry {
+    struct TranslationBlock *tb;
+    unsigned int gen;
+} TBJmpCacheEntry;
+
+/* Maximum number of single-page TLB flushes batched for a vCPU before
+ * they are coalesced into a flush of the whole MMU index.
+ */
+#define TLB_FLUSH_PENDING_PAGES 16
+
+/* TLB flushes requested by other threads and not performed yet by the
+ * vCPU owning the TLB, see cputlb.c.
+ */
+typedef struct CPUTLBFlushPending {
+    QemuSpin lock;
+    bool queued;            /* work item scheduled on the owning vCPU */
+    uint16_t full_idxmap;   /* MMU indexes to flush entirely */
+    uint16_t nr_pages;
+    struct {
+        vaddr addr;
+        uint16_t idxmap;
+    } pages[TLB_FLUSH_PENDING_PAGES];
+} CPUTLBFlushPending;
+
 /* work queue */
 struct qemu_work_item {
     struct qemu_work_item *next;
@@ -238,6 +266,7 @@ struct qemu_work_item {
     void *data;
     int done;
     bool free;
+    bool exclusive;
 };
 
 /**
@@ -247,7 +276,8 @@ struct qemu_work_item {
  * @nr_threads: Number of threads within this CPU.
  * @numa_node: NUMA node this CPU is belonging to.
  * @host_tid: Host thread ID.
- * @running: #true if CPU is currently running (usermode).
+ * @running: #true if CPU is currently running (usermode, or executing
+ *           translated code in multi-threaded TCG).
  * @created: Indicates whether the CPU thread has been successfully created.
  * @interrupt_request: Indicates a pending interrupt request.
  * @halted: Nonzero if the CPU is in suspended state.
@@ -272,6 +302,8 @@ struct qemu_work_item {
  * @as: Pointer to the first AddressSpace, for the convenience of targets which
  *      only have a single AddressSpace
  * @env_ptr: Pointer to subclass-specific CPUArchState field.
+ * @tb_jmp_cache: Per-vCPU cache of recently executed TBs, indexed by PC.
+ * @tb_jmp_cache_gen: Generation of the valid @tb_jmp_cache entries.
  * @gdb_regs: Additional GDB registers.
  * @gdb_num_regs: Number of total registers accessible to GDB.
  * @gdb_num_g_regs: Number of registers in GDB 'g' packets.
@@ -282,6 +314,8 @@ struct qemu_work_item {
  * @kvm_fd: vCPU file descriptor for KVM.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
+ * @tlb_flush_pending: Batched cross-vCPU TLB flush requests.
+ * @tlb: Target-specific TLB bookkeeping, see cputlb.c.
  * @trace_dstate: Dynamic tracing state of events for this vCPU (bitmask).
  *
  * State of one CPU core or thread.
@@ -319,13 +353,17 @@ struct CPUState {
     QemuMutex work_mutex;
     struct qemu_work_item *queued_work_first, *queued_work_last;
 
+    CPUTLBFlushPending tlb_flush_pending;
+    struct CPUTLB *tlb;
+
     CPUAddressSpace *cpu_ases;
     int num_ases;
     AddressSpace *as;
     MemoryRegion *memory;
 
     void *env_ptr; /* CPUArchState */
-    struct TranslationBlock *tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    TBJmpCacheEntry tb_jmp_cache[TB_JMP_CACHE_SIZE];
+    unsigned int tb_jmp_cache_gen;
     struct GDBRegisterState *gdb_regs;
     int gdb_num_regs;
     int gdb_num_g_regs;
@@ -570,6 +608,22 @@ ObjectClass *cpu_class_by_name(const char *typename, const char *cpu_model);
  */
 CPUState *cpu_generic_init(const char *typename, const char *cpu_model);
 
+/**
+ * cpu_tb_jmp_cache_clear:
+ * @cpu: The vCPU whose jump cache is invalidated.
+ *
+ * Invalidates every entry of the jump cache of @cpu in constant time.
+ * Must be called by the thread running @cpu, or while it is stopped.
+ */
+static inline void cpu_tb_jmp_cache_clear(CPUState *cpu)
+{
+    if (unlikely(++cpu->tb_jmp_cache_gen == 0)) {
+        /* The generation wrapped; stale entries could match again.  */
+        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        cpu->tb_jmp_cache_gen = 1;
+    }
+}
+
 /**
  * cpu_has_work:
  * @cpu: The vCPU to check.
@@ -635,6 +689,29 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
  */
 void async_run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data);
 
+/**
+ * async_safe_run_on_cpu:
+ * @cpu: The vCPU to run on.
+ * @func: The function to be executed.
+ * @data: Data to pass to the function.
+ *
+ * Schedules the function @func for execution on the vCPU @cpu asynchronously,
+ * while all other vCPUs are outside of translated code.  This is used for
+ * work, such as flushing the translation buffer, that must not race with
+ * any vCPU executing guest code.
+ */
+void async_safe_run_on_cpu(CPUState *cpu, void (*func)(void *data),
+                           void *data);
+
+/**
+ * qemu_tcg_mttcg_enabled:
+ * Check whether we are running multi-threaded TCG or not.
+ *
+ * Returns: %true if each vCPU has its own TCG thread, %false otherwise.
+ */
+extern bool mttcg_enabled;
+#define qemu_tcg_mttcg_enabled() (mttcg_enabled)
+
 /**
  * qemu_get_cpu:
  * @index: The CPUState@cpu_index value of the CPU to obtain.
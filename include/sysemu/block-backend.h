@@ -181,6 +181,9 @@ void blk_op_block_all(BlockBackend *blk, Error *reason);
 void blk_op_unblock_all(BlockBackend *blk, Error *reason);
 AioContext *blk_get_aio_context(BlockBackend *blk);
 void blk_set_aio_context(BlockBackend *blk, AioContext *new_context);
+int blk_add_queue_context(BlockBackend *blk, AioContext *ctx, Error **errp);
+void blk_del_queue_context(BlockBackend *blk, AioContext *ctx);
+bool blk_is_multiqueue(BlockBackend *blk);
 void blk_add_aio_context_notifier(BlockBackend *blk,
         void (*attached_aio_context)(AioContext *new_context, void *opaque),
         void (*detach_aio_context)(void *opaque), void *opaque);
@@ -32,4 +32,8 @@ void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 void numa_unset_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node);
 uint32_t numa_get_node(ram_addr_t addr, Error **errp);
 
+typedef void NumaRamRangeFunc(int node, ram_addr_t start, ram_addr_t length,
+                              void *opaque);
+void numa_foreach_ram_range(NumaRamRangeFunc *func, void *opaque);
+
 #endif
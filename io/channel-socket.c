@@ -24,6 +24,9 @@
 #include "io/channel-watch.h"
 #include "trace.h"
 #include "qapi/clone-visitor.h"
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <linux/errqueue.h>
+#endif
 
 #define SOCKET_MAX_FDS 16
 
@@ -159,6 +162,20 @@ int qio_channel_socket_connect_sync(QIOChannelSocket *ioc,
         return -1;
     }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+    {
+        int v = 1;
+
+        /* This only allows writes to ask for MSG_ZEROCOPY; it fails
+         * for the socket types that do not support it.
+         */
+        if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &v, sizeof(v)) == 0) {
+            QIO_CHANNEL(ioc)->features |=
+                (1 << QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY);
+        }
+    }
+#endif
+
     return 0;
 }
 
@@ -521,6 +538,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
                                          size_t niov,
                                          int *fds,
                                          size_t nfds,
+                                         int flags,
                                          Error **errp)
 {
     QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
@@ -529,9 +547,16 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     char control[CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS)];
     size_t fdsize = sizeof(int) * nfds;
     struct cmsghdr *cmsg;
+    int sflags = 0;
 
     memset(control, 0, CMSG_SPACE(sizeof(int) * SOCKET_MAX_FDS));
 
+#ifdef CONFIG_MSG_ZEROCOPY
+    if (flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+        sflags |= MSG_ZEROCOPY;
+    }
+#endif
+
     msg.msg_iov = (struct iovec *)iov;
     msg.msg_iovlen = niov;
 
@@ -554,7 +579,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
     }
 
  retry:
-    ret = sendmsg(sioc->fd, &msg, 0);
+    ret = sendmsg(sioc->fd, &msg, sflags);
     if (ret <= 0) {
         if (errno == EAGAIN) {
             return QIO_CHANNEL_ERR_BLOCK;
@@ -562,12 +587,79 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
         if (errno == EINTR) {
             goto retry;
         }
+        if (errno == ENOBUFS && sflags) {
+            /* The pinned pages are charged to RLIMIT_MEMLOCK */
+            error_setg_errno(errp, errno,
+                             "Unable to lock memory for a zero copy "
+                             "write to socket");
+            return -1;
+        }
         error_setg_errno(errp, errno,
                          "Unable to write to socket");
         return -1;
     }
+    if (sflags) {
+        sioc->zero_copy_queued++;
+    }
     return ret;
 }
+
+
+#ifdef CONFIG_MSG_ZEROCOPY
+static int qio_channel_socket_flush(QIOChannel *ioc,
+                                    Error **errp)
+{
+    QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
+    struct msghdr msg = { NULL, };
+    char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+    struct sock_extended_err *serr;
+    struct cmsghdr *cmsg;
+    bool copied = false;
+
+    while (sioc->zero_copy_sent < sioc->zero_copy_queued) {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(sioc->fd, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EAGAIN) {
+                /* Completions are signalled as an error condition */
+                qio_channel_wait(ioc, G_IO_ERR);
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            error_setg_errno(errp, errno,
+                             "Unable to read socket error queue");
+            return -1;
+        }
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg ||
+            !((cmsg->cmsg_level == SOL_IP &&
+               cmsg->cmsg_type == IP_RECVERR) ||
+              (cmsg->cmsg_level == SOL_IPV6 &&
+               cmsg->cmsg_type == IPV6_RECVERR))) {
+            error_setg(errp, "Unexpected message in socket error queue");
+            return -1;
+        }
+
+        serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+        if (serr->ee_errno || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+            error_setg_errno(errp, serr->ee_errno,
+                             "Zero copy write to socket failed");
+            return -1;
+        }
+
+        /* One notification covers the writes numbered ee_info..ee_data */
+        sioc->zero_copy_sent += serr->ee_data - serr->ee_info + 1;
+        if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+            copied = true;
+        }
+    }
+
+    return copied;
+}
+#endif /* CONFIG_MSG_ZEROCOPY */
 #else /* WIN32 */
 static ssize_t qio_channel_socket_readv(QIOChannel *ioc,
                                         const struct iovec *iov,
@@ -616,6 +708,7 @@ static ssize_t qio_channel_socket_writev(QIOChannel *ioc,
                                          size_t niov,
                                          int *fds,
                                          size_t nfds,
+                                         int flags,
                                          Error **errp)
 {
     QIOChannelSocket *sioc = QIO_CHANNEL_SOCKET(ioc);
@@ -771,6 +864,9 @@ static void qio_channel_socket_class_init(ObjectClass *klass,
     ioc_klass->io_set_cork = qio_channel_socket_set_cork;
     ioc_klass->io_set_delay = qio_channel_socket_set_delay;
     ioc_klass->io_create_watch = qio_channel_socket_create_watch;
+#ifdef CONFIG_MSG_ZEROCOPY
+    ioc_klass->io_flush = qio_channel_socket_flush;
+#endif
 }
 
 static const TypeInfo qio_channel_socket_info = {
@@ -0,0 +1,247 @@
+/*
+ * Dirty page rate measurement
+ *
+ * Samples the migration dirty log for a fixed window without starting a
+ * migration, so that management can estimate up front whether pre-copy
+ * will converge for a guest, and which RAMBlocks and NUMA nodes account
+ * for most of the writes.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi/qmp/qerror.h"
+#include "qapi-visit.h"
+#include "qmp-commands.h"
+#include "qemu/bitmap.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "exec/address-spaces.h"
+#include "exec/ram_addr.h"
+#include "migration/migration.h"
+#include "sysemu/numa.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
+
+#define DIRTY_RATE_MAX_CALC_TIME 60 /* seconds */
+
+/* All of this is protected by the iothread lock */
+static DirtyRateStatus dirty_rate_status = DIRTY_RATE_STATUS_UNSTARTED;
+static int64_t dirty_rate_calc_time;
+static DirtyRateInfo *dirty_rate_result;
+static Error *dirty_rate_blocker;
+static QemuThread dirty_rate_thread;
+
+typedef struct DirtyRateNodeStats {
+    uint64_t size;
+    uint64_t dirty_pages;
+} DirtyRateNodeStats;
+
+typedef struct DirtyRateNodeCount {
+    unsigned long *bmap;
+    unsigned long nbits;
+    DirtyRateNodeStats nodes[MAX_NODES];
+} DirtyRateNodeCount;
+
+static double dirty_rate_mbps(uint64_t pages, int64_t elapsed_ns)
+{
+    return (double)(pages << TARGET_PAGE_BITS) / (1024 * 1024) /
+           ((double)elapsed_ns / NANOSECONDS_PER_SECOND);
+}
+
+/*
+ * Move the dirty log into a fresh bitmap covering all of ram_addr_t
+ * space, and return it.  If @blocks is not NULL, add an entry with the
+ * dirty page count of each RAMBlock to it.
+ *
+ * Called with the iothread lock held.
+ */
+static unsigned long *dirty_rate_sync(DirtyRateBlockInfoList **blocks,
+                                      unsigned long *nbits,
+                                      uint64_t *total)
+{
+    unsigned long *bmap;
+    RAMBlock *block;
+
+    *nbits = last_ram_offset() >> TARGET_PAGE_BITS;
+    bmap = bitmap_new(*nbits);
+    *total = 0;
+
+    address_space_sync_dirty_bitmap(&address_space_memory);
+
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        uint64_t pages = cpu_physical_memory_sync_dirty_bitmap(bmap,
+                                        block->offset, block->used_length);
+
+        *total += pages;
+        if (blocks) {
+            DirtyRateBlockInfoList *entry = g_new0(DirtyRateBlockInfoList, 1);
+
+            entry->value = g_new0(DirtyRateBlockInfo, 1);
+            entry->value->id = g_strdup(block->idstr);
+            entry->value->size = block->used_length;
+            entry->value->dirty_pages = pages;
+            *blocks = entry;
+            blocks = &entry->next;
+            trace_dirty_rate_block(block->idstr, pages);
+        }
+    }
+    rcu_read_unlock();
+
+    return bmap;
+}
+
+static void dirty_rate_count_node(int node, ram_addr_t start,
+                                  ram_addr_t length, void *opaque)
+{
+    DirtyRateNodeCount *count = opaque;
+    unsigned long first = start >> TARGET_PAGE_BITS;
+    unsigned long end = MIN((start + length) >> TARGET_PAGE_BITS,
+                            count->nbits);
+    unsigned long page;
+
+    count->nodes[node].size += length;
+    for (page = find_next_bit(count->bmap, end, first); page < end;
+         page = find_next_bit(count->bmap, end, page + 1)) {
+        count->nodes[node].dirty_pages++;
+    }
+}
+
+static void *dirty_rate_thread_fn(void *opaque)
+{
+    DirtyRateInfo *info = g_new0(DirtyRateInfo, 1);
+    DirtyRateBlockInfoList *blocks = NULL, *b;
+    DirtyRateNodeInfoList **next_node = &info->nodes;
+    DirtyRateNodeCount *count;
+    int64_t start_time, elapsed;
+    unsigned long nbits;
+    uint64_t total;
+    int i;
+
+    rcu_register_thread();
+
+    /* Dirty bits accumulated before the log was started are stale;
+     * the first sync only throws them away.
+     */
+    qemu_mutex_lock_iothread();
+    memory_global_dirty_log_start();
+    g_free(dirty_rate_sync(NULL, &nbits, &total));
+    start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    qemu_mutex_unlock_iothread();
+
+    g_usleep(dirty_rate_calc_time * G_USEC_PER_SEC);
+
+    count = g_new0(DirtyRateNodeCount, 1);
+    qemu_mutex_lock_iothread();
+    count->bmap = dirty_rate_sync(&blocks, &count->nbits, &total);
+    elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time;
+    memory_global_dirty_log_stop();
+    numa_foreach_ram_range(dirty_rate_count_node, count);
+
+    info->status = DIRTY_RATE_STATUS_MEASURED;
+    info->has_calc_time = true;
+    info->calc_time = dirty_rate_calc_time;
+    info->has_page_size = true;
+    info->page_size = TARGET_PAGE_SIZE;
+    info->has_dirty_pages = true;
+    info->dirty_pages = total;
+    info->has_dirty_rate = true;
+    info->dirty_rate = dirty_rate_mbps(total, elapsed);
+
+    for (b = blocks; b; b = b->next) {
+        b->value->dirty_rate = dirty_rate_mbps(b->value->dirty_pages,
+                                               elapsed);
+    }
+    info->has_blocks = true;
+    info->blocks = blocks;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        DirtyRateNodeInfoList *entry = g_new0(DirtyRateNodeInfoList, 1);
+
+        entry->value = g_new0(DirtyRateNodeInfo, 1);
+        entry->value->node = i;
+        entry->value->size = count->nodes[i].size;
+        entry->value->dirty_pages = count->nodes[i].dirty_pages;
+        entry->value->dirty_rate = dirty_rate_mbps(count->nodes[i].dirty_pages,
+                                                   elapsed);
+        *next_node = entry;
+        next_node = &entry->next;
+    }
+    info->has_nodes = nb_numa_nodes > 0;
+
+    trace_dirty_rate_done(total, elapsed / SCALE_MS);
+
+    qapi_free_DirtyRateInfo(dirty_rate_result);
+    dirty_rate_result = info;
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURED;
+    migrate_del_blocker(dirty_rate_blocker);
+    error_free(dirty_rate_blocker);
+    dirty_rate_blocker = NULL;
+    qemu_mutex_unlock_iothread();
+
+    g_free(count->bmap);
+    g_free(count);
+    rcu_unregister_thread();
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (dirty_rate_status == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "A dirty rate measurement is already in progress");
+        return;
+    }
+    if (migration_is_setup_or_active(s->state) ||
+        s->state == MIGRATION_STATUS_CANCELLING) {
+        error_setg(errp, QERR_MIGRATION_ACTIVE);
+        return;
+    }
+    if (runstate_check(RUN_STATE_INMIGRATE)) {
+        error_setg(errp, "Guest is waiting for an incoming migration");
+        return;
+    }
+    if (calc_time < 1 || calc_time > DIRTY_RATE_MAX_CALC_TIME) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "calc-time",
+                   "an integer in the range of 1 to "
+                   stringify(DIRTY_RATE_MAX_CALC_TIME));
+        return;
+    }
+
+    /* Migration needs the dirty log to itself */
+    error_setg(&dirty_rate_blocker,
+               "A dirty rate measurement is in progress");
+    migrate_add_blocker(dirty_rate_blocker);
+
+    trace_dirty_rate_start(calc_time);
+    dirty_rate_status = DIRTY_RATE_STATUS_MEASURING;
+    dirty_rate_calc_time = calc_time;
+    qemu_thread_create(&dirty_rate_thread, "dirtyrate", dirty_rate_thread_fn,
+                       NULL, QEMU_THREAD_DETACHED);
+}
+
+DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    DirtyRateInfo *info;
+
+    if (dirty_rate_status == DIRTY_RATE_STATUS_MEASURED) {
+        return QAPI_CLONE(DirtyRateInfo, dirty_rate_result);
+    }
+
+    info = g_new0(DirtyRateInfo, 1);
+    info->status = dirty_rate_status;
+    if (dirty_rate_status == DIRTY_RATE_STATUS_MEASURING) {
+        info->has_calc_time = true;
+        info->calc_time = dirty_rate_calc_time;
+    }
+    return info;
+}
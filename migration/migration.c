@@ -54,6 +54,9 @@
 /* Define default autoconverge cpu throttle migration parameters */
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL 20
 #define DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT 10
+/* Default number of parallel RAM channels and pages per packet */
+#define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
+#define DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT 16
 
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
@@ -89,6 +92,8 @@ MigrationState *migrate_get_current(void)
             .decompress_threads = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
             .cpu_throttle_initial = DEFAULT_MIGRATE_CPU_THROTTLE_INITIAL,
             .cpu_throttle_increment = DEFAULT_MIGRATE_CPU_THROTTLE_INCREMENT,
+            .x_multifd_channels = DEFAULT_MIGRATE_MULTIFD_CHANNELS,
+            .x_multifd_page_count = DEFAULT_MIGRATE_MULTIFD_PAGE_COUNT,
         },
     };
 
@@ -296,6 +301,27 @@ void migrate_send_rp_req_pages(MigrationIncomingState *mis, const char *rbname,
     }
 }
 
+/* The multifd channels are opened by the socket transport itself, and
+ * carry raw guest pages without going through the TLS layer.
+ */
+static bool migrate_multifd_check_uri(const char *uri, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_use_multifd()) {
+        return true;
+    }
+    if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "Multifd migration requires a tcp: or unix: URI");
+        return false;
+    }
+    if (s->parameters.tls_creds) {
+        error_setg(errp, "Multifd migration is not compatible with TLS");
+        return false;
+    }
+    return true;
+}
+
 void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
@@ -303,6 +329,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
     qapi_event_send_migration(MIGRATION_STATUS_SETUP, &error_abort);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
+    } else if (!migrate_multifd_check_uri(uri, errp)) {
+        return;
     } else if (strstart(uri, "tcp:", &p)) {
         tcp_start_incoming_migration(p, errp);
 #ifdef CONFIG_RDMA
@@ -379,6 +407,7 @@ static void process_incoming_migration_co(void *opaque)
     migrate_set_state(&mis->state, MIGRATION_STATUS_NONE,
                       MIGRATION_STATUS_ACTIVE);
     ret = qemu_loadvm_state(f);
+    multifd_load_cleanup();
 
     ps = postcopy_state_get();
     trace_process_incoming_migration_co_end(ret, ps);
@@ -566,6 +595,8 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->cpu_throttle_increment = s->parameters.cpu_throttle_increment;
     params->tls_creds = g_strdup(s->parameters.tls_creds);
     params->tls_hostname = g_strdup(s->parameters.tls_hostname);
+    params->x_multifd_channels = s->parameters.x_multifd_channels;
+    params->x_multifd_page_count = s->parameters.x_multifd_page_count;
 
     return params;
 }
@@ -574,7 +605,7 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
  * Return true if we're already in the middle of a migration
  * (i.e. any of the active or setup states)
  */
-static bool migration_is_setup_or_active(int state)
+bool migration_is_setup_or_active(int state)
 {
     switch (state) {
     case MIGRATION_STATUS_ACTIVE:
@@ -596,6 +627,7 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->cache_size = migrate_xbzrle_cache_size();
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
         info->xbzrle_cache->cache_miss_rate = xbzrle_mig_cache_miss_rate();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
@@ -757,6 +789,36 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
                 false;
         }
     }
+
+    if (migrate_use_multifd()) {
+        /* Pages reach the destination out of order with respect to the
+         * main stream, which neither the postcopy page requests nor the
+         * XBZRLE cache can cope with; compression would need its own
+         * per-channel streams.
+         */
+        if (migrate_postcopy_ram() || migrate_use_xbzrle() ||
+            migrate_use_compression()) {
+            error_report("Multifd is not currently compatible with "
+                         "postcopy, xbzrle or compression");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD] = false;
+        }
+    }
+
+    if (migrate_use_zero_copy_send()) {
+#ifdef CONFIG_MSG_ZEROCOPY
+        /* The main stream buffers are reused as soon as they are written,
+         * only the multifd channels send from guest memory.
+         */
+        if (!migrate_use_multifd()) {
+            error_report("Zero copy send requires multifd");
+            s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND] =
+                false;
+        }
+#else
+        error_report("Zero copy send is not supported by this host");
+        s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND] = false;
+#endif
+    }
 }
 
 void qmp_migrate_set_parameters(bool has_compress_level,
@@ -773,6 +835,10 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                                 const char *tls_creds,
                                 bool has_tls_hostname,
                                 const char *tls_hostname,
+                                bool has_x_multifd_channels,
+                                int64_t x_multifd_channels,
+                                bool has_x_multifd_page_count,
+                                int64_t x_multifd_page_count,
                                 Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -808,6 +874,22 @@ void qmp_migrate_set_parameters(bool has_compress_level,
                    "cpu_throttle_increment",
                    "an integer in the range of 1 to 99");
     }
+    if (has_x_multifd_channels &&
+            (x_multifd_channels < 1 || x_multifd_channels > 255)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_channels",
+                   "is invalid, it should be in the range of 1 to 255");
+        return;
+    }
+    if (has_x_multifd_page_count &&
+            (x_multifd_page_count < 1 ||
+             x_multifd_page_count > MULTIFD_PAGE_COUNT_MAX)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "x_multifd_page_count",
+                   "is invalid, it should be in the range of 1 to "
+                   stringify(MULTIFD_PAGE_COUNT_MAX));
+        return;
+    }
 
     if (has_compress_level) {
         s->parameters.compress_level = compress_level;
@@ -832,6 +914,12 @@ void qmp_migrate_set_parameters(bool has_compress_level,
         g_free(s->parameters.tls_hostname);
         s->parameters.tls_hostname = g_strdup(tls_hostname);
     }
+    if (has_x_multifd_channels) {
+        s->parameters.x_multifd_channels = x_multifd_channels;
+    }
+    if (has_x_multifd_page_count) {
+        s->parameters.x_multifd_page_count = x_multifd_page_count;
+    }
 }
 
 
@@ -1095,6 +1183,10 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    if (!migrate_multifd_check_uri(uri, errp)) {
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -1279,6 +1371,42 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+bool migrate_use_multifd(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
+int migrate_multifd_channels(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_channels;
+}
+
+int migrate_multifd_page_count(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.x_multifd_page_count;
+}
+
 /* migration thread support */
 /*
  * Something bad happened to the RP stream, mark an error
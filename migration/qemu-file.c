@@ -273,6 +273,15 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/* Account @size bytes that were sent on behalf of @f through another
+ * channel, so that rate limiting and the bandwidth estimate cover them.
+ */
+void qemu_file_credit_transfer(QEMUFile *f, size_t size)
+{
+    f->pos += size;
+    f->bytes_xfer += size;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
@@ -68,6 +68,7 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
+#define RAM_SAVE_FLAG_MULTIFD_SYNC     0x200
 
 static const uint8_t ZERO_TARGET_PAGE[TARGET_PAGE_SIZE];
 
@@ -151,6 +152,7 @@ typedef struct AccountingInfo {
     uint64_t iterations;
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
+    uint64_t xbzrle_cache_hit;
     uint64_t xbzrle_cache_miss;
     double xbzrle_cache_miss_rate;
     uint64_t xbzrle_overflows;
@@ -203,6 +205,11 @@ uint64_t xbzrle_mig_pages_transferred(void)
     return acct_info.xbzrle_pages;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
 uint64_t xbzrle_mig_pages_cache_miss(void)
 {
     return acct_info.xbzrle_cache_miss;
@@ -481,7 +488,9 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
 
-    if (!cache_is_cached(XBZRLE.cache, current_addr, bitmap_sync_count)) {
+    prev_cached_page = cache_lookup(XBZRLE.cache, current_addr,
+                                    bitmap_sync_count);
+    if (!prev_cached_page) {
         acct_info.xbzrle_cache_miss++;
         if (!last_stage) {
             if (cache_insert(XBZRLE.cache, current_addr, *current_data,
@@ -495,8 +504,7 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
         }
         return -1;
     }
-
-    prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
+    acct_info.xbzrle_cache_hit++;
 
     /* save current buffer into memory */
     memcpy(XBZRLE.current_buf, *current_data, TARGET_PAGE_SIZE);
@@ -737,6 +745,8 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
     bool send_async = true;
     RAMBlock *block = pss->block;
     ram_addr_t offset = pss->offset;
+    /* The XBZRLE cache is neither read nor updated in the bulk stage */
+    bool use_cache = !ram_bulk_stage && migrate_use_xbzrle();
 
     p = block->host + offset;
 
@@ -749,7 +759,9 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         pages = 1;
     }
 
-    XBZRLE_cache_lock();
+    if (use_cache) {
+        qemu_mutex_lock(&XBZRLE.lock);
+    }
 
     current_addr = block->offset + offset;
 
@@ -771,7 +783,7 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
              * page would be stale
              */
             xbzrle_cache_zero_page(current_addr);
-        } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
+        } else if (use_cache) {
             pages = save_xbzrle_page(f, &p, current_addr, block,
                                      offset, last_stage, bytes_transferred);
             if (!last_stage) {
@@ -797,7 +809,9 @@ static int ram_save_page(QEMUFile *f, PageSearchStatus *pss,
         acct_info.norm_pages++;
     }
 
-    XBZRLE_cache_unlock();
+    if (use_cache) {
+        qemu_mutex_unlock(&XBZRLE.lock);
+    }
 
     return pages;
 }
@@ -825,6 +839,461 @@ static int do_compress_ram_page(QEMUFile *f, RAMBlock *block,
 
 static uint64_t bytes_transferred;
 
+/* Multiple channel (multifd) migration
+ *
+ * Normal pages are batched into packets, each holding up to
+ * x-multifd-page-count pages of a single RAMBlock, and written by one
+ * thread per channel on its own socket.  The main stream keeps zero pages
+ * and the RAM_SAVE_FLAG_MULTIFD_SYNC points: at each of them every channel
+ * has sent all the pages queued before, followed by a packet carrying
+ * MULTIFD_FLAG_SYNC, and the destination waits for all the channels to
+ * reach that packet before it goes on reading the main stream.  This keeps
+ * a page sent in one round from overtaking the same page sent later.
+ *
+ * With x-zero-copy-send, the pages (but not the packet headers, whose
+ * buffer is reused) are written with MSG_ZEROCOPY, and the kernel may read
+ * them from guest memory after the write has returned.  Each sync point
+ * waits for the completions of all channels, so that no zero copy write
+ * is still in flight when the dirty bitmap is synchronized again and the
+ * pages it covers may be sent once more.
+ */
+
+#define MULTIFD_MAGIC 0x11223344U
+#define MULTIFD_VERSION 1
+
+#define MULTIFD_FLAG_SYNC (1 << 0)
+
+struct MultiFDPacket {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t pages_used;
+    uint64_t packet_num;
+    char ramblock[256];
+    uint64_t offset[];
+} QEMU_PACKED;
+typedef struct MultiFDPacket MultiFDPacket;
+
+struct MultiFDPages {
+    /* number of used pages */
+    uint32_t used;
+    /* number of allocated pages */
+    uint32_t allocated;
+    /* all the pages belong to this block */
+    RAMBlock *block;
+    /* offset of each page inside the block */
+    ram_addr_t *offset;
+};
+typedef struct MultiFDPages MultiFDPages;
+
+struct MultiFDSendParams {
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted by the migration thread when there is a job, or to quit */
+    QemuSemaphore sem;
+    /* everything below is protected by mutex */
+    QemuMutex mutex;
+    bool quit;
+    /* a job (pages and/or a sync packet) is waiting to be sent */
+    int pending_job;
+    MultiFDPages *pages;
+    uint32_t flags;
+    /* owned by the thread */
+    MultiFDPacket *packet;
+    struct iovec *iov;
+    uint64_t num_packets;
+};
+typedef struct MultiFDSendParams MultiFDSendParams;
+
+static struct {
+    MultiFDSendParams *params;
+    /* number of channels */
+    int count;
+    /* pages being batched by the migration thread */
+    MultiFDPages *pages;
+    /* one post per channel that is idle and has not been given a job */
+    QemuSemaphore channels_ready;
+    int next_channel;
+    /* set once any channel fails */
+    int error;
+    bool zero_copy;
+} *multifd_send_state;
+
+static MultiFDPages *multifd_pages_init(uint32_t count)
+{
+    MultiFDPages *pages = g_new0(MultiFDPages, 1);
+
+    pages->allocated = count;
+    pages->offset = g_new0(ram_addr_t, count);
+    return pages;
+}
+
+static void multifd_pages_free(MultiFDPages *pages)
+{
+    g_free(pages->offset);
+    g_free(pages);
+}
+
+static void multifd_send_fill_packet(MultiFDSendParams *p)
+{
+    MultiFDPacket *packet = p->packet;
+    MultiFDPages *pages = p->pages;
+    uint32_t i;
+
+    packet->magic = cpu_to_be32(MULTIFD_MAGIC);
+    packet->version = cpu_to_be32(MULTIFD_VERSION);
+    packet->flags = cpu_to_be32(p->flags);
+    packet->pages_used = cpu_to_be32(pages->used);
+    packet->packet_num = cpu_to_be64(p->num_packets++);
+    memset(packet->ramblock, 0, sizeof(packet->ramblock));
+    if (pages->block) {
+        pstrcpy(packet->ramblock, sizeof(packet->ramblock),
+                pages->block->idstr);
+    }
+
+    p->iov[0].iov_base = packet;
+    p->iov[0].iov_len = sizeof(*packet) + pages->used * sizeof(uint64_t);
+    for (i = 0; i < pages->used; i++) {
+        packet->offset[i] = cpu_to_be64(pages->offset[i]);
+        p->iov[i + 1].iov_base = pages->block->host + pages->offset[i];
+        p->iov[i + 1].iov_len = TARGET_PAGE_SIZE;
+    }
+}
+
+/* The packet header is copied into the socket buffer, since the thread
+ * reuses p->packet as soon as the write returns; only the pages are sent
+ * straight from guest memory.
+ */
+static int multifd_send_zero_copy(MultiFDSendParams *p, uint32_t niov,
+                                  Error **errp)
+{
+    if (qio_channel_writev_all(p->c, p->iov, 1, errp) < 0) {
+        return -1;
+    }
+    if (niov == 1) {
+        return 0;
+    }
+    return qio_channel_writev_all_flags(p->c, p->iov + 1, niov - 1,
+                                        QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                                        errp);
+}
+
+static void *multifd_send_thread(void *opaque)
+{
+    MultiFDSendParams *p = opaque;
+    Error *local_err = NULL;
+    QIOChannel *c;
+    int ret;
+
+    trace_multifd_send_thread_start(p->id);
+
+    c = socket_send_channel_create(&local_err);
+    if (!c) {
+        goto out;
+    }
+    if (multifd_send_state->zero_copy &&
+        !qio_channel_has_feature(c, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "Zero copy send is not supported by the "
+                   "multifd channels");
+        object_unref(OBJECT(c));
+        goto out;
+    }
+    qemu_mutex_lock(&p->mutex);
+    p->c = c;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&multifd_send_state->channels_ready);
+
+    while (true) {
+        qemu_sem_wait(&p->sem);
+        qemu_mutex_lock(&p->mutex);
+        if (p->pending_job) {
+            uint32_t niov = p->pages->used + 1;
+
+            multifd_send_fill_packet(p);
+            p->flags = 0;
+            qemu_mutex_unlock(&p->mutex);
+
+            if (multifd_send_state->zero_copy) {
+                ret = multifd_send_zero_copy(p, niov, &local_err);
+            } else {
+                ret = qio_channel_writev_all(p->c, p->iov, niov, &local_err);
+            }
+            if (ret < 0) {
+                goto out;
+            }
+
+            qemu_mutex_lock(&p->mutex);
+            p->pages->used = 0;
+            p->pages->block = NULL;
+            p->pending_job--;
+            qemu_mutex_unlock(&p->mutex);
+            qemu_sem_post(&multifd_send_state->channels_ready);
+        } else if (p->quit) {
+            qemu_mutex_unlock(&p->mutex);
+            break;
+        } else {
+            qemu_mutex_unlock(&p->mutex);
+        }
+    }
+
+out:
+    if (local_err) {
+        error_report_err(local_err);
+        atomic_set(&multifd_send_state->error, 1);
+        qemu_file_set_error(migrate_get_current()->to_dst_file, -EIO);
+        /* wake up the migration thread if it is waiting for a channel */
+        qemu_sem_post(&multifd_send_state->channels_ready);
+    }
+    trace_multifd_send_thread_end(p->id, p->num_packets);
+
+    return NULL;
+}
+
+static void multifd_save_setup(void)
+{
+    int thread_count, page_count;
+    int i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    thread_count = migrate_multifd_channels();
+    page_count = migrate_multifd_page_count();
+    multifd_send_state = g_malloc0(sizeof(*multifd_send_state));
+    multifd_send_state->count = thread_count;
+    multifd_send_state->params = g_new0(MultiFDSendParams, thread_count);
+    multifd_send_state->pages = multifd_pages_init(page_count);
+    multifd_send_state->zero_copy = migrate_use_zero_copy_send();
+    qemu_sem_init(&multifd_send_state->channels_ready, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_init(&p->mutex);
+        qemu_sem_init(&p->sem, 0);
+        p->id = i;
+        p->pages = multifd_pages_init(page_count);
+        p->packet = g_malloc0(sizeof(MultiFDPacket) +
+                              page_count * sizeof(uint64_t));
+        p->iov = g_new0(struct iovec, page_count + 1);
+        p->name = g_strdup_printf("multifdsend_%d", i);
+        qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void multifd_save_cleanup(void)
+{
+    bool aborted;
+    int i;
+
+    if (!multifd_send_state) {
+        return;
+    }
+
+    /* After a successful migration the threads still have to push out
+     * the last sync packets; otherwise unblock any pending I/O.
+     */
+    aborted = !migration_has_finished(migrate_get_current());
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->quit = true;
+        if (aborted && p->c) {
+            qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        }
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    for (i = 0; i < multifd_send_state->count; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_thread_join(&p->thread);
+        if (p->c) {
+            object_unref(OBJECT(p->c));
+        }
+        qemu_mutex_destroy(&p->mutex);
+        qemu_sem_destroy(&p->sem);
+        multifd_pages_free(p->pages);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_send_state->channels_ready);
+    multifd_pages_free(multifd_send_state->pages);
+    g_free(multifd_send_state->params);
+    g_free(multifd_send_state);
+    multifd_send_state = NULL;
+}
+
+/* Grab the next idle channel.  Returns with its mutex held, or NULL if a
+ * channel has failed.
+ */
+static MultiFDSendParams *multifd_get_idle_channel(void)
+{
+    int channels = multifd_send_state->count;
+    MultiFDSendParams *p;
+    int i;
+
+    qemu_sem_wait(&multifd_send_state->channels_ready);
+    if (atomic_read(&multifd_send_state->error)) {
+        /* leave the post for the next waiter, so that nobody hangs */
+        qemu_sem_post(&multifd_send_state->channels_ready);
+        return NULL;
+    }
+
+    for (i = multifd_send_state->next_channel;; i = (i + 1) % channels) {
+        p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        if (!p->pending_job) {
+            multifd_send_state->next_channel = (i + 1) % channels;
+            return p;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+}
+
+static int multifd_send_pages(void)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+    MultiFDSendParams *p;
+
+    p = multifd_get_idle_channel();
+    if (!p) {
+        return -1;
+    }
+    p->pending_job++;
+    multifd_send_state->pages = p->pages;
+    p->pages = pages;
+    qemu_mutex_unlock(&p->mutex);
+    qemu_sem_post(&p->sem);
+
+    return 0;
+}
+
+static int multifd_queue_page(RAMBlock *block, ram_addr_t offset)
+{
+    MultiFDPages *pages = multifd_send_state->pages;
+
+    if (pages->block && pages->block != block) {
+        if (multifd_send_pages() < 0) {
+            return -1;
+        }
+        pages = multifd_send_state->pages;
+    }
+
+    pages->block = block;
+    pages->offset[pages->used++] = offset;
+    if (pages->used == pages->allocated) {
+        return multifd_send_pages();
+    }
+    return 0;
+}
+
+/* Put a synchronization point on the main stream, after all the pages
+ * queued so far.  Must be called within the same RCU critical section
+ * that queued the pages, since the threads access the RAMBlocks.
+ */
+static void multifd_send_sync_main(QEMUFile *f)
+{
+    Error *local_err = NULL;
+    int channels, i;
+
+    if (!migrate_use_multifd()) {
+        return;
+    }
+    if (multifd_send_state->pages->used && multifd_send_pages() < 0) {
+        goto err;
+    }
+
+    trace_multifd_send_sync_main();
+
+    /* Once every channel is idle, each of them has sent its pages */
+    channels = multifd_send_state->count;
+    for (i = 0; i < channels; i++) {
+        MultiFDSendParams *p = multifd_get_idle_channel();
+
+        if (!p) {
+            goto err;
+        }
+        qemu_mutex_unlock(&p->mutex);
+    }
+    /* The threads are all waiting for a job, so their channels are idle */
+    for (i = 0; multifd_send_state->zero_copy && i < channels; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+        int ret = qio_channel_flush(p->c, &local_err);
+
+        if (ret < 0) {
+            error_report_err(local_err);
+            goto err;
+        }
+        trace_multifd_send_zero_copy_flush(p->id, ret);
+    }
+    for (i = 0; i < channels; i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        p->flags |= MULTIFD_FLAG_SYNC;
+        p->pending_job++;
+        qemu_mutex_unlock(&p->mutex);
+        qemu_sem_post(&p->sem);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_MULTIFD_SYNC);
+    bytes_transferred += 8;
+    return;
+
+err:
+    qemu_file_set_error(f, -EIO);
+}
+
+/**
+ * ram_save_multifd_page: Send the given page through the multifd channels
+ *
+ * Zero pages still go to the main stream, everything else is queued for
+ * the sender threads.
+ *
+ * Returns: Number of pages written, or < 0 on error.
+ *
+ * @f: QEMUFile where to send the data
+ * @pss: data about the page we want to send
+ * @bytes_transferred: increase it with the number of transferred bytes
+ */
+static int ram_save_multifd_page(QEMUFile *f, PageSearchStatus *pss,
+                                 uint64_t *bytes_transferred)
+{
+    RAMBlock *block = pss->block;
+    ram_addr_t offset = pss->offset;
+    int pages;
+
+    /* Only the main stream pages count for RAM_SAVE_FLAG_CONTINUE, so
+     * last_sent_block is kept up to date here rather than by the caller.
+     */
+    pages = save_zero_page(f, block,
+                           offset | (block == last_sent_block ?
+                                     RAM_SAVE_FLAG_CONTINUE : 0),
+                           block->host + offset, bytes_transferred);
+    if (pages > 0) {
+        last_sent_block = block;
+        return pages;
+    }
+
+    if (multifd_queue_page(block, offset) < 0) {
+        qemu_file_set_error(f, -EIO);
+        return -1;
+    }
+    qemu_file_credit_transfer(f, TARGET_PAGE_SIZE);
+    *bytes_transferred += TARGET_PAGE_SIZE;
+    acct_info.norm_pages++;
+
+    return 1;
+}
+
 static void flush_compressed_data(QEMUFile *f)
 {
     int idx, len, thread_count;
@@ -1239,6 +1708,8 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
             res = ram_save_compressed_page(f, pss,
                                            last_stage,
                                            bytes_transferred);
+        } else if (migrate_use_multifd()) {
+            res = ram_save_multifd_page(f, pss, bytes_transferred);
         } else {
             res = ram_save_page(f, pss, last_stage,
                                 bytes_transferred);
@@ -1255,7 +1726,7 @@ static int ram_save_target_page(MigrationState *ms, QEMUFile *f,
          * might have decided the page was identical so didn't bother writing
          * to the stream.
          */
-        if (res > 0) {
+        if (res > 0 && !migrate_use_multifd()) {
             last_sent_block = pss->block;
         }
     }
@@ -1434,6 +1905,7 @@ static void ram_migration_cleanup(void *opaque)
         XBZRLE.current_buf = NULL;
     }
     XBZRLE_cache_unlock();
+    multifd_save_cleanup();
 }
 
 static void reset_ram_globals(void)
@@ -1915,6 +2387,8 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    multifd_save_setup();
+
     /* For memory_global_dirty_log_start below.  */
     qemu_mutex_lock_iothread();
 
@@ -2008,6 +2482,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
     flush_compressed_data(f);
+    multifd_send_sync_main(f);
     rcu_read_unlock();
 
     /*
@@ -2052,6 +2527,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     }
 
     flush_compressed_data(f);
+    multifd_send_sync_main(f);
     ram_control_after_iterate(f, RAM_CONTROL_FINISH);
 
     rcu_read_unlock();
@@ -2167,6 +2643,262 @@ static inline void *host_from_ram_block_offset(RAMBlock *block,
     return block->host + offset;
 }
 
+struct MultiFDRecvParams {
+    uint8_t id;
+    char *name;
+    QemuThread thread;
+    QIOChannel *c;
+    /* posted by the main thread to release us after a sync point */
+    QemuSemaphore sem_sync;
+    bool quit;
+    /* number of page slots in packet and iov */
+    uint32_t allocated;
+    MultiFDPacket *packet;
+    struct iovec *iov;
+    uint64_t num_packets;
+};
+typedef struct MultiFDRecvParams MultiFDRecvParams;
+
+static struct {
+    MultiFDRecvParams *params;
+    /* number of channels expected, and connected so far */
+    int count;
+    int connected;
+    /* posted by each channel when it reaches a sync packet, or fails */
+    QemuSemaphore sem_sync;
+    /* set once any channel fails or goes away */
+    int error;
+} *multifd_recv_state;
+
+/* Read one packet and place its pages straight into guest memory.
+ *
+ * Returns: 1 if a packet was read, 0 on end of file, -1 on error
+ */
+static int multifd_recv_packet(MultiFDRecvParams *p, uint32_t *flags,
+                               Error **errp)
+{
+    struct iovec iov = {
+        .iov_base = p->packet,
+        .iov_len = sizeof(MultiFDPacket),
+    };
+    MultiFDPacket *packet;
+    RAMBlock *block;
+    uint32_t used, i;
+    int ret;
+
+    ret = qio_channel_readv_all_eof(p->c, &iov, 1, errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    packet = p->packet;
+    if (be32_to_cpu(packet->magic) != MULTIFD_MAGIC) {
+        error_setg(errp, "multifd: received packet magic %x, expected %x",
+                   be32_to_cpu(packet->magic), MULTIFD_MAGIC);
+        return -1;
+    }
+    if (be32_to_cpu(packet->version) != MULTIFD_VERSION) {
+        error_setg(errp, "multifd: received packet version %u, expected %u",
+                   be32_to_cpu(packet->version), MULTIFD_VERSION);
+        return -1;
+    }
+    used = be32_to_cpu(packet->pages_used);
+    if (used > MULTIFD_PAGE_COUNT_MAX) {
+        error_setg(errp, "multifd: received packet with %u pages, "
+                   "maximum is %u", used, MULTIFD_PAGE_COUNT_MAX);
+        return -1;
+    }
+    *flags = be32_to_cpu(packet->flags);
+    p->num_packets++;
+    if (!used) {
+        return 1;
+    }
+
+    if (used > p->allocated) {
+        p->packet = packet = g_realloc(packet, sizeof(MultiFDPacket) +
+                                       used * sizeof(uint64_t));
+        p->iov = g_renew(struct iovec, p->iov, used);
+        p->allocated = used;
+    }
+    if (qio_channel_read_all(p->c, (char *)packet->offset,
+                             used * sizeof(uint64_t), errp) < 0) {
+        return -1;
+    }
+
+    packet->ramblock[sizeof(packet->ramblock) - 1] = 0;
+    rcu_read_lock();
+    block = qemu_ram_block_by_name(packet->ramblock);
+    if (!block) {
+        error_setg(errp, "multifd: unknown ramblock \"%s\"",
+                   packet->ramblock);
+        ret = -1;
+        goto out;
+    }
+    for (i = 0; i < used; i++) {
+        uint64_t offset = be64_to_cpu(packet->offset[i]);
+        void *host = host_from_ram_block_offset(block, offset);
+
+        if (!host || (offset & ~TARGET_PAGE_MASK)) {
+            error_setg(errp, "multifd: illegal RAM offset %" PRIx64
+                       " in ramblock \"%s\"", offset, packet->ramblock);
+            ret = -1;
+            goto out;
+        }
+        p->iov[i].iov_base = host;
+        p->iov[i].iov_len = TARGET_PAGE_SIZE;
+    }
+    ret = qio_channel_readv_all(p->c, p->iov, used, errp) < 0 ? -1 : 1;
+
+out:
+    rcu_read_unlock();
+    return ret;
+}
+
+static void *multifd_recv_thread(void *opaque)
+{
+    MultiFDRecvParams *p = opaque;
+    Error *local_err = NULL;
+    uint32_t flags = 0;
+    int ret;
+
+    rcu_register_thread();
+    trace_multifd_recv_thread_start(p->id);
+
+    while (true) {
+        ret = multifd_recv_packet(p, &flags, &local_err);
+        if (ret <= 0) {
+            break;
+        }
+        if (flags & MULTIFD_FLAG_SYNC) {
+            qemu_sem_post(&multifd_recv_state->sem_sync);
+            qemu_sem_wait(&p->sem_sync);
+        }
+        if (atomic_read(&p->quit)) {
+            break;
+        }
+    }
+
+    if (local_err) {
+        if (!atomic_read(&p->quit)) {
+            error_report_err(local_err);
+        } else {
+            error_free(local_err);
+        }
+    }
+    if (ret <= 0) {
+        /* A channel that is gone will never reach the next sync point */
+        atomic_set(&multifd_recv_state->error, 1);
+        qemu_sem_post(&multifd_recv_state->sem_sync);
+    }
+    trace_multifd_recv_thread_end(p->id, p->num_packets);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+void multifd_load_setup(void)
+{
+    int thread_count;
+    int i;
+
+    multifd_load_cleanup();
+
+    thread_count = migrate_multifd_channels();
+    multifd_recv_state = g_malloc0(sizeof(*multifd_recv_state));
+    multifd_recv_state->params = g_new0(MultiFDRecvParams, thread_count);
+    multifd_recv_state->count = thread_count;
+    qemu_sem_init(&multifd_recv_state->sem_sync, 0);
+
+    for (i = 0; i < thread_count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        qemu_sem_init(&p->sem_sync, 0);
+        p->id = i;
+        p->packet = g_malloc0(sizeof(MultiFDPacket));
+        p->name = g_strdup_printf("multifdrecv_%d", i);
+    }
+}
+
+void multifd_recv_new_channel(QIOChannel *ioc)
+{
+    MultiFDRecvParams *p;
+
+    if (!multifd_recv_state ||
+        multifd_recv_state->connected == multifd_recv_state->count) {
+        error_report("multifd: unexpected migration connection");
+        return;
+    }
+
+    p = &multifd_recv_state->params[multifd_recv_state->connected++];
+    object_ref(OBJECT(ioc));
+    p->c = ioc;
+    qemu_thread_create(&p->thread, p->name, multifd_recv_thread, p,
+                       QEMU_THREAD_JOINABLE);
+}
+
+void multifd_load_cleanup(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        return;
+    }
+
+    for (i = 0; i < multifd_recv_state->connected; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        atomic_set(&p->quit, true);
+        qio_channel_shutdown(p->c, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+        qemu_sem_post(&p->sem_sync);
+    }
+
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        MultiFDRecvParams *p = &multifd_recv_state->params[i];
+
+        if (p->c) {
+            qemu_thread_join(&p->thread);
+            object_unref(OBJECT(p->c));
+        }
+        qemu_sem_destroy(&p->sem_sync);
+        g_free(p->packet);
+        g_free(p->iov);
+        g_free(p->name);
+    }
+    qemu_sem_destroy(&multifd_recv_state->sem_sync);
+    g_free(multifd_recv_state->params);
+    g_free(multifd_recv_state);
+    multifd_recv_state = NULL;
+}
+
+/* Called from ram_load() at a RAM_SAVE_FLAG_MULTIFD_SYNC point: wait until
+ * every channel has received all the pages sent before it, then let them
+ * go on with the next round.
+ */
+static int multifd_recv_sync_main(void)
+{
+    int i;
+
+    if (!multifd_recv_state) {
+        error_report("multifd: sync point received, but x-multifd "
+                     "is not enabled");
+        return -EINVAL;
+    }
+
+    trace_multifd_recv_sync_main();
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_wait(&multifd_recv_state->sem_sync);
+    }
+    if (atomic_read(&multifd_recv_state->error)) {
+        error_report("multifd: a channel has failed");
+        return -EIO;
+    }
+    for (i = 0; i < multifd_recv_state->count; i++) {
+        qemu_sem_post(&multifd_recv_state->params[i].sem_sync);
+    }
+
+    return 0;
+}
+
 /*
  * If a page (or a whole RDMA chunk) has been
  * determined to be zero, then zap it.
@@ -2554,6 +3286,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MULTIFD_SYNC:
+            ret = multifd_recv_sync_main();
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
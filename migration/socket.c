@@ -19,6 +19,8 @@
 #include "qemu-common.h"
 #include "qemu/error-report.h"
 #include "qapi/error.h"
+#include "qapi/clone-visitor.h"
+#include "qapi-visit.h"
 #include "migration/migration.h"
 #include "migration/qemu-file.h"
 #include "io/channel-socket.h"
@@ -55,6 +57,30 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+/* Address of the outgoing migration, kept around so that the multifd
+ * sender threads can open their own connections to the destination.
+ */
+static SocketAddress *outgoing_saddr;
+
+QIOChannel *socket_send_channel_create(Error **errp)
+{
+    QIOChannelSocket *sioc;
+
+    if (!outgoing_saddr) {
+        error_setg(errp, "Multifd requires a socket migration transport");
+        return NULL;
+    }
+
+    sioc = qio_channel_socket_new();
+    if (qio_channel_socket_connect_sync(sioc, outgoing_saddr, errp) < 0) {
+        object_unref(OBJECT(sioc));
+        return NULL;
+    }
+    trace_migration_socket_send_channel_created();
+    return QIO_CHANNEL(sioc);
+}
+
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -100,6 +126,9 @@ static void socket_start_outgoing_migration(MigrationState *s,
         data->hostname = g_strdup(saddr->u.inet.data->host);
     }
 
+    qapi_free_SocketAddress(outgoing_saddr);
+    outgoing_saddr = QAPI_CLONE(SocketAddress, saddr);
+
     qio_channel_socket_connect_async(sioc,
                                      saddr,
                                      socket_outgoing_migration,
@@ -125,6 +154,15 @@ void unix_start_outgoing_migration(MigrationState *s,
 }
 
 
+/* With multifd, the source first connects the main migration stream and
+ * then one connection per channel.  The main stream is only processed once
+ * every channel has been accepted, because loading RAM waits for all the
+ * channels at each synchronization point and would otherwise keep the main
+ * loop from accepting the rest.
+ */
+static unsigned int incoming_channels;
+static QIOChannel *incoming_main_ioc;
+
 static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
                                                  GIOCondition condition,
                                                  gpointer opaque)
@@ -142,11 +180,31 @@ static gboolean socket_accept_incoming_migration(QIOChannel *ioc,
 
     trace_migration_socket_incoming_accepted();
 
+    if (!migrate_use_multifd()) {
+        migration_channel_process_incoming(migrate_get_current(),
+                                           QIO_CHANNEL(sioc));
+        object_unref(OBJECT(sioc));
+        goto out;
+    }
+
+    if (incoming_channels++ == 0) {
+        incoming_main_ioc = QIO_CHANNEL(sioc);
+    } else {
+        multifd_recv_new_channel(QIO_CHANNEL(sioc));
+        object_unref(OBJECT(sioc));
+    }
+    if (incoming_channels <= migrate_multifd_channels()) {
+        return TRUE; /* keep accepting */
+    }
+
     migration_channel_process_incoming(migrate_get_current(),
-                                       QIO_CHANNEL(sioc));
-    object_unref(OBJECT(sioc));
+                                       incoming_main_ioc);
 
 out:
+    if (incoming_main_ioc) {
+        object_unref(OBJECT(incoming_main_ioc));
+        incoming_main_ioc = NULL;
+    }
     /* Close listening socket as its no longer needed */
     qio_channel_close(ioc, NULL);
     return FALSE; /* unregister */
@@ -164,6 +222,11 @@ static void socket_start_incoming_migration(SocketAddress *saddr,
         return;
     }
 
+    if (migrate_use_multifd()) {
+        incoming_channels = 0;
+        multifd_load_setup();
+    }
+
     qio_channel_add_watch(QIO_CHANNEL(listen_ioc),
                           G_IO_IN,
                           socket_accept_incoming_migration,
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -24,17 +25,14 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+static int xbzrle_encode_buffer_int(uint8_t *old_buf, uint8_t *new_buf,
+                                    int slen, uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
     long res;
     uint8_t *nzrun_start = NULL;
 
-    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
-               sizeof(long)));
-
     while (i < slen) {
         /* overflow */
         if (d + 2 > dlen) {
@@ -126,6 +124,221 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * Vector implementations.  They compare a whole vector of both pages at a
+ * time and use the resulting byte mask to find where a run ends, so they
+ * produce exactly the same output as xbzrle_encode_buffer_int().
+ */
+
+/* Returns the length of the run starting at @i of bytes that are equal
+ * (if @equal) or different (if !@equal) in @old_buf and @new_buf.
+ */
+typedef int XbzrleRunFunc(const uint8_t *old_buf, const uint8_t *new_buf,
+                          int i, int slen, bool equal);
+
+static inline __attribute__((__always_inline__))
+int xbzrle_encode_runs(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                       uint8_t *dst, int dlen, XbzrleRunFunc *run)
+{
+    uint32_t zrun_len, nzrun_len;
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_len = run(old_buf, new_buf, i, slen, true);
+        i += zrun_len;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_len = run(old_buf, new_buf, i, slen, false);
+        d += uleb128_encode_small(dst + d, nzrun_len);
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+static inline int xbzrle_run_sse2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf,
+                                  int i, int slen, bool equal)
+{
+    int start = i;
+
+    for (; i + sizeof(__m128i) <= slen; i += sizeof(__m128i)) {
+        __m128i o = _mm_loadu_si128((const __m128i *)(old_buf + i));
+        __m128i n = _mm_loadu_si128((const __m128i *)(new_buf + i));
+        /* one bit set for each byte that ends the run */
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(o, n));
+
+        if (equal) {
+            mask ^= 0xffff;
+        }
+        if (mask) {
+            return i + ctz32(mask) - start;
+        }
+    }
+
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i - start;
+}
+
+static int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <cpuid.h>
+#include <immintrin.h>
+
+static inline int xbzrle_run_avx2(const uint8_t *old_buf,
+                                  const uint8_t *new_buf,
+                                  int i, int slen, bool equal)
+{
+    int start = i;
+
+    for (; i + sizeof(__m256i) <= slen; i += sizeof(__m256i)) {
+        __m256i o = _mm256_loadu_si256((const __m256i *)(old_buf + i));
+        __m256i n = _mm256_loadu_si256((const __m256i *)(new_buf + i));
+        /* one bit set for each byte that ends the run */
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(o, n));
+
+        if (equal) {
+            mask = ~mask;
+        }
+        if (mask) {
+            return i + ctz32(mask) - start;
+        }
+    }
+
+    while (i < slen && (old_buf[i] == new_buf[i]) == equal) {
+        i++;
+    }
+    return i - start;
+}
+
+static int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf,
+                                     int slen, uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_runs(old_buf, new_buf, slen, dst, dlen,
+                              xbzrle_run_avx2);
+}
+#pragma GCC pop_options
+
+static bool avx2_support(void)
+{
+    unsigned int a, b, c, d;
+    uint32_t xcr0_lo, xcr0_hi;
+
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return false;
+    }
+
+    /* The OS must save the YMM registers too */
+    __cpuid(1, a, b, c, d);
+    if (!(c & bit_OSXSAVE) || !(c & bit_AVX)) {
+        return false;
+    }
+    asm("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+    if ((xcr0_lo & 6) != 6) {
+        return false;
+    }
+
+    __cpuid_count(7, 0, a, b, c, d);
+
+    return b & bit_AVX2;
+}
+#endif
+
+typedef int XbzrleEncodeFunc(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                             uint8_t *dst, int dlen);
+
+/* From the fastest to the slowest */
+static const struct {
+    const char *name;
+    XbzrleEncodeFunc *func;
+} xbzrle_accels[] = {
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", xbzrle_encode_buffer_avx2 },
+#endif
+#ifdef __SSE2__
+    { "sse2", xbzrle_encode_buffer_sse2 },
+#endif
+    { "int", xbzrle_encode_buffer_int },
+};
+
+static unsigned int xbzrle_accel;
+
+static void __attribute__((constructor)) init_xbzrle_accel(void)
+{
+#ifdef CONFIG_AVX2_OPT
+    if (!avx2_support()) {
+        xbzrle_accel++;
+    }
+#endif
+}
+
+/* For testing only: switch to the next slower implementation.  Returns
+ * false if the current one is already the last.
+ */
+bool test_xbzrle_encode_next_accel(void)
+{
+    if (xbzrle_accel + 1 < ARRAY_SIZE(xbzrle_accels)) {
+        xbzrle_accel++;
+        return true;
+    }
+    return false;
+}
+
+const char *xbzrle_encode_accel_name(void)
+{
+    return xbzrle_accels[xbzrle_accel].name;
+}
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
+               sizeof(long)));
+
+    return xbzrle_accels[xbzrle_accel].func(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;
@@ -52,6 +52,9 @@ static int max_numa_nodeid; /* Highest specified NUMA node ID, plus one.
 int nb_numa_nodes;
 NodeInfo numa_info[MAX_NODES];
 
+/* Boot RAM when NUMA nodes are defined without memdevs */
+static MemoryRegion *numa_legacy_ram;
+
 void numa_set_mem_node_id(ram_addr_t addr, uint64_t size, uint32_t node)
 {
     struct numa_addr_range *range;
@@ -443,6 +446,9 @@ void memory_region_allocate_system_memory(MemoryRegion *mr, Object *owner,
 
     if (nb_numa_nodes == 0 || !have_memdevs) {
         allocate_system_memory_nonnuma(mr, owner, name, ram_size);
+        if (nb_numa_nodes) {
+            numa_legacy_ram = mr;
+        }
         return;
     }
 
@@ -508,6 +514,73 @@ void query_numa_node_mem(uint64_t node_mem[])
     }
 }
 
+static void numa_foreach_backend_range(HostMemoryBackend *backend, int node,
+                                      NumaRamRangeFunc *func, void *opaque)
+{
+    MemoryRegion *mr = host_memory_backend_get_memory(backend, &error_abort);
+
+    if (mr->ram_block) {
+        func(node, memory_region_get_ram_addr(mr), memory_region_size(mr),
+             opaque);
+    }
+}
+
+/*
+ * Call @func for each piece of guest RAM that belongs to a NUMA node,
+ * giving its location in ram_addr_t space.  A node can be passed more
+ * than once, e.g. for its boot memory and for each pc-dimm plugged into
+ * it.  Nothing is reported if the guest has no NUMA nodes.
+ */
+void numa_foreach_ram_range(NumaRamRangeFunc *func, void *opaque)
+{
+    MemoryDeviceInfoList *info_list = NULL;
+    MemoryDeviceInfoList **prev = &info_list;
+    MemoryDeviceInfoList *info;
+    ram_addr_t offset;
+    int i;
+
+    if (nb_numa_nodes <= 0) {
+        return;
+    }
+
+    if (numa_legacy_ram) {
+        /* The nodes are laid out in order within a single RAMBlock */
+        offset = memory_region_get_ram_addr(numa_legacy_ram);
+        for (i = 0; i < nb_numa_nodes; i++) {
+            if (numa_info[i].node_mem) {
+                func(i, offset, numa_info[i].node_mem, opaque);
+            }
+            offset += numa_info[i].node_mem;
+        }
+    } else {
+        for (i = 0; i < nb_numa_nodes; i++) {
+            if (numa_info[i].node_memdev) {
+                numa_foreach_backend_range(numa_info[i].node_memdev, i,
+                                           func, opaque);
+            }
+        }
+    }
+
+    qmp_pc_dimm_device_list(qdev_get_machine(), &prev);
+    for (info = info_list; info; info = info->next) {
+        MemoryDeviceInfo *value = info->value;
+        PCDIMMDeviceInfo *dimm;
+        Object *obj;
+
+        if (!value || value->type != MEMORY_DEVICE_INFO_KIND_DIMM) {
+            continue;
+        }
+        dimm = value->u.dimm.data;
+        obj = object_resolve_path_type(dimm->memdev, TYPE_MEMORY_BACKEND,
+                                       NULL);
+        if (obj) {
+            numa_foreach_backend_range(MEMORY_BACKEND(obj), dimm->node,
+                                       func, opaque);
+        }
+    }
+    qapi_free_MemoryDeviceInfoList(info_list);
+}
+
 static int query_memdev(Object *obj, void *opaque)
 {
     MemdevList **list = opaque;
@@ -1,6 +1,6 @@
 /*
  * Page cache for QEMU
- * The cache is base on a hash of the page address
+ * The cache is set-associative, indexed by the page address
  *
  * Copyright 2012 Red Hat, Inc. and/or its affiliates
  *
@@ -29,20 +29,35 @@
 /* the page in cache will not be replaced in two cycles */
 #define CACHED_PAGE_LIFETIME 2
 
+/* number of pages that can be cached for addresses mapping to one set */
+#define CACHE_WAYS 8
+
 typedef struct CacheItem CacheItem;
 
 struct CacheItem {
     uint64_t it_addr;
     uint64_t it_age;
+    /* value of PageCache.tick at the last hit or insertion */
+    uint64_t it_tick;
     uint8_t *it_data;
 };
 
+/*
+ * The cache is an array of sets of num_ways items each.  A page can only
+ * be cached in the set selected by its page number, but in any of the
+ * ways of that set; when all of them are taken, the least recently used
+ * page is evicted unless it was used in the last CACHED_PAGE_LIFETIME
+ * bitmap generations.
+ */
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
     uint64_t max_item_age;
     int64_t num_items;
+    unsigned int num_ways;
+    uint64_t set_mask;
+    uint64_t tick;
 };
 
 PageCache *cache_init(int64_t num_pages, unsigned int page_size)
@@ -71,8 +86,12 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->set_mask = num_pages / cache->num_ways - 1;
+    cache->tick = 0;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " (%u-way)\n",
+            cache->max_num_items, cache->num_ways);
 
     /* We prefer not to abort if there is no memory */
     cache->page_cache = g_try_malloc((cache->max_num_items) *
@@ -86,6 +105,7 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     for (i = 0; i < cache->max_num_items; i++) {
         cache->page_cache[i].it_data = NULL;
         cache->page_cache[i].it_age = 0;
+        cache->page_cache[i].it_tick = 0;
         cache->page_cache[i].it_addr = -1;
     }
 
@@ -108,43 +128,76 @@ void cache_fini(PageCache *cache)
     g_free(cache);
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first item of the set that can hold @address */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
-    g_assert(cache->max_num_items);
-    return (address / cache->page_size) & (cache->max_num_items - 1);
+    size_t set;
+
+    g_assert(cache);
+    g_assert(cache->page_cache);
+
+    set = (address / cache->page_size) & cache->set_mask;
+    return &cache->page_cache[set * cache->num_ways];
 }
 
 static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set = cache_get_set(cache, addr);
+    unsigned int i;
 
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    return it ? it->it_data : NULL;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+uint8_t *cache_lookup(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *it = cache_get_by_addr(cache, addr);
+
+    if (!it) {
+        return NULL;
+    }
+
+    /* update the it_age when the cache hit */
+    it->it_age = current_age;
+    it->it_tick = ++cache->tick;
+    return it->it_data;
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr,
-                     uint64_t current_age)
+bool cache_is_cached(PageCache *cache, uint64_t addr, uint64_t current_age)
 {
-    CacheItem *it;
+    return cache_lookup(cache, addr, current_age) != NULL;
+}
 
-    it = cache_get_by_addr(cache, addr);
+/* Returns the item where @addr can be stored: the one that already caches
+ * it, a free one, or else the least recently used one in its set.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
+{
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = NULL;
+    unsigned int i;
 
-    if (it->it_addr == addr) {
-        /* update the it_age when the cache hit */
-        it->it_age = current_age;
-        return true;
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+        /* free items have a zero it_tick, so they are picked first */
+        if (!victim || set[i].it_tick < victim->it_tick) {
+            victim = &set[i];
+        }
     }
-    return false;
+    return victim;
 }
 
 int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
@@ -154,7 +207,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     CacheItem *it;
 
     /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
+    it = cache_get_victim(cache, addr);
 
     if (it->it_data && it->it_addr != addr &&
         it->it_age + CACHED_PAGE_LIFETIME > current_age) {
@@ -174,6 +227,7 @@ int cache_insert(PageCache *cache, uint64_t addr, const uint8_t *pdata,
     memcpy(it->it_data, pdata, cache->page_size);
 
     it->it_age = current_age;
+    it->it_tick = ++cache->tick;
     it->it_addr = addr;
 
     return 0;
@@ -209,8 +263,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         old_it = &cache->page_cache[i];
         if (old_it->it_addr != -1) {
             /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
+            new_it = cache_get_victim(new_cache, old_it->it_addr);
+            if (new_it->it_data && new_it->it_tick >= old_it->it_tick) {
                 /* keep the MRU page */
                 g_free(old_it->it_data);
             } else {
@@ -218,9 +272,7 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
                     new_cache->num_items++;
                 }
                 g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
+                *new_it = *old_it;
             }
         }
     }
@@ -229,6 +281,8 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
     cache->num_items = new_cache->num_items;
+    cache->num_ways = new_cache->num_ways;
+    cache->set_mask = new_cache->set_mask;
 
     g_free(new_cache);
 
@@ -781,6 +781,90 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "calc-dirty-rate",
+        .args_type  = "calc-time:i",
+        .mhandler.cmd_new = qmp_marshal_calc_dirty_rate,
+    },
+
+SQMP
+calc-dirty-rate
+---------------
+
+Start measuring the rate at which the guest dirties its RAM, using the
+migration dirty log, without starting a migration.  Migration is blocked
+until the measurement finishes.
+
+Arguments:
+
+- "calc-time": length of the sampling window in seconds, 1 to 60 (json-int)
+
+Example:
+
+-> { "execute": "calc-dirty-rate", "arguments": { "calc-time": 1 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-dirty-rate",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_dirty_rate,
+    },
+
+SQMP
+query-dirty-rate
+----------------
+
+Show the state and the result of the last dirty rate measurement.
+
+Return a json-object with the following information:
+
+- "status": "unstarted", "measuring" or "measured" (json-string)
+- "calc-time": length of the sampling window in seconds (json-int, optional)
+- "page-size": page size in bytes (json-int, optional)
+- "dirty-pages": number of pages written in the window (json-int, optional)
+- "dirty-rate": dirty rate of all guest RAM in MB/s (json-number, optional)
+- "blocks": json-array of per-RAMBlock statistics (optional), each with
+  - "id": RAMBlock name (json-string)
+  - "size": RAMBlock size in bytes (json-int)
+  - "dirty-pages": pages written in the window (json-int)
+  - "dirty-rate": dirty rate in MB/s (json-number)
+- "nodes": json-array of per-NUMA-node statistics (optional), each with
+  - "node": node ID (json-int)
+  - "size": node memory size in bytes (json-int)
+  - "dirty-pages": pages written in the window (json-int)
+  - "dirty-rate": dirty rate in MB/s (json-number)
+
+The optional fields other than "calc-time" are only present once the
+status is "measured".
+
+Example:
+
+-> { "execute": "query-dirty-rate" }
+<- { "return": {
+        "status": "measured",
+        "calc-time": 1,
+        "page-size": 4096,
+        "dirty-pages": 5120,
+        "dirty-rate": 19.98,
+        "blocks": [
+          { "id": "pc.ram", "size": 1073741824,
+            "dirty-pages": 5110, "dirty-rate": 19.94 },
+          { "id": "vga.vram", "size": 16777216,
+            "dirty-pages": 10, "dirty-rate": 0.04 }
+        ],
+        "nodes": [
+          { "node": 0, "size": 536870912,
+            "dirty-pages": 4000, "dirty-rate": 15.61 },
+          { "node": 1, "size": 536870912,
+            "dirty-pages": 1110, "dirty-rate": 4.33 }
+        ]
+     }
+   }
+
 EQMP
 
     {
@@ -2760,6 +2844,19 @@ Each json-object contain the following:
         - "avg_wr_queue_depth": average number of pending write
                                 operations in the defined interval
                                 (json-number).
+    - "rd_latency_histogram": latency histogram of the read operations
+                              accounted in "rd_total_time_ns" since the
+                              last block-latency-histogram-reset
+                              (json-object, optional, only present for
+                              devices), with the following member:
+        - "bins": number of operations whose latency is at least 2^i and
+                  less than 2^(i+1) nanoseconds, for each bin i; the last
+                  of the 40 bins has no upper bound, and trailing empty
+                  bins are omitted (json-array of json-int)
+    - "wr_latency_histogram": latency histogram of the write operations
+                              (json-object, optional)
+    - "flush_latency_histogram": latency histogram of the flush operations
+                                 (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2872,6 +2969,31 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_blockstats,
     },
 
+SQMP
+block-latency-histogram-reset
+-----------------------------
+
+Clear the latency histograms of a block device, which are reported by
+query-blockstats.  The other statistics are not affected.
+
+Arguments:
+
+- "device": the device name (json-string)
+
+Example:
+
+-> { "execute": "block-latency-histogram-reset",
+     "arguments": { "device": "drive0" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-latency-histogram-reset",
+        .args_type  = "device:B",
+        .mhandler.cmd_new = qmp_marshal_block_latency_histogram_reset,
+    },
+
 SQMP
 query-cpus
 ----------
@@ -3586,6 +3708,7 @@ The main json-object contains the following:
          - "cache-size": XBZRLE cache size in bytes
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
+         - "cache-hit": number of XBZRLE page cache hits
          - "cache-miss": number of XBRZRLE page cache misses
          - "cache-miss-rate": rate of XBRZRLE page cache misses
          - "overflow": number of times XBZRLE overflows.  This means
@@ -3695,6 +3818,7 @@ Examples:
             "cache-size":67108864,
             "bytes":20971520,
             "pages":2444343,
+            "cache-hit":2442099,
             "cache-miss":2244,
             "cache-miss-rate":0.123,
             "overflow":34434
@@ -3723,6 +3847,8 @@ Enable/Disable migration capabilities
 - "compress": use multiple compression threads to accelerate live migration
 - "events": generate events for each migration state change
 - "postcopy-ram": postcopy mode for live migration
+- "x-multifd": send RAM over multiple parallel channels
+- "x-zero-copy-send": send x-multifd pages without copying them
 
 Arguments:
 
@@ -3753,6 +3879,8 @@ Query current migration capabilities
          - "compress": Multiple compression threads state (json-bool)
          - "events": Migration state change event state (json-bool)
          - "postcopy-ram": postcopy ram state (json-bool)
+         - "x-multifd": multiple migration channels state (json-bool)
+         - "x-zero-copy-send": zero copy send state (json-bool)
 
 Arguments:
 
@@ -3766,7 +3894,9 @@ Example:
      {"state": false, "capability": "zero-blocks"},
      {"state": false, "capability": "compress"},
      {"state": true, "capability": "events"},
-     {"state": false, "capability": "postcopy-ram"}
+     {"state": false, "capability": "postcopy-ram"},
+     {"state": false, "capability": "x-multifd"},
+     {"state": false, "capability": "x-zero-copy-send"}
    ]}
 
 EQMP
@@ -3790,6 +3920,10 @@ Set migration parameters
                           throttled for auto-converge (json-int)
 - "cpu-throttle-increment": set throttle increasing percentage for
                             auto-converge (json-int)
+- "x-multifd-channels": set number of parallel channels for x-multifd
+                        migration (json-int)
+- "x-multifd-page-count": set number of pages per x-multifd packet
+                          (json-int)
 
 Arguments:
 
@@ -3803,7 +3937,7 @@ EQMP
     {
         .name       = "migrate-set-parameters",
         .args_type  =
-            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?",
+            "compress-level:i?,compress-threads:i?,decompress-threads:i?,cpu-throttle-initial:i?,cpu-throttle-increment:i?,x-multifd-channels:i?,x-multifd-page-count:i?",
         .mhandler.cmd_new = qmp_marshal_migrate_set_parameters,
     },
 SQMP
@@ -3820,6 +3954,9 @@ Query current migration parameters
                                     throttled (json-int)
          - "cpu-throttle-increment" : throttle increasing percentage for
                                       auto-converge (json-int)
+         - "x-multifd-channels" : number of x-multifd channels (json-int)
+         - "x-multifd-page-count" : number of pages per x-multifd packet
+                                    (json-int)
 
 Arguments:
 
@@ -3832,7 +3969,9 @@ Example:
          "cpu-throttle-increment": 10,
          "compress-threads": 8,
          "compress-level": 1,
-         "cpu-throttle-initial": 20
+         "cpu-throttle-initial": 20,
+         "x-multifd-channels": 2,
+         "x-multifd-page-count": 16
       }
    }
 
@@ -1066,6 +1066,22 @@ DO_GEN_ST(8, MO_UB, 3)
 DO_GEN_ST(16, MO_UW, 2)
 DO_GEN_ST(32, MO_UL, 0)
 
+/* Return the guest virtual address for an AArch32 access of size OPC,
+ * with the same BE32 adjustment as gen_aa32_ld/st above.  The caller
+ * must free the result.
+ */
+static TCGv gen_aa32_addr(DisasContext *s, TCGv_i32 a32, TCGMemOp opc)
+{
+    TCGv addr = tcg_temp_new();
+    tcg_gen_extu_i32_tl(addr, a32);
+
+    /* Not needed for user-mode BE32, where we use MO_BE instead.  */
+    if (!IS_USER_ONLY && s->sctlr_b && (opc & MO_SIZE) < MO_32) {
+        tcg_gen_xori_tl(addr, addr, 4 - (1 << (opc & MO_SIZE)));
+    }
+    return addr;
+}
+
 static inline void gen_set_pc_im(DisasContext *s, target_ulong val)
 {
     tcg_gen_movi_i32(cpu_R[15], val);
@@ -5235,6 +5251,52 @@ static const uint8_t neon_3r_sizes[] = {
     [NEON_3R_FLOAT_MISC] = 0x5, /* size bit 1 encodes op */
 };
 
+/* Translate the Neon 3-reg-same insns which operate on each element
+ * independently and have a TCG vector equivalent, working directly on
+ * the whole D or Q registers.  Return false if the insn is not one of them.
+ */
+static bool gen_neon_3r_vec(int op, int u, int size, int q,
+                            int rd, int rn, int rm)
+{
+    long dofs = vfp_reg_offset(1, rd);
+    long nofs = vfp_reg_offset(1, rn);
+    long mofs = vfp_reg_offset(1, rm);
+    unsigned oprsz = q ? 16 : 8;
+
+    switch (op) {
+    case NEON_3R_VADD_VSUB:
+        if (u) {
+            tcg_gen_vec_sub(size, dofs, nofs, mofs, oprsz);
+        } else {
+            tcg_gen_vec_add(size, dofs, nofs, mofs, oprsz);
+        }
+        return true;
+    case NEON_3R_VTST_VCEQ:
+        if (!u) {
+            return false;
+        }
+        tcg_gen_vec_cmpeq(size, dofs, nofs, mofs, oprsz);
+        return true;
+    case NEON_3R_LOGIC:
+        switch ((u << 2) | size) {
+        case 0: /* VAND */
+            tcg_gen_vec_and(dofs, nofs, mofs, oprsz);
+            return true;
+        case 1: /* VBIC */
+            tcg_gen_vec_andc(dofs, nofs, mofs, oprsz);
+            return true;
+        case 2: /* VORR */
+            tcg_gen_vec_or(dofs, nofs, mofs, oprsz);
+            return true;
+        case 4: /* VEOR */
+            tcg_gen_vec_xor(dofs, nofs, mofs, oprsz);
+            return true;
+        }
+        return false;
+    }
+    return false;
+}
+
 /* Symbolic constants for op fields for Neon 2-register miscellaneous.
  * The values correspond to bits [17:16,10:7]; see the ARM ARM DDI0406B
  * table A7-13.
@@ -5499,6 +5561,9 @@ static int disas_neon_data_insn(DisasContext *s, uint32_t insn)
             tcg_temp_free_i32(tmp3);
             return 0;
         }
+        if (gen_neon_3r_vec(op, u, size, q, rd, rn, rm)) {
+            return 0;
+        }
         if (size == 3 && op != NEON_3R_LOGIC) {
             /* 64-bit element instructions. */
             for (pass = 0; pass < (q ? 2 : 1); pass++) {
@@ -7721,9 +7786,9 @@ static void gen_logicq_cc(TCGv_i32 lo, TCGv_i32 hi)
    the architecturally mandated semantics, and avoids having to monitor
    regular stores.
 
-   In system emulation mode only one CPU will be running at once, so
-   this sequence is effectively atomic.  In user emulation mode we
-   throw an exception and handle the atomic operation elsewhere.  */
+   The store is performed with an atomic compare-and-swap against the
+   value seen by the load, so the sequence stays atomic with respect to
+   other vCPUs running in parallel.  */
 static void gen_load_exclusive(DisasContext *s, int rt, int rt2,
                                TCGv_i32 addr, int size)
 {
@@ -7768,23 +7833,15 @@ static void gen_clrex(DisasContext *s)
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
 
-#ifdef CONFIG_USER_ONLY
 static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
                                 TCGv_i32 addr, int size)
 {
-    tcg_gen_extu_i32_i64(cpu_exclusive_test, addr);
-    tcg_gen_movi_i32(cpu_exclusive_info,
-                     size | (rd << 4) | (rt << 8) | (rt2 << 12));
-    gen_exception_internal_insn(s, 4, EXCP_STREX);
-}
-#else
-static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
-                                TCGv_i32 addr, int size)
-{
-    TCGv_i32 tmp;
-    TCGv_i64 val64, extaddr;
+    TCGv_i32 t0, t1, t2;
+    TCGv_i64 extaddr;
+    TCGv taddr;
     TCGLabel *done_label;
     TCGLabel *fail_label;
+    TCGMemOp opc = size | MO_ALIGN | s->be_data;
 
     /* if (env->exclusive_addr == addr && env->exclusive_val == [addr]) {
          [addr] = {Rt};
@@ -7799,69 +7856,52 @@ static void gen_store_exclusive(DisasContext *s, int rd, int rt, int rt2,
     tcg_gen_brcond_i64(TCG_COND_NE, extaddr, cpu_exclusive_addr, fail_label);
     tcg_temp_free_i64(extaddr);
 
-    tmp = tcg_temp_new_i32();
-    switch (size) {
-    case 0:
-        gen_aa32_ld8u(s, tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_ld16u(s, tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_ld32u(s, tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
-
-    val64 = tcg_temp_new_i64();
+    taddr = gen_aa32_addr(s, addr, opc);
+    t0 = tcg_temp_new_i32();
+    t1 = load_reg(s, rt);
     if (size == 3) {
-        TCGv_i32 tmp2 = tcg_temp_new_i32();
-        TCGv_i32 tmp3 = tcg_temp_new_i32();
-        tcg_gen_addi_i32(tmp2, addr, 4);
-        gen_aa32_ld32u(s, tmp3, tmp2, get_mem_index(s));
-        tcg_temp_free_i32(tmp2);
-        tcg_gen_concat_i32_i64(val64, tmp, tmp3);
-        tcg_temp_free_i32(tmp3);
-    } else {
-        tcg_gen_extu_i32_i64(val64, tmp);
-    }
-    tcg_temp_free_i32(tmp);
+        TCGv_i64 o64 = tcg_temp_new_i64();
+        TCGv_i64 n64 = tcg_temp_new_i64();
+        TCGv_i64 c64 = tcg_temp_new_i64();
+
+        /* exclusive_val holds the word at addr in its low half; a single
+           big-endian doubleword access sees the two words swapped.  */
+        t2 = load_reg(s, rt2);
+        tcg_gen_concat_i32_i64(n64, t1, t2);
+        tcg_temp_free_i32(t2);
+        if (s->be_data == MO_BE) {
+            tcg_gen_rotri_i64(n64, n64, 32);
+            tcg_gen_rotri_i64(c64, cpu_exclusive_val, 32);
+        } else {
+            tcg_gen_mov_i64(c64, cpu_exclusive_val);
+        }
 
-    tcg_gen_brcond_i64(TCG_COND_NE, val64, cpu_exclusive_val, fail_label);
-    tcg_temp_free_i64(val64);
+        tcg_gen_atomic_cmpxchg_i64(o64, taddr, c64, n64,
+                                   get_mem_index(s), opc);
+        tcg_gen_setcond_i64(TCG_COND_NE, o64, o64, c64);
+        tcg_gen_extrl_i64_i32(t0, o64);
 
-    tmp = load_reg(s, rt);
-    switch (size) {
-    case 0:
-        gen_aa32_st8(s, tmp, addr, get_mem_index(s));
-        break;
-    case 1:
-        gen_aa32_st16(s, tmp, addr, get_mem_index(s));
-        break;
-    case 2:
-    case 3:
-        gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-        break;
-    default:
-        abort();
-    }
-    tcg_temp_free_i32(tmp);
-    if (size == 3) {
-        tcg_gen_addi_i32(addr, addr, 4);
-        tmp = load_reg(s, rt2);
-        gen_aa32_st32(s, tmp, addr, get_mem_index(s));
-        tcg_temp_free_i32(tmp);
+        tcg_temp_free_i64(c64);
+        tcg_temp_free_i64(n64);
+        tcg_temp_free_i64(o64);
+    } else {
+        t2 = tcg_temp_new_i32();
+        tcg_gen_extrl_i64_i32(t2, cpu_exclusive_val);
+        tcg_gen_atomic_cmpxchg_i32(t0, taddr, t2, t1, get_mem_index(s), opc);
+        tcg_gen_setcond_i32(TCG_COND_NE, t0, t0, t2);
+        tcg_temp_free_i32(t2);
     }
-    tcg_gen_movi_i32(cpu_R[rd], 0);
+    tcg_temp_free_i32(t1);
+    tcg_temp_free(taddr);
+    tcg_gen_mov_i32(cpu_R[rd], t0);
+    tcg_temp_free_i32(t0);
     tcg_gen_br(done_label);
+
     gen_set_label(fail_label);
     tcg_gen_movi_i32(cpu_R[rd], 1);
     gen_set_label(done_label);
     tcg_gen_movi_i64(cpu_exclusive_addr, -1);
 }
-#endif
 
 /* gen_srs:
  * @env: CPUARMState
@@ -1512,6 +1512,22 @@ static inline void cpu_get_tb_cpu_state(CPUX86State *env, target_ulong *pc,
         (env->eflags & (IOPL_MASK | TF_MASK | RF_MASK | VM_MASK | AC_MASK));
 }
 
+/* The translator embeds no host address in the generated code other than
+   through exit_tb, and only depends on the CPUID feature words besides
+   the (pc, cs_base, flags) tuple, so its output can be kept in the
+   persistent translation cache.  */
+#define TARGET_SUPPORTS_TB_CACHE
+
+static inline void cpu_get_tb_cache_state(CPUX86State *env,
+                                          const void **data, size_t *size)
+{
+    *data = env->features;
+    *size = sizeof(env->features);
+}
+
+/* gen_intermediate_code honours CF_SUPERBLOCK.  */
+#define TARGET_SUPPORTS_SUPERBLOCKS
+
 void do_cpu_init(X86CPU *cpu);
 void do_cpu_sipi(X86CPU *cpu);
 
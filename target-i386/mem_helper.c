@@ -78,31 +78,80 @@ void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 }
 
 #ifdef TARGET_X86_64
-void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
+static void do_cmpxchg16b(CPUX86State *env, target_ulong a0, uintptr_t ra)
 {
     uint64_t d0, d1;
     int eflags;
 
     if ((a0 & 0xf) != 0) {
-        raise_exception_ra(env, EXCP0D_GPF, GETPC());
+        raise_exception_ra(env, EXCP0D_GPF, ra);
     }
     eflags = cpu_cc_compute_all(env, CC_OP);
-    d0 = cpu_ldq_data_ra(env, a0, GETPC());
-    d1 = cpu_ldq_data_ra(env, a0 + 8, GETPC());
+    d0 = cpu_ldq_data_ra(env, a0, ra);
+    d1 = cpu_ldq_data_ra(env, a0 + 8, ra);
     if (d0 == env->regs[R_EAX] && d1 == env->regs[R_EDX]) {
-        cpu_stq_data_ra(env, a0, env->regs[R_EBX], GETPC());
-        cpu_stq_data_ra(env, a0 + 8, env->regs[R_ECX], GETPC());
+        cpu_stq_data_ra(env, a0, env->regs[R_EBX], ra);
+        cpu_stq_data_ra(env, a0 + 8, env->regs[R_ECX], ra);
         eflags |= CC_Z;
     } else {
         /* always do the store */
-        cpu_stq_data_ra(env, a0, d0, GETPC());
-        cpu_stq_data_ra(env, a0 + 8, d1, GETPC());
+        cpu_stq_data_ra(env, a0, d0, ra);
+        cpu_stq_data_ra(env, a0 + 8, d1, ra);
         env->regs[R_EDX] = d1;
         env->regs[R_EAX] = d0;
         eflags &= ~CC_Z;
     }
     CC_SRC = eflags;
 }
+
+void helper_cmpxchg16b(CPUX86State *env, target_ulong a0)
+{
+    do_cmpxchg16b(env, a0, GETPC());
+}
+
+/* LOCK CMPXCHG16B.  Use the host's 128-bit compare-and-swap if it has
+ * one.  Otherwise, with several vCPU threads, restart the instruction
+ * with the other vCPUs stopped (EXCP_ATOMIC), where the plain version
+ * above is atomic too.
+ */
+void helper_cmpxchg16b_locked(CPUX86State *env, target_ulong a0)
+{
+#if defined(CONFIG_CMPXCHG128) && !defined(HOST_WORDS_BIGENDIAN)
+    unsigned __int128 *haddr, oldv, cmpv, newv;
+    int eflags;
+
+    if ((a0 & 0xf) != 0) {
+        raise_exception_ra(env, EXCP0D_GPF, GETPC());
+    }
+#ifdef CONFIG_USER_ONLY
+    haddr = g2h(a0);
+#else
+    haddr = tlb_vaddr_to_host_atomic(env, a0, 16, cpu_mmu_index(env, false),
+                                     GETRA());
+#endif
+    if (haddr) {
+        eflags = cpu_cc_compute_all(env, CC_OP);
+        cmpv = ((unsigned __int128)env->regs[R_EDX] << 64) | env->regs[R_EAX];
+        newv = ((unsigned __int128)env->regs[R_ECX] << 64) | env->regs[R_EBX];
+        oldv = __sync_val_compare_and_swap_16(haddr, cmpv, newv);
+        if (oldv == cmpv) {
+            eflags |= CC_Z;
+        } else {
+            env->regs[R_EDX] = (uint64_t)(oldv >> 64);
+            env->regs[R_EAX] = (uint64_t)oldv;
+            eflags &= ~CC_Z;
+        }
+        CC_SRC = eflags;
+        return;
+    }
+    /* MMIO: as atomic as any device access gets */
+#else
+    if (parallel_cpus) {
+        cpu_loop_exit_atomic(ENV_GET_CPU(env), GETPC());
+    }
+#endif
+    do_cmpxchg16b(env, a0, GETPC());
+}
 #endif
 
 void helper_boundw(CPUX86State *env, target_ulong a0, int v)
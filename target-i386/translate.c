@@ -1256,57 +1256,105 @@ static void gen_helper_fp_arith_STN_ST0(int op, int opreg)
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d)
 {
+    bool locked = d == OR_TMP0 && (s1->prefix & PREFIX_LOCK);
+
     if (d != OR_TMP0) {
         gen_op_mov_v_reg(ot, cpu_T0, d);
-    } else {
+    } else if (!locked || op == OP_CMPL) {
         gen_op_ld_v(s1, ot, cpu_T0, cpu_A0);
     }
     switch(op) {
     case OP_ADCL:
         gen_compute_eflags_c(s1, cpu_tmp4);
-        tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
-        tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_tmp4);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_add_tl(cpu_T0, cpu_tmp4, cpu_T1);
+            tcg_gen_atomic_fetch_add_tl(cpu_tmp0, cpu_A0, cpu_T0,
+                                        s1->mem_index, ot | MO_LE);
+            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_tmp0);
+        } else {
+            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
+            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_tmp4);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update3_cc(cpu_tmp4);
         set_cc_op(s1, CC_OP_ADCB + ot);
         break;
     case OP_SBBL:
         gen_compute_eflags_c(s1, cpu_tmp4);
-        tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_T1);
-        tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_tmp4);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_add_tl(cpu_T0, cpu_T1, cpu_tmp4);
+            tcg_gen_neg_tl(cpu_T0, cpu_T0);
+            tcg_gen_atomic_fetch_add_tl(cpu_tmp0, cpu_A0, cpu_T0,
+                                        s1->mem_index, ot | MO_LE);
+            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_tmp0);
+        } else {
+            tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_T1);
+            tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_tmp4);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update3_cc(cpu_tmp4);
         set_cc_op(s1, CC_OP_SBBB + ot);
         break;
     case OP_ADDL:
-        tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_atomic_fetch_add_tl(cpu_T0, cpu_A0, cpu_T1,
+                                        s1->mem_index, ot | MO_LE);
+            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
+        } else {
+            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update2_cc();
         set_cc_op(s1, CC_OP_ADDB + ot);
         break;
     case OP_SUBL:
-        tcg_gen_mov_tl(cpu_cc_srcT, cpu_T0);
-        tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_neg_tl(cpu_T0, cpu_T1);
+            tcg_gen_atomic_fetch_add_tl(cpu_cc_srcT, cpu_A0, cpu_T0,
+                                        s1->mem_index, ot | MO_LE);
+            tcg_gen_sub_tl(cpu_T0, cpu_cc_srcT, cpu_T1);
+        } else {
+            tcg_gen_mov_tl(cpu_cc_srcT, cpu_T0);
+            tcg_gen_sub_tl(cpu_T0, cpu_T0, cpu_T1);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update2_cc();
         set_cc_op(s1, CC_OP_SUBB + ot);
         break;
     default:
     case OP_ANDL:
-        tcg_gen_and_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_atomic_fetch_and_tl(cpu_T0, cpu_A0, cpu_T1,
+                                        s1->mem_index, ot | MO_LE);
+            tcg_gen_and_tl(cpu_T0, cpu_T0, cpu_T1);
+        } else {
+            tcg_gen_and_tl(cpu_T0, cpu_T0, cpu_T1);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update1_cc();
         set_cc_op(s1, CC_OP_LOGICB + ot);
         break;
     case OP_ORL:
-        tcg_gen_or_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_atomic_fetch_or_tl(cpu_T0, cpu_A0, cpu_T1,
+                                       s1->mem_index, ot | MO_LE);
+            tcg_gen_or_tl(cpu_T0, cpu_T0, cpu_T1);
+        } else {
+            tcg_gen_or_tl(cpu_T0, cpu_T0, cpu_T1);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update1_cc();
         set_cc_op(s1, CC_OP_LOGICB + ot);
         break;
     case OP_XORL:
-        tcg_gen_xor_tl(cpu_T0, cpu_T0, cpu_T1);
-        gen_op_st_rm_T0_A0(s1, ot, d);
+        if (locked) {
+            tcg_gen_atomic_fetch_xor_tl(cpu_T0, cpu_A0, cpu_T1,
+                                        s1->mem_index, ot | MO_LE);
+            tcg_gen_xor_tl(cpu_T0, cpu_T0, cpu_T1);
+        } else {
+            tcg_gen_xor_tl(cpu_T0, cpu_T0, cpu_T1);
+            gen_op_st_rm_T0_A0(s1, ot, d);
+        }
         gen_op_update1_cc();
         set_cc_op(s1, CC_OP_LOGICB + ot);
         break;
@@ -1322,6 +1370,16 @@ static void gen_op(DisasContext *s1, int op, TCGMemOp ot, int d)
 /* if d == OR_TMP0, it means memory operand (address in A0) */
 static void gen_inc(DisasContext *s1, TCGMemOp ot, int d, int c)
 {
+    if (d == OR_TMP0 && (s1->prefix & PREFIX_LOCK)) {
+        gen_compute_eflags_c(s1, cpu_cc_src);
+        tcg_gen_movi_tl(cpu_T0, c > 0 ? 1 : -1);
+        tcg_gen_atomic_fetch_add_tl(cpu_tmp0, cpu_A0, cpu_T0,
+                                    s1->mem_index, ot | MO_LE);
+        tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_tmp0);
+        set_cc_op(s1, (c > 0 ? CC_OP_INCB : CC_OP_DECB) + ot);
+        tcg_gen_mov_tl(cpu_cc_dst, cpu_T0);
+        return;
+    }
     if (d != OR_TMP0) {
         gen_op_mov_v_reg(ot, cpu_T0, d);
     } else {
@@ -2508,6 +2566,90 @@ static void gen_jmp(DisasContext *s, target_ulong eip)
     gen_jmp_tb(s, eip, 0);
 }
 
+/* Return true if the instruction at PC recomputes all of CC_OP, CC_DST,
+   CC_SRC and CC_SRC2 without reading them and cannot raise an exception,
+   i.e. if it is a register or immediate form of CMP or TEST.  */
+static bool insn_kills_cc(CPUX86State *env, DisasContext *s, target_ulong pc)
+{
+    int b, modrm;
+
+    /* REX, opcode, modrm and imm32 must all be on this page.  */
+    if (TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK) < 8) {
+        return false;
+    }
+    b = cpu_ldub_code(env, pc++);
+#ifdef TARGET_X86_64
+    if (CODE64(s) && (b & 0xf0) == 0x40) {
+        b = cpu_ldub_code(env, pc++);
+    }
+#endif
+    switch (b) {
+    case 0x3c: /* cmp eAX, Iv */
+    case 0x3d:
+    case 0xa8: /* test eAX, Iv */
+    case 0xa9:
+        return true;
+    case 0x38 ... 0x3b: /* cmp Ev, Gv and cmp Gv, Ev */
+    case 0x84: /* test Ev, Gv */
+    case 0x85:
+        modrm = cpu_ldub_code(env, pc);
+        return (modrm >> 6) == 3;
+    case 0x80: /* grp1: only cmp Ev, Iv */
+    case 0x81:
+    case 0x83:
+        modrm = cpu_ldub_code(env, pc);
+        return (modrm >> 6) == 3 && ((modrm >> 3) & 7) == OP_CMPL;
+    default:
+        return false;
+    }
+}
+
+/* Jump to EIP without saving the condition codes on the chained path,
+   because the instruction there overwrites them.  They are still written
+   back when the exit is not linked, and cpu-exec only links the exit to
+   a TB that was translated with TB_LAZY_ENTRY.  */
+static bool gen_jmp_lazy_cc(CPUX86State *env, DisasContext *s,
+                            target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    /* Only peek at the pages that are being translated.  */
+    if (!s->jmp_opt || (s->tb->cflags & CF_USE_ICOUNT) ||
+        ((pc & TARGET_PAGE_MASK) != (s->tb->pc & TARGET_PAGE_MASK) &&
+         (pc & TARGET_PAGE_MASK) != (s->pc_start & TARGET_PAGE_MASK)) ||
+        !insn_kills_cc(env, s, pc)) {
+        return false;
+    }
+
+    tcg_gen_goto_tb_lazy(0);
+    gen_update_cc_op(s);
+    set_cc_op(s, CC_OP_DYNAMIC);
+    gen_jmp_im(eip);
+    tcg_gen_exit_tb((uintptr_t)s->tb);
+    s->tb->lazy_flags |= TB_LAZY_JMP0;
+    s->is_jmp = DISAS_TB_JUMP;
+    return true;
+}
+
+/* Direct jump or call to EIP.  A superblock goes on translating at the
+   destination instead of ending the TB.  Invalidation only knows about
+   [tb->pc, tb->pc + tb->size), so only forward jumps within the first
+   page are followed.  */
+static void gen_jmp_direct(CPUX86State *env, DisasContext *s,
+                           target_ulong eip)
+{
+    target_ulong pc = s->cs_base + eip;
+
+    if ((s->tb->cflags & CF_SUPERBLOCK) && s->jmp_opt && pc >= s->pc &&
+        (pc & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK)) {
+        s->pc = pc;
+        return;
+    }
+    if (!gen_jmp_lazy_cc(env, s, eip)) {
+        gen_jmp(s, eip);
+    }
+}
+
 static inline void gen_ldq_env_A0(DisasContext *s, int offset)
 {
     tcg_gen_qemu_ld_i64(cpu_tmp1_i64, cpu_A0, s->mem_index, MO_LEQ);
@@ -2896,6 +3038,46 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the common integer MMX/SSE operations inline with the TCG vector
+   operations rather than calling out to the helpers.  Return false if B
+   is not one of them.  The vector operations count elements from the
+   least significant bits of each 64-bit word, which matches the layout
+   of the registers only on little-endian hosts.  */
+static bool gen_sse_vec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+#ifndef HOST_WORDS_BIGENDIAN
+    unsigned oprsz = is_xmm ? 16 : 8;
+
+    switch (b) {
+    case 0xfc ... 0xfe: /* paddb, paddw, paddd */
+        tcg_gen_vec_add(b - 0xfc, op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    case 0xd4: /* paddq */
+        tcg_gen_vec_add(MO_64, op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubd, psubq */
+        tcg_gen_vec_sub(b - 0xf8, op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeqd */
+        tcg_gen_vec_cmpeq(b - 0x74, op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    case 0xdb: /* pand */
+        tcg_gen_vec_and(op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    case 0xdf: /* pandn */
+        tcg_gen_vec_andc(op1_offset, op2_offset, op1_offset, oprsz);
+        return true;
+    case 0xeb: /* por */
+        tcg_gen_vec_or(op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    case 0xef: /* pxor */
+        tcg_gen_vec_xor(op1_offset, op1_offset, op2_offset, oprsz);
+        return true;
+    }
+#endif
+    return false;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4290,6 +4472,12 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
         case 0x70: /* pshufx insn */
         case 0xc6: /* pshufx insn */
             val = cpu_ldub_code(env, s->pc++);
+#ifndef HOST_WORDS_BIGENDIAN
+            if (b == 0x70 && b1 == 1) { /* pshufd */
+                tcg_gen_vec_shuf32(op1_offset, op2_offset, val);
+                break;
+            }
+#endif
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             /* XXX: introduce a new table? */
@@ -4322,6 +4510,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (b1 <= 1 && gen_sse_vec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
@@ -4495,10 +4686,6 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     s->aflag = aflag;
     s->dflag = dflag;
 
-    /* lock generation */
-    if (prefixes & PREFIX_LOCK)
-        gen_helper_lock();
-
     /* now check op code */
  reswitch:
     switch(b) {
@@ -4636,7 +4823,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (op == 0)
                 s->rip_offset = insn_const_size(ot);
             gen_lea_modrm(env, s, modrm);
-            gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            if (!(s->prefix & PREFIX_LOCK) || op != 2) {
+                gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            }
         } else {
             gen_op_mov_v_reg(ot, cpu_T0, rm);
         }
@@ -4649,19 +4838,50 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             set_cc_op(s, CC_OP_LOGICB + ot);
             break;
         case 2: /* not */
-            tcg_gen_not_tl(cpu_T0, cpu_T0);
-            if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+            if (mod != 3 && (s->prefix & PREFIX_LOCK)) {
+                tcg_gen_movi_tl(cpu_T0, ~0);
+                tcg_gen_atomic_fetch_xor_tl(cpu_T0, cpu_A0, cpu_T0,
+                                            s->mem_index, ot | MO_LE);
             } else {
-                gen_op_mov_reg_v(ot, rm, cpu_T0);
+                tcg_gen_not_tl(cpu_T0, cpu_T0);
+                if (mod != 3) {
+                    gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                } else {
+                    gen_op_mov_reg_v(ot, rm, cpu_T0);
+                }
             }
             break;
         case 3: /* neg */
-            tcg_gen_neg_tl(cpu_T0, cpu_T0);
-            if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+            if (mod != 3 && (s->prefix & PREFIX_LOCK)) {
+                TCGLabel *label1 = gen_new_label();
+                TCGv a0 = tcg_temp_local_new();
+                TCGv t0 = tcg_temp_local_new();
+                TCGv t1 = tcg_temp_new();
+                TCGv t2 = tcg_temp_new();
+
+                /* There is no atomic negate; retry a compare-and-swap
+                   until the value we negated is still in memory.  */
+                tcg_gen_mov_tl(a0, cpu_A0);
+                tcg_gen_mov_tl(t0, cpu_T0);
+                gen_set_label(label1);
+                tcg_gen_mov_tl(t2, t0);
+                tcg_gen_neg_tl(t1, t0);
+                tcg_gen_atomic_cmpxchg_tl(t0, a0, t2, t1,
+                                          s->mem_index, ot | MO_LE);
+                tcg_gen_brcond_tl(TCG_COND_NE, t0, t2, label1);
+                tcg_gen_neg_tl(cpu_T0, t0);
+
+                tcg_temp_free(t2);
+                tcg_temp_free(t1);
+                tcg_temp_free(t0);
+                tcg_temp_free(a0);
             } else {
-                gen_op_mov_reg_v(ot, rm, cpu_T0);
+                tcg_gen_neg_tl(cpu_T0, cpu_T0);
+                if (mod != 3) {
+                    gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                } else {
+                    gen_op_mov_reg_v(ot, rm, cpu_T0);
+                }
             }
             gen_op_update_neg_cc();
             set_cc_op(s, CC_OP_SUBB + ot);
@@ -5059,9 +5279,15 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         } else {
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T0, reg);
-            gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
-            tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
-            gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+            if (s->prefix & PREFIX_LOCK) {
+                tcg_gen_atomic_fetch_add_tl(cpu_T1, cpu_A0, cpu_T0,
+                                            s->mem_index, ot | MO_LE);
+                tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
+            } else {
+                gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
+                tcg_gen_add_tl(cpu_T0, cpu_T0, cpu_T1);
+                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+            }
             gen_op_mov_reg_v(ot, reg, cpu_T1);
         }
         gen_op_update2_cc();
@@ -5082,6 +5308,29 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             t2 = tcg_temp_local_new();
             a0 = tcg_temp_local_new();
             gen_op_mov_v_reg(ot, t1, reg);
+            if (mod != 3 && (s->prefix & PREFIX_LOCK)) {
+                gen_lea_modrm(env, s, modrm);
+                tcg_gen_mov_tl(t2, cpu_regs[R_EAX]);
+                gen_extu(ot, t2);
+                tcg_gen_atomic_cmpxchg_tl(t0, cpu_A0, t2, t1,
+                                          s->mem_index, ot | MO_LE);
+                if (ot <= MO_16) {
+                    gen_op_mov_reg_v(ot, R_EAX, t0);
+                } else {
+                    /* Leave the high half of RAX alone on success.  */
+                    tcg_gen_movcond_tl(TCG_COND_EQ, cpu_regs[R_EAX], t0, t2,
+                                       cpu_regs[R_EAX], t0);
+                }
+                tcg_gen_mov_tl(cpu_cc_src, t0);
+                tcg_gen_mov_tl(cpu_cc_srcT, t2);
+                tcg_gen_sub_tl(cpu_cc_dst, t2, t0);
+                set_cc_op(s, CC_OP_SUBB + ot);
+                tcg_temp_free(t0);
+                tcg_temp_free(t1);
+                tcg_temp_free(t2);
+                tcg_temp_free(a0);
+                break;
+            }
             if (mod == 3) {
                 rm = (modrm & 7) | REX_B(s);
                 gen_op_mov_v_reg(ot, t0, rm);
@@ -5133,14 +5382,55 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             if (!(s->cpuid_ext_features & CPUID_EXT_CX16))
                 goto illegal_op;
             gen_lea_modrm(env, s, modrm);
-            gen_helper_cmpxchg16b(cpu_env, cpu_A0);
+            if (s->prefix & PREFIX_LOCK) {
+                /* There is no 128-bit TCG atomic op; the helper uses the
+                 * host's 128-bit cmpxchg, or else runs with the other
+                 * vCPUs stopped.  linux-user cannot stop the other
+                 * threads and relies on the global lock instead.
+                 */
+                gen_helper_lock();
+                gen_helper_cmpxchg16b_locked(cpu_env, cpu_A0);
+                gen_helper_unlock();
+            } else {
+                gen_helper_cmpxchg16b(cpu_env, cpu_A0);
+            }
         } else
 #endif        
         {
             if (!(s->cpuid_features & CPUID_CX8))
                 goto illegal_op;
             gen_lea_modrm(env, s, modrm);
-            gen_helper_cmpxchg8b(cpu_env, cpu_A0);
+            if (s->prefix & PREFIX_LOCK) {
+                TCGv_i64 cmpv = tcg_temp_new_i64();
+                TCGv_i64 newv = tcg_temp_new_i64();
+                TCGv z = tcg_temp_new();
+
+                gen_compute_eflags(s);
+                tcg_gen_concat_tl_i64(cmpv, cpu_regs[R_EAX],
+                                      cpu_regs[R_EDX]);
+                tcg_gen_concat_tl_i64(newv, cpu_regs[R_EBX],
+                                      cpu_regs[R_ECX]);
+                tcg_gen_atomic_cmpxchg_i64(newv, cpu_A0, cmpv, newv,
+                                           s->mem_index, MO_LEQ);
+                tcg_gen_setcond_i64(TCG_COND_EQ, cmpv, newv, cmpv);
+                tcg_gen_trunc_i64_tl(z, cmpv);
+                tcg_gen_deposit_tl(cpu_cc_src, cpu_cc_src, z,
+                                   ctz32(CC_Z), 1);
+
+                /* EDX:EAX only receive the old value on failure.  */
+                tcg_gen_extr_i64_tl(cpu_T0, cpu_T1, newv);
+                tcg_gen_movi_tl(cpu_tmp0, 0);
+                tcg_gen_movcond_tl(TCG_COND_NE, cpu_regs[R_EAX], z, cpu_tmp0,
+                                   cpu_regs[R_EAX], cpu_T0);
+                tcg_gen_movcond_tl(TCG_COND_NE, cpu_regs[R_EDX], z, cpu_tmp0,
+                                   cpu_regs[R_EDX], cpu_T1);
+
+                tcg_temp_free(z);
+                tcg_temp_free_i64(newv);
+                tcg_temp_free_i64(cmpv);
+            } else {
+                gen_helper_cmpxchg8b(cpu_env, cpu_A0);
+            }
         }
         set_cc_op(s, CC_OP_EFLAGS);
         break;
@@ -5464,12 +5754,8 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             gen_lea_modrm(env, s, modrm);
             gen_op_mov_v_reg(ot, cpu_T0, reg);
             /* for xchg, lock is implicit */
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_lock();
-            gen_op_ld_v(s, ot, cpu_T1, cpu_A0);
-            gen_op_st_v(s, ot, cpu_T0, cpu_A0);
-            if (!(prefixes & PREFIX_LOCK))
-                gen_helper_unlock();
+            tcg_gen_atomic_xchg_tl(cpu_T1, cpu_A0, cpu_T0,
+                                   s->mem_index, ot | MO_LE);
             gen_op_mov_reg_v(ot, reg, cpu_T1);
         }
         break;
@@ -6348,7 +6634,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_movi_tl(cpu_T0, next_eip);
             gen_push_v(s, cpu_T0);
             gen_bnd_jmp(s);
-            gen_jmp(s, tval);
+            gen_jmp_direct(env, s, tval);
         }
         break;
     case 0x9a: /* lcall im */
@@ -6378,7 +6664,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tval &= 0xffffffff;
         }
         gen_bnd_jmp(s);
-        gen_jmp(s, tval);
+        gen_jmp_direct(env, s, tval);
         break;
     case 0xea: /* ljmp im */
         {
@@ -6400,7 +6686,7 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (dflag == MO_16) {
             tval &= 0xffff;
         }
-        gen_jmp(s, tval);
+        gen_jmp_direct(env, s, tval);
         break;
     case 0x70 ... 0x7f: /* jcc Jb */
         tval = (int8_t)insn_get(env, s, MO_8);
@@ -6555,7 +6841,9 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
         if (mod != 3) {
             s->rip_offset = 1;
             gen_lea_modrm(env, s, modrm);
-            gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            if (!(s->prefix & PREFIX_LOCK)) {
+                gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            }
         } else {
             gen_op_mov_v_reg(ot, cpu_T0, rm);
         }
@@ -6591,38 +6879,60 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
             tcg_gen_sari_tl(cpu_tmp0, cpu_T1, 3 + ot);
             tcg_gen_shli_tl(cpu_tmp0, cpu_tmp0, ot);
             tcg_gen_add_tl(cpu_A0, cpu_A0, cpu_tmp0);
-            gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            if (!(s->prefix & PREFIX_LOCK)) {
+                gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+            }
         } else {
             gen_op_mov_v_reg(ot, cpu_T0, rm);
         }
     bt_op:
         tcg_gen_andi_tl(cpu_T1, cpu_T1, (1 << (3 + ot)) - 1);
-        tcg_gen_shr_tl(cpu_tmp4, cpu_T0, cpu_T1);
-        switch(op) {
-        case 0:
-            break;
-        case 1:
-            tcg_gen_movi_tl(cpu_tmp0, 1);
-            tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T1);
-            tcg_gen_or_tl(cpu_T0, cpu_T0, cpu_tmp0);
-            break;
-        case 2:
-            tcg_gen_movi_tl(cpu_tmp0, 1);
-            tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T1);
-            tcg_gen_andc_tl(cpu_T0, cpu_T0, cpu_tmp0);
-            break;
-        default:
-        case 3:
-            tcg_gen_movi_tl(cpu_tmp0, 1);
-            tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T1);
-            tcg_gen_xor_tl(cpu_T0, cpu_T0, cpu_tmp0);
-            break;
-        }
-        if (op != 0) {
-            if (mod != 3) {
-                gen_op_st_v(s, ot, cpu_T0, cpu_A0);
-            } else {
-                gen_op_mov_reg_v(ot, rm, cpu_T0);
+        tcg_gen_movi_tl(cpu_tmp0, 1);
+        tcg_gen_shl_tl(cpu_tmp0, cpu_tmp0, cpu_T1);
+        if (mod != 3 && (s->prefix & PREFIX_LOCK)) {
+            switch (op) {
+            case 0: /* bt */
+                /* The load was suppressed above for LOCK; do it now.  */
+                gen_op_ld_v(s, ot, cpu_T0, cpu_A0);
+                break;
+            case 1: /* bts */
+                tcg_gen_atomic_fetch_or_tl(cpu_T0, cpu_A0, cpu_tmp0,
+                                           s->mem_index, ot | MO_LE);
+                break;
+            case 2: /* btr */
+                tcg_gen_not_tl(cpu_tmp0, cpu_tmp0);
+                tcg_gen_atomic_fetch_and_tl(cpu_T0, cpu_A0, cpu_tmp0,
+                                            s->mem_index, ot | MO_LE);
+                break;
+            default:
+            case 3: /* btc */
+                tcg_gen_atomic_fetch_xor_tl(cpu_T0, cpu_A0, cpu_tmp0,
+                                            s->mem_index, ot | MO_LE);
+                break;
+            }
+            tcg_gen_shr_tl(cpu_tmp4, cpu_T0, cpu_T1);
+        } else {
+            tcg_gen_shr_tl(cpu_tmp4, cpu_T0, cpu_T1);
+            switch (op) {
+            case 0: /* bt */
+                break;
+            case 1: /* bts */
+                tcg_gen_or_tl(cpu_T0, cpu_T0, cpu_tmp0);
+                break;
+            case 2: /* btr */
+                tcg_gen_andc_tl(cpu_T0, cpu_T0, cpu_tmp0);
+                break;
+            default:
+            case 3: /* btc */
+                tcg_gen_xor_tl(cpu_T0, cpu_T0, cpu_tmp0);
+                break;
+            }
+            if (op != 0) {
+                if (mod != 3) {
+                    gen_op_st_v(s, ot, cpu_T0, cpu_A0);
+                } else {
+                    gen_op_mov_reg_v(ot, rm, cpu_T0);
+                }
             }
         }
 
@@ -8080,20 +8390,11 @@ static target_ulong disas_insn(CPUX86State *env, DisasContext *s,
     default:
         goto unknown_op;
     }
-    /* lock generation */
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
     return s->pc;
  illegal_op:
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
-    /* XXX: ensure that no lock was generated */
     gen_illegal_opcode(s);
     return s->pc;
  unknown_op:
-    if (s->prefix & PREFIX_LOCK)
-        gen_helper_unlock();
-    /* XXX: ensure that no lock was generated */
     gen_unknown_opcode(env, s);
     return s->pc;
 }
@@ -8161,6 +8462,11 @@ void tcg_x86_init(void)
                                     "cc_src");
     cpu_cc_src2 = tcg_global_mem_new(cpu_env, offsetof(CPUX86State, cc_src2),
                                      "cc_src2");
+    /* See gen_jmp_lazy_cc.  */
+    tcg_global_set_lazy_sync_i32(cpu_cc_op);
+    tcg_global_set_lazy_sync(cpu_cc_dst);
+    tcg_global_set_lazy_sync(cpu_cc_src);
+    tcg_global_set_lazy_sync(cpu_cc_src2);
 
     for (i = 0; i < CPU_NB_REGS; ++i) {
         cpu_regs[i] = tcg_global_mem_new(cpu_env,
@@ -8201,6 +8507,8 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
     target_ulong cs_base;
     int num_insns;
     int max_insns;
+    CCOp lazy_cc_op = CC_OP_DYNAMIC;
+    target_ulong lazy_eip = 0;
 
     /* generate intermediate code */
     pc_start = tb->pc;
@@ -8270,6 +8578,15 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
     cpu_ptr1 = tcg_temp_new_ptr();
     cpu_cc_srcT = tcg_temp_local_new();
 
+    /* A predecessor may jump here with the condition codes unsaved, see
+       gen_jmp_lazy_cc.  The exit request check then has to wait until
+       the first instruction has recomputed them.  */
+    if (dc->jmp_opt && !(tb->cflags & (CF_USE_ICOUNT | CF_LAST_IO)) &&
+        !singlestep && !cpu_breakpoint_test(cs, pc_start, BP_ANY) &&
+        insn_kills_cc(env, dc, pc_start)) {
+        tb->lazy_flags |= TB_LAZY_ENTRY;
+    }
+
     dc->is_jmp = DISAS_NEXT;
     pc_ptr = pc_start;
     num_insns = 0;
@@ -8303,6 +8620,11 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
         }
 
         pc_ptr = disas_insn(env, dc, pc_ptr);
+        if (num_insns == 1 && (tb->lazy_flags & TB_LAZY_ENTRY)) {
+            lazy_cc_op = dc->cc_op;
+            lazy_eip = pc_ptr - dc->cs_base;
+            gen_tb_exit_check();
+        }
         /* stop translation if indicated */
         if (dc->is_jmp)
             break;
@@ -8348,6 +8670,13 @@ void gen_intermediate_code(CPUX86State *env, TranslationBlock *tb)
     if (tb->cflags & CF_LAST_IO)
         gen_io_end();
 done_generating:
+    if (tb->lazy_flags & TB_LAZY_ENTRY) {
+        /* Leave after the first instruction, with its flags.  */
+        gen_set_label(exitreq_label);
+        tcg_gen_movi_i32(cpu_cc_op, lazy_cc_op);
+        gen_jmp_im(lazy_eip);
+        tcg_gen_exit_tb((uintptr_t)tb + TB_EXIT_REQUESTED);
+    }
     gen_tb_end(tb, num_insns);
 
 #ifdef DEBUG_DISAS
@@ -0,0 +1,625 @@
+/*
+ * Persistent translation cache
+ *
+ * The host code of the TBs translated in one run of QEMU is kept in a
+ * file, together with the relocations recorded by the TCG backend and
+ * the guest code it was translated from.  A later run of the same QEMU
+ * binary on the same host copies the code back into code_gen_buffer
+ * instead of translating the guest code again, provided the guest code
+ * is still byte for byte identical.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "exec/exec-all.h"
+#include "exec/memory.h"
+#include "tcg.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "sysemu/sysemu.h"
+#include "tb-cache.h"
+
+#if defined(TARGET_SUPPORTS_TB_CACHE) && \
+    defined(TCG_TARGET_IMPLEMENTS_TB_RELOCS) && defined(CONFIG_LINUX)
+#define TB_CACHE_SUPPORTED
+#endif
+
+#define TB_CACHE_MAGIC      "QEMUTBC"
+#define TB_CACHE_VERSION    2
+
+/* Upper bound on the size of the cache, both in memory and on disk.  */
+#define TB_CACHE_MAX_SIZE   (256 * 1024 * 1024)
+
+/* Translations kept for the same (pc, cs_base, flags), for guest code
+   that differs between the images booted with the same cache.  */
+#define TB_CACHE_MAX_VARIANTS 4
+
+typedef struct TBCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t nb_entries;
+    uint64_t host_id;
+} TBCacheHeader;
+
+typedef struct TBCacheKey {
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t cpu_state;         /* hash of cpu_get_tb_cache_state() */
+    uint32_t flags;
+    uint32_t pad;
+} TBCacheKey;
+
+/* The part of an entry that is written to the file, followed by the
+   relocations, the host code, the search data and the guest code.  */
+typedef struct TBCacheRecord {
+    TBCacheKey key;
+    uint32_t guest_size;
+    uint32_t icount;
+    uint32_t code_size;
+    uint32_t search_size;
+    uint32_t nb_relocs;
+    uint16_t jmp_reset_offset[2];
+    uint16_t jmp_insn_offset[2];
+    uint32_t lazy_flags;
+} TBCacheRecord;
+
+typedef struct TBCacheEntry {
+    struct TBCacheEntry *next;  /* other variants for the same key */
+    TBCacheRecord rec;
+    uint8_t data[];
+} TBCacheEntry;
+
+/* All fields but the statistics are protected by tb_lock.  */
+static struct {
+    char *path;
+    GHashTable *htable;
+    uint64_t host_id;
+    size_t size;
+    unsigned nb_entries;
+    bool dirty;
+    Notifier exit_notifier;
+    /* statistics */
+    unsigned hits;
+    unsigned misses;
+    unsigned stale;
+    unsigned stores;
+} tb_cache;
+
+#define FNV_OFFSET_BASIS    0xcbf29ce484222325ULL
+#define FNV_PRIME           0x100000001b3ULL
+
+static uint64_t tb_cache_hash(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        h = (h ^ p[i]) * FNV_PRIME;
+    }
+    return h;
+}
+
+static guint tb_cache_key_hash(gconstpointer key)
+{
+    return tb_cache_hash(FNV_OFFSET_BASIS, key, sizeof(TBCacheKey));
+}
+
+static gboolean tb_cache_key_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(TBCacheKey)) == 0;
+}
+
+static size_t tb_cache_data_size(const TBCacheRecord *rec)
+{
+    return rec->nb_relocs * sizeof(TCGTBReloc) + rec->code_size +
+           rec->search_size + rec->guest_size;
+}
+
+static TCGTBReloc *tb_cache_relocs(TBCacheEntry *e)
+{
+    return (TCGTBReloc *)e->data;
+}
+
+static uint8_t *tb_cache_code(TBCacheEntry *e)
+{
+    return e->data + e->rec.nb_relocs * sizeof(TCGTBReloc);
+}
+
+static uint8_t *tb_cache_guest(TBCacheEntry *e)
+{
+    return tb_cache_code(e) + e->rec.code_size + e->rec.search_size;
+}
+
+static void tb_cache_make_key(TBCacheKey *key, CPUArchState *env,
+                              TranslationBlock *tb)
+{
+#ifdef TARGET_SUPPORTS_TB_CACHE
+    const void *state;
+    size_t size;
+
+    cpu_get_tb_cache_state(env, &state, &size);
+    key->cpu_state = tb_cache_hash(FNV_OFFSET_BASIS, state, size);
+#else
+    key->cpu_state = 0;
+#endif
+    key->pc = tb->pc;
+    key->cs_base = tb->cs_base;
+    key->flags = tb->flags;
+    key->pad = 0;
+}
+
+/* The cached code calls into the executable and depends on the host
+   features the backend detected, so only reuse it with the very same
+   binary on the same kind of host.  */
+static bool tb_cache_compute_host_id(uint64_t *id, Error **errp)
+{
+    struct stat st;
+    uint64_t h = FNV_OFFSET_BASIS;
+    uint64_t features = tcg_tb_relocs_host_id();
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        error_setg_errno(errp, errno, "cannot identify the QEMU executable");
+        return false;
+    }
+    h = tb_cache_hash(h, QEMU_VERSION, strlen(QEMU_VERSION));
+    h = tb_cache_hash(h, TARGET_NAME, strlen(TARGET_NAME));
+    h = tb_cache_hash(h, &st.st_ino, sizeof(st.st_ino));
+    h = tb_cache_hash(h, &st.st_size, sizeof(st.st_size));
+    h = tb_cache_hash(h, &st.st_mtime, sizeof(st.st_mtime));
+    h = tb_cache_hash(h, &features, sizeof(features));
+    *id = h;
+    return true;
+}
+
+static void tb_cache_entry_free(TBCacheEntry *e)
+{
+    tb_cache.size -= sizeof(TBCacheEntry) + tb_cache_data_size(&e->rec);
+    tb_cache.nb_entries--;
+    g_free(e);
+}
+
+/* Add E in front of the variants for its key.  A variant for the same
+   guest code is replaced, and the oldest one is dropped if there are
+   too many.  */
+static void tb_cache_insert(TBCacheEntry *e)
+{
+    TBCacheEntry *head, **pe;
+    int n = 1;
+
+    /* The table uses the key of the first variant, which may go away.  */
+    head = g_hash_table_lookup(tb_cache.htable, &e->rec.key);
+    if (head) {
+        g_hash_table_remove(tb_cache.htable, &e->rec.key);
+    }
+    for (pe = &head; *pe; ) {
+        TBCacheEntry *old = *pe;
+
+        if (n == TB_CACHE_MAX_VARIANTS ||
+            (old->rec.guest_size == e->rec.guest_size &&
+             memcmp(tb_cache_guest(old), tb_cache_guest(e),
+                    e->rec.guest_size) == 0)) {
+            *pe = old->next;
+            tb_cache_entry_free(old);
+        } else {
+            pe = &old->next;
+            n++;
+        }
+    }
+    e->next = head;
+
+    g_hash_table_insert(tb_cache.htable, &e->rec.key, e);
+    tb_cache.size += sizeof(TBCacheEntry) + tb_cache_data_size(&e->rec);
+    tb_cache.nb_entries++;
+}
+
+static bool tb_cache_entry_valid(TBCacheEntry *e)
+{
+    TCGTBReloc *r = tb_cache_relocs(e);
+    int i;
+
+    for (i = 0; i < e->rec.nb_relocs; i++) {
+        unsigned size = r[i].type == TCG_TB_RELOC_ABS64 ? 8 : 4;
+
+        if (r[i].kind > TCG_TB_RELOC_TEXT ||
+            r[i].type > TCG_TB_RELOC_PC32 ||
+            r[i].offset > e->rec.code_size ||
+            e->rec.code_size - r[i].offset < size) {
+            return false;
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (e->rec.jmp_reset_offset[i] != TB_JMP_RESET_OFFSET_INVALID &&
+            e->rec.jmp_reset_offset[i] >= e->rec.code_size) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void tb_cache_load(void)
+{
+    TBCacheHeader hdr;
+    FILE *f;
+    unsigned i;
+
+    f = fopen(tb_cache.path, "rb");
+    if (!f) {
+        if (errno != ENOENT) {
+            error_report("warning: cannot open translation cache %s: %s",
+                         tb_cache.path, strerror(errno));
+        }
+        return;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+        memcmp(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic)) ||
+        hdr.version != TB_CACHE_VERSION) {
+        error_report("warning: %s is not a translation cache, ignoring it",
+                     tb_cache.path);
+        goto out;
+    }
+    if (hdr.host_id != tb_cache.host_id) {
+        /* Written by another QEMU binary; it is replaced at exit.  */
+        goto out;
+    }
+
+    for (i = 0; i < hdr.nb_entries; i++) {
+        TBCacheRecord rec;
+        TBCacheEntry *e;
+        size_t size;
+
+        if (fread(&rec, sizeof(rec), 1, f) != 1) {
+            break;
+        }
+        if (rec.nb_relocs > TCG_MAX_TB_RELOCS ||
+            rec.code_size > TB_CACHE_MAX_SIZE ||
+            rec.search_size > TB_CACHE_MAX_SIZE ||
+            rec.guest_size == 0 || rec.guest_size > 2 * TARGET_PAGE_SIZE) {
+            break;
+        }
+        size = tb_cache_data_size(&rec);
+        if (tb_cache.size + sizeof(TBCacheEntry) + size > TB_CACHE_MAX_SIZE) {
+            break;
+        }
+
+        e = g_malloc(sizeof(TBCacheEntry) + size);
+        e->rec = rec;
+        if (fread(e->data, size, 1, f) != 1 || !tb_cache_entry_valid(e)) {
+            g_free(e);
+            break;
+        }
+        tb_cache_insert(e);
+    }
+    if (i < hdr.nb_entries) {
+        error_report("warning: translation cache %s is truncated or corrupt, "
+                     "loaded %u of %u entries", tb_cache.path, i,
+                     hdr.nb_entries);
+        tb_cache.dirty = true;
+    }
+
+out:
+    fclose(f);
+}
+
+static bool tb_cache_write(FILE *f)
+{
+    TBCacheHeader hdr;
+    GHashTableIter iter;
+    gpointer value;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TB_CACHE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TB_CACHE_VERSION;
+    hdr.nb_entries = tb_cache.nb_entries;
+    hdr.host_id = tb_cache.host_id;
+    if (fwrite(&hdr, sizeof(hdr), 1, f) != 1) {
+        return false;
+    }
+
+    g_hash_table_iter_init(&iter, tb_cache.htable);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        TBCacheEntry *e;
+
+        for (e = value; e; e = e->next) {
+            if (fwrite(&e->rec, sizeof(e->rec), 1, f) != 1 ||
+                fwrite(e->data, tb_cache_data_size(&e->rec), 1, f) != 1) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void tb_cache_save(Notifier *n, void *data)
+{
+    char *tmp;
+    FILE *f;
+    bool ok;
+
+    tb_lock();
+    if (!tb_cache.dirty) {
+        goto out;
+    }
+
+    tmp = g_strdup_printf("%s.tmp", tb_cache.path);
+    f = fopen(tmp, "wb");
+    if (!f) {
+        error_report("cannot write translation cache %s: %s",
+                     tmp, strerror(errno));
+        g_free(tmp);
+        goto out;
+    }
+    ok = tb_cache_write(f);
+    if (fclose(f) != 0) {
+        ok = false;
+    }
+    if (ok && rename(tmp, tb_cache.path) < 0) {
+        ok = false;
+    }
+    if (!ok) {
+        error_report("cannot write translation cache %s: %s",
+                     tb_cache.path, strerror(errno));
+        unlink(tmp);
+    }
+    g_free(tmp);
+    tb_cache.dirty = false;
+
+out:
+    tb_unlock();
+}
+
+void tb_cache_init(const char *path, Error **errp)
+{
+#ifndef TB_CACHE_SUPPORTED
+    error_setg(errp, "The translation cache is not supported "
+               "for this target or host");
+    return;
+#endif
+    if (use_icount) {
+        error_setg(errp, "The translation cache is not compatible "
+                   "with icount");
+        return;
+    }
+    if (!tb_cache_compute_host_id(&tb_cache.host_id, errp)) {
+        return;
+    }
+
+    tb_cache.path = g_strdup(path);
+    tb_cache.htable = g_hash_table_new(tb_cache_key_hash, tb_cache_key_equal);
+    tb_cache_load();
+
+    tb_cache.exit_notifier.notify = tb_cache_save;
+    qemu_add_exit_notifier(&tb_cache.exit_notifier);
+}
+
+/* Only the translations of plain TBs are reused: anything else depends
+   on state that is not part of the key.  */
+bool tb_cache_active(CPUState *cpu, int cflags)
+{
+    return tb_cache.htable && cflags == 0 && !singlestep &&
+           !cpu->singlestep_enabled && QTAILQ_EMPTY(&cpu->breakpoints);
+}
+
+static bool tb_cache_guest_code_matches(CPUArchState *env, TBCacheEntry *e,
+                                        target_ulong pc,
+                                        tb_page_addr_t phys_pc)
+{
+    const uint8_t *guest = tb_cache_guest(e);
+    size_t size = e->rec.guest_size;
+    size_t len;
+
+    len = MIN(size, TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK));
+    if (memcmp(qemu_map_ram_ptr(NULL, phys_pc), guest, len)) {
+        return false;
+    }
+    if (len < size) {
+        tb_page_addr_t phys_page2 = get_page_addr_code(env, pc + len);
+
+        if (phys_page2 == -1 ||
+            memcmp(qemu_map_ram_ptr(NULL, phys_page2), guest + len,
+                   size - len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool tb_cache_apply_reloc(TranslationBlock *tb, uint8_t *code,
+                                 const TCGTBReloc *r)
+{
+    uint8_t *field = code + r->offset;
+    uintptr_t base, target;
+
+    switch (r->kind) {
+    case TCG_TB_RELOC_TB:
+        base = (uintptr_t)tb;
+        break;
+    case TCG_TB_RELOC_TC:
+        base = (uintptr_t)code;
+        break;
+    case TCG_TB_RELOC_PROLOGUE:
+        base = (uintptr_t)tcg_ctx.code_gen_prologue;
+        break;
+    case TCG_TB_RELOC_TEXT:
+        base = tcg_tb_reloc_text_base();
+        break;
+    default:
+        return false;
+    }
+    target = base + r->addend;
+
+    switch (r->type) {
+    case TCG_TB_RELOC_ABS32: {
+        uint32_t val = target;
+
+        if (val != target) {
+            return false;
+        }
+        memcpy(field, &val, sizeof(val));
+        return true;
+    }
+    case TCG_TB_RELOC_ABS64: {
+        uint64_t val = target;
+
+        memcpy(field, &val, sizeof(val));
+        return true;
+    }
+    case TCG_TB_RELOC_PC32: {
+        intptr_t disp = target - ((uintptr_t)field + 4);
+        int32_t val = disp;
+
+        if (val != disp) {
+            return false;
+        }
+        memcpy(field, &val, sizeof(val));
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+/* Copy the code of E at tb->tc_ptr and relocate it.  Nothing else can
+   see that part of code_gen_buffer until the TB is linked, so a failure
+   half way leaves nothing to undo.  */
+static bool tb_cache_install(TranslationBlock *tb, TBCacheEntry *e)
+{
+    uint8_t *code = tb->tc_ptr;
+    size_t size = e->rec.code_size + e->rec.search_size;
+    TCGTBReloc *r = tb_cache_relocs(e);
+    int i;
+
+    if (code + size > (uint8_t *)tcg_ctx.code_gen_highwater) {
+        return false;
+    }
+    memcpy(code, tb_cache_code(e), size);
+    for (i = 0; i < e->rec.nb_relocs; i++) {
+        if (!tb_cache_apply_reloc(tb, code, &r[i])) {
+            return false;
+        }
+    }
+
+    tb->size = e->rec.guest_size;
+    tb->icount = e->rec.icount;
+    tb->tc_search = code + e->rec.code_size;
+    tb->lazy_flags = e->rec.lazy_flags;
+    tb->jmp_reset_offset[0] = e->rec.jmp_reset_offset[0];
+    tb->jmp_reset_offset[1] = e->rec.jmp_reset_offset[1];
+#ifdef USE_DIRECT_JUMP
+    tb->jmp_insn_offset[0] = e->rec.jmp_insn_offset[0];
+    tb->jmp_insn_offset[1] = e->rec.jmp_insn_offset[1];
+#endif
+    flush_icache_range((uintptr_t)code, (uintptr_t)code + e->rec.code_size);
+    return true;
+}
+
+/* Called with tb_lock held, instead of translating TB.  */
+bool tb_cache_restore(CPUState *cpu, TranslationBlock *tb,
+                      tb_page_addr_t phys_pc,
+                      int *code_size, int *search_size)
+{
+    CPUArchState *env = cpu->env_ptr;
+    TBCacheKey key;
+    TBCacheEntry *e;
+
+    tb_cache_make_key(&key, env, tb);
+    e = g_hash_table_lookup(tb_cache.htable, &key);
+    if (!e) {
+        atomic_inc(&tb_cache.misses);
+        return false;
+    }
+
+    for (; e; e = e->next) {
+        if (tb_cache_guest_code_matches(env, e, tb->pc, phys_pc) &&
+            tb_cache_install(tb, e)) {
+            *code_size = e->rec.code_size;
+            *search_size = e->rec.search_size;
+            atomic_inc(&tb_cache.hits);
+            return true;
+        }
+    }
+    atomic_inc(&tb_cache.stale);
+    return false;
+}
+
+/* Called with tb_lock held, after TB was translated with relocations
+   enabled.  */
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb,
+                    tb_page_addr_t phys_pc, tb_page_addr_t phys_page2,
+                    int code_size, int search_size)
+{
+    TBCacheRecord rec;
+    TBCacheEntry *e;
+    uint8_t *guest;
+    size_t size, len;
+
+    if (tcg_ctx.tb_relocs_invalid || tb->size == 0) {
+        return;
+    }
+
+    memset(&rec, 0, sizeof(rec));
+    tb_cache_make_key(&rec.key, cpu->env_ptr, tb);
+    rec.guest_size = tb->size;
+    rec.icount = tb->icount;
+    rec.code_size = code_size;
+    rec.search_size = search_size;
+    rec.nb_relocs = tcg_ctx.nb_tb_relocs;
+    rec.lazy_flags = tb->lazy_flags;
+    rec.jmp_reset_offset[0] = tb->jmp_reset_offset[0];
+    rec.jmp_reset_offset[1] = tb->jmp_reset_offset[1];
+#ifdef USE_DIRECT_JUMP
+    rec.jmp_insn_offset[0] = tb->jmp_insn_offset[0];
+    rec.jmp_insn_offset[1] = tb->jmp_insn_offset[1];
+#endif
+
+    size = tb_cache_data_size(&rec);
+    if (tb_cache.size + sizeof(TBCacheEntry) + size > TB_CACHE_MAX_SIZE) {
+        return;
+    }
+
+    e = g_malloc(sizeof(TBCacheEntry) + size);
+    e->rec = rec;
+    memcpy(tb_cache_relocs(e), tcg_ctx.tb_relocs,
+           rec.nb_relocs * sizeof(TCGTBReloc));
+    memcpy(tb_cache_code(e), tb->tc_ptr, code_size + search_size);
+
+    guest = tb_cache_guest(e);
+    len = MIN(rec.guest_size,
+              TARGET_PAGE_SIZE - (tb->pc & ~TARGET_PAGE_MASK));
+    memcpy(guest, qemu_map_ram_ptr(NULL, phys_pc), len);
+    if (len < rec.guest_size) {
+        memcpy(guest + len, qemu_map_ram_ptr(NULL, phys_page2),
+               rec.guest_size - len);
+    }
+
+    tb_cache_insert(e);
+    tb_cache.dirty = true;
+    atomic_inc(&tb_cache.stores);
+}
+
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!tb_cache.htable) {
+        return;
+    }
+    cpu_fprintf(f, "TB cache            %s: %u entries, %zu KB\n",
+                tb_cache.path, tb_cache.nb_entries, tb_cache.size / 1024);
+    cpu_fprintf(f, "TB cache lookups    %u hits, %u misses, %u stale, "
+                "%u stores\n", atomic_read(&tb_cache.hits),
+                atomic_read(&tb_cache.misses), atomic_read(&tb_cache.stale),
+                atomic_read(&tb_cache.stores));
+}
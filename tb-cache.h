@@ -0,0 +1,33 @@
+/*
+ * Persistent translation cache
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TB_CACHE_H
+#define TB_CACHE_H
+
+#include "exec/exec-all.h"
+
+/* tb-cache.c */
+void tb_cache_init(const char *path, Error **errp);
+bool tb_cache_active(CPUState *cpu, int cflags);
+bool tb_cache_restore(CPUState *cpu, TranslationBlock *tb,
+                      tb_page_addr_t phys_pc,
+                      int *code_size, int *search_size);
+void tb_cache_store(CPUState *cpu, TranslationBlock *tb,
+                    tb_page_addr_t phys_pc, tb_page_addr_t phys_page2,
+                    int code_size, int search_size);
+void tb_cache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
+#endif /* TB_CACHE_H */
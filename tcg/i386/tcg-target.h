@@ -27,6 +27,8 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE  1
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 31
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
+#define TCG_TARGET_IMPLEMENTS_TB_RELOCS 1
 
 #ifdef __x86_64__
 # define TCG_TARGET_REG_BITS  64
@@ -76,8 +78,15 @@ typedef enum {
 #endif
 
 extern bool have_bmi1;
+#if TCG_TARGET_REG_BITS == 64
+# define have_sse2 1
+#else
+extern bool have_sse2;
+#endif
 
 /* optional instructions */
+#define TCG_TARGET_HAS_vec              have_sse2
+#define TCG_TARGET_HAS_atomic           (TCG_TARGET_REG_BITS == 64)
 #define TCG_TARGET_HAS_div2_i32         1
 #define TCG_TARGET_HAS_rot_i32          1
 #define TCG_TARGET_HAS_ext8s_i32        1
@@ -133,6 +133,11 @@ static bool have_movbe;
    it there.  Therefore we always define the variable.  */
 bool have_bmi1;
 
+/* Likewise for SSE2, which is always present on 64-bit hosts.  */
+#if TCG_TARGET_REG_BITS == 32
+bool have_sse2;
+#endif
+
 #if defined(CONFIG_CPUID_H) && defined(bit_BMI2)
 static bool have_bmi2;
 #else
@@ -238,6 +243,15 @@ static int target_parse_constraint(TCGArgConstraint *ct, const char **pct_str)
         tcg_regset_reset_reg(ct->u.regs, TCG_REG_L1);
         break;
 
+        /* atomic operation operands: as 'L', and not %eax either */
+    case 'M':
+        ct->ct |= TCG_CT_REG;
+        tcg_regset_set32(ct->u.regs, 0, 0xffff);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_L0);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_L1);
+        tcg_regset_reset_reg(ct->u.regs, TCG_REG_EAX);
+        break;
+
     case 'e':
         ct->ct |= TCG_CT_CONST_S32;
         break;
@@ -306,9 +320,12 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_ARITH_GvEv	(0x03)		/* ... plus (ARITH_FOO << 3) */
 #define OPC_ANDN        (0xf2 | P_EXT38)
 #define OPC_ADD_GvEv	(OPC_ARITH_GvEv | (ARITH_ADD << 3))
+#define OPC_AND_GvEv	(OPC_ARITH_GvEv | (ARITH_AND << 3))
 #define OPC_BSWAP	(0xc8 | P_EXT)
 #define OPC_CALL_Jz	(0xe8)
 #define OPC_CMOVCC      (0x40 | P_EXT)  /* ... plus condition code */
+#define OPC_CMPXCHG_EbGb (0xb0 | P_EXT)
+#define OPC_CMPXCHG_EvGv (0xb1 | P_EXT)
 #define OPC_CMP_GvEv	(OPC_ARITH_GvEv | (ARITH_CMP << 3))
 #define OPC_DEC_r32	(0x48)
 #define OPC_IMUL_GvEv	(0xaf | P_EXT)
@@ -320,6 +337,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_JMP_long	(0xe9)
 #define OPC_JMP_short	(0xeb)
 #define OPC_LEA         (0x8d)
+#define OPC_LOCK        (0xf0)
 #define OPC_MOVB_EvGv	(0x88)		/* stores, more or less */
 #define OPC_MOVL_EvGv	(0x89)		/* stores, more or less */
 #define OPC_MOVL_GvEv	(0x8b)		/* loads, more or less */
@@ -333,6 +351,26 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_MOVSLQ	(0x63 | P_REXW)
 #define OPC_MOVZBL	(0xb6 | P_EXT)
 #define OPC_MOVZWL	(0xb7 | P_EXT)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
 #define OPC_POP_r32	(0x58)
 #define OPC_PUSH_r32	(0x50)
 #define OPC_PUSH_Iv	(0x68)
@@ -346,7 +384,11 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_SHLX        (0xf7 | P_EXT38 | P_DATA16)
 #define OPC_SHRX        (0xf7 | P_EXT38 | P_SIMDF2)
 #define OPC_TESTL	(0x85)
+#define OPC_XADD_EbGb   (0xc0 | P_EXT)
+#define OPC_XADD_EvGv   (0xc1 | P_EXT)
 #define OPC_XCHG_ax_r32	(0x90)
+#define OPC_XCHG_EbGb   (0x86)
+#define OPC_XCHG_EvGv   (0x87)
 
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
@@ -431,6 +473,11 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
     if (opc & P_ADDR32) {
         tcg_out8(s, 0x67);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
 
     rex = 0;
     rex |= (opc & P_REXW) ? 0x8 : 0x0;  /* REX.W */
@@ -465,6 +512,11 @@ static void tcg_out_opc(TCGContext *s, int opc)
     if (opc & P_DATA16) {
         tcg_out8(s, 0x66);
     }
+    if (opc & P_SIMDF3) {
+        tcg_out8(s, 0xf3);
+    } else if (opc & P_SIMDF2) {
+        tcg_out8(s, 0xf2);
+    }
     if (opc & (P_EXT | P_EXT38)) {
         tcg_out8(s, 0x0f);
         if (opc & P_EXT38) {
@@ -660,9 +712,11 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
         return;
     }
 
-    /* Try a 7 byte pc-relative lea before the 10 byte movq.  */
+    /* Try a 7 byte pc-relative lea before the 10 byte movq.  The result
+       would change with the location of the code, so not for code that
+       may be relocated.  */
     diff = arg - ((uintptr_t)s->code_ptr + 7);
-    if (diff == (int32_t)diff) {
+    if (diff == (int32_t)diff && !s->tb_relocs_enabled) {
         tcg_out_opc(s, OPC_LEA | P_REXW, ret, 0, 0);
         tcg_out8(s, (LOWREGMASK(ret) << 3) | 5);
         tcg_out32(s, diff);
@@ -673,6 +727,23 @@ static void tcg_out_movi(TCGContext *s, TCGType type,
     tcg_out64(s, arg);
 }
 
+/* Load the host address ARG, using an encoding that can be relocated
+   when that is required.  */
+static void tcg_out_movi_ptr(TCGContext *s, TCGReg ret, uintptr_t arg)
+{
+    if (!s->tb_relocs_enabled) {
+        tcg_out_movi(s, TCG_TYPE_PTR, ret, arg);
+    } else if (TCG_TARGET_REG_BITS == 64) {
+        tcg_out_opc(s, OPC_MOVL_Iv + P_REXW + LOWREGMASK(ret), 0, ret, 0);
+        tcg_tb_reloc_add(s, s->code_ptr, TCG_TB_RELOC_ABS64, arg);
+        tcg_out64(s, arg);
+    } else {
+        tcg_out_opc(s, OPC_MOVL_Iv + LOWREGMASK(ret), 0, ret, 0);
+        tcg_tb_reloc_add(s, s->code_ptr, TCG_TB_RELOC_ABS32, arg);
+        tcg_out32(s, arg);
+    }
+}
+
 static inline void tcg_out_pushi(TCGContext *s, tcg_target_long val)
 {
     if (val == (int8_t)val) {
@@ -1112,9 +1183,13 @@ static void tcg_out_branch(TCGContext *s, int call, tcg_insn_unit *dest)
 
     if (disp == (int32_t)disp) {
         tcg_out_opc(s, call ? OPC_CALL_Jz : OPC_JMP_long, 0, 0, 0);
+        if (dest < s->code_buf || dest > s->code_ptr) {
+            tcg_tb_reloc_add(s, s->code_ptr, TCG_TB_RELOC_PC32,
+                             (uintptr_t)dest);
+        }
         tcg_out32(s, disp);
     } else {
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_R10, (uintptr_t)dest);
+        tcg_out_movi_ptr(s, TCG_REG_R10, (uintptr_t)dest);
         tcg_out_modrm(s, OPC_GRP5,
                       call ? EXT5_CALLN_Ev : EXT5_JMPN_Ev, TCG_REG_R10);
     }
@@ -1212,7 +1287,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
         }
         if (TCG_TYPE_PTR == TCG_TYPE_I64) {
             hrexw = P_REXW;
-            if (TARGET_PAGE_BITS + CPU_TLB_BITS > 32) {
+            if (TARGET_PAGE_BITS + CPU_TLB_DYN_MAX_BITS > 32) {
                 tlbtype = TCG_TYPE_I64;
                 tlbrexw = P_REXW;
             }
@@ -1236,15 +1311,17 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
                    TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
 
     tgen_arithi(s, ARITH_AND + trexw, r1, tlb_mask, 0);
-    tgen_arithi(s, ARITH_AND + tlbrexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
 
-    tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
-                             offsetof(CPUArchState, tlb_table[mem_index][0])
-                             + which);
+    /* and tlb_mask[mem_index](env), r0 */
+    tcg_out_modrm_offset(s, OPC_AND_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
+
+    /* add tlb_table[mem_index](env), r0 */
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_table[mem_index]));
 
-    /* cmp 0(r0), r1 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, 0);
+    /* cmp which(r0), r1 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, which);
 
     /* Prepare for both the fast path add of the tlb addend, and the slow
        path function argument setup.  There are two cases worth note:
@@ -1260,8 +1337,8 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
     s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r0), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, 4);
+        /* cmp which+4(r0), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, which + 4);
 
         /* jne slow_path */
         tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
@@ -1273,7 +1350,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     /* add addend(r0), r1 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1, r0,
-                         offsetof(CPUTLBEntry, addend) - which);
+                         offsetof(CPUTLBEntry, addend));
 }
 
 /*
@@ -1335,12 +1412,14 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
         ofs += 4;
 
         tcg_out_sti(s, TCG_TYPE_PTR, (uintptr_t)l->raddr, TCG_REG_ESP, ofs);
+        tcg_tb_reloc_add(s, s->code_ptr - 4, TCG_TB_RELOC_ABS32,
+                         (uintptr_t)l->raddr);
     } else {
         tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
         /* The second argument is already loaded with addrlo.  */
         tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[2], oi);
-        tcg_out_movi(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[3],
-                     (uintptr_t)l->raddr);
+        tcg_out_movi_ptr(s, tcg_target_call_iarg_regs[3],
+                         (uintptr_t)l->raddr);
     }
 
     tcg_out_call(s, qemu_ld_helpers[opc & (MO_BSWAP | MO_SIZE)]);
@@ -1384,6 +1463,119 @@ static void tcg_out_qemu_ld_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
     tcg_out_jmp(s, l->raddr);
 }
 
+#if TCG_TARGET_HAS_atomic
+/* helper signature: helper_atomic_<op><size>_mmu(CPUState *env,
+ *     target_ulong addr, [uintxx_t cmpv,] uintxx_t val, int mmu_idx,
+ *     uintptr_t ra)
+ */
+static void * const atomic_cmpxchg_helpers[4] = {
+    helper_atomic_cmpxchgb_mmu, helper_atomic_cmpxchgw_mmu,
+    helper_atomic_cmpxchgl_mmu, helper_atomic_cmpxchgq_mmu,
+};
+static void * const atomic_xchg_helpers[4] = {
+    helper_atomic_xchgb_mmu, helper_atomic_xchgw_mmu,
+    helper_atomic_xchgl_mmu, helper_atomic_xchgq_mmu,
+};
+static void * const atomic_fetch_add_helpers[4] = {
+    helper_atomic_fetch_addb_mmu, helper_atomic_fetch_addw_mmu,
+    helper_atomic_fetch_addl_mmu, helper_atomic_fetch_addq_mmu,
+};
+static void * const atomic_fetch_and_helpers[4] = {
+    helper_atomic_fetch_andb_mmu, helper_atomic_fetch_andw_mmu,
+    helper_atomic_fetch_andl_mmu, helper_atomic_fetch_andq_mmu,
+};
+static void * const atomic_fetch_or_helpers[4] = {
+    helper_atomic_fetch_orb_mmu, helper_atomic_fetch_orw_mmu,
+    helper_atomic_fetch_orl_mmu, helper_atomic_fetch_orq_mmu,
+};
+static void * const atomic_fetch_xor_helpers[4] = {
+    helper_atomic_fetch_xorb_mmu, helper_atomic_fetch_xorw_mmu,
+    helper_atomic_fetch_xorl_mmu, helper_atomic_fetch_xorq_mmu,
+};
+
+/*
+ * Generate code for the slow path for an atomic operation
+ */
+static void tcg_out_atomic_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
+{
+    TCGMemOpIdx oi = l->oi;
+    TCGMemOp s_bits = get_memop(oi) & MO_SIZE;
+    TCGType type = (s_bits == MO_64 ? TCG_TYPE_I64 : TCG_TYPE_I32);
+    void * const *helpers;
+    int arg = 2;
+
+    /* resolve label address */
+    tcg_patch32(l->label_ptr[0], s->code_ptr - l->label_ptr[0] - 4);
+
+    switch (l->atomic_opc) {
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+        /* The compared value is in %rax, which is not an argument
+           register; move the new value first, as it may be sitting in
+           the register that receives the compared value.  */
+        tcg_out_mov(s, type, tcg_target_call_iarg_regs[3], l->datalo_reg);
+        tcg_out_mov(s, type, tcg_target_call_iarg_regs[2], TCG_REG_RAX);
+        helpers = atomic_cmpxchg_helpers;
+        arg = 4;
+        break;
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+        helpers = atomic_xchg_helpers;
+        break;
+    case INDEX_op_atomic_fetch_add_i32:
+    case INDEX_op_atomic_fetch_add_i64:
+        helpers = atomic_fetch_add_helpers;
+        break;
+    case INDEX_op_atomic_fetch_and_i32:
+    case INDEX_op_atomic_fetch_and_i64:
+        helpers = atomic_fetch_and_helpers;
+        break;
+    case INDEX_op_atomic_fetch_or_i32:
+    case INDEX_op_atomic_fetch_or_i64:
+        helpers = atomic_fetch_or_helpers;
+        break;
+    case INDEX_op_atomic_fetch_xor_i32:
+    case INDEX_op_atomic_fetch_xor_i64:
+        helpers = atomic_fetch_xor_helpers;
+        break;
+    default:
+        tcg_abort();
+    }
+    if (arg == 2) {
+        tcg_out_mov(s, type, tcg_target_call_iarg_regs[2], l->datalo_reg);
+        arg = 3;
+    }
+
+    tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
+    /* The second argument is already loaded with addrlo.  */
+
+    /* With Win64, oi and the return address may have to go on the stack.  */
+    if (arg < ARRAY_SIZE(tcg_target_call_iarg_regs)) {
+        tcg_out_movi(s, TCG_TYPE_I32, tcg_target_call_iarg_regs[arg], oi);
+    } else {
+        tcg_out_sti(s, TCG_TYPE_I32, oi, TCG_REG_ESP,
+                    TCG_TARGET_CALL_STACK_OFFSET
+                    + (arg - ARRAY_SIZE(tcg_target_call_iarg_regs)) * 8);
+    }
+    arg++;
+    if (arg < ARRAY_SIZE(tcg_target_call_iarg_regs)) {
+        tcg_out_movi_ptr(s, tcg_target_call_iarg_regs[arg],
+                         (uintptr_t)l->raddr);
+    } else {
+        tcg_out_movi_ptr(s, TCG_REG_RAX, (uintptr_t)l->raddr);
+        tcg_out_st(s, TCG_TYPE_PTR, TCG_REG_RAX, TCG_REG_ESP,
+                   TCG_TARGET_CALL_STACK_OFFSET
+                   + (arg - ARRAY_SIZE(tcg_target_call_iarg_regs)) * 8);
+    }
+
+    tcg_out_call(s, helpers[s_bits]);
+
+    /* The helpers return the old value zero-extended to uintxx_t.  */
+    tcg_out_mov(s, type, l->ret_reg, TCG_REG_RAX);
+    tcg_out_jmp(s, l->raddr);
+}
+#endif /* TCG_TARGET_HAS_atomic */
+
 /*
  * Generate code for the slow path for a store at the end of block
  */
@@ -1395,6 +1587,13 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
     tcg_insn_unit **label_ptr = &l->label_ptr[0];
     TCGReg retaddr;
 
+#if TCG_TARGET_HAS_atomic
+    if (l->is_atomic) {
+        tcg_out_atomic_slow_path(s, l);
+        return;
+    }
+#endif
+
     /* resolve label address */
     tcg_patch32(label_ptr[0], s->code_ptr - label_ptr[0] - 4);
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
@@ -1427,7 +1626,7 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
         ofs += 4;
 
         retaddr = TCG_REG_EAX;
-        tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+        tcg_out_movi_ptr(s, retaddr, (uintptr_t)l->raddr);
         tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP, ofs);
     } else {
         tcg_out_mov(s, TCG_TYPE_PTR, tcg_target_call_iarg_regs[0], TCG_AREG0);
@@ -1438,10 +1637,10 @@ static void tcg_out_qemu_st_slow_path(TCGContext *s, TCGLabelQemuLdst *l)
 
         if (ARRAY_SIZE(tcg_target_call_iarg_regs) > 4) {
             retaddr = tcg_target_call_iarg_regs[4];
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_ptr(s, retaddr, (uintptr_t)l->raddr);
         } else {
             retaddr = TCG_REG_RAX;
-            tcg_out_movi(s, TCG_TYPE_PTR, retaddr, (uintptr_t)l->raddr);
+            tcg_out_movi_ptr(s, retaddr, (uintptr_t)l->raddr);
             tcg_out_st(s, TCG_TYPE_PTR, retaddr, TCG_REG_ESP,
                        TCG_TARGET_CALL_STACK_OFFSET);
         }
@@ -1779,6 +1978,248 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+#if TCG_TARGET_HAS_atomic
+/* Perform the atomic operation OPC on the host address BASE + OFS.
+   The register constraints place RET in %rax for cmpxchg (where it is
+   also the compared value) and for the logical operations, and in VAL
+   itself for xchg and fetch_add.  TCG_REG_L0 is free for scratch.  */
+static void tcg_out_atomic_direct(TCGContext *s, TCGOpcode opc, TCGReg ret,
+                                  TCGReg val, TCGReg base, intptr_t ofs,
+                                  int seg, TCGMemOp memop)
+{
+    TCGMemOp s_bits = memop & MO_SIZE;
+    int vsize = (s_bits == MO_64 ? P_REXW : s_bits == MO_16 ? P_DATA16 : 0);
+    int cmpxchg, arith, ld;
+    tcg_insn_unit *loop;
+
+    if (s_bits == MO_8) {
+        cmpxchg = OPC_CMPXCHG_EbGb + P_REXB_R + seg;
+    } else {
+        cmpxchg = OPC_CMPXCHG_EvGv + vsize + seg;
+    }
+
+    switch (opc) {
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+        tcg_out8(s, OPC_LOCK);
+        tcg_out_modrm_offset(s, cmpxchg, val, base, ofs);
+        break;
+
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+        /* xchg with a memory operand is always locked.  */
+        tcg_out_modrm_offset(s, (s_bits == MO_8
+                                 ? OPC_XCHG_EbGb + P_REXB_R
+                                 : OPC_XCHG_EvGv + vsize) + seg,
+                             ret, base, ofs);
+        break;
+
+    case INDEX_op_atomic_fetch_add_i32:
+    case INDEX_op_atomic_fetch_add_i64:
+        tcg_out8(s, OPC_LOCK);
+        tcg_out_modrm_offset(s, (s_bits == MO_8
+                                 ? OPC_XADD_EbGb + P_REXB_R
+                                 : OPC_XADD_EvGv + vsize) + seg,
+                             ret, base, ofs);
+        break;
+
+    case INDEX_op_atomic_fetch_and_i32:
+    case INDEX_op_atomic_fetch_and_i64:
+        arith = ARITH_AND;
+        goto do_loop;
+    case INDEX_op_atomic_fetch_or_i32:
+    case INDEX_op_atomic_fetch_or_i64:
+        arith = ARITH_OR;
+        goto do_loop;
+    case INDEX_op_atomic_fetch_xor_i32:
+    case INDEX_op_atomic_fetch_xor_i64:
+        arith = ARITH_XOR;
+    do_loop:
+        /* There is no locked form that returns the old value: retry
+           a compare-and-swap of %rax OP val until nobody interferes.  */
+        switch (s_bits) {
+        case MO_8:
+            ld = OPC_MOVZBL;
+            break;
+        case MO_16:
+            ld = OPC_MOVZWL;
+            break;
+        case MO_32:
+            ld = OPC_MOVL_GvEv;
+            break;
+        default:
+            ld = OPC_MOVL_GvEv + P_REXW;
+            break;
+        }
+        tcg_out_modrm_offset(s, ld + seg, TCG_REG_RAX, base, ofs);
+        loop = s->code_ptr;
+        tcg_out_mov(s, TCG_TYPE_I64, TCG_REG_L0, TCG_REG_RAX);
+        tgen_arithr(s, arith + P_REXW, TCG_REG_L0, val);
+        tcg_out8(s, OPC_LOCK);
+        tcg_out_modrm_offset(s, cmpxchg, TCG_REG_L0, base, ofs);
+        tcg_out8(s, OPC_JCC_short + JCC_JNE);
+        tcg_out8(s, loop - s->code_ptr - 1);
+        break;
+
+    default:
+        tcg_abort();
+    }
+
+    /* Zero-extend the old value from the size of the access.  */
+    switch (s_bits) {
+    case MO_8:
+        tcg_out_ext8u(s, ret, ret);
+        break;
+    case MO_16:
+        tcg_out_ext16u(s, ret, ret);
+        break;
+    case MO_32:
+        tcg_out_ext32u(s, ret, ret);
+        break;
+    default:
+        break;
+    }
+}
+
+static void tcg_out_atomic(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    bool is_cmpxchg = (opc == INDEX_op_atomic_cmpxchg_i32
+                       || opc == INDEX_op_atomic_cmpxchg_i64);
+    TCGReg ret = args[0];
+    TCGReg addr = args[1];
+    TCGReg val = args[is_cmpxchg ? 3 : 2];
+    TCGMemOpIdx oi = args[is_cmpxchg ? 4 : 3];
+    TCGMemOp opc_mem = get_memop(oi);
+#if defined(CONFIG_SOFTMMU)
+    tcg_insn_unit *label_ptr[2];
+    TCGLabelQemuLdst *label;
+
+    tcg_out_tlb_load(s, addr, 0, get_mmuidx(oi), opc_mem,
+                     label_ptr, offsetof(CPUTLBEntry, addr_write));
+
+    /* TLB Hit.  */
+    tcg_out_atomic_direct(s, opc, ret, val, TCG_REG_L1, 0, 0, opc_mem);
+
+    /* Record the current context of the operation into ldst label */
+    label = new_ldst_label(s);
+    label->is_ld = false;
+    label->is_atomic = true;
+    label->atomic_opc = opc;
+    label->oi = oi;
+    label->datalo_reg = val;
+    label->ret_reg = ret;
+    label->addrlo_reg = addr;
+    label->raddr = s->code_ptr;
+    label->label_ptr[0] = label_ptr[0];
+#else
+    {
+        int32_t offset = guest_base;
+        TCGReg base = addr;
+        int seg = 0;
+
+        /* As in tcg_out_qemu_st; L0 stays free for the scratch.  */
+        if (guest_base == 0 || guest_base_flags) {
+            seg = guest_base_flags;
+            offset = 0;
+            if (TCG_TARGET_REG_BITS > TARGET_LONG_BITS) {
+                seg |= P_ADDR32;
+            }
+        } else if (offset != guest_base) {
+            if (TARGET_LONG_BITS == 32) {
+                tcg_out_ext32u(s, TCG_REG_L0, base);
+                base = TCG_REG_L0;
+            }
+            tcg_out_movi(s, TCG_TYPE_I64, TCG_REG_L1, guest_base);
+            tgen_arithr(s, ARITH_ADD + P_REXW, TCG_REG_L1, base);
+            base = TCG_REG_L1;
+            offset = 0;
+        } else if (TARGET_LONG_BITS == 32) {
+            tcg_out_ext32u(s, TCG_REG_L1, base);
+            base = TCG_REG_L1;
+        }
+
+        tcg_out_atomic_direct(s, opc, ret, val, base, offset, seg, opc_mem);
+    }
+#endif
+}
+#endif /* TCG_TARGET_HAS_atomic */
+
+/* Vector operations work on CPU state through %xmm0 and %xmm1, which
+   are not otherwise used by generated code and are clobbered by calls.  */
+#define TCG_REG_XMM0  0
+#define TCG_REG_XMM1  1
+
+static void tcg_out_vec_ld(TCGContext *s, int r, TCGReg base,
+                           intptr_t ofs, unsigned oprsz)
+{
+    tcg_out_modrm_offset(s, oprsz == 16 ? OPC_MOVDQU_VxWx : OPC_MOVQ_VqWq,
+                         r, base, ofs);
+}
+
+static void tcg_out_vec_st(TCGContext *s, int r, TCGReg base,
+                           intptr_t ofs, unsigned oprsz)
+{
+    tcg_out_modrm_offset(s, oprsz == 16 ? OPC_MOVDQU_WxVx : OPC_MOVQ_WqVq,
+                         r, base, ofs);
+}
+
+static void tcg_out_vec_op(TCGContext *s, TCGOpcode opc, const TCGArg *args)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int cmpeq_insn[3] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD
+    };
+    TCGReg env = args[0];
+    unsigned oprsz = TCG_VEC_OPRSZ(args[4]);
+    unsigned vece = TCG_VEC_VECE(args[4]);
+    int insn;
+
+    tcg_out_vec_ld(s, TCG_REG_XMM0, env, args[2], oprsz);
+    if (opc == INDEX_op_shuf32_vec) {
+        tcg_out_modrm(s, OPC_PSHUFD, TCG_REG_XMM0, TCG_REG_XMM0);
+        tcg_out8(s, args[3]);
+        tcg_out_vec_st(s, TCG_REG_XMM0, env, args[1], oprsz);
+        return;
+    }
+
+    tcg_out_vec_ld(s, TCG_REG_XMM1, env, args[3], oprsz);
+    switch (opc) {
+    case INDEX_op_add_vec:
+        insn = add_insn[vece];
+        break;
+    case INDEX_op_sub_vec:
+        insn = sub_insn[vece];
+        break;
+    case INDEX_op_and_vec:
+        insn = OPC_PAND;
+        break;
+    case INDEX_op_or_vec:
+        insn = OPC_POR;
+        break;
+    case INDEX_op_xor_vec:
+        insn = OPC_PXOR;
+        break;
+    case INDEX_op_andc_vec:
+        /* pandn inverts its destination operand.  */
+        tcg_out_modrm(s, OPC_PANDN, TCG_REG_XMM1, TCG_REG_XMM0);
+        tcg_out_vec_st(s, TCG_REG_XMM1, env, args[1], oprsz);
+        return;
+    case INDEX_op_cmpeq_vec:
+        tcg_debug_assert(vece < 3);
+        insn = cmpeq_insn[vece];
+        break;
+    default:
+        tcg_abort();
+    }
+    tcg_out_modrm(s, insn, TCG_REG_XMM0, TCG_REG_XMM1);
+    tcg_out_vec_st(s, TCG_REG_XMM0, env, args[1], oprsz);
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -1796,7 +2237,11 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
 
     switch(opc) {
     case INDEX_op_exit_tb:
-        tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, args[0]);
+        if (args[0]) {
+            tcg_out_movi_ptr(s, TCG_REG_EAX, args[0]);
+        } else {
+            tcg_out_movi(s, TCG_TYPE_PTR, TCG_REG_EAX, 0);
+        }
         tcg_out_jmp(s, tb_ret_addr);
         break;
     case INDEX_op_goto_tb:
@@ -2033,6 +2478,23 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         tcg_out_qemu_st(s, args, 1);
         break;
 
+#if TCG_TARGET_HAS_atomic
+    case INDEX_op_atomic_cmpxchg_i32:
+    case INDEX_op_atomic_cmpxchg_i64:
+    case INDEX_op_atomic_xchg_i32:
+    case INDEX_op_atomic_xchg_i64:
+    case INDEX_op_atomic_fetch_add_i32:
+    case INDEX_op_atomic_fetch_add_i64:
+    case INDEX_op_atomic_fetch_and_i32:
+    case INDEX_op_atomic_fetch_and_i64:
+    case INDEX_op_atomic_fetch_or_i32:
+    case INDEX_op_atomic_fetch_or_i64:
+    case INDEX_op_atomic_fetch_xor_i32:
+    case INDEX_op_atomic_fetch_xor_i64:
+        tcg_out_atomic(s, opc, args);
+        break;
+#endif
+
     OP_32_64(mulu2):
         tcg_out_modrm(s, OPC_GRP3_Ev + rexw, EXT3_MUL, args[3]);
         break;
@@ -2130,6 +2592,17 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
         }
         break;
 
+    case INDEX_op_add_vec:
+    case INDEX_op_sub_vec:
+    case INDEX_op_and_vec:
+    case INDEX_op_or_vec:
+    case INDEX_op_xor_vec:
+    case INDEX_op_andc_vec:
+    case INDEX_op_cmpeq_vec:
+    case INDEX_op_shuf32_vec:
+        tcg_out_vec_op(s, opc, args);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -2271,6 +2744,30 @@ static const TCGTargetOpDef x86_op_defs[] = {
     { INDEX_op_qemu_ld_i64, { "r", "r", "L", "L" } },
     { INDEX_op_qemu_st_i64, { "L", "L", "L", "L" } },
 #endif
+
+#if TCG_TARGET_HAS_atomic
+    { INDEX_op_atomic_cmpxchg_i32, { "a", "M", "0", "M" } },
+    { INDEX_op_atomic_xchg_i32, { "M", "M", "0" } },
+    { INDEX_op_atomic_fetch_add_i32, { "M", "M", "0" } },
+    { INDEX_op_atomic_fetch_and_i32, { "a", "M", "M" } },
+    { INDEX_op_atomic_fetch_or_i32, { "a", "M", "M" } },
+    { INDEX_op_atomic_fetch_xor_i32, { "a", "M", "M" } },
+    { INDEX_op_atomic_cmpxchg_i64, { "a", "M", "0", "M" } },
+    { INDEX_op_atomic_xchg_i64, { "M", "M", "0" } },
+    { INDEX_op_atomic_fetch_add_i64, { "M", "M", "0" } },
+    { INDEX_op_atomic_fetch_and_i64, { "a", "M", "M" } },
+    { INDEX_op_atomic_fetch_or_i64, { "a", "M", "M" } },
+    { INDEX_op_atomic_fetch_xor_i64, { "a", "M", "M" } },
+#endif
+
+    { INDEX_op_add_vec, { "r" } },
+    { INDEX_op_sub_vec, { "r" } },
+    { INDEX_op_and_vec, { "r" } },
+    { INDEX_op_or_vec, { "r" } },
+    { INDEX_op_xor_vec, { "r" } },
+    { INDEX_op_andc_vec, { "r" } },
+    { INDEX_op_cmpeq_vec, { "r" } },
+    { INDEX_op_shuf32_vec, { "r" } },
     { -1 },
 };
 
@@ -2358,6 +2855,12 @@ static void tcg_target_qemu_prologue(TCGContext *s)
 #endif
 }
 
+static uint64_t tcg_target_tb_relocs_host_id(void)
+{
+    return have_cmov | have_movbe << 1 | have_bmi1 << 2 | have_bmi2 << 3
+           | have_sse2 << 4;
+}
+
 static void tcg_target_init(TCGContext *s)
 {
 #ifdef CONFIG_CPUID_H
@@ -2376,6 +2879,9 @@ static void tcg_target_init(TCGContext *s)
         /* MOVBE is only available on Intel Atom and Haswell CPUs, so we
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
+#endif
+#ifndef have_sse2
+        have_sse2 = (d & bit_SSE2) != 0;
 #endif
     }
 
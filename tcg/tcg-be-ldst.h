@@ -24,6 +24,9 @@
 
 typedef struct TCGLabelQemuLdst {
     bool is_ld;             /* qemu_ld: true, qemu_st: false */
+    bool is_atomic;         /* atomic op, handled by the st slow path */
+    TCGOpcode atomic_opc;   /* opcode of the atomic op */
+    TCGReg ret_reg;         /* reg index of the result of the atomic op */
     TCGMemOpIdx oi;
     TCGType type;           /* result type of a load */
     TCGReg addrlo_reg;      /* reg index for low word of guest virtual addr */
@@ -88,6 +91,7 @@ static inline TCGLabelQemuLdst *new_ldst_label(TCGContext *s)
     TCGBackendData *be = s->be;
     TCGLabelQemuLdst *l = tcg_malloc(sizeof(*l));
 
+    l->is_atomic = false;
     l->next = be->labels;
     be->labels = l;
     return l;
@@ -30,6 +30,8 @@
 #include "tcg-op.h"
 #include "trace-tcg.h"
 #include "trace/mem.h"
+#include "exec/helper-proto.h"
+#include "exec/helper-gen.h"
 
 /* Reduce the number of ifdefs below.  This assumes that all uses of
    TCGV_HIGH and TCGV_LOW are properly protected by a conditional that
@@ -1835,6 +1837,244 @@ void tcg_gen_extr32_i64(TCGv_i64 lo, TCGv_i64 hi, TCGv_i64 arg)
     tcg_gen_shri_i64(hi, arg, 32);
 }
 
+/* Vector operations.  Without host support they are expanded to
+   64-bit operations, working on several elements at once.  */
+
+static const uint64_t vec_msb[4] = {
+    0x8080808080808080ull,
+    0x8000800080008000ull,
+    0x8000000080000000ull,
+    0x8000000000000000ull,
+};
+
+static void gen_vec_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                            TCGv_i64 b)
+{
+    TCGv_i64 t1, t2, t3, m;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+    /* Add without the msb of each element, so that no carry crosses
+       into the next one, then fix up the msb with the xor.  */
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    m = tcg_const_i64(vec_msb[vece]);
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(m);
+}
+
+static void gen_vec_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                            TCGv_i64 b)
+{
+    TCGv_i64 t1, t2, t3, m;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+    /* Likewise, with the msb of A set so that no borrow crosses.  */
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+    m = tcg_const_i64(vec_msb[vece]);
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+    tcg_temp_free_i64(m);
+}
+
+static void gen_vec_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                            TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_vec_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                           TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_vec_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                            TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_vec_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                             TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_vec_cmpeq_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a,
+                              TCGv_i64 b)
+{
+    TCGv_i64 t, u, m;
+
+    if (vece == MO_64) {
+        tcg_gen_setcond_i64(TCG_COND_EQ, d, a, b);
+        tcg_gen_neg_i64(d, d);
+        return;
+    }
+    /* The msb of each element of U is set if the element of A ^ B is
+       nonzero; spread it over the element and invert.  */
+    t = tcg_temp_new_i64();
+    u = tcg_temp_new_i64();
+    m = tcg_const_i64(~vec_msb[vece]);
+    tcg_gen_xor_i64(t, a, b);
+    tcg_gen_and_i64(u, t, m);
+    tcg_gen_add_i64(u, u, m);
+    tcg_gen_or_i64(u, u, t);
+    tcg_gen_andc_i64(u, u, m);
+    tcg_gen_shri_i64(u, u, (8 << vece) - 1);
+    tcg_gen_muli_i64(u, u, (1ull << (8 << vece)) - 1);
+    tcg_gen_not_i64(d, u);
+    tcg_temp_free_i64(t);
+    tcg_temp_free_i64(u);
+    tcg_temp_free_i64(m);
+}
+
+static void expand_vec_i64(unsigned vece, intptr_t dofs, intptr_t aofs,
+                           intptr_t bofs, unsigned oprsz,
+                           void (*fni)(unsigned, TCGv_i64, TCGv_i64,
+                                       TCGv_i64))
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    unsigned i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, tcg_ctx.tcg_env, aofs + i);
+        tcg_gen_ld_i64(t1, tcg_ctx.tcg_env, bofs + i);
+        fni(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, tcg_ctx.tcg_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+    tcg_temp_free_i64(t1);
+}
+
+static void tcg_gen_vec_op(TCGOpcode opc, unsigned vece, intptr_t dofs,
+                           intptr_t aofs, intptr_t bofs, unsigned oprsz,
+                           void (*fni)(unsigned, TCGv_i64, TCGv_i64,
+                                       TCGv_i64))
+{
+    tcg_debug_assert(oprsz == 8 || oprsz == 16);
+    tcg_debug_assert(vece <= MO_64);
+
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op5(&tcg_ctx, opc, GET_TCGV_PTR(tcg_ctx.tcg_env),
+                    dofs, aofs, bofs, TCG_VEC_DESC(oprsz, vece));
+    } else {
+        expand_vec_i64(vece, dofs, aofs, bofs, oprsz, fni);
+    }
+}
+
+void tcg_gen_vec_add(unsigned vece, intptr_t dofs, intptr_t aofs,
+                     intptr_t bofs, unsigned oprsz)
+{
+    tcg_gen_vec_op(INDEX_op_add_vec, vece, dofs, aofs, bofs, oprsz,
+                   gen_vec_add_i64);
+}
+
+void tcg_gen_vec_sub(unsigned vece, intptr_t dofs, intptr_t aofs,
+                     intptr_t bofs, unsigned oprsz)
+{
+    tcg_gen_vec_op(INDEX_op_sub_vec, vece, dofs, aofs, bofs, oprsz,
+                   gen_vec_sub_i64);
+}
+
+void tcg_gen_vec_and(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                     unsigned oprsz)
+{
+    tcg_gen_vec_op(INDEX_op_and_vec, MO_64, dofs, aofs, bofs, oprsz,
+                   gen_vec_and_i64);
+}
+
+void tcg_gen_vec_or(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                    unsigned oprsz)
+{
+    tcg_gen_vec_op(INDEX_op_or_vec, MO_64, dofs, aofs, bofs, oprsz,
+                   gen_vec_or_i64);
+}
+
+void tcg_gen_vec_xor(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                     unsigned oprsz)
+{
+    tcg_gen_vec_op(INDEX_op_xor_vec, MO_64, dofs, aofs, bofs, oprsz,
+                   gen_vec_xor_i64);
+}
+
+void tcg_gen_vec_andc(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                      unsigned oprsz)
+{
+    tcg_gen_vec_op(INDEX_op_andc_vec, MO_64, dofs, aofs, bofs, oprsz,
+                   gen_vec_andc_i64);
+}
+
+void tcg_gen_vec_cmpeq(unsigned vece, intptr_t dofs, intptr_t aofs,
+                       intptr_t bofs, unsigned oprsz)
+{
+    /* SSE2 has no 64-bit element compare.  */
+    if (vece == MO_64) {
+        expand_vec_i64(vece, dofs, aofs, bofs, oprsz, gen_vec_cmpeq_i64);
+        return;
+    }
+    tcg_gen_vec_op(INDEX_op_cmpeq_vec, vece, dofs, aofs, bofs, oprsz,
+                   gen_vec_cmpeq_i64);
+}
+
+void tcg_gen_vec_shuf32(intptr_t dofs, intptr_t aofs, unsigned imm)
+{
+    TCGv_i64 e[4], t;
+    int i;
+
+    tcg_debug_assert(imm <= 0xff);
+
+    if (TCG_TARGET_HAS_vec) {
+        tcg_gen_op5(&tcg_ctx, INDEX_op_shuf32_vec,
+                    GET_TCGV_PTR(tcg_ctx.tcg_env),
+                    dofs, aofs, imm, TCG_VEC_DESC(16, MO_32));
+        return;
+    }
+
+    /* Read all of AOFS before writing DOFS.  */
+    for (i = 0; i < 4; i++) {
+        e[i] = tcg_temp_new_i64();
+    }
+    t = tcg_temp_new_i64();
+    tcg_gen_ld_i64(t, tcg_ctx.tcg_env, aofs);
+    tcg_gen_extr32_i64(e[0], e[1], t);
+    tcg_gen_ld_i64(t, tcg_ctx.tcg_env, aofs + 8);
+    tcg_gen_extr32_i64(e[2], e[3], t);
+    for (i = 0; i < 2; i++) {
+        tcg_gen_concat32_i64(t, e[(imm >> (4 * i)) & 3],
+                             e[(imm >> (4 * i + 2)) & 3]);
+        tcg_gen_st_i64(t, tcg_ctx.tcg_env, dofs + 8 * i);
+    }
+    for (i = 0; i < 4; i++) {
+        tcg_temp_free_i64(e[i]);
+    }
+    tcg_temp_free_i64(t);
+}
+
 /* QEMU specific operations.  */
 
 void tcg_gen_goto_tb(unsigned idx)
@@ -1849,6 +2089,16 @@ void tcg_gen_goto_tb(unsigned idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+void tcg_gen_goto_tb_lazy(unsigned idx)
+{
+    tcg_debug_assert(idx <= 1);
+#ifdef CONFIG_DEBUG_TCG
+    tcg_debug_assert((tcg_ctx.goto_tb_issue_mask & (1 << idx)) == 0);
+    tcg_ctx.goto_tb_issue_mask |= 1 << idx;
+#endif
+    tcg_gen_op1i(INDEX_op_goto_tb_lazy, idx);
+}
+
 static inline TCGMemOp tcg_canonicalize_memop(TCGMemOp op, bool is64, bool st)
 {
     /* Trigger the asserts within as early as possible.  */
@@ -1958,3 +2208,236 @@ void tcg_gen_qemu_st_i64(TCGv_i64 val, TCGv addr, TCGArg idx, TCGMemOp memop)
                                addr, trace_mem_get_info(memop, 1));
     gen_ldst_i64(INDEX_op_qemu_st_i64, val, addr, memop, idx);
 }
+
+static void tcg_gen_ext_i32(TCGv_i32 ret, TCGv_i32 val, TCGMemOp opc)
+{
+    switch (opc & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i32(ret, val);
+        break;
+    case MO_UB:
+        tcg_gen_ext8u_i32(ret, val);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i32(ret, val);
+        break;
+    case MO_UW:
+        tcg_gen_ext16u_i32(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i32(ret, val);
+        break;
+    }
+}
+
+static void tcg_gen_ext_i64(TCGv_i64 ret, TCGv_i64 val, TCGMemOp opc)
+{
+    switch (opc & MO_SSIZE) {
+    case MO_SB:
+        tcg_gen_ext8s_i64(ret, val);
+        break;
+    case MO_UB:
+        tcg_gen_ext8u_i64(ret, val);
+        break;
+    case MO_SW:
+        tcg_gen_ext16s_i64(ret, val);
+        break;
+    case MO_UW:
+        tcg_gen_ext16u_i64(ret, val);
+        break;
+    case MO_SL:
+        tcg_gen_ext32s_i64(ret, val);
+        break;
+    case MO_UL:
+        tcg_gen_ext32u_i64(ret, val);
+        break;
+    default:
+        tcg_gen_mov_i64(ret, val);
+        break;
+    }
+}
+
+/* The inline atomic operations are only provided by 64-bit hosts, where
+   the guest address always fits a single host register.  */
+#if TARGET_LONG_BITS == 32
+# define TCGV_TL_ARG(X)  GET_TCGV_I32(X)
+#else
+# define TCGV_TL_ARG(X)  GET_TCGV_I64(X)
+#endif
+
+typedef void (*gen_atomic_cx_i32)(TCGv_i32, TCGv_env, TCGv,
+                                  TCGv_i32, TCGv_i32, TCGv_i32);
+typedef void (*gen_atomic_cx_i64)(TCGv_i64, TCGv_env, TCGv,
+                                  TCGv_i64, TCGv_i64, TCGv_i32);
+typedef void (*gen_atomic_op_i32)(TCGv_i32, TCGv_env, TCGv,
+                                  TCGv_i32, TCGv_i32);
+typedef void (*gen_atomic_op_i64)(TCGv_i64, TCGv_env, TCGv,
+                                  TCGv_i64, TCGv_i32);
+
+static void * const table_cmpxchg[4] = {
+    [MO_8] = gen_helper_atomic_cmpxchgb,
+    [MO_16] = gen_helper_atomic_cmpxchgw,
+    [MO_32] = gen_helper_atomic_cmpxchgl,
+    [MO_64] = gen_helper_atomic_cmpxchgq,
+};
+
+/* Only the low (8 << (MEMOP & MO_SIZE)) bits of CMPV take part in the
+   comparison.  The result is zero- or sign-extended according to MEMOP.  */
+void tcg_gen_atomic_cmpxchg_i32(TCGv_i32 retv, TCGv addr, TCGv_i32 cmpv,
+                                TCGv_i32 newv, TCGArg idx, TCGMemOp memop)
+{
+    TCGMemOpIdx oi;
+
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    oi = make_memop_idx(memop & ~MO_SIGN, idx);
+    trace_guest_mem_before_tcg(tcg_ctx.cpu, tcg_ctx.tcg_env,
+                               addr, trace_mem_get_info(memop, 1));
+
+    if (TCG_TARGET_HAS_atomic && !(memop & MO_BSWAP)) {
+        tcg_gen_op5(&tcg_ctx, INDEX_op_atomic_cmpxchg_i32, GET_TCGV_I32(retv),
+                    TCGV_TL_ARG(addr), GET_TCGV_I32(cmpv),
+                    GET_TCGV_I32(newv), oi);
+    } else {
+        gen_atomic_cx_i32 gen = table_cmpxchg[memop & MO_SIZE];
+        TCGv_i32 t_oi = tcg_const_i32(oi);
+
+        gen(retv, tcg_ctx.tcg_env, addr, cmpv, newv, t_oi);
+        tcg_temp_free_i32(t_oi);
+    }
+
+    if (memop & MO_SIGN) {
+        tcg_gen_ext_i32(retv, retv, memop);
+    }
+}
+
+void tcg_gen_atomic_cmpxchg_i64(TCGv_i64 retv, TCGv addr, TCGv_i64 cmpv,
+                                TCGv_i64 newv, TCGArg idx, TCGMemOp memop)
+{
+    TCGMemOpIdx oi;
+
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    oi = make_memop_idx(memop & ~MO_SIGN, idx);
+    trace_guest_mem_before_tcg(tcg_ctx.cpu, tcg_ctx.tcg_env,
+                               addr, trace_mem_get_info(memop, 1));
+
+    if (TCG_TARGET_HAS_atomic && !(memop & MO_BSWAP)) {
+        tcg_gen_op5(&tcg_ctx, INDEX_op_atomic_cmpxchg_i64, GET_TCGV_I64(retv),
+                    TCGV_TL_ARG(addr), GET_TCGV_I64(cmpv),
+                    GET_TCGV_I64(newv), oi);
+    } else if ((memop & MO_SIZE) == MO_64) {
+        gen_atomic_cx_i64 gen = table_cmpxchg[MO_64];
+        TCGv_i32 t_oi = tcg_const_i32(oi);
+
+        gen(retv, tcg_ctx.tcg_env, addr, cmpv, newv, t_oi);
+        tcg_temp_free_i32(t_oi);
+    } else {
+        gen_atomic_cx_i32 gen = table_cmpxchg[memop & MO_SIZE];
+        TCGv_i32 c32 = tcg_temp_new_i32();
+        TCGv_i32 n32 = tcg_temp_new_i32();
+        TCGv_i32 t_oi = tcg_const_i32(oi);
+
+        tcg_gen_extrl_i64_i32(c32, cmpv);
+        tcg_gen_extrl_i64_i32(n32, newv);
+        gen(c32, tcg_ctx.tcg_env, addr, c32, n32, t_oi);
+        tcg_gen_extu_i32_i64(retv, c32);
+        tcg_temp_free_i32(c32);
+        tcg_temp_free_i32(n32);
+        tcg_temp_free_i32(t_oi);
+    }
+
+    if (memop & MO_SIGN) {
+        tcg_gen_ext_i64(retv, retv, memop);
+    }
+}
+
+static void do_atomic_op_i32(TCGv_i32 ret, TCGv addr, TCGv_i32 val,
+                             TCGArg idx, TCGMemOp memop, TCGOpcode opc,
+                             void * const table[])
+{
+    TCGMemOpIdx oi;
+
+    memop = tcg_canonicalize_memop(memop, 0, 0);
+    oi = make_memop_idx(memop & ~MO_SIGN, idx);
+    trace_guest_mem_before_tcg(tcg_ctx.cpu, tcg_ctx.tcg_env,
+                               addr, trace_mem_get_info(memop, 1));
+
+    if (TCG_TARGET_HAS_atomic && !(memop & MO_BSWAP)) {
+        tcg_gen_op4(&tcg_ctx, opc, GET_TCGV_I32(ret), TCGV_TL_ARG(addr),
+                    GET_TCGV_I32(val), oi);
+    } else {
+        gen_atomic_op_i32 gen = table[memop & MO_SIZE];
+        TCGv_i32 t_oi = tcg_const_i32(oi);
+
+        gen(ret, tcg_ctx.tcg_env, addr, val, t_oi);
+        tcg_temp_free_i32(t_oi);
+    }
+
+    if (memop & MO_SIGN) {
+        tcg_gen_ext_i32(ret, ret, memop);
+    }
+}
+
+static void do_atomic_op_i64(TCGv_i64 ret, TCGv addr, TCGv_i64 val,
+                             TCGArg idx, TCGMemOp memop, TCGOpcode opc,
+                             void * const table[])
+{
+    TCGMemOpIdx oi;
+
+    memop = tcg_canonicalize_memop(memop, 1, 0);
+    oi = make_memop_idx(memop & ~MO_SIGN, idx);
+    trace_guest_mem_before_tcg(tcg_ctx.cpu, tcg_ctx.tcg_env,
+                               addr, trace_mem_get_info(memop, 1));
+
+    if (TCG_TARGET_HAS_atomic && !(memop & MO_BSWAP)) {
+        tcg_gen_op4(&tcg_ctx, opc, GET_TCGV_I64(ret), TCGV_TL_ARG(addr),
+                    GET_TCGV_I64(val), oi);
+    } else if ((memop & MO_SIZE) == MO_64) {
+        gen_atomic_op_i64 gen = table[MO_64];
+        TCGv_i32 t_oi = tcg_const_i32(oi);
+
+        gen(ret, tcg_ctx.tcg_env, addr, val, t_oi);
+        tcg_temp_free_i32(t_oi);
+    } else {
+        gen_atomic_op_i32 gen = table[memop & MO_SIZE];
+        TCGv_i32 v32 = tcg_temp_new_i32();
+        TCGv_i32 t_oi = tcg_const_i32(oi);
+
+        tcg_gen_extrl_i64_i32(v32, val);
+        gen(v32, tcg_ctx.tcg_env, addr, v32, t_oi);
+        tcg_gen_extu_i32_i64(ret, v32);
+        tcg_temp_free_i32(v32);
+        tcg_temp_free_i32(t_oi);
+    }
+
+    if (memop & MO_SIGN) {
+        tcg_gen_ext_i64(ret, ret, memop);
+    }
+}
+
+#define GEN_ATOMIC_HELPER(NAME)                                         \
+static void * const table_##NAME[4] = {                                 \
+    [MO_8] = gen_helper_atomic_##NAME##b,                               \
+    [MO_16] = gen_helper_atomic_##NAME##w,                              \
+    [MO_32] = gen_helper_atomic_##NAME##l,                              \
+    [MO_64] = gen_helper_atomic_##NAME##q,                              \
+};                                                                      \
+void tcg_gen_atomic_##NAME##_i32                                        \
+    (TCGv_i32 ret, TCGv addr, TCGv_i32 val, TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    do_atomic_op_i32(ret, addr, val, idx, memop,                        \
+                     INDEX_op_atomic_##NAME##_i32, table_##NAME);       \
+}                                                                       \
+void tcg_gen_atomic_##NAME##_i64                                        \
+    (TCGv_i64 ret, TCGv addr, TCGv_i64 val, TCGArg idx, TCGMemOp memop) \
+{                                                                       \
+    do_atomic_op_i64(ret, addr, val, idx, memop,                        \
+                     INDEX_op_atomic_##NAME##_i64, table_##NAME);       \
+}
+
+GEN_ATOMIC_HELPER(xchg)
+GEN_ATOMIC_HELPER(fetch_add)
+GEN_ATOMIC_HELPER(fetch_and)
+GEN_ATOMIC_HELPER(fetch_or)
+GEN_ATOMIC_HELPER(fetch_xor)
+
+#undef GEN_ATOMIC_HELPER
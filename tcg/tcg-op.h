@@ -694,6 +694,30 @@ static inline void tcg_gen_concat32_i64(TCGv_i64 ret, TCGv_i64 lo, TCGv_i64 hi)
     tcg_gen_deposit_i64(ret, lo, hi, 32, 32);
 }
 
+/* Vector operations on CPU state.  DOFS, AOFS and BOFS are offsets from
+   cpu_env of vectors of OPRSZ (8 or 16) bytes, made of host-endian 64-bit
+   words whose 1 << VECE byte elements count from the least significant
+   bits.  The operands may overlap exactly.  */
+
+void tcg_gen_vec_add(unsigned vece, intptr_t dofs, intptr_t aofs,
+                     intptr_t bofs, unsigned oprsz);
+void tcg_gen_vec_sub(unsigned vece, intptr_t dofs, intptr_t aofs,
+                     intptr_t bofs, unsigned oprsz);
+void tcg_gen_vec_and(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                     unsigned oprsz);
+void tcg_gen_vec_or(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                    unsigned oprsz);
+void tcg_gen_vec_xor(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                     unsigned oprsz);
+void tcg_gen_vec_andc(intptr_t dofs, intptr_t aofs, intptr_t bofs,
+                      unsigned oprsz);
+/* Elements are set to all ones where equal, to zero elsewhere.  */
+void tcg_gen_vec_cmpeq(unsigned vece, intptr_t dofs, intptr_t aofs,
+                       intptr_t bofs, unsigned oprsz);
+/* 32-bit element I of the 16-byte vector at DOFS is set to element
+   (IMM >> 2 * I) & 3 of AOFS.  */
+void tcg_gen_vec_shuf32(intptr_t dofs, intptr_t aofs, unsigned imm);
+
 /* QEMU specific operations.  */
 
 #ifndef TARGET_LONG_BITS
@@ -768,10 +792,22 @@ static inline void tcg_gen_exit_tb(uintptr_t val)
  */
 void tcg_gen_goto_tb(unsigned idx);
 
+/**
+ * tcg_gen_goto_tb_lazy() - output goto_tb_lazy TCG operation
+ * @idx: Direct jump slot index (0 or 1)
+ *
+ * Like tcg_gen_goto_tb(), but globals marked with tcg_global_set_lazy_sync
+ * are only written back when the direct jump is not taken.  The caller
+ * must ensure that the slot is only linked to a TB that recomputes those
+ * globals before reading them.  See tcg/README for more info.
+ */
+void tcg_gen_goto_tb_lazy(unsigned idx);
+
 #if TARGET_LONG_BITS == 32
 #define tcg_temp_new() tcg_temp_new_i32()
 #define tcg_global_reg_new tcg_global_reg_new_i32
 #define tcg_global_mem_new tcg_global_mem_new_i32
+#define tcg_global_set_lazy_sync tcg_global_set_lazy_sync_i32
 #define tcg_temp_local_new() tcg_temp_local_new_i32()
 #define tcg_temp_free tcg_temp_free_i32
 #define TCGV_UNUSED(x) TCGV_UNUSED_I32(x)
@@ -779,10 +815,17 @@ void tcg_gen_goto_tb(unsigned idx);
 #define TCGV_EQUAL(a, b) TCGV_EQUAL_I32(a, b)
 #define tcg_gen_qemu_ld_tl tcg_gen_qemu_ld_i32
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i32
+#define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i32
+#define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i32
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i32
+#define tcg_gen_atomic_fetch_and_tl tcg_gen_atomic_fetch_and_i32
+#define tcg_gen_atomic_fetch_or_tl tcg_gen_atomic_fetch_or_i32
+#define tcg_gen_atomic_fetch_xor_tl tcg_gen_atomic_fetch_xor_i32
 #else
 #define tcg_temp_new() tcg_temp_new_i64()
 #define tcg_global_reg_new tcg_global_reg_new_i64
 #define tcg_global_mem_new tcg_global_mem_new_i64
+#define tcg_global_set_lazy_sync tcg_global_set_lazy_sync_i64
 #define tcg_temp_local_new() tcg_temp_local_new_i64()
 #define tcg_temp_free tcg_temp_free_i64
 #define TCGV_UNUSED(x) TCGV_UNUSED_I64(x)
@@ -790,6 +833,12 @@ void tcg_gen_goto_tb(unsigned idx);
 #define TCGV_EQUAL(a, b) TCGV_EQUAL_I64(a, b)
 #define tcg_gen_qemu_ld_tl tcg_gen_qemu_ld_i64
 #define tcg_gen_qemu_st_tl tcg_gen_qemu_st_i64
+#define tcg_gen_atomic_cmpxchg_tl tcg_gen_atomic_cmpxchg_i64
+#define tcg_gen_atomic_xchg_tl tcg_gen_atomic_xchg_i64
+#define tcg_gen_atomic_fetch_add_tl tcg_gen_atomic_fetch_add_i64
+#define tcg_gen_atomic_fetch_and_tl tcg_gen_atomic_fetch_and_i64
+#define tcg_gen_atomic_fetch_or_tl tcg_gen_atomic_fetch_or_i64
+#define tcg_gen_atomic_fetch_xor_tl tcg_gen_atomic_fetch_xor_i64
 #endif
 
 void tcg_gen_qemu_ld_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
@@ -797,6 +846,21 @@ void tcg_gen_qemu_st_i32(TCGv_i32, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_ld_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
 void tcg_gen_qemu_st_i64(TCGv_i64, TCGv, TCGArg, TCGMemOp);
 
+void tcg_gen_atomic_cmpxchg_i32(TCGv_i32, TCGv, TCGv_i32, TCGv_i32,
+                                TCGArg, TCGMemOp);
+void tcg_gen_atomic_cmpxchg_i64(TCGv_i64, TCGv, TCGv_i64, TCGv_i64,
+                                TCGArg, TCGMemOp);
+void tcg_gen_atomic_xchg_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_xchg_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_add_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_add_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_and_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_and_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_or_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_or_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_xor_i32(TCGv_i32, TCGv, TCGv_i32, TCGArg, TCGMemOp);
+void tcg_gen_atomic_fetch_xor_i64(TCGv_i64, TCGv, TCGv_i64, TCGArg, TCGMemOp);
+
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
     tcg_gen_qemu_ld_tl(ret, addr, mem_index, MO_UB);
@@ -76,7 +76,7 @@ DEF(rotl_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_rot_i32))
 DEF(rotr_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_rot_i32))
 DEF(deposit_i32, 1, 2, 2, IMPL(TCG_TARGET_HAS_deposit_i32))
 
-DEF(brcond_i32, 0, 2, 2, TCG_OPF_BB_END)
+DEF(brcond_i32, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH)
 
 DEF(add2_i32, 2, 4, 0, IMPL(TCG_TARGET_HAS_add2_i32))
 DEF(sub2_i32, 2, 4, 0, IMPL(TCG_TARGET_HAS_sub2_i32))
@@ -84,7 +84,8 @@ DEF(mulu2_i32, 2, 2, 0, IMPL(TCG_TARGET_HAS_mulu2_i32))
 DEF(muls2_i32, 2, 2, 0, IMPL(TCG_TARGET_HAS_muls2_i32))
 DEF(muluh_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i32))
 DEF(mulsh_i32, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i32))
-DEF(brcond2_i32, 0, 4, 2, TCG_OPF_BB_END | IMPL(TCG_TARGET_REG_BITS == 32))
+DEF(brcond2_i32, 0, 4, 2,
+    TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | IMPL(TCG_TARGET_REG_BITS == 32))
 DEF(setcond2_i32, 1, 4, 1, IMPL(TCG_TARGET_REG_BITS == 32))
 
 DEF(ext8s_i32, 1, 1, 0, IMPL(TCG_TARGET_HAS_ext8s_i32))
@@ -148,7 +149,7 @@ DEF(extrh_i64_i32, 1, 1, 0,
     IMPL(TCG_TARGET_HAS_extrh_i64_i32)
     | (TCG_TARGET_REG_BITS == 32 ? TCG_OPF_NOT_PRESENT : 0))
 
-DEF(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | IMPL64)
+DEF(brcond_i64, 0, 2, 2, TCG_OPF_BB_END | TCG_OPF_COND_BRANCH | IMPL64)
 DEF(ext8s_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_ext8s_i64))
 DEF(ext16s_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_ext16s_i64))
 DEF(ext32s_i64, 1, 1, 0, IMPL64 | IMPL(TCG_TARGET_HAS_ext32s_i64))
@@ -173,6 +174,19 @@ DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 DEF(muluh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i64))
 DEF(mulsh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i64))
 
+/* vector operations on CPU state: env, dofs, aofs, bofs, desc */
+#define IMPLVEC  TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_vec)
+
+DEF(add_vec, 0, 1, 4, IMPLVEC)
+DEF(sub_vec, 0, 1, 4, IMPLVEC)
+DEF(and_vec, 0, 1, 4, IMPLVEC)
+DEF(or_vec, 0, 1, 4, IMPLVEC)
+DEF(xor_vec, 0, 1, 4, IMPLVEC)
+DEF(andc_vec, 0, 1, 4, IMPLVEC)
+DEF(cmpeq_vec, 0, 1, 4, IMPLVEC)
+/* env, dofs, aofs, imm, desc */
+DEF(shuf32_vec, 0, 1, 4, IMPLVEC)
+
 #define TLADDR_ARGS  (TARGET_LONG_BITS <= TCG_TARGET_REG_BITS ? 1 : 2)
 #define DATA64_ARGS  (TCG_TARGET_REG_BITS == 64 ? 1 : 2)
 
@@ -181,6 +195,7 @@ DEF(insn_start, 0, 0, TLADDR_ARGS * TARGET_INSN_START_WORDS,
     TCG_OPF_NOT_PRESENT)
 DEF(exit_tb, 0, 0, 1, TCG_OPF_BB_END)
 DEF(goto_tb, 0, 0, 1, TCG_OPF_BB_END)
+DEF(goto_tb_lazy, 0, 0, 1, TCG_OPF_NOT_PRESENT | TCG_OPF_SIDE_EFFECTS)
 
 DEF(qemu_ld_i32, 1, TLADDR_ARGS, 1,
     TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS)
@@ -191,8 +206,34 @@ DEF(qemu_ld_i64, DATA64_ARGS, TLADDR_ARGS, 1,
 DEF(qemu_st_i64, 0, TLADDR_ARGS + DATA64_ARGS, 1,
     TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS | TCG_OPF_64BIT)
 
+/* guest atomic operations: ret, addr, [cmpv,] val, oi */
+#define IMPLATOMIC  TCG_OPF_CALL_CLOBBER | TCG_OPF_SIDE_EFFECTS \
+                    | IMPL(TCG_TARGET_HAS_atomic)
+
+DEF(atomic_cmpxchg_i32, 1, TLADDR_ARGS + 2, 1, IMPLATOMIC)
+DEF(atomic_xchg_i32, 1, TLADDR_ARGS + 1, 1, IMPLATOMIC)
+DEF(atomic_fetch_add_i32, 1, TLADDR_ARGS + 1, 1, IMPLATOMIC)
+DEF(atomic_fetch_and_i32, 1, TLADDR_ARGS + 1, 1, IMPLATOMIC)
+DEF(atomic_fetch_or_i32, 1, TLADDR_ARGS + 1, 1, IMPLATOMIC)
+DEF(atomic_fetch_xor_i32, 1, TLADDR_ARGS + 1, 1, IMPLATOMIC)
+
+DEF(atomic_cmpxchg_i64, DATA64_ARGS, TLADDR_ARGS + 2 * DATA64_ARGS, 1,
+    IMPLATOMIC | TCG_OPF_64BIT)
+DEF(atomic_xchg_i64, DATA64_ARGS, TLADDR_ARGS + DATA64_ARGS, 1,
+    IMPLATOMIC | TCG_OPF_64BIT)
+DEF(atomic_fetch_add_i64, DATA64_ARGS, TLADDR_ARGS + DATA64_ARGS, 1,
+    IMPLATOMIC | TCG_OPF_64BIT)
+DEF(atomic_fetch_and_i64, DATA64_ARGS, TLADDR_ARGS + DATA64_ARGS, 1,
+    IMPLATOMIC | TCG_OPF_64BIT)
+DEF(atomic_fetch_or_i64, DATA64_ARGS, TLADDR_ARGS + DATA64_ARGS, 1,
+    IMPLATOMIC | TCG_OPF_64BIT)
+DEF(atomic_fetch_xor_i64, DATA64_ARGS, TLADDR_ARGS + DATA64_ARGS, 1,
+    IMPLATOMIC | TCG_OPF_64BIT)
+
 #undef TLADDR_ARGS
 #undef DATA64_ARGS
 #undef IMPL
 #undef IMPL64
+#undef IMPLVEC
+#undef IMPLATOMIC
 #undef DEF
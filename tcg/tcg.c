@@ -422,6 +422,69 @@ void tcg_prologue_init(TCGContext *s)
 #endif
 }
 
+/* Record that FIELD, in the code being generated, holds TARGET encoded
+   as TYPE.  TARGET is classified according to the region it points to;
+   see TCGTBRelocKind.  */
+void tcg_tb_reloc_add(TCGContext *s, tcg_insn_unit *field,
+                      TCGTBRelocType type, uintptr_t target)
+{
+    TCGTBReloc *r;
+    uintptr_t base;
+
+    if (!s->tb_relocs_enabled) {
+        return;
+    }
+    if (s->nb_tb_relocs == TCG_MAX_TB_RELOCS) {
+        s->tb_relocs_invalid = true;
+        return;
+    }
+
+    r = &s->tb_relocs[s->nb_tb_relocs++];
+    r->offset = tcg_ptr_byte_diff(field, s->code_buf);
+    r->type = type;
+    if (target - s->tb_relocs_tb < 4) {
+        r->kind = TCG_TB_RELOC_TB;
+        base = s->tb_relocs_tb;
+    } else if (target >= (uintptr_t)s->code_buf &&
+               target < (uintptr_t)s->code_gen_buffer
+                        + s->code_gen_buffer_size) {
+        r->kind = TCG_TB_RELOC_TC;
+        base = (uintptr_t)s->code_buf;
+    } else if (target >= (uintptr_t)s->code_gen_prologue &&
+               target < (uintptr_t)s->code_gen_buffer) {
+        r->kind = TCG_TB_RELOC_PROLOGUE;
+        base = (uintptr_t)s->code_gen_prologue;
+    } else if (target >= (uintptr_t)s->code_gen_buffer &&
+               target < (uintptr_t)s->code_buf) {
+        /* Code of another TB, which the cache cannot locate.  */
+        s->nb_tb_relocs--;
+        s->tb_relocs_invalid = true;
+        return;
+    } else {
+        r->kind = TCG_TB_RELOC_TEXT;
+        base = tcg_tb_reloc_text_base();
+    }
+    r->addend = (intptr_t)(target - base);
+}
+
+/* Any function of the executable will do: with a position-independent
+   executable, everything moves by the same amount.  */
+uintptr_t tcg_tb_reloc_text_base(void)
+{
+    return (uintptr_t)tcg_gen_code;
+}
+
+/* Identify the host features that affect the code generated by the
+   backend, so that code is never reused on a host that lacks them.  */
+uint64_t tcg_tb_relocs_host_id(void)
+{
+#ifdef TCG_TARGET_IMPLEMENTS_TB_RELOCS
+    return tcg_target_tb_relocs_host_id();
+#else
+    return 0;
+#endif
+}
+
 void tcg_func_start(TCGContext *s)
 {
     tcg_pool_reset(s);
@@ -575,6 +638,21 @@ int tcg_global_mem_new_internal(TCGType type, TCGv_ptr base,
     return temp_idx(s, ts);
 }
 
+/* Let the global at IDX stay in a register across goto_tb_lazy, so that
+   it is only written back when the chained jump is not taken.  */
+void tcg_global_set_lazy_sync_internal(int idx)
+{
+    TCGContext *s = &tcg_ctx;
+    TCGTemp *ts = &s->temps[idx];
+
+    tcg_debug_assert(idx < s->nb_globals);
+    tcg_debug_assert(!ts->fixed_reg && !ts->indirect_reg);
+    ts->lazy_sync = 1;
+    if (TCG_TARGET_REG_BITS == 32 && ts->base_type == TCG_TYPE_I64) {
+        ts[1].lazy_sync = 1;
+    }
+}
+
 static int tcg_temp_new_internal(TCGType type, int temp_local)
 {
     TCGContext *s = &tcg_ctx;
@@ -1422,6 +1500,25 @@ static inline void tcg_la_bb_end(TCGContext *s, uint8_t *temp_state)
     }
 }
 
+/* liveness analysis: conditional branch: all temps are dead, globals
+   and local temps should be in memory for the branch target, but they
+   remain live in registers on the fall-through path. */
+static inline void tcg_la_bb_sync(TCGContext *s, uint8_t *temp_state)
+{
+    int i, n;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        temp_state[i] |= TS_MEM;
+    }
+    for (i = s->nb_globals, n = s->nb_temps; i < n; i++) {
+        if (s->temps[i].temp_local) {
+            temp_state[i] |= TS_MEM;
+        } else {
+            temp_state[i] = TS_DEAD;
+        }
+    }
+}
+
 /* Liveness analysis : update the opc_arg_life array to tell if a
    given input arguments is dead. Instructions updating dead
    temporaries are removed. */
@@ -1515,6 +1612,18 @@ static void liveness_pass_1(TCGContext *s, uint8_t *temp_state)
             /* mark the temporary as dead */
             temp_state[args[0]] = TS_DEAD;
             break;
+        case INDEX_op_goto_tb_lazy:
+            /* The direct jump leaves the TB like goto_tb, but the lazily
+               synced globals are written back by the op itself on the
+               unchained path, so they stay live in registers up to it.  */
+            for (i = 0; i < nb_globals; i++) {
+                if (!s->temps[i].lazy_sync) {
+                    temp_state[i] = TS_DEAD | TS_MEM;
+                } else if (temp_state[i] & TS_MEM) {
+                    temp_state[i] = 0;
+                }
+            }
+            break;
 
         case INDEX_op_add2_i32:
             opc_new = INDEX_op_add_i32;
@@ -1625,7 +1734,9 @@ static void liveness_pass_1(TCGContext *s, uint8_t *temp_state)
                 }
 
                 /* if end of basic block, update */
-                if (def->flags & TCG_OPF_BB_END) {
+                if (def->flags & TCG_OPF_COND_BRANCH) {
+                    tcg_la_bb_sync(s, temp_state);
+                } else if (def->flags & TCG_OPF_BB_END) {
                     tcg_la_bb_end(s, temp_state);
                 } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
                     /* globals should be synced to memory */
@@ -1696,7 +1807,10 @@ static bool liveness_pass_2(TCGContext *s, uint8_t *temp_state)
             nb_oargs = def->nb_oargs;
 
             /* Set flags similar to how calls require.  */
-            if (def->flags & TCG_OPF_BB_END) {
+            if (def->flags & TCG_OPF_COND_BRANCH) {
+                /* Like reading globals: sync_globals */
+                call_flags = TCG_CALL_NO_WRITE_GLOBALS;
+            } else if (def->flags & TCG_OPF_BB_END) {
                 /* Like writing globals: save_globals */
                 call_flags = 0;
             } else if (def->flags & TCG_OPF_SIDE_EFFECTS) {
@@ -1949,6 +2063,9 @@ static void temp_sync(TCGContext *s, TCGTemp *ts,
             if (free_or_dead
                 && tcg_out_sti(s, ts->type, ts->val,
                                ts->mem_base->reg, ts->mem_offset)) {
+#ifdef CONFIG_PROFILER
+                s->st_count++;
+#endif
                 break;
             }
             temp_load(s, ts, tcg_target_available_regs[ts->type],
@@ -1958,6 +2075,9 @@ static void temp_sync(TCGContext *s, TCGTemp *ts,
         case TEMP_VAL_REG:
             tcg_out_st(s, ts->type, ts->reg,
                        ts->mem_base->reg, ts->mem_offset);
+#ifdef CONFIG_PROFILER
+            s->st_count++;
+#endif
             break;
 
         case TEMP_VAL_MEM:
@@ -2002,7 +2122,17 @@ static TCGReg tcg_reg_alloc(TCGContext *s, TCGRegSet desired_regs,
             return reg;
     }
 
-    /* XXX: do better spill choice */
+    /* Then prefer a register whose temp is already in memory, so that
+       spilling it does not need a store.  */
+    for(i = 0; i < n; i++) {
+        reg = order[i];
+        if (tcg_regset_test_reg(reg_ct, reg)
+            && s->reg_to_temp[reg]->mem_coherent) {
+            tcg_reg_free(s, reg, allocated_regs);
+            return reg;
+        }
+    }
+
     for(i = 0; i < n; i++) {
         reg = order[i];
         if (tcg_regset_test_reg(reg_ct, reg)) {
@@ -2033,6 +2163,9 @@ static void temp_load(TCGContext *s, TCGTemp *ts, TCGRegSet desired_regs,
         reg = tcg_reg_alloc(s, desired_regs, allocated_regs, ts->indirect_base);
         tcg_out_ld(s, ts->type, reg, ts->mem_base->reg, ts->mem_offset);
         ts->mem_coherent = 1;
+#ifdef CONFIG_PROFILER
+        s->ld_count++;
+#endif
         break;
     case TEMP_VAL_DEAD:
     default:
@@ -2079,6 +2212,29 @@ static void sync_globals(TCGContext *s, TCGRegSet allocated_regs)
     }
 }
 
+/* at a conditional branch, we assume all temporaries are dead and all
+   globals and local temps are synced to their canonical location; they
+   stay in their registers for the fall-through path. */
+static void tcg_reg_alloc_cbranch(TCGContext *s, TCGRegSet allocated_regs)
+{
+    int i;
+
+    sync_globals(s, allocated_regs);
+
+    for (i = s->nb_globals; i < s->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[i];
+        /* The liveness analysis already ensures that temps are dead and
+           that local temps are synced.  Keep tcg_debug_asserts for
+           safety. */
+        if (ts->temp_local) {
+            tcg_debug_assert(ts->val_type != TEMP_VAL_REG
+                             || ts->mem_coherent);
+        } else {
+            tcg_debug_assert(ts->val_type == TEMP_VAL_DEAD);
+        }
+    }
+}
+
 /* at the end of a basic block, we assume all temporaries are dead and
    all globals are stored at their canonical location. */
 static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
@@ -2099,6 +2255,29 @@ static void tcg_reg_alloc_bb_end(TCGContext *s, TCGRegSet allocated_regs)
     save_globals(s, allocated_regs);
 }
 
+/* Emit the direct jump of goto_tb_lazy, followed by the stores of the
+   lazily synced globals that only the unchained path performs.  */
+static void tcg_reg_alloc_goto_tb_lazy(TCGContext *s, const TCGArg *args)
+{
+    static const int const_args[1] = { 1 };
+    int i;
+
+    for (i = 0; i < s->nb_globals; i++) {
+        if (!s->temps[i].lazy_sync) {
+            temp_save(s, &s->temps[i], s->reserved_regs);
+        }
+    }
+
+    tcg_out_op(s, INDEX_op_goto_tb, args, const_args);
+
+    for (i = 0; i < s->nb_globals; i++) {
+        TCGTemp *ts = &s->temps[i];
+        if (ts->lazy_sync && ts->val_type != TEMP_VAL_MEM) {
+            temp_sync(s, ts, s->reserved_regs, 1);
+        }
+    }
+}
+
 static void tcg_reg_alloc_movi(TCGContext *s, const TCGArg *args,
                                TCGLifeData arg_life)
 {
@@ -2294,7 +2473,9 @@ static void tcg_reg_alloc_op(TCGContext *s,
         }
     }
 
-    if (def->flags & TCG_OPF_BB_END) {
+    if (def->flags & TCG_OPF_COND_BRANCH) {
+        tcg_reg_alloc_cbranch(s, allocated_regs);
+    } else if (def->flags & TCG_OPF_BB_END) {
         tcg_reg_alloc_bb_end(s, allocated_regs);
     } else {
         if (def->flags & TCG_OPF_CALL_CLOBBER) {
@@ -2647,6 +2828,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
         case INDEX_op_discard:
             temp_dead(s, &s->temps[args[0]]);
             break;
+        case INDEX_op_goto_tb_lazy:
+            tcg_reg_alloc_goto_tb_lazy(s, args);
+            break;
         case INDEX_op_set_label:
             tcg_reg_alloc_bb_end(s, s->reserved_regs);
             tcg_out_label(s, arg_label(args[0]), s->code_ptr);
@@ -2678,6 +2862,9 @@ int tcg_gen_code(TCGContext *s, TranslationBlock *tb)
     }
     tcg_debug_assert(num_insns >= 0);
     s->gen_insn_end_off[num_insns] = tcg_current_code_size(s);
+#ifdef CONFIG_PROFILER
+    s->insn_count += num_insns + 1;
+#endif
 
     /* Generate TB finalization at the end of block */
     if (!tcg_out_tb_finalize(s)) {
@@ -2714,6 +2901,12 @@ void tcg_dump_info(FILE *f, fprintf_function cpu_fprintf)
                 (double)s->code_out_len / tb_div_count);
     cpu_fprintf(f, "avg search data/TB  %0.1f\n",
                 (double)s->search_out_len / tb_div_count);
+    cpu_fprintf(f, "avg host code/insn  %0.1f\n",
+                s->insn_count ? (double)s->code_out_len / s->insn_count : 0);
+    cpu_fprintf(f, "reg loads/insn      %0.2f\n",
+                s->insn_count ? (double)s->ld_count / s->insn_count : 0);
+    cpu_fprintf(f, "reg stores/insn     %0.2f\n",
+                s->insn_count ? (double)s->st_count / s->insn_count : 0);
     
     cpu_fprintf(f, "cycles/op           %0.1f\n", 
                 s->op_count ? (double)tot / s->op_count : 0);
@@ -79,6 +79,16 @@ typedef uint64_t tcg_target_ulong;
 #error unsupported
 #endif
 
+/* Oversized TCG guests (64-bit guest on a 32-bit host) cannot update
+ * guest-sized values atomically, which rules out running vCPUs in
+ * parallel threads.
+ */
+#if TARGET_LONG_BITS > TCG_TARGET_REG_BITS
+#define TCG_OVERSIZED_GUEST 1
+#else
+#define TCG_OVERSIZED_GUEST 0
+#endif
+
 #if TCG_TARGET_NB_REGS <= 32
 typedef uint32_t TCGRegSet;
 #elif TCG_TARGET_NB_REGS <= 64
@@ -124,6 +134,14 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_sub2_i32         1
 #endif
 
+#ifndef TCG_TARGET_HAS_vec
+#define TCG_TARGET_HAS_vec              0
+#endif
+
+#ifndef TCG_TARGET_HAS_atomic
+#define TCG_TARGET_HAS_atomic           0
+#endif
+
 #ifndef TCG_TARGET_deposit_i32_valid
 #define TCG_TARGET_deposit_i32_valid(ofs, len) 1
 #endif
@@ -562,6 +580,8 @@ typedef struct TCGTemp {
                                   basic blocks. Otherwise, it is not
                                   preserved across basic blocks. */
     unsigned int temp_allocated:1; /* never used for code gen */
+    unsigned int lazy_sync:1; /* global is only synced on the unchained
+                                 path of goto_tb_lazy */
 
     tcg_target_long val;
     struct TCGTemp *mem_base;
@@ -603,6 +623,33 @@ typedef struct TCGOp {
     unsigned life   : 16;       /* 64 */
 } TCGOp;
 
+/* Relocations against host addresses that change from one run of QEMU
+   to the next.  Backends that define TCG_TARGET_IMPLEMENTS_TB_RELOCS
+   record them while tb_relocs_enabled is set, so that the persistent
+   translation cache (tb-cache.c) can move the code of a TB into another
+   process.  */
+typedef enum TCGTBRelocKind {
+    TCG_TB_RELOC_TB,            /* the TranslationBlock being generated */
+    TCG_TB_RELOC_TC,            /* the host code of that TB */
+    TCG_TB_RELOC_PROLOGUE,      /* the prologue of code_gen_buffer */
+    TCG_TB_RELOC_TEXT,          /* a function of the QEMU executable */
+} TCGTBRelocKind;
+
+typedef enum TCGTBRelocType {
+    TCG_TB_RELOC_ABS32,         /* 32-bit absolute address */
+    TCG_TB_RELOC_ABS64,         /* 64-bit absolute address */
+    TCG_TB_RELOC_PC32,          /* 32-bit offset from the end of the field */
+} TCGTBRelocType;
+
+typedef struct TCGTBReloc {
+    uint32_t offset;            /* of the field, from the start of the TB */
+    uint8_t kind;               /* TCGTBRelocKind */
+    uint8_t type;               /* TCGTBRelocType */
+    int64_t addend;             /* from the base address of KIND */
+} TCGTBReloc;
+
+#define TCG_MAX_TB_RELOCS 128
+
 /* Make sure operands fit in the bitfields above.  */
 QEMU_BUILD_BUG_ON(NB_OPS > (1 << 8));
 QEMU_BUILD_BUG_ON(OPC_BUF_SIZE > (1 << 10));
@@ -625,6 +672,13 @@ struct TCGContext {
     uint16_t *tb_jmp_insn_offset; /* tb->jmp_insn_offset if USE_DIRECT_JUMP */
     uintptr_t *tb_jmp_target_addr; /* tb->jmp_target_addr if !USE_DIRECT_JUMP */
 
+    /* relocations for the persistent translation cache */
+    bool tb_relocs_enabled;
+    bool tb_relocs_invalid;
+    int nb_tb_relocs;
+    uintptr_t tb_relocs_tb;
+    TCGTBReloc tb_relocs[TCG_MAX_TB_RELOCS];
+
     TCGRegSet reserved_regs;
     intptr_t current_frame_offset;
     intptr_t frame_start;
@@ -653,6 +707,9 @@ struct TCGContext {
     int64_t opt_time;
     int64_t restore_count;
     int64_t restore_time;
+    int64_t insn_count; /* guest insns translated */
+    int64_t ld_count; /* temps loaded from memory by the allocator */
+    int64_t st_count; /* temps stored to memory by the allocator */
 #endif
 
 #ifdef CONFIG_DEBUG_TCG
@@ -750,9 +807,15 @@ void tcg_func_start(TCGContext *s);
 
 int tcg_gen_code(TCGContext *s, TranslationBlock *tb);
 
+void tcg_tb_reloc_add(TCGContext *s, tcg_insn_unit *field,
+                      TCGTBRelocType type, uintptr_t target);
+uintptr_t tcg_tb_reloc_text_base(void);
+uint64_t tcg_tb_relocs_host_id(void);
+
 void tcg_set_frame(TCGContext *s, TCGReg reg, intptr_t start, intptr_t size);
 
 int tcg_global_mem_new_internal(TCGType, TCGv_ptr, intptr_t, const char *);
+void tcg_global_set_lazy_sync_internal(int idx);
 
 TCGv_i32 tcg_global_reg_new_i32(TCGReg reg, const char *name);
 TCGv_i64 tcg_global_reg_new_i64(TCGReg reg, const char *name);
@@ -770,6 +833,11 @@ static inline TCGv_i32 tcg_global_mem_new_i32(TCGv_ptr reg, intptr_t offset,
     return MAKE_TCGV_I32(idx);
 }
 
+static inline void tcg_global_set_lazy_sync_i32(TCGv_i32 v)
+{
+    tcg_global_set_lazy_sync_internal(GET_TCGV_I32(v));
+}
+
 static inline TCGv_i32 tcg_temp_new_i32(void)
 {
     return tcg_temp_new_internal_i32(0);
@@ -787,6 +855,11 @@ static inline TCGv_i64 tcg_global_mem_new_i64(TCGv_ptr reg, intptr_t offset,
     return MAKE_TCGV_I64(idx);
 }
 
+static inline void tcg_global_set_lazy_sync_i64(TCGv_i64 v)
+{
+    tcg_global_set_lazy_sync_internal(GET_TCGV_I64(v));
+}
+
 static inline TCGv_i64 tcg_temp_new_i64(void)
 {
     return tcg_temp_new_internal_i64(0);
@@ -828,6 +901,12 @@ typedef struct TCGArgConstraint {
 
 #define TCG_MAX_OP_ARGS 16
 
+/* The last constant argument of the vector opcodes: the vector size
+   in bytes (8 or 16) and the log2 of the element size in bytes.  */
+#define TCG_VEC_DESC(oprsz, vece)  ((((oprsz) == 16) << 2) | (vece))
+#define TCG_VEC_OPRSZ(desc)        ((desc) & 4 ? 16 : 8)
+#define TCG_VEC_VECE(desc)         ((desc) & 3)
+
 /* Bits for TCGOpDef->flags, 8 bits available.  */
 enum {
     /* Instruction defines the end of a basic block.  */
@@ -842,6 +921,9 @@ enum {
     /* Instruction is optional and not implemented by the host, or insn
        is generic and should not be implemened by the host.  */
     TCG_OPF_NOT_PRESENT  = 0x10,
+    /* Instruction is a conditional branch: globals and local temps are
+       synced to memory but stay live on the fall-through path.  */
+    TCG_OPF_COND_BRANCH  = 0x20,
 };
 
 typedef struct TCGOpDef {
@@ -1145,6 +1227,42 @@ uint32_t helper_be_ldl_cmmu(CPUArchState *env, target_ulong addr,
 uint64_t helper_be_ldq_cmmu(CPUArchState *env, target_ulong addr,
                             TCGMemOpIdx oi, uintptr_t retaddr);
 
+/* Out-of-line atomic operations, called from the backend slow paths.  */
+uint32_t helper_atomic_cmpxchgb_mmu(CPUArchState *env, target_ulong addr,
+                                    uint32_t cmpv, uint32_t newv,
+                                    TCGMemOpIdx oi, uintptr_t retaddr);
+uint32_t helper_atomic_cmpxchgw_mmu(CPUArchState *env, target_ulong addr,
+                                    uint32_t cmpv, uint32_t newv,
+                                    TCGMemOpIdx oi, uintptr_t retaddr);
+uint32_t helper_atomic_cmpxchgl_mmu(CPUArchState *env, target_ulong addr,
+                                    uint32_t cmpv, uint32_t newv,
+                                    TCGMemOpIdx oi, uintptr_t retaddr);
+uint64_t helper_atomic_cmpxchgq_mmu(CPUArchState *env, target_ulong addr,
+                                    uint64_t cmpv, uint64_t newv,
+                                    TCGMemOpIdx oi, uintptr_t retaddr);
+
+#define GEN_ATOMIC_HELPER_MMU(NAME)                                       \
+uint32_t helper_atomic_##NAME##b_mmu(CPUArchState *env, target_ulong addr, \
+                                     uint32_t val, TCGMemOpIdx oi,        \
+                                     uintptr_t retaddr);                  \
+uint32_t helper_atomic_##NAME##w_mmu(CPUArchState *env, target_ulong addr, \
+                                     uint32_t val, TCGMemOpIdx oi,        \
+                                     uintptr_t retaddr);                  \
+uint32_t helper_atomic_##NAME##l_mmu(CPUArchState *env, target_ulong addr, \
+                                     uint32_t val, TCGMemOpIdx oi,        \
+                                     uintptr_t retaddr);                  \
+uint64_t helper_atomic_##NAME##q_mmu(CPUArchState *env, target_ulong addr, \
+                                     uint64_t val, TCGMemOpIdx oi,        \
+                                     uintptr_t retaddr);
+
+GEN_ATOMIC_HELPER_MMU(xchg)
+GEN_ATOMIC_HELPER_MMU(fetch_add)
+GEN_ATOMIC_HELPER_MMU(fetch_and)
+GEN_ATOMIC_HELPER_MMU(fetch_or)
+GEN_ATOMIC_HELPER_MMU(fetch_xor)
+
+#undef GEN_ATOMIC_HELPER_MMU
+
 /* Temporary aliases until backends are converted.  */
 #ifdef TARGET_WORDS_BIGENDIAN
 # define helper_ret_ldsw_mmu  helper_be_ldsw_mmu
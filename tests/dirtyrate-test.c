@@ -0,0 +1,195 @@
+/*
+ * QTest testcase for dirty page rate measurement
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+
+#define RAM_SIZE            (64 * 1024 * 1024)
+#define NUMA_NODES          2
+#define TARGET_PAGE_SIZE    4096
+#define TIMEOUT_US          (30 * 1000 * 1000)
+
+static QDict *query_dirty_rate(void)
+{
+    QDict *response, *info;
+
+    response = qmp("{ 'execute': 'query-dirty-rate' }");
+    g_assert(qdict_haskey(response, "return"));
+    info = qdict_get_qdict(response, "return");
+    QINCREF(info);
+    QDECREF(response);
+
+    return info;
+}
+
+static void assert_qmp_error(QDict *response, const char *desc)
+{
+    QDict *error;
+
+    g_assert(qdict_haskey(response, "error"));
+    error = qdict_get_qdict(response, "error");
+    g_assert_cmpstr(qdict_get_str(error, "desc"), ==, desc);
+    QDECREF(response);
+}
+
+static void assert_calc_error(int calc_time, const char *desc)
+{
+    assert_qmp_error(qmp("{ 'execute': 'calc-dirty-rate',"
+                         "  'arguments': { 'calc-time': %d } }", calc_time),
+                     desc);
+}
+
+static void test_measure(void)
+{
+    const char *range_error = "Parameter 'calc-time' expects an integer in "
+                              "the range of 1 to 60";
+    gint64 start_time;
+    const QListEntry *p;
+    QDict *response, *info, *entry;
+    QList *list;
+    bool found_ram = false;
+    int64_t ram_dirty_pages = 0, node_dirty_pages = 0;
+    int nodes = 0;
+
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "unstarted");
+    g_assert(!qdict_haskey(info, "calc-time"));
+    g_assert(!qdict_haskey(info, "blocks"));
+    QDECREF(info);
+
+    assert_calc_error(0, range_error);
+    assert_calc_error(61, range_error);
+
+    response = qmp("{ 'execute': 'calc-dirty-rate',"
+                   "  'arguments': { 'calc-time': 1 } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measuring");
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    g_assert(!qdict_haskey(info, "dirty-rate"));
+    QDECREF(info);
+
+    assert_calc_error(1, "A dirty rate measurement is already in progress");
+
+    /* The measurement owns the dirty log until it is done */
+    assert_qmp_error(qmp("{ 'execute': 'migrate',"
+                         "  'arguments': { 'uri': 'exec:cat > /dev/null' } }"),
+                     "A dirty rate measurement is in progress");
+
+    start_time = g_get_monotonic_time();
+    for (;;) {
+        info = query_dirty_rate();
+        if (strcmp(qdict_get_str(info, "status"), "measuring")) {
+            break;
+        }
+        QDECREF(info);
+        g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+        g_usleep(100 * 1000);
+    }
+
+    g_assert_cmpstr(qdict_get_str(info, "status"), ==, "measured");
+    g_assert_cmpint(qdict_get_int(info, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(info, "page-size"), ==, TARGET_PAGE_SIZE);
+    g_assert_cmpint(qdict_get_int(info, "dirty-pages"), >=, 0);
+    g_assert(qdict_haskey(info, "dirty-rate"));
+
+    list = qdict_get_qlist(info, "blocks");
+    g_assert(list);
+    for (p = qlist_first(list); p; p = qlist_next(p)) {
+        entry = qobject_to_qdict(qlist_entry_obj(p));
+        g_assert(entry);
+        g_assert(qdict_haskey(entry, "dirty-rate"));
+        if (!strcmp(qdict_get_str(entry, "id"), "pc.ram")) {
+            g_assert_cmpint(qdict_get_int(entry, "size"), ==, RAM_SIZE);
+            ram_dirty_pages = qdict_get_int(entry, "dirty-pages");
+            g_assert_cmpint(ram_dirty_pages, <=,
+                            RAM_SIZE / TARGET_PAGE_SIZE);
+            found_ram = true;
+        }
+    }
+    g_assert(found_ram);
+
+    /* Legacy -numa nodes split pc.ram in order */
+    list = qdict_get_qlist(info, "nodes");
+    g_assert(list);
+    for (p = qlist_first(list); p; p = qlist_next(p)) {
+        entry = qobject_to_qdict(qlist_entry_obj(p));
+        g_assert(entry);
+        g_assert_cmpint(qdict_get_int(entry, "node"), ==, nodes);
+        g_assert_cmpint(qdict_get_int(entry, "size"), ==,
+                        RAM_SIZE / NUMA_NODES);
+        g_assert(qdict_haskey(entry, "dirty-rate"));
+        node_dirty_pages += qdict_get_int(entry, "dirty-pages");
+        nodes++;
+    }
+    g_assert_cmpint(nodes, ==, NUMA_NODES);
+    g_assert_cmpint(node_dirty_pages, ==, ram_dirty_pages);
+
+    QDECREF(info);
+}
+
+static void test_migration_active(void)
+{
+    gint64 start_time;
+    QDict *response, *info;
+    const char *status;
+    bool cancelled;
+
+    /* Slow enough that the migration is still running below */
+    response = qmp("{ 'execute': 'migrate_set_speed',"
+                   "  'arguments': { 'value': 1024 } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    response = qmp("{ 'execute': 'migrate',"
+                   "  'arguments': { 'uri': 'exec:cat > /dev/null' } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    assert_calc_error(1, "There's a migration process in progress");
+
+    info = query_dirty_rate();
+    g_assert_cmpstr(qdict_get_str(info, "status"), !=, "measuring");
+    QDECREF(info);
+
+    response = qmp("{ 'execute': 'migrate_cancel' }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    start_time = g_get_monotonic_time();
+    do {
+        g_assert(g_get_monotonic_time() - start_time <= TIMEOUT_US);
+        g_usleep(100 * 1000);
+        response = qmp("{ 'execute': 'query-migrate' }");
+        info = qdict_get_qdict(response, "return");
+        status = qdict_get_str(info, "status");
+        g_assert_cmpstr(status, !=, "completed");
+        cancelled = !strcmp(status, "cancelled");
+        QDECREF(response);
+    } while (!cancelled);
+}
+
+int main(int argc, char **argv)
+{
+    int ret;
+
+    g_test_init(&argc, &argv, NULL);
+    qtest_add_func("/dirtyrate/measure", test_measure);
+    qtest_add_func("/dirtyrate/migration-active", test_migration_active);
+
+    qtest_start("-m 64M -numa node,mem=32M -numa node,mem=32M");
+    ret = g_test_run();
+
+    qtest_end();
+
+    return ret;
+}
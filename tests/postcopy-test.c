@@ -352,12 +352,50 @@ static void cleanup(const char *filename)
     unlink(path);
 }
 
-static void test_migrate(void)
+static void migrate_set_capability(const char *capability)
+{
+    gchar *cmd;
+    QDict *rsp;
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate-set-capabilities',"
+                          "'arguments': { "
+                              "'capabilities': [ {"
+                                  "'capability': '%s',"
+                                  "'state': true } ] } }",
+                          capability);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+static void migrate_set_multifd_channels(int channels)
+{
+    gchar *cmd;
+    QDict *rsp;
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate-set-parameters',"
+                          "'arguments': { 'x-multifd-channels': %d } }",
+                          channels);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+/*
+ * Migrate a guest that keeps dirtying its memory, either switching to
+ * postcopy after a pass or, with @multifd, in precopy over several
+ * multifd channels.  Multifd cannot be combined with postcopy.
+ */
+static void test_migrate_common(bool multifd)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
     QTestState *global = global_qtest, *from, *to;
     unsigned char dest_byte_a, dest_byte_b, dest_byte_c, dest_byte_d;
     gchar *cmd, *cmd_src, *cmd_dst;
+    /* The multifd channels must be set up before listening */
+    const char *incoming = multifd ? "defer" : uri;
     QDict *rsp;
 
     char *bootpath = g_strdup_printf("%s/bootsect", tmpfs);
@@ -377,7 +415,7 @@ static void test_migrate(void)
                                   " -serial file:%s/dest_serial"
                                   " -drive file=%s,format=raw"
                                   " -incoming %s",
-                                  tmpfs, bootpath, uri);
+                                  tmpfs, bootpath, incoming);
     } else if (strcmp(arch, "ppc64") == 0) {
         init_bootfile_ppc(bootpath);
         cmd_src = g_strdup_printf("-machine accel=kvm:tcg -m 256M"
@@ -389,7 +427,7 @@ static void test_migrate(void)
                                   " -name pcdest,debug-threads=on"
                                   " -serial file:%s/dest_serial"
                                   " -incoming %s",
-                                  tmpfs, uri);
+                                  tmpfs, incoming);
     } else {
         g_assert_not_reached();
     }
@@ -401,22 +439,28 @@ static void test_migrate(void)
     g_free(cmd_dst);
 
     global_qtest = from;
-    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
-                  "'arguments': { "
-                      "'capabilities': [ {"
-                          "'capability': 'postcopy-ram',"
-                          "'state': true } ] } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
+    if (multifd) {
+        migrate_set_capability("x-multifd");
+        migrate_set_multifd_channels(4);
+    } else {
+        migrate_set_capability("postcopy-ram");
+    }
 
     global_qtest = to;
-    rsp = qmp("{ 'execute': 'migrate-set-capabilities',"
-                  "'arguments': { "
-                      "'capabilities': [ {"
-                          "'capability': 'postcopy-ram',"
-                          "'state': true } ] } }");
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
+    if (multifd) {
+        migrate_set_capability("x-multifd");
+        migrate_set_multifd_channels(4);
+
+        cmd = g_strdup_printf("{ 'execute': 'migrate-incoming',"
+                              "'arguments': { 'uri': '%s' } }",
+                              uri);
+        rsp = qmp(cmd);
+        g_free(cmd);
+        g_assert(qdict_haskey(rsp, "return"));
+        QDECREF(rsp);
+    } else {
+        migrate_set_capability("postcopy-ram");
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -448,20 +492,35 @@ static void test_migrate(void)
 
     wait_for_migration_pass();
 
-    rsp = return_or_event(qmp("{ 'execute': 'migrate-start-postcopy' }"));
-    g_assert(qdict_haskey(rsp, "return"));
-    QDECREF(rsp);
+    if (multifd) {
+        /* Let precopy converge now that the channels have carried a pass */
+        rsp = return_or_event(qmp("{ 'execute': 'migrate_set_downtime',"
+                                  "'arguments': { 'value': 10 } }"));
+        g_assert(qdict_haskey(rsp, "return"));
+        QDECREF(rsp);
 
-    if (!got_stop) {
-        qmp_eventwait("STOP");
-    }
+        wait_for_migration_complete();
 
-    global_qtest = to;
-    qmp_eventwait("RESUME");
+        global_qtest = to;
+        qmp_eventwait("RESUME");
+        wait_for_serial("dest_serial");
+        global_qtest = from;
+    } else {
+        rsp = return_or_event(qmp("{ 'execute': 'migrate-start-postcopy' }"));
+        g_assert(qdict_haskey(rsp, "return"));
+        QDECREF(rsp);
 
-    wait_for_serial("dest_serial");
-    global_qtest = from;
-    wait_for_migration_complete();
+        if (!got_stop) {
+            qmp_eventwait("STOP");
+        }
+
+        global_qtest = to;
+        qmp_eventwait("RESUME");
+
+        wait_for_serial("dest_serial");
+        global_qtest = from;
+        wait_for_migration_complete();
+    }
 
     qtest_quit(from);
 
@@ -495,6 +554,16 @@ static void test_migrate(void)
     cleanup("dest_serial");
 }
 
+static void test_migrate(void)
+{
+    test_migrate_common(false);
+}
+
+static void test_migrate_multifd(void)
+{
+    test_migrate_common(true);
+}
+
 int main(int argc, char **argv)
 {
     char template[] = "/tmp/postcopy-test-XXXXXX";
@@ -502,10 +571,6 @@ int main(int argc, char **argv)
 
     g_test_init(&argc, &argv, NULL);
 
-    if (!ufd_version_check()) {
-        return 0;
-    }
-
     tmpfs = mkdtemp(template);
     if (!tmpfs) {
         g_test_message("mkdtemp on path (%s): %s\n", template, strerror(errno));
@@ -514,7 +579,10 @@ int main(int argc, char **argv)
 
     module_call_init(MODULE_INIT_QOM);
 
-    qtest_add_func("/postcopy", test_migrate);
+    if (ufd_version_check()) {
+        qtest_add_func("/postcopy", test_migrate);
+    }
+    qtest_add_func("/multifd", test_migrate_multifd);
 
     ret = g_test_run();
 
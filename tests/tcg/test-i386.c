@@ -502,6 +502,55 @@ void test_loop(void)
     TEST_LOOP("loopnzl");
 }
 
+/* Direct jumps to a cmp/test, whose flags are not stored when the
+   blocks are chained, and to an adc that does read them.  Also serves
+   as a benchmark: see the lazy-cc target in the Makefile.  */
+void test_lazy_cc(void)
+{
+    long i, sum, carry, flags;
+
+    sum = 0;
+    asm volatile ("xor %0, %0\n"
+                  "1:\n"
+                  "add %0, %1\n"
+                  "inc %0\n"
+                  "jmp 2f\n"
+                  "2:\n"
+                  "cmp %2, %0\n"
+                  "jb 1b\n"
+                  : "=&r" (i), "+r" (sum)
+                  : "r" (1000000L));
+    printf("lazy_cc cmp: i=" FMTLX " sum=" FMTLX "\n", i, sum);
+
+    sum = 0;
+    asm volatile ("1:\n"
+                  "sub $3, %1\n"
+                  "dec %0\n"
+                  "jmp 2f\n"
+                  "2:\n"
+                  "test %0, %0\n"
+                  "jnz 1b\n"
+                  "pushf\n"
+                  "pop %2\n"
+                  : "=r" (i), "+r" (sum), "=r" (flags)
+                  : "0" (100000L));
+    printf("lazy_cc test: i=" FMTLX " sum=" FMTLX " flags=%04lx\n",
+           i, sum, flags & (CC_C | CC_P | CC_Z | CC_S | CC_O));
+
+    carry = 0;
+    asm volatile ("mov %2, %0\n"
+                  "1:\n"
+                  "add %0, %0\n"
+                  "jmp 2f\n"
+                  "2:\n"
+                  "adc $0, %1\n"
+                  "test %0, %0\n"
+                  "jnz 1b\n"
+                  : "=&r" (i), "+r" (carry)
+                  : "r" (0x12345L));
+    printf("lazy_cc adc: i=" FMTLX " carry=" FMTLX "\n", i, carry);
+}
+
 #undef CC_MASK
 #ifdef TEST_P4_FLAGS
 #define CC_MASK (CC_C | CC_P | CC_Z | CC_S | CC_O | CC_A)
@@ -2735,6 +2784,7 @@ int main(int argc, char **argv)
     test_mul();
     test_jcc();
     test_loop();
+    test_lazy_cc();
     test_floats();
 #if !defined(__x86_64__)
     test_bcd();
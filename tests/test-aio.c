@@ -13,6 +13,8 @@
 #include "qemu/osdep.h"
 #include "block/aio.h"
 #include "qapi/error.h"
+#include "qemu/coroutine.h"
+#include "qemu/thread.h"
 #include "qemu/timer.h"
 #include "qemu/sockets.h"
 #include "qemu/error-report.h"
@@ -504,6 +506,124 @@ static void test_timer_schedule(void)
     timer_del(&data.timer);
 }
 
+/* Coroutines moving between the main context and one run by another thread */
+
+#define CO_HOPS 100
+#define CO_COUNT 10
+
+static AioContext *remote_ctx;
+static QemuThread remote_thread;
+static bool remote_stop;
+
+typedef struct {
+    Coroutine *co;
+    AioContext *target;
+    QEMUBH *bh;
+} RescheduleData;
+
+typedef struct {
+    int hops;
+    int wrong_thread;
+    bool done;
+} CoScheduleTestData;
+
+static void *remote_thread_fn(void *opaque)
+{
+    while (!remote_stop) {
+        aio_poll(remote_ctx, true);
+    }
+    return NULL;
+}
+
+static void remote_stop_bh_cb(void *opaque)
+{
+    remote_stop = true;
+}
+
+static void reschedule_bh_cb(void *opaque)
+{
+    RescheduleData *data = opaque;
+
+    qemu_bh_delete(data->bh);
+    aio_co_schedule(data->target, data->co);
+}
+
+/* Move the calling coroutine from @from to @target.  The coroutine may
+ * only be scheduled once it has yielded, so do it from a BH of @from.
+ */
+static void coroutine_fn reschedule_self(AioContext *from, AioContext *target)
+{
+    RescheduleData data = {
+        .co = qemu_coroutine_self(),
+        .target = target,
+    };
+
+    data.bh = aio_bh_new(from, reschedule_bh_cb, &data);
+    qemu_bh_schedule(data.bh);
+    qemu_coroutine_yield();
+}
+
+static void coroutine_fn co_schedule_test_co(void *opaque)
+{
+    CoScheduleTestData *data = opaque;
+    int i;
+
+    for (i = 0; i < CO_HOPS; i++) {
+        reschedule_self(ctx, remote_ctx);
+        if (!qemu_thread_is_self(&remote_thread)) {
+            data->wrong_thread++;
+        }
+        reschedule_self(remote_ctx, ctx);
+        if (qemu_thread_is_self(&remote_thread)) {
+            data->wrong_thread++;
+        }
+        data->hops++;
+    }
+    data->done = true;
+}
+
+static void test_co_schedule_remote(void)
+{
+    CoScheduleTestData data[CO_COUNT] = { { 0 } };
+    Error *local_err = NULL;
+    QEMUBH *stop_bh;
+    bool done;
+    int i;
+
+    remote_ctx = aio_context_new(&local_err);
+    g_assert(remote_ctx);
+    remote_stop = false;
+    qemu_thread_create(&remote_thread, "aio-remote", remote_thread_fn,
+                       NULL, QEMU_THREAD_JOINABLE);
+
+    for (i = 0; i < CO_COUNT; i++) {
+        Coroutine *co = qemu_coroutine_create(co_schedule_test_co, &data[i]);
+
+        aio_context_acquire(ctx);
+        qemu_coroutine_enter(co);
+        aio_context_release(ctx);
+    }
+
+    do {
+        aio_poll(ctx, true);
+        done = true;
+        for (i = 0; i < CO_COUNT; i++) {
+            done = done && data[i].done;
+        }
+    } while (!done);
+
+    for (i = 0; i < CO_COUNT; i++) {
+        g_assert_cmpint(data[i].hops, ==, CO_HOPS);
+        g_assert_cmpint(data[i].wrong_thread, ==, 0);
+    }
+
+    stop_bh = aio_bh_new(remote_ctx, remote_stop_bh_cb, NULL);
+    qemu_bh_schedule(stop_bh);
+    qemu_thread_join(&remote_thread);
+    qemu_bh_delete(stop_bh);
+    aio_context_unref(remote_ctx);
+}
+
 /* Now the same tests, using the context as a GSource.  They are
  * very similar to the ones above, with g_main_context_iteration
  * replacing aio_poll.  However:
@@ -857,6 +977,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
+    g_test_add_func("/aio/coroutine/schedule-remote", test_co_schedule_remote);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
     g_test_add_func("/aio-gsource/bh/schedule",             test_source_bh_schedule);
@@ -0,0 +1,135 @@
+/*
+ * Interval tree tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+#define N 2000
+#define KEY_RANGE 100000
+#define MAX_LEN 500
+
+static IntervalTreeNode nodes[N];
+static bool inserted[N];
+static IntervalTreeRoot root;
+
+/* Check the tree invariants and return the height of @node */
+static int check_subtree(IntervalTreeNode *node, IntervalTreeNode *parent)
+{
+    uint64_t subtree_last;
+    int hl, hr;
+
+    if (!node) {
+        return 0;
+    }
+    g_assert(node->parent == parent);
+    g_assert(node->start <= node->last);
+
+    hl = check_subtree(node->left, node);
+    hr = check_subtree(node->right, node);
+    g_assert_cmpint(ABS(hl - hr), <=, 1);
+    g_assert_cmpint(node->height, ==, 1 + MAX(hl, hr));
+
+    subtree_last = node->last;
+    if (node->left) {
+        g_assert_cmpuint(node->left->start, <=, node->start);
+        subtree_last = MAX(subtree_last, node->left->subtree_last);
+    }
+    if (node->right) {
+        g_assert_cmpuint(node->right->start, >=, node->start);
+        subtree_last = MAX(subtree_last, node->right->subtree_last);
+    }
+    g_assert_cmpuint(node->subtree_last, ==, subtree_last);
+
+    return node->height;
+}
+
+static void check_query(uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node;
+    uint64_t prev_start = 0;
+    int found = 0, expected = 0;
+    int i;
+
+    for (node = interval_tree_iter_first(&root, start, last); node;
+         node = interval_tree_iter_next(node, start, last)) {
+        g_assert(node->start <= last && start <= node->last);
+        g_assert_cmpuint(node->start, >=, prev_start);
+        prev_start = node->start;
+        found++;
+    }
+
+    for (i = 0; i < N; i++) {
+        if (inserted[i] && nodes[i].start <= last && start <= nodes[i].last) {
+            expected++;
+        }
+    }
+    g_assert_cmpint(found, ==, expected);
+}
+
+static void test_empty(void)
+{
+    IntervalTreeRoot empty = { NULL };
+    IntervalTreeNode node = { .start = 10, .last = 20 };
+
+    g_assert(interval_tree_empty(&empty));
+    g_assert(interval_tree_iter_first(&empty, 0, UINT64_MAX) == NULL);
+
+    interval_tree_insert(&node, &empty);
+    g_assert(!interval_tree_empty(&empty));
+    g_assert(interval_tree_iter_first(&empty, 0, 9) == NULL);
+    g_assert(interval_tree_iter_first(&empty, 21, 30) == NULL);
+    g_assert(interval_tree_iter_first(&empty, 20, 20) == &node);
+    g_assert(interval_tree_iter_first(&empty, 0, 10) == &node);
+    g_assert(interval_tree_iter_next(&node, 0, 10) == NULL);
+
+    interval_tree_remove(&node, &empty);
+    g_assert(interval_tree_empty(&empty));
+}
+
+static void test_random(void)
+{
+    GRand *rand = g_rand_new_with_seed(42);
+    int i, j;
+
+    for (i = 0; i < 100000; i++) {
+        int n = g_rand_int_range(rand, 0, N);
+
+        if (inserted[n]) {
+            interval_tree_remove(&nodes[n], &root);
+            inserted[n] = false;
+        } else {
+            nodes[n].start = g_rand_int_range(rand, 0, KEY_RANGE);
+            nodes[n].last = nodes[n].start + g_rand_int_range(rand, 0, MAX_LEN);
+            interval_tree_insert(&nodes[n], &root);
+            inserted[n] = true;
+        }
+
+        if (i % 1000 == 0) {
+            check_subtree(root.root, NULL);
+            for (j = 0; j < 20; j++) {
+                uint64_t start = g_rand_int_range(rand, 0, KEY_RANGE);
+                check_query(start, start + g_rand_int_range(rand, 0, MAX_LEN));
+            }
+        }
+    }
+
+    for (i = 0; i < N; i++) {
+        if (inserted[i]) {
+            interval_tree_remove(&nodes[i], &root);
+            inserted[i] = false;
+        }
+    }
+    g_assert(interval_tree_empty(&root));
+    g_rand_free(rand);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/interval-tree/empty", test_empty);
+    g_test_add_func("/interval-tree/random", test_random);
+    return g_test_run();
+}
@@ -446,6 +446,7 @@ static void test_io_channel_unix_fd_pass(void)
                             G_N_ELEMENTS(iosend),
                             fdsend,
                             G_N_ELEMENTS(fdsend),
+                            0,
                             &error_abort);
 
     qio_channel_readv_full(dst,
@@ -522,6 +523,79 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+#ifdef CONFIG_MSG_ZEROCOPY
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *src, *dst;
+    char sendbuf[4][4096];
+    char recvbuf[sizeof(sendbuf)];
+    struct iovec iov[4];
+    Error *local_err = NULL;
+    int ret;
+    size_t i;
+
+    listen_addr->type = SOCKET_ADDRESS_KIND_INET;
+    listen_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *listen_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_KIND_INET;
+    connect_addr->u.inet.data = g_new(InetSocketAddress, 1);
+    *connect_addr->u.inet.data = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &src, &dst);
+
+    if (!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        /* Older kernel */
+        goto cleanup;
+    }
+
+    /* Nothing to wait for yet */
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+
+    for (i = 0; i < G_N_ELEMENTS(iov); i++) {
+        memset(sendbuf[i], 'a' + i, sizeof(sendbuf[i]));
+        iov[i].iov_base = sendbuf[i];
+        iov[i].iov_len = sizeof(sendbuf[i]);
+    }
+    g_assert_cmpint(qio_channel_writev_all_flags(
+                        src, iov, G_N_ELEMENTS(iov),
+                        QIO_CHANNEL_WRITE_FLAG_ZERO_COPY, &error_abort),
+                    ==, 0);
+
+    /* Loopback connections fall back to copying */
+    ret = qio_channel_flush(src, &error_abort);
+    g_assert(ret == 0 || ret == 1);
+    g_assert_cmpint(QIO_CHANNEL_SOCKET(src)->zero_copy_sent, ==,
+                    QIO_CHANNEL_SOCKET(src)->zero_copy_queued);
+
+    g_assert_cmpint(qio_channel_read_all(dst, recvbuf, sizeof(recvbuf),
+                                         &error_abort), ==, 0);
+    g_assert(memcmp(sendbuf, recvbuf, sizeof(recvbuf)) == 0);
+
+    /* The flag is refused by channels that do not support it */
+    g_assert_cmpint(qio_channel_writev_all_flags(
+                        dst, iov, 1, QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                        &local_err), ==, -1);
+    g_assert(local_err);
+    error_free(local_err);
+
+ cleanup:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+#endif /* CONFIG_MSG_ZEROCOPY */
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -547,6 +621,10 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+#ifdef CONFIG_MSG_ZEROCOPY
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
+#endif
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
@@ -0,0 +1,166 @@
+/*
+ * XBZRLE page cache tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "migration/page_cache.h"
+
+#define PAGE_SIZE 64
+#define WAYS 8
+#define SETS 16
+
+/* Address of the @n-th page mapping to @set */
+static uint64_t page_addr(int set, int n)
+{
+    return ((uint64_t)n * SETS + set) * PAGE_SIZE;
+}
+
+static void fill_page(uint8_t *buf, uint64_t addr)
+{
+    memset(buf, addr / PAGE_SIZE, PAGE_SIZE);
+}
+
+static void check_page(PageCache *cache, uint64_t addr, bool cached)
+{
+    uint8_t expected[PAGE_SIZE];
+    uint8_t *data = get_cached_data(cache, addr);
+
+    if (!cached) {
+        g_assert(data == NULL);
+        return;
+    }
+    g_assert(data != NULL);
+    fill_page(expected, addr);
+    g_assert(memcmp(data, expected, PAGE_SIZE) == 0);
+}
+
+static void insert_page(PageCache *cache, uint64_t addr, uint64_t age,
+                        int expected)
+{
+    uint8_t buf[PAGE_SIZE];
+
+    fill_page(buf, addr);
+    g_assert_cmpint(cache_insert(cache, addr, buf, age), ==, expected);
+}
+
+static void test_associative(void)
+{
+    PageCache *cache = cache_init(WAYS * SETS, PAGE_SIZE);
+    int i;
+
+    /* A direct-mapped cache would only keep the last of these */
+    for (i = 0; i < WAYS; i++) {
+        insert_page(cache, page_addr(3, i), 0, 0);
+    }
+    for (i = 0; i < WAYS; i++) {
+        check_page(cache, page_addr(3, i), true);
+        g_assert(cache_is_cached(cache, page_addr(3, i), 0));
+    }
+    check_page(cache, page_addr(4, 0), false);
+    g_assert(!cache_is_cached(cache, page_addr(4, 0), 0));
+    g_assert(cache_lookup(cache, page_addr(3, WAYS), 0) == NULL);
+
+    /* The set is full of fresh pages */
+    insert_page(cache, page_addr(3, WAYS), 1, -1);
+    check_page(cache, page_addr(3, WAYS), false);
+
+    /* Overwriting a cached page is always possible */
+    insert_page(cache, page_addr(3, 5), 1, 0);
+    check_page(cache, page_addr(3, 5), true);
+
+    cache_fini(cache);
+}
+
+static void test_lru(void)
+{
+    PageCache *cache = cache_init(WAYS * SETS, PAGE_SIZE);
+    int i;
+
+    for (i = 0; i < WAYS; i++) {
+        insert_page(cache, page_addr(0, i), 0, 0);
+    }
+
+    /* Touch all pages but the third one */
+    for (i = WAYS - 1; i >= 0; i--) {
+        if (i != 2) {
+            g_assert(cache_lookup(cache, page_addr(0, i), 0) != NULL);
+        }
+    }
+
+    /* The least recently used page is evicted once it is old enough */
+    insert_page(cache, page_addr(0, WAYS), 2, 0);
+    check_page(cache, page_addr(0, 2), false);
+    check_page(cache, page_addr(0, WAYS), true);
+
+    /* Next comes the one touched first */
+    insert_page(cache, page_addr(0, WAYS + 1), 2, 0);
+    check_page(cache, page_addr(0, WAYS - 1), false);
+    for (i = 0; i < WAYS - 1; i++) {
+        check_page(cache, page_addr(0, i), i != 2);
+    }
+
+    cache_fini(cache);
+}
+
+static void test_small(void)
+{
+    PageCache *cache = cache_init(3, PAGE_SIZE);
+    int i;
+
+    /* Rounded down to two pages, both in a single set */
+    for (i = 0; i < 2; i++) {
+        insert_page(cache, i * PAGE_SIZE, 0, 0);
+    }
+    insert_page(cache, 2 * PAGE_SIZE, 0, -1);
+    insert_page(cache, 2 * PAGE_SIZE, 2, 0);
+    check_page(cache, 0, false);
+    check_page(cache, PAGE_SIZE, true);
+    check_page(cache, 2 * PAGE_SIZE, true);
+
+    cache_fini(cache);
+}
+
+static void test_resize(void)
+{
+    PageCache *cache = cache_init(WAYS * SETS, PAGE_SIZE);
+    int set, i;
+
+    for (set = 0; set < SETS; set++) {
+        for (i = 0; i < WAYS; i++) {
+            insert_page(cache, page_addr(set, i), 0, 0);
+        }
+    }
+
+    /* Halving the cache merges pairs of sets, keeping the MRU pages */
+    g_assert_cmpint(cache_resize(cache, WAYS * SETS / 2), ==,
+                    WAYS * SETS / 2);
+    for (set = 0; set < SETS; set++) {
+        for (i = 0; i < WAYS; i++) {
+            check_page(cache, page_addr(set, i), set >= SETS / 2);
+        }
+    }
+
+    g_assert_cmpint(cache_resize(cache, WAYS * SETS), ==, WAYS * SETS);
+    for (set = SETS / 2; set < SETS; set++) {
+        for (i = 0; i < WAYS; i++) {
+            check_page(cache, page_addr(set, i), true);
+        }
+    }
+    insert_page(cache, page_addr(0, 0), 0, 0);
+    check_page(cache, page_addr(0, 0), true);
+
+    cache_fini(cache);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/page-cache/associative", test_associative);
+    g_test_add_func("/page-cache/lru", test_lru);
+    g_test_add_func("/page-cache/small", test_small);
+    g_test_add_func("/page-cache/resize", test_resize);
+    return g_test_run();
+}
@@ -174,6 +174,73 @@ static void test_encode_decode(void)
     }
 }
 
+#define ACCEL_PAGES 500
+
+/* Every implementation must produce the same encoding as the best one.
+ * This switches implementations, so it has to run last.
+ */
+static void test_encode_accels(void)
+{
+    uint8_t *old_buf = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *new_buf = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *ref = g_malloc(ACCEL_PAGES * PAGE_SIZE);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    uint8_t *decoded = g_malloc(PAGE_SIZE);
+    int ref_len[ACCEL_PAGES];
+    bool first = true;
+    int i, j;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        uint8_t *o = old_buf + i * PAGE_SIZE;
+        uint8_t *n = new_buf + i * PAGE_SIZE;
+        int changes = g_test_rand_int_range(0, i % 8 ? 200 : PAGE_SIZE);
+
+        /* Few distinct values, so that runs of all lengths show up */
+        for (j = 0; j < PAGE_SIZE; j++) {
+            o[j] = g_test_rand_int_range(0, i % 4 + 1);
+        }
+        memcpy(n, o, PAGE_SIZE);
+        while (changes--) {
+            n[g_test_rand_int_range(0, PAGE_SIZE)] = g_test_rand_int();
+        }
+    }
+
+    do {
+        for (i = 0; i < ACCEL_PAGES; i++) {
+            uint8_t *o = old_buf + i * PAGE_SIZE;
+            uint8_t *n = new_buf + i * PAGE_SIZE;
+            /* exercise the overflow checks as well */
+            int dlen = i % 5 ? PAGE_SIZE : 100 + i;
+            int rc = xbzrle_encode_buffer(o, n, PAGE_SIZE, compressed, dlen);
+
+            if (first) {
+                ref_len[i] = rc;
+                if (rc > 0) {
+                    memcpy(ref + i * PAGE_SIZE, compressed, rc);
+                }
+            } else {
+                g_assert_cmpint(rc, ==, ref_len[i]);
+                g_assert(rc <= 0 ||
+                         !memcmp(ref + i * PAGE_SIZE, compressed, rc));
+            }
+
+            if (rc >= 0) {
+                memcpy(decoded, o, PAGE_SIZE);
+                g_assert(xbzrle_decode_buffer(compressed, rc, decoded,
+                                              PAGE_SIZE) >= 0);
+                g_assert(memcmp(decoded, n, PAGE_SIZE) == 0);
+            }
+        }
+        first = false;
+    } while (test_xbzrle_encode_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(ref);
+    g_free(compressed);
+    g_free(decoded);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +253,7 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_accels", test_encode_accels);
 
     return g_test_run();
 }
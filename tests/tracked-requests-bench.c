@@ -0,0 +1,190 @@
+/*
+ * Benchmark for the request serialisation in block/io.c
+ *
+ * Keeps a fixed number of requests in flight against a null-co node with
+ * emulated latency.  A configurable share of them are unaligned writes,
+ * which go through read-modify-write and are therefore serialising; the
+ * others are aligned reads and writes.  Every request passes through
+ * bdrv_aligned_preadv/pwritev and the overlap checks against all the
+ * others in flight, so the throughput reflects the cost of those checks
+ * at high queue depth.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qstring.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
+#include "block/block.h"
+#include "sysemu/block-backend.h"
+
+#define IMAGE_SIZE (1LL << 30)
+
+static unsigned int duration = 1;
+static unsigned int n_requests = 1000;
+static unsigned int request_size = 4096;
+static unsigned int serialising_pct = 10;
+static int64_t latency_ns = 100000;
+
+static BlockBackend *blk;
+static bool stopping;
+static unsigned int n_running;
+static uint64_t n_reads, n_writes, n_serialising;
+
+static void coroutine_fn worker(void *opaque)
+{
+    GRand *rand = g_rand_new_with_seed(GPOINTER_TO_UINT(opaque));
+    void *buf = g_malloc0(request_size);
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int ret;
+
+    while (!stopping) {
+        int64_t offset = (int64_t)g_rand_int_range(rand, 0,
+                                                   IMAGE_SIZE / request_size)
+                         * request_size;
+        unsigned int bytes = request_size;
+        bool is_write = g_rand_boolean(rand);
+
+        if (g_rand_int_range(rand, 0, 100) < serialising_pct) {
+            /* Misaligned at both ends: two serialising RMW cycles */
+            offset += 1;
+            bytes -= 2;
+            is_write = true;
+            n_serialising++;
+        }
+
+        iov = (struct iovec) { .iov_base = buf, .iov_len = bytes };
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        if (is_write) {
+            ret = blk_co_pwritev(blk, offset, bytes, &qiov, 0);
+            n_writes++;
+        } else {
+            ret = blk_co_preadv(blk, offset, bytes, &qiov, 0);
+            n_reads++;
+        }
+        g_assert_cmpint(ret, ==, 0);
+    }
+
+    g_free(buf);
+    g_rand_free(rand);
+    n_running--;
+}
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d = duration, in seconds (default: %u)\n",
+            duration);
+    fprintf(stderr, " -n = number of requests in flight (default: %u)\n",
+            n_requests);
+    fprintf(stderr, " -b = request size in bytes (default: %u)\n",
+            request_size);
+    fprintf(stderr, " -s = percentage of serialising requests "
+            "(default: %u)\n", serialising_pct);
+    fprintf(stderr, " -l = emulated latency in ns (default: %" PRId64 ")\n",
+            latency_ns);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "b:d:hl:n:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'b':
+            request_size = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 'l':
+            latency_ns = atoll(optarg);
+            break;
+        case 'n':
+            n_requests = atoi(optarg);
+            break;
+        case 's':
+            serialising_pct = atoi(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+
+    if (request_size < 2 * BDRV_SECTOR_SIZE ||
+        request_size % BDRV_SECTOR_SIZE) {
+        fprintf(stderr, "request size must be a multiple of %d, "
+                "at least %d\n", BDRV_SECTOR_SIZE, 2 * BDRV_SECTOR_SIZE);
+        exit(-1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    AioContext *ctx;
+    QDict *opts;
+    char *latency;
+    int64_t start, end, now;
+    unsigned int i;
+    double secs;
+
+    parse_args(argc, argv);
+
+    qemu_init_main_loop(&error_fatal);
+    bdrv_init();
+    ctx = qemu_get_aio_context();
+
+    opts = qdict_new();
+    qdict_put(opts, "driver", qstring_from_str("null-co"));
+    latency = g_strdup_printf("%" PRId64, latency_ns);
+    qdict_put(opts, "latency-ns", qstring_from_str(latency));
+    g_free(latency);
+    blk = blk_new_open(NULL, NULL, opts, BDRV_O_RDWR, &error_fatal);
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    end = start + duration * NANOSECONDS_PER_SECOND;
+
+    for (i = 0; i < n_requests; i++) {
+        Coroutine *co = qemu_coroutine_create(worker, GUINT_TO_POINTER(i));
+
+        n_running++;
+        qemu_coroutine_enter(co);
+    }
+
+    do {
+        aio_poll(ctx, true);
+        now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    } while (now < end);
+
+    stopping = true;
+    while (n_running) {
+        aio_poll(ctx, true);
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+
+    secs = (double)(now - start) / NANOSECONDS_PER_SECOND;
+    printf("requests in flight: %u, latency: %" PRId64 " ns\n",
+           n_requests, latency_ns);
+    printf("reads:       %10" PRIu64 "\n", n_reads);
+    printf("writes:      %10" PRIu64 " (%" PRIu64 " serialising)\n",
+           n_writes, n_serialising);
+    printf("throughput:  %10.2f kIOPS\n",
+           (n_reads + n_writes) / secs / 1000);
+
+    blk_unref(blk);
+    return 0;
+}
@@ -688,6 +688,144 @@ static void pci_idx(void)
     test_end();
 }
 
+/* Queue a 512 byte request for @sector on @vq, and return its address */
+static uint64_t virtio_blk_pci_submit(QVirtioDevice *dev,
+                                      QGuestAllocator *alloc, QVirtQueue *vq,
+                                      uint32_t type, uint64_t sector, char fill)
+{
+    QVirtioBlkReq req;
+    uint64_t req_addr;
+    uint32_t free_head;
+
+    req.type = type;
+    req.ioprio = 1;
+    req.sector = sector;
+    req.data = g_malloc(512);
+    memset(req.data, fill, 512);
+
+    req_addr = virtio_blk_request(alloc, &req, 512);
+
+    g_free(req.data);
+
+    free_head = qvirtqueue_add(vq, req_addr, 16, false, true);
+    qvirtqueue_add(vq, req_addr + 16, 512, type == VIRTIO_BLK_T_IN, true);
+    qvirtqueue_add(vq, req_addr + 528, 1, true, false);
+    qvirtqueue_kick(&qvirtio_pci, dev, vq, free_head);
+
+    return req_addr;
+}
+
+/* Wait for the device to write the status byte at @addr.  The queues share
+ * the ISR, so it cannot tell which request has completed.
+ */
+static uint8_t virtio_blk_wait_status(uint64_t addr)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint8_t val;
+
+    while ((val = readb(addr)) == 0xff) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+    return val;
+}
+
+static void pci_iothreads(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci[2];
+    QGuestAllocator *alloc;
+    QDict *response;
+    uint64_t req_addr[8];
+    uint32_t features;
+    char *cmdline;
+    char *tmp_path;
+    char data[512];
+    uint8_t status;
+    int i;
+
+    tmp_path = drive_create();
+
+    cmdline = g_strdup_printf("-object iothread,id=a -object iothread,id=b "
+                        "-drive if=none,id=drive0,file=%s,format=raw "
+                        "-device virtio-blk-pci,id=drv0,drive=drive0,"
+                        "num-queues=2,iothreads=a:b,addr=%x.%x",
+                        tmp_path, PCI_SLOT, PCI_FN);
+    qtest_start(cmdline);
+    unlink(tmp_path);
+    g_free(tmp_path);
+    g_free(cmdline);
+
+    bus = qpci_init_pc();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+    alloc = pc_alloc_init();
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    g_assert(features & (1u << VIRTIO_BLK_F_MQ));
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                    (1u << VIRTIO_RING_F_INDIRECT_DESC) |
+                    (1u << VIRTIO_RING_F_EVENT_IDX) |
+                    (1u << VIRTIO_BLK_F_SCSI));
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+
+    for (i = 0; i < 2; i++) {
+        vqpci[i] = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                     alloc, i);
+    }
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Write through both queues, i.e. from both iothreads, and drain the
+     * node with the requests in flight by stopping the VM.
+     */
+    for (i = 0; i < 8; i++) {
+        req_addr[i] = virtio_blk_pci_submit(&dev->vdev, alloc,
+                                            &vqpci[i % 2]->vq,
+                                            VIRTIO_BLK_T_OUT, i, 'a' + i);
+    }
+
+    response = qmp("{ 'execute': 'stop' }");
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+    response = qmp("{ 'execute': 'cont' }");
+    g_assert(!qdict_haskey(response, "error"));
+    QDECREF(response);
+
+    for (i = 0; i < 8; i++) {
+        status = virtio_blk_wait_status(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* Read the data back through the other queue */
+    for (i = 0; i < 8; i++) {
+        req_addr[i] = virtio_blk_pci_submit(&dev->vdev, alloc,
+                                            &vqpci[(i + 1) % 2]->vq,
+                                            VIRTIO_BLK_T_IN, i, 0);
+    }
+
+    for (i = 0; i < 8; i++) {
+        status = virtio_blk_wait_status(req_addr[i] + 528);
+        g_assert_cmpint(status, ==, 0);
+
+        memread(req_addr[i] + 16, data, 512);
+        g_assert_cmpint(data[0], ==, 'a' + i);
+        g_assert_cmpint(data[511], ==, 'a' + i);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* End test */
+    for (i = 0; i < 2; i++) {
+        qvirtqueue_cleanup(&qvirtio_pci, &vqpci[i]->vq, alloc);
+    }
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_hotplug(void)
 {
     QPCIBus *bus;
@@ -763,6 +901,7 @@ int main(int argc, char **argv)
         qtest_add_func("/virtio/blk/pci/config", pci_config);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
+        qtest_add_func("/virtio/blk/pci/iothreads", pci_iothreads);
         qtest_add_func("/virtio/blk/pci/hotplug", pci_hotplug);
     } else if (strcmp(arch, "arm") == 0) {
         qtest_add_func("/virtio/blk/mmio/basic", mmio_basic);
@@ -0,0 +1,194 @@
+/*
+ * Benchmark for the page scanning done by RAM migration
+ *
+ * Measures the throughput of xbzrle_encode_buffer(), with each of the
+ * available implementations, and of the zero page check on three kinds of
+ * pages: zero pages, pages that differ from the cached copy in a few
+ * places, and random pages that differ everywhere.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
+#include "include/migration/migration.h"
+
+#define PAGE_SIZE 4096
+
+enum {
+    PAGES_ZERO,
+    PAGES_SPARSE,
+    PAGES_RANDOM,
+    PAGES__MAX,
+};
+
+static const char *const page_names[PAGES__MAX] = {
+    [PAGES_ZERO] = "zero",
+    [PAGES_SPARSE] = "sparse",
+    [PAGES_RANDOM] = "random",
+};
+
+static double duration = 0.5;
+static unsigned int n_pages = 1024;
+static unsigned int sparse_changes = 32;
+
+static uint8_t *old_pages[PAGES__MAX];
+static uint8_t *new_pages[PAGES__MAX];
+static uint8_t *encoded;
+
+static void fill_pages(GRand *rand)
+{
+    size_t size = (size_t)n_pages * PAGE_SIZE;
+    size_t i;
+    unsigned int j;
+
+    for (i = 0; i < PAGES__MAX; i++) {
+        old_pages[i] = qemu_memalign(PAGE_SIZE, size);
+        new_pages[i] = qemu_memalign(PAGE_SIZE, size);
+    }
+
+    memset(old_pages[PAGES_ZERO], 0, size);
+    memset(new_pages[PAGES_ZERO], 0, size);
+
+    for (i = 0; i < size; i++) {
+        old_pages[PAGES_SPARSE][i] = g_rand_int(rand);
+        old_pages[PAGES_RANDOM][i] = g_rand_int(rand);
+        new_pages[PAGES_RANDOM][i] = g_rand_int(rand);
+    }
+
+    /* A few short runs of changed bytes in each page */
+    memcpy(new_pages[PAGES_SPARSE], old_pages[PAGES_SPARSE], size);
+    for (i = 0; i < n_pages; i++) {
+        uint8_t *page = new_pages[PAGES_SPARSE] + i * PAGE_SIZE;
+
+        for (j = 0; j < sparse_changes; j++) {
+            int offset = g_rand_int_range(rand, 0, PAGE_SIZE - 8);
+            int len = g_rand_int_range(rand, 1, 8);
+
+            while (len--) {
+                page[offset + len] ^= 0xff;
+            }
+        }
+    }
+
+    encoded = g_malloc(PAGE_SIZE);
+}
+
+/* Returns the throughput of the zero check or of the encoder in MB/s */
+static double measure(int type, bool zero_check)
+{
+    int64_t start, now, end;
+    uint64_t bytes = 0;
+    unsigned int i = 0;
+
+    start = get_clock();
+    end = start + duration * NANOSECONDS_PER_SECOND;
+    do {
+        uint8_t *o = old_pages[type] + (size_t)i * PAGE_SIZE;
+        uint8_t *n = new_pages[type] + (size_t)i * PAGE_SIZE;
+
+        if (zero_check) {
+            g_assert((buffer_find_nonzero_offset(n, PAGE_SIZE) == PAGE_SIZE)
+                     == (type == PAGES_ZERO));
+        } else {
+            xbzrle_encode_buffer(o, n, PAGE_SIZE, encoded, PAGE_SIZE);
+        }
+        bytes += PAGE_SIZE;
+        i = (i + 1) % n_pages;
+        now = get_clock();
+    } while (now < end);
+
+    return bytes / ((double)(now - start) / NANOSECONDS_PER_SECOND) / 1e6;
+}
+
+static void print_row(const char *name, bool zero_check)
+{
+    int type;
+
+    printf("%-20s", name);
+    for (type = 0; type < PAGES__MAX; type++) {
+        printf(" %10.1f", measure(type, zero_check));
+    }
+    printf("\n");
+}
+
+static void usage_complete(int argc, char *argv[])
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv[0]);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, " -d = duration of each measurement, in seconds "
+            "(default: %.1f)\n", duration);
+    fprintf(stderr, " -n = number of pages of each kind (default: %u)\n",
+            n_pages);
+    fprintf(stderr, " -s = changed runs per sparse page (default: %u)\n",
+            sparse_changes);
+    exit(-1);
+}
+
+static void parse_args(int argc, char *argv[])
+{
+    int c;
+
+    for (;;) {
+        c = getopt(argc, argv, "d:hn:s:");
+        if (c < 0) {
+            break;
+        }
+        switch (c) {
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'h':
+            usage_complete(argc, argv);
+            exit(0);
+        case 'n':
+            n_pages = atoi(optarg);
+            break;
+        case 's':
+            sparse_changes = atoi(optarg);
+            break;
+        default:
+            usage_complete(argc, argv);
+        }
+    }
+
+    if (!n_pages) {
+        fprintf(stderr, "the number of pages must be positive\n");
+        exit(-1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    GRand *rand;
+    int type;
+
+    parse_args(argc, argv);
+
+    rand = g_rand_new_with_seed(1);
+    fill_pages(rand);
+    g_rand_free(rand);
+
+    printf("%-20s", "MB/s");
+    for (type = 0; type < PAGES__MAX; type++) {
+        printf(" %10s", page_names[type]);
+    }
+    printf("\n");
+
+    print_row("zero check", true);
+    do {
+        char *name = g_strdup_printf("xbzrle %s",
+                                     xbzrle_encode_accel_name());
+
+        print_row(name, false);
+        g_free(name);
+    } while (test_xbzrle_encode_next_accel());
+
+    for (type = 0; type < PAGES__MAX; type++) {
+        qemu_vfree(old_pages[type]);
+        qemu_vfree(new_pages[type]);
+    }
+    g_free(encoded);
+    return 0;
+}
@@ -47,6 +47,7 @@
 #endif
 #else
 #include "exec/address-spaces.h"
+#include "tb-cache.h"
 #endif
 
 #include "exec/cputlb.h"
@@ -111,6 +112,7 @@ typedef struct PageDesc {
 
 #define V_L1_SHIFT (L1_MAP_ADDR_SPACE_BITS - TARGET_PAGE_BITS - V_L1_BITS)
 
+bool parallel_cpus;
 uintptr_t qemu_host_page_size;
 intptr_t qemu_host_page_mask;
 
@@ -121,36 +123,32 @@ static void *l1_map[V_L1_SIZE];
 TCGContext tcg_ctx;
 
 /* translation block context */
-#ifdef CONFIG_USER_ONLY
 __thread int have_tb_lock;
-#endif
 
+/* tb_lock protects code generation and the TB data structures (page
+ * lists, jump lists and the tbs array).  Lookups through the TB hash
+ * table and the per-vCPU jump cache do not need it.
+ */
 void tb_lock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(!have_tb_lock);
     qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
     have_tb_lock++;
-#endif
 }
 
 void tb_unlock(void)
 {
-#ifdef CONFIG_USER_ONLY
     assert(have_tb_lock);
     have_tb_lock--;
     qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
-#endif
 }
 
 void tb_lock_reset(void)
 {
-#ifdef CONFIG_USER_ONLY
     if (have_tb_lock) {
         qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
         have_tb_lock = 0;
     }
-#endif
 }
 
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -761,30 +759,105 @@ bool tcg_enabled(void)
     return tcg_ctx.code_gen_buffer != NULL;
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
+/* Regions smaller than this are not worth splitting the buffer for.  */
+#define TB_MIN_REGION_SIZE (1024 * 1024)
+
+/* Space left at the end of a region for the code of one opcode,
+   as for the whole buffer in tcg_prologue_init.  */
+#define TB_REGION_HIGHWATER 1024
+
+static void tb_region_enter(TBRegion *r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    ctx->cur_region = r - ctx->regions;
+    r->last_use = ++ctx->region_clock;
+    tcg_ctx.code_gen_ptr = r->start;
+    tcg_ctx.code_gen_highwater = r->highwater;
+}
+
+static inline void *tb_region_end(TBRegion *r)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+
+    return r == &ctx->regions[ctx->cur_region] ? tcg_ctx.code_gen_ptr : r->end;
+}
+
+/* Split the code buffer and the tbs array into regions.  This can only
+   be done once the prologue has been generated at the start of the
+   buffer, which user-mode emulation does late, so it happens on the
+   first allocation after startup or after a flush.  */
+static void tb_regions_init(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    size_t size = tcg_ctx.code_gen_buffer_size;
+    int i, n;
+
+    n = MIN(TB_MAX_REGIONS, MAX(size / TB_MIN_REGION_SIZE, 1));
+    ctx->nb_regions = n;
+    ctx->region_size = QEMU_ALIGN_DOWN(size / n, CODE_GEN_ALIGN);
+    ctx->region_max_tbs = tcg_ctx.code_gen_max_blocks / n;
+    ctx->region_clock = 0;
+    for (i = 0; i < n; i++) {
+        TBRegion *r = &ctx->regions[i];
+
+        r->start = tcg_ctx.code_gen_buffer + i * ctx->region_size;
+        r->end = r->start;
+        r->highwater = r->start + ctx->region_size - TB_REGION_HIGHWATER;
+        r->tbs = ctx->tbs + i * ctx->region_max_tbs;
+        r->nb_tbs = 0;
+        r->last_use = 0;
+    }
+    tb_region_enter(&ctx->regions[0]);
+}
+
+/* Record that the region holding TB is in use, so that it is not the
+   next one to be evicted.  Called without tb_lock; a lost update only
+   makes the LRU order slightly less accurate.  */
+void tb_region_touch(TranslationBlock *tb)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[(tb - ctx->tbs) / ctx->region_max_tbs];
+
+    atomic_set(&r->last_use, atomic_read(&ctx->region_clock));
+}
+
+/* Allocate a new translation block in the current region.  Return NULL
+   if the region has no room left for it; see tb_evict.  */
 static TranslationBlock *tb_alloc(target_ulong pc)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     TranslationBlock *tb;
+    TBRegion *r;
 
-    if (tcg_ctx.tb_ctx.nb_tbs >= tcg_ctx.code_gen_max_blocks) {
+    if (unlikely(ctx->nb_regions == 0)) {
+        tb_regions_init();
+    }
+    r = &ctx->regions[ctx->cur_region];
+    if (r->nb_tbs >= ctx->region_max_tbs) {
         return NULL;
     }
-    tb = &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
+    ctx->nb_tbs++;
     tb->pc = pc;
     tb->cflags = 0;
+    /* Not findable, nor chained to, until tb_gen_code links it.  */
+    tb->invalid = true;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r = &ctx->regions[ctx->cur_region];
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (tcg_ctx.tb_ctx.nb_tbs > 0 &&
-            tb == &tcg_ctx.tb_ctx.tbs[tcg_ctx.tb_ctx.nb_tbs - 1]) {
+    if (ctx->nb_regions && r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
         tcg_ctx.code_gen_ptr = tb->tc_ptr;
-        tcg_ctx.tb_ctx.nb_tbs--;
+        r->nb_tbs--;
+        ctx->nb_tbs--;
     }
 }
 
@@ -831,12 +904,8 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
-void tb_flush(CPUState *cpu)
+static void do_tb_flush(CPUState *cpu)
 {
-    if (!tcg_enabled()) {
-        return;
-    }
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
            (unsigned long)(tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer),
@@ -851,17 +920,141 @@ void tb_flush(CPUState *cpu)
     tcg_ctx.tb_ctx.nb_tbs = 0;
 
     CPU_FOREACH(cpu) {
-        memset(cpu->tb_jmp_cache, 0, sizeof(cpu->tb_jmp_cache));
+        cpu_tb_jmp_cache_clear(cpu);
         cpu->tb_flushed = true;
     }
 
     qht_reset_size(&tcg_ctx.tb_ctx.htable, CODE_GEN_HTABLE_SIZE);
     page_flush_tb();
 
+    /* The regions are laid out again by the next tb_alloc.  */
+    tcg_ctx.tb_ctx.nb_regions = 0;
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
-    tcg_ctx.tb_ctx.tb_flush_count++;
+    atomic_mb_set(&tcg_ctx.tb_ctx.tb_flush_count,
+                  tcg_ctx.tb_ctx.tb_flush_count + 1);
+}
+
+#ifdef CONFIG_SOFTMMU
+/* Run as exclusive work, with no vCPU executing translated code.  */
+static void tb_flush_safe_work(void *data)
+{
+    int tb_flush_count = (uintptr_t)data;
+
+    tb_lock();
+    /* If the buffer has already been flushed on behalf of another vCPU
+       since this request was queued, there is nothing left to do.  */
+    if (tcg_ctx.tb_ctx.tb_flush_count == tb_flush_count) {
+        do_tb_flush(first_cpu);
+    }
+    tb_unlock();
+}
+#endif
+
+/* With multi-threaded TCG the flush is deferred until all vCPUs have
+ * left translated code, so callers must not assume that the buffer is
+ * empty when tb_flush returns.
+ */
+void tb_flush(CPUState *cpu)
+{
+    if (!tcg_enabled()) {
+        return;
+    }
+#ifdef CONFIG_SOFTMMU
+    if (qemu_tcg_mttcg_enabled()) {
+        int tb_flush_count = atomic_mb_read(&tcg_ctx.tb_ctx.tb_flush_count);
+
+        async_safe_run_on_cpu(cpu, tb_flush_safe_work,
+                              (void *)(uintptr_t)tb_flush_count);
+        return;
+    }
+#endif
+    do_tb_flush(cpu);
+}
+
+/* Pick the region to reuse once the current one is full: an unused
+   one if there is any, else the least recently used one, taking the
+   regions in allocation order on ties.  */
+static TBRegion *tb_region_victim(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *victim = NULL;
+    int i;
+
+    for (i = 1; i <= ctx->nb_regions; i++) {
+        TBRegion *r = &ctx->regions[(ctx->cur_region + i) % ctx->nb_regions];
+
+        if (r->nb_tbs == 0) {
+            return r;
+        }
+        if (!victim || r->last_use < victim->last_use) {
+            victim = r;
+        }
+    }
+    return victim;
+}
+
+/* Invalidate the TBs of one region and continue allocating from it.  */
+static void do_tb_evict(void)
+{
+    TBContext *ctx = &tcg_ctx.tb_ctx;
+    TBRegion *r;
+    CPUState *cpu;
+    int i;
+
+    ctx->regions[ctx->cur_region].end = tcg_ctx.code_gen_ptr;
+    r = tb_region_victim();
+    for (i = 0; i < r->nb_tbs; i++) {
+        TranslationBlock *tb = &r->tbs[i];
+
+        if (!tb->invalid) {
+            tb_phys_invalidate(tb, -1);
+        }
+    }
+    ctx->nb_tbs -= r->nb_tbs;
+    r->nb_tbs = 0;
+    r->end = r->start;
+    tb_region_enter(r);
+
+    /* A vCPU may be about to chain from a TB of the evicted region.  */
+    CPU_FOREACH(cpu) {
+        cpu->tb_flushed = true;
+    }
+    atomic_mb_set(&ctx->tb_evict_count, ctx->tb_evict_count + 1);
+}
+
+#ifdef CONFIG_SOFTMMU
+/* Run as exclusive work, with no vCPU executing translated code.  */
+static void tb_evict_safe_work(void *data)
+{
+    int tb_evict_count = (uintptr_t)data;
+
+    tb_lock();
+    /* Another vCPU may already have made room.  */
+    if (tcg_ctx.tb_ctx.tb_evict_count == tb_evict_count) {
+        do_tb_evict();
+    }
+    tb_unlock();
+}
+#endif
+
+/* Make room in a full code buffer by evicting a single region, so that
+ * only the code that was dropped has to be translated again.  As for
+ * tb_flush, this is deferred with multi-threaded TCG.
+ */
+static void tb_evict(CPUState *cpu)
+{
+#ifdef CONFIG_SOFTMMU
+    if (qemu_tcg_mttcg_enabled()) {
+        int tb_evict_count = atomic_mb_read(&tcg_ctx.tb_ctx.tb_evict_count);
+
+        async_safe_run_on_cpu(cpu, tb_evict_safe_work,
+                              (void *)(uintptr_t)tb_evict_count);
+        return;
+    }
+#endif
+    do_tb_evict();
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -990,6 +1183,9 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     uint32_t h;
     tb_page_addr_t phys_pc;
 
+    /* make sure no vCPU chains to this TB from now on */
+    atomic_set(&tb->invalid, true);
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_hash_func(phys_pc, tb->pc, tb->flags);
@@ -1010,8 +1206,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     /* remove the TB from the hash list */
     h = tb_jmp_cache_hash_func(tb->pc);
     CPU_FOREACH(cpu) {
-        if (cpu->tb_jmp_cache[h] == tb) {
-            cpu->tb_jmp_cache[h] = NULL;
+        if (atomic_read(&cpu->tb_jmp_cache[h].tb) == tb) {
+            atomic_set(&cpu->tb_jmp_cache[h].tb, NULL);
         }
     }
 
@@ -1164,8 +1360,14 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb = tb_alloc(pc);
     if (unlikely(!tb)) {
  buffer_overflow:
-        /* flush must be done */
-        tb_flush(cpu);
+        /* the current region is full, make room in another one */
+        tb_evict(cpu);
+        if (qemu_tcg_mttcg_enabled()) {
+            /* The eviction only happens once every vCPU has left translated
+               code; make the execution loop process it right away.  */
+            cpu->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(cpu);
+        }
         /* cannot fail at this point */
         tb = tb_alloc(pc);
         assert(tb != NULL);
@@ -1176,6 +1378,23 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+    tb->exec_count = 0;
+    tb->lazy_flags = 0;
+
+#ifdef CONFIG_SOFTMMU
+    tcg_ctx.tb_relocs_enabled = false;
+    if (tb_cache_active(cpu, cflags)) {
+        if (tb_cache_restore(cpu, tb, phys_pc,
+                             &gen_code_size, &search_size)) {
+            goto restored;
+        }
+        /* Record what the cache needs to move the code elsewhere.  */
+        tcg_ctx.tb_relocs_enabled = true;
+        tcg_ctx.tb_relocs_invalid = false;
+        tcg_ctx.nb_tb_relocs = 0;
+        tcg_ctx.tb_relocs_tb = (uintptr_t)tb;
+    }
+#endif
 
 #ifdef CONFIG_PROFILER
     tcg_ctx.tb_count1++; /* includes aborted translations because of
@@ -1240,6 +1459,9 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     }
 #endif
 
+#ifdef CONFIG_SOFTMMU
+ restored:
+#endif
     tcg_ctx.code_gen_ptr = (void *)
         ROUND_UP((uintptr_t)gen_code_buf + gen_code_size + search_size,
                  CODE_GEN_ALIGN);
@@ -1264,11 +1486,19 @@ TranslationBlock *tb_gen_code(CPUState *cpu,
     if ((pc & TARGET_PAGE_MASK) != virt_page2) {
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
-    /* As long as consistency of the TB stuff is provided by tb_lock in user
-     * mode and is implicit in single-threaded softmmu emulation, no explicit
-     * memory barrier is required before tb_link_page() makes the TB visible
-     * through the physical hash table and physical page list.
+#ifdef CONFIG_SOFTMMU
+    if (tcg_ctx.tb_relocs_enabled) {
+        tb_cache_store(cpu, tb, phys_pc, phys_page2,
+                       gen_code_size, search_size);
+        tcg_ctx.tb_relocs_enabled = false;
+    }
+#endif
+    /* Consistency of the TB stuff is provided by tb_lock.  Lock-free
+     * lookups only see the TB once qht_insert() has published it, and
+     * that publication orders the generated code and TB fields before
+     * the pointer, so no explicit memory barrier is required here.
      */
+    tb->invalid = false;
     tb_link_page(tb, phys_pc, phys_page2);
     return tb;
 }
@@ -1507,23 +1737,30 @@ static bool tb_invalidate_phys_page(tb_page_addr_t addr, uintptr_t pc)
    tb[1].tc_ptr. Return NULL if not found */
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
 {
+    TBContext *ctx = &tcg_ctx.tb_ctx;
     int m_min, m_max, m;
     uintptr_t v;
     TranslationBlock *tb;
+    TBRegion *r;
+    size_t i;
 
-    if (tcg_ctx.tb_ctx.nb_tbs <= 0) {
+    if (ctx->nb_tbs <= 0 || tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer) {
+        return NULL;
+    }
+    i = (tc_ptr - (uintptr_t)tcg_ctx.code_gen_buffer) / ctx->region_size;
+    if (i >= ctx->nb_regions) {
         return NULL;
     }
-    if (tc_ptr < (uintptr_t)tcg_ctx.code_gen_buffer ||
-        tc_ptr >= (uintptr_t)tcg_ctx.code_gen_ptr) {
+    r = &ctx->regions[i];
+    if (r->nb_tbs <= 0 || tc_ptr >= (uintptr_t)tb_region_end(r)) {
         return NULL;
     }
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = tcg_ctx.tb_ctx.nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tcg_ctx.tb_ctx.tbs[m];
+        tb = &r->tbs[m];
         v = (uintptr_t)tb->tc_ptr;
         if (v == tc_ptr) {
             return tb;
@@ -1533,7 +1770,7 @@ static TranslationBlock *tb_find_pc(uintptr_t tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tcg_ctx.tb_ctx.tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 #if !defined(CONFIG_USER_ONLY)
@@ -1551,7 +1788,9 @@ void tb_invalidate_phys_addr(AddressSpace *as, hwaddr addr)
         return;
     }
     ram_addr = memory_region_get_ram_addr(mr) + addr;
+    tb_lock();
     tb_invalidate_phys_page_range(ram_addr, ram_addr + 1, 0);
+    tb_unlock();
     rcu_read_unlock();
 }
 #endif /* !defined(CONFIG_USER_ONLY) */
@@ -1592,6 +1831,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint32_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(cpu, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1647,7 +1887,7 @@ void cpu_io_recompile(CPUState *cpu, uintptr_t retaddr)
        the first in the TB) then we end up generating a whole new TB and
        repeating the fault, which is horribly inefficient.
        Better would be to execute just this insn uncached, or generate a
-       second new TB.  */
+       second new TB.  The tb_lock is released by the execution loop.  */
     cpu_loop_exit_noexc(cpu);
 }
 
@@ -1659,11 +1899,11 @@ void tb_flush_jmp_cache(CPUState *cpu, target_ulong addr)
        overlap the flushed page.  */
     i = tb_jmp_cache_hash_page(addr - TARGET_PAGE_SIZE);
     memset(&cpu->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+           TB_JMP_PAGE_SIZE * sizeof(TBJmpCacheEntry));
 
     i = tb_jmp_cache_hash_page(addr);
     memset(&cpu->tb_jmp_cache[i], 0,
-           TB_JMP_PAGE_SIZE * sizeof(TranslationBlock *));
+           TB_JMP_PAGE_SIZE * sizeof(TBJmpCacheEntry));
 }
 
 static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
@@ -1706,37 +1946,50 @@ static void print_qht_statistics(FILE *f, fprintf_function cpu_fprintf,
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
-    int i, target_code_size, max_target_code_size;
-    int direct_jmp_count, direct_jmp2_count, cross_page;
+    int i, j, target_code_size, max_target_code_size;
+    int direct_jmp_count, direct_jmp2_count, cross_page, superblocks;
+    ptrdiff_t code_size;
     TranslationBlock *tb;
     struct qht_stats hst;
 
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
+    superblocks = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for (i = 0; i < tcg_ctx.tb_ctx.nb_tbs; i++) {
-        tb = &tcg_ctx.tb_ctx.tbs[i];
-        target_code_size += tb->size;
-        if (tb->size > max_target_code_size) {
-            max_target_code_size = tb->size;
-        }
-        if (tb->page_addr[1] != -1) {
-            cross_page++;
-        }
-        if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
-            direct_jmp_count++;
-            if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
-                direct_jmp2_count++;
+    code_size = 0;
+    for (j = 0; j < tcg_ctx.tb_ctx.nb_regions; j++) {
+        TBRegion *r = &tcg_ctx.tb_ctx.regions[j];
+
+        code_size += tb_region_end(r) - r->start;
+        for (i = 0; i < r->nb_tbs; i++) {
+            tb = &r->tbs[i];
+            target_code_size += tb->size;
+            if (tb->size > max_target_code_size) {
+                max_target_code_size = tb->size;
+            }
+            if (tb->page_addr[1] != -1) {
+                cross_page++;
+            }
+            if (tb->cflags & CF_SUPERBLOCK) {
+                superblocks++;
+            }
+            if (tb->jmp_reset_offset[0] != TB_JMP_RESET_OFFSET_INVALID) {
+                direct_jmp_count++;
+                if (tb->jmp_reset_offset[1] != TB_JMP_RESET_OFFSET_INVALID) {
+                    direct_jmp2_count++;
+                }
             }
         }
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
     cpu_fprintf(f, "gen code size       %td/%zd\n",
-                tcg_ctx.code_gen_ptr - tcg_ctx.code_gen_buffer,
-                tcg_ctx.code_gen_highwater - tcg_ctx.code_gen_buffer);
+                code_size, tcg_ctx.code_gen_buffer_size);
+    cpu_fprintf(f, "regions             %d of %zd bytes (current %d)\n",
+                tcg_ctx.tb_ctx.nb_regions, tcg_ctx.tb_ctx.region_size,
+                tcg_ctx.tb_ctx.cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n",
             tcg_ctx.tb_ctx.nb_tbs, tcg_ctx.code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
@@ -1744,15 +1997,14 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                     tcg_ctx.tb_ctx.nb_tbs : 0,
             max_target_code_size);
     cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-            tcg_ctx.tb_ctx.nb_tbs ? (tcg_ctx.code_gen_ptr -
-                                     tcg_ctx.code_gen_buffer) /
-                                     tcg_ctx.tb_ctx.nb_tbs : 0,
-                target_code_size ? (double) (tcg_ctx.code_gen_ptr -
-                                             tcg_ctx.code_gen_buffer) /
-                                             target_code_size : 0);
+            tcg_ctx.tb_ctx.nb_tbs ? code_size / tcg_ctx.tb_ctx.nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n", cross_page,
             tcg_ctx.tb_ctx.nb_tbs ? (cross_page * 100) /
                                     tcg_ctx.tb_ctx.nb_tbs : 0);
+    cpu_fprintf(f, "superblock count    %d (%d%%)\n", superblocks,
+            tcg_ctx.tb_ctx.nb_tbs ? (superblocks * 100) /
+                                    tcg_ctx.tb_ctx.nb_tbs : 0);
     cpu_fprintf(f, "direct jump count   %d (%d%%) (2 jumps=%d %d%%)\n",
                 direct_jmp_count,
                 tcg_ctx.tb_ctx.nb_tbs ? (direct_jmp_count * 100) /
@@ -1767,9 +2019,15 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tcg_ctx.tb_ctx.tb_flush_count);
+    cpu_fprintf(f, "TB region evictions %d\n", tcg_ctx.tb_ctx.tb_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n",
             tcg_ctx.tb_ctx.tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    cpu_fprintf(f, "TLB page flushes    %d\n", tlb_flush_page_count);
+    cpu_fprintf(f, "TLB async flushes   %d (%d requests merged)\n",
+                tlb_flush_async_count, tlb_flush_elided_count);
+    tlb_dump_info(f, cpu_fprintf);
+    tb_cache_dump_info(f, cpu_fprintf);
     tcg_dump_info(f, cpu_fprintf);
 }
 
@@ -0,0 +1,250 @@
+/*
+ * Interval trees
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ * The lookup functions follow the algorithm of the Linux kernel's
+ * interval_tree_generic.h; balancing is done AVL-style, with parent
+ * pointers so that iteration needs no stack.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/interval-tree.h"
+
+static inline int node_height(IntervalTreeNode *node)
+{
+    return node ? node->height : 0;
+}
+
+/* Recompute the height and subtree_last of @node from its children */
+static void node_update(IntervalTreeNode *node)
+{
+    uint64_t subtree_last = node->last;
+
+    if (node->left && node->left->subtree_last > subtree_last) {
+        subtree_last = node->left->subtree_last;
+    }
+    if (node->right && node->right->subtree_last > subtree_last) {
+        subtree_last = node->right->subtree_last;
+    }
+    node->subtree_last = subtree_last;
+    node->height = 1 + MAX(node_height(node->left), node_height(node->right));
+}
+
+/* Make @new take the place of @old as a child of @parent */
+static void replace_child(IntervalTreeRoot *root, IntervalTreeNode *parent,
+                          IntervalTreeNode *old, IntervalTreeNode *new)
+{
+    if (!parent) {
+        root->root = new;
+    } else if (parent->left == old) {
+        parent->left = new;
+    } else {
+        assert(parent->right == old);
+        parent->right = new;
+    }
+}
+
+static IntervalTreeNode *rotate_left(IntervalTreeRoot *root,
+                                     IntervalTreeNode *x)
+{
+    IntervalTreeNode *y = x->right;
+
+    x->right = y->left;
+    if (y->left) {
+        y->left->parent = x;
+    }
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+    y->left = x;
+    x->parent = y;
+
+    node_update(x);
+    node_update(y);
+    return y;
+}
+
+static IntervalTreeNode *rotate_right(IntervalTreeRoot *root,
+                                      IntervalTreeNode *x)
+{
+    IntervalTreeNode *y = x->left;
+
+    x->left = y->right;
+    if (y->right) {
+        y->right->parent = x;
+    }
+    y->parent = x->parent;
+    replace_child(root, x->parent, x, y);
+    y->right = x;
+    x->parent = y;
+
+    node_update(x);
+    node_update(y);
+    return y;
+}
+
+/* Restore the AVL invariant and subtree_last from @node up to the root */
+static void rebalance(IntervalTreeRoot *root, IntervalTreeNode *node)
+{
+    while (node) {
+        int balance = node_height(node->left) - node_height(node->right);
+
+        if (balance > 1) {
+            if (node_height(node->left->left) <
+                node_height(node->left->right)) {
+                rotate_left(root, node->left);
+            }
+            node = rotate_right(root, node);
+        } else if (balance < -1) {
+            if (node_height(node->right->right) <
+                node_height(node->right->left)) {
+                rotate_right(root, node->right);
+            }
+            node = rotate_left(root, node);
+        } else {
+            node_update(node);
+        }
+        node = node->parent;
+    }
+}
+
+void interval_tree_insert(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode **link = &root->root;
+    IntervalTreeNode *parent = NULL;
+
+    assert(node->start <= node->last);
+
+    while (*link) {
+        parent = *link;
+        if (node->start < parent->start) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+        }
+    }
+
+    node->left = node->right = NULL;
+    node->parent = parent;
+    node->height = 1;
+    node->subtree_last = node->last;
+    *link = node;
+
+    rebalance(root, parent);
+}
+
+void interval_tree_remove(IntervalTreeNode *node, IntervalTreeRoot *root)
+{
+    IntervalTreeNode *parent = node->parent;
+    IntervalTreeNode *fixup;
+
+    if (node->left && node->right) {
+        /* Replace node with its successor, the leftmost node on the right */
+        IntervalTreeNode *succ = node->right;
+
+        while (succ->left) {
+            succ = succ->left;
+        }
+
+        if (succ->parent == node) {
+            fixup = succ;
+        } else {
+            fixup = succ->parent;
+            fixup->left = succ->right;
+            if (succ->right) {
+                succ->right->parent = fixup;
+            }
+            succ->right = node->right;
+            node->right->parent = succ;
+        }
+
+        succ->left = node->left;
+        node->left->parent = succ;
+        succ->parent = parent;
+        replace_child(root, parent, node, succ);
+    } else {
+        IntervalTreeNode *child = node->left ? node->left : node->right;
+
+        if (child) {
+            child->parent = parent;
+        }
+        replace_child(root, parent, node, child);
+        fixup = parent;
+    }
+
+    rebalance(root, fixup);
+    node->left = node->right = node->parent = NULL;
+}
+
+/* Find the leftmost node in the subtree of @node that overlaps
+ * [@start, @last].  Requires @start <= @node->subtree_last.
+ */
+static IntervalTreeNode *subtree_search(IntervalTreeNode *node,
+                                        uint64_t start, uint64_t last)
+{
+    while (true) {
+        if (node->left && start <= node->left->subtree_last) {
+            /* Some nodes in the left subtree end after @start.  The
+             * leftmost of them is the match, if anything is.
+             */
+            node = node->left;
+            continue;
+        }
+        if (node->start <= last) {
+            if (start <= node->last) {
+                return node;
+            }
+            if (node->right) {
+                node = node->right;
+                if (start <= node->subtree_last) {
+                    continue;
+                }
+            }
+        }
+        return NULL;
+    }
+}
+
+IntervalTreeNode *interval_tree_iter_first(IntervalTreeRoot *root,
+                                           uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *node = root->root;
+
+    if (!node || node->subtree_last < start) {
+        return NULL;
+    }
+    return subtree_search(node, start, last);
+}
+
+IntervalTreeNode *interval_tree_iter_next(IntervalTreeNode *node,
+                                          uint64_t start, uint64_t last)
+{
+    IntervalTreeNode *right = node->right;
+    IntervalTreeNode *prev;
+
+    while (true) {
+        /* Invariant: node->start <= last, right == node->right.  First
+         * search the right subtree if it can contain a match.
+         */
+        if (right && start <= right->subtree_last) {
+            return subtree_search(right, start, last);
+        }
+
+        /* Move up the tree until we come from a node's left child */
+        do {
+            prev = node;
+            node = node->parent;
+            if (!node) {
+                return NULL;
+            }
+            right = node->right;
+        } while (prev == right);
+
+        if (last < node->start) {
+            return NULL;
+        } else if (start <= node->last) {
+            return node;
+        }
+    }
+}
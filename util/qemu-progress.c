@@ -29,6 +29,7 @@ struct progress_state {
     float current;
     float last_print;
     float min_skip;
+    double rate;
     void (*print)(void);
     void (*end)(void);
 };
@@ -43,7 +44,12 @@ static volatile sig_atomic_t print_pending;
  */
 static void progress_simple_print(void)
 {
-    printf("    (%3.2f/100%%)\r", state.current);
+    if (state.rate) {
+        printf("    (%3.2f/100%%, %.1f MiB/s)\r", state.current,
+               state.rate / (1024 * 1024));
+    } else {
+        printf("    (%3.2f/100%%)\r", state.current);
+    }
     fflush(stdout);
 }
 
@@ -68,7 +74,12 @@ static void sigusr_print(int signal)
 static void progress_dummy_print(void)
 {
     if (print_pending) {
-        fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        if (state.rate) {
+            fprintf(stderr, "    (%3.2f/100%%, %.1f MiB/s)\n", state.current,
+                    state.rate / (1024 * 1024));
+        } else {
+            fprintf(stderr, "    (%3.2f/100%%)\n", state.current);
+        }
         print_pending = 0;
     }
 }
@@ -125,6 +136,15 @@ void qemu_progress_end(void)
     state.end();
 }
 
+/*
+ * Set the throughput, in bytes per second, that is shown along with the
+ * progress on the next report.  Zero hides it.
+ */
+void qemu_progress_set_rate(double bytes_per_sec)
+{
+    state.rate = bytes_per_sec;
+}
+
 /*
  * Report progress.
  * @delta is how much progress we made.